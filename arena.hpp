@@ -0,0 +1,74 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <memory_resource>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+// How much memory a tiling thread's arena starts with, and the most it
+// will keep between tiles after growing to fit a big one
+#define TILE_ARENA_INITIAL (1024 * 1024)
+#define TILE_ARENA_MAX (64 * 1024 * 1024)
+
+// Scratch memory for the containers that write_tile() builds for each
+// attempt at a tile and then throws away. Allocation just takes the next
+// bytes of the buffer, freeing does nothing, and reset() makes the whole
+// buffer available again. If an attempt needs more than the buffer holds,
+// the rest comes from malloc, and the buffer is enlarged at the next reset.
+struct tile_arena : std::pmr::memory_resource {
+	std::vector<char> buffer;
+	std::unique_ptr<std::pmr::monotonic_buffer_resource> pool;
+
+	size_t used = 0;	      // bytes allocated since the last reset
+	size_t high_water = 0;	      // most bytes allocated between any two resets
+	size_t resets = 0;	      // attempts at tiles that have used the arena
+	size_t overflowed = 0;	      // attempts that needed more than the buffer
+	bool overflowing = false;
+
+	tile_arena() {
+		buffer.resize(TILE_ARENA_INITIAL);
+		pool = std::make_unique<std::pmr::monotonic_buffer_resource>(buffer.data(), buffer.size(), std::pmr::new_delete_resource());
+	}
+
+	tile_arena(tile_arena const &) = delete;
+	tile_arena &operator=(tile_arena const &) = delete;
+
+	// Everything allocated from the arena must have been destroyed
+	void reset() {
+		if (used > buffer.size() && buffer.size() < TILE_ARENA_MAX) {
+			pool.reset();
+			std::vector<char>().swap(buffer);
+			buffer.resize(std::min((size_t) TILE_ARENA_MAX, used + used / 4));
+		}
+
+		pool = std::make_unique<std::pmr::monotonic_buffer_resource>(buffer.data(), buffer.size(), std::pmr::new_delete_resource());
+		used = 0;
+		overflowing = false;
+		resets++;
+	}
+
+       private:
+	void *do_allocate(size_t bytes, size_t alignment) override {
+		used += bytes;
+		if (used > high_water) {
+			high_water = used;
+		}
+		if (used > buffer.size() && !overflowing) {
+			overflowing = true;
+			overflowed++;
+		}
+
+		return pool->allocate(bytes, alignment);
+	}
+
+	void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+		pool->deallocate(p, bytes, alignment);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+		return this == &other;
+	}
+};
+
+#endif
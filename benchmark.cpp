@@ -0,0 +1,397 @@
+// End-to-end benchmarks of tippecanoe, tile-join, and tippecanoe-decode,
+// run on synthetic datasets that are generated the same way every time,
+// so that the results can be compared across changes to the code.
+//
+//     ./benchmark [-s scale] [-d datadir] [-b bindir] [-r runs] [dataset ...]
+//
+// runs the named datasets, or all of them, and prints one JSON object per
+// line for each program run: its wall-clock and CPU seconds, its peak RSS,
+// and, for tippecanoe, the per-phase report from --json-progress.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include "errors.hpp"
+
+// A small generator of its own, rather than rand(), so that the datasets
+// are the same on every platform
+struct bench_random {
+	unsigned long long state;
+
+	bench_random(unsigned long long seed)
+	    : state(seed) {
+	}
+
+	unsigned long long next() {
+		// xorshift64*
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545F4914F6CDD1DULL;
+	}
+
+	// Uniform in [0, 1)
+	double uniform() {
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	// Roughly normal, with mean 0 and standard deviation 1
+	double normal() {
+		double sum = 0;
+		for (size_t i = 0; i < 12; i++) {
+			sum += uniform();
+		}
+		return sum - 6;
+	}
+};
+
+static void write_position(FILE *f, double lon, double lat, bool first) {
+	fprintf(f, "%s[%.6f,%.6f]", first ? "" : ",", lon, lat);
+}
+
+// Points clustered around a few hundred centers, like addresses in cities
+static void make_points(FILE *f, size_t scale) {
+	bench_random r(1);
+	size_t n = 100000 * scale;
+
+	std::vector<std::pair<double, double>> centers;
+	for (size_t i = 0; i < 300; i++) {
+		centers.emplace_back(-125 + 58 * r.uniform(), 25 + 24 * r.uniform());
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		auto const &c = centers[r.next() % centers.size()];
+		double lon = c.first + 0.2 * r.normal();
+		double lat = c.second + 0.15 * r.normal();
+
+		fprintf(f, "{\"type\":\"Feature\",\"properties\":{\"id\":%zu,\"kind\":\"point%llu\"},\"geometry\":{\"type\":\"Point\",\"coordinates\":", i, r.next() % 8);
+		write_position(f, lon, lat, true);
+		fprintf(f, "}}\n");
+	}
+}
+
+// Random walks of thousands of vertices each, like GPS traces
+static void make_lines(FILE *f, size_t scale) {
+	bench_random r(2);
+	size_t n = 500 * scale;
+
+	for (size_t i = 0; i < n; i++) {
+		double lon = -120 + 45 * r.uniform();
+		double lat = 28 + 18 * r.uniform();
+		double heading = 2 * M_PI * r.uniform();
+		size_t vertices = 1000 + r.next() % 4000;
+
+		fprintf(f, "{\"type\":\"Feature\",\"properties\":{\"id\":%zu},\"geometry\":{\"type\":\"LineString\",\"coordinates\":[", i);
+		for (size_t j = 0; j < vertices; j++) {
+			write_position(f, lon, lat, j == 0);
+			heading += 0.3 * r.normal();
+			lon += 0.001 * cos(heading);
+			lat += 0.001 * sin(heading);
+		}
+		fprintf(f, "]}}\n");
+	}
+}
+
+// Star-shaped polygons of thousands of vertices each, like detailed
+// administrative boundaries
+static void make_polygons(FILE *f, size_t scale) {
+	bench_random r(3);
+	size_t n = 100 * scale;
+
+	for (size_t i = 0; i < n; i++) {
+		double cx = -120 + 45 * r.uniform();
+		double cy = 28 + 18 * r.uniform();
+		double radius = 0.05 + 0.5 * r.uniform();
+		size_t vertices = 1000 + r.next() % 9000;
+
+		fprintf(f, "{\"type\":\"Feature\",\"properties\":{\"id\":%zu},\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[[", i);
+		double first = 0;
+		for (size_t j = 0; j <= vertices; j++) {
+			double d;
+			if (j == 0) {
+				d = first = radius * (0.7 + 0.3 * r.uniform());
+			} else if (j == vertices) {
+				d = first;  // close the ring
+			} else {
+				d = radius * (0.7 + 0.3 * r.uniform());
+			}
+
+			double a = 2 * M_PI * (j % vertices) / vertices;
+			write_position(f, cx + d * cos(a), cy + d * sin(a), j == 0);
+		}
+		fprintf(f, "]]}}\n");
+	}
+}
+
+// Points with many attributes, most of whose values are all different
+static void make_attributes(FILE *f, size_t scale) {
+	bench_random r(4);
+	size_t n = 20000 * scale;
+
+	for (size_t i = 0; i < n; i++) {
+		fprintf(f, "{\"type\":\"Feature\",\"properties\":{\"id\":%zu", i);
+		for (size_t a = 0; a < 20; a++) {
+			unsigned long long v = r.next();
+			if (a % 4 == 0) {
+				fprintf(f, ",\"num%zu\":%.4f", a, (v % 10000000) / 100.0);
+			} else if (a % 4 == 1) {
+				fprintf(f, ",\"cat%zu\":\"c%llu\"", a, v % 50);
+			} else {
+				fprintf(f, ",\"str%zu\":\"%016llx\"", a, v);
+			}
+		}
+		fprintf(f, "},\"geometry\":{\"type\":\"Point\",\"coordinates\":");
+		write_position(f, -180 + 360 * r.uniform(), -80 + 160 * r.uniform(), true);
+		fprintf(f, "}}\n");
+	}
+}
+
+struct dataset {
+	const char *name;
+	void (*make)(FILE *f, size_t scale);
+	std::vector<std::string> options;  // for tippecanoe
+} datasets[] = {
+	{"points", make_points, {"-z12", "--drop-densest-as-needed"}},
+	{"lines", make_lines, {"-z11"}},
+	{"polygons", make_polygons, {"-z9"}},
+	{"attributes", make_attributes, {"-z5", "-r1", "--no-tile-size-limit"}},
+};
+
+struct run_result {
+	double wall = 0;
+	double cpu = 0;
+	long long max_rss = 0;
+	std::string err;  // what the program wrote to stderr
+};
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run a program with its standard output discarded, and measure it
+static run_result run(std::vector<std::string> const &args) {
+	std::vector<char *> argv;
+	for (auto const &a : args) {
+		argv.push_back((char *) a.c_str());
+	}
+	argv.push_back(NULL);
+
+	int errpipe[2];
+	if (pipe(errpipe) != 0) {
+		perror("pipe");
+		exit(EXIT_OPEN);
+	}
+
+	double start = now();
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_IMPOSSIBLE);
+	}
+	if (pid == 0) {
+		int devnull = open("/dev/null", O_WRONLY);
+		if (devnull < 0 || dup2(devnull, 1) < 0 || dup2(errpipe[1], 2) < 0) {
+			perror("redirect");
+			exit(EXIT_OPEN);
+		}
+		close(errpipe[0]);
+		execv(argv[0], argv.data());
+		perror(argv[0]);
+		exit(EXIT_OPEN);
+	}
+
+	close(errpipe[1]);
+
+	run_result r;
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(errpipe[0], buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read");
+			exit(EXIT_READ);
+		}
+		r.err.append(buf, n);
+	}
+	close(errpipe[0]);
+
+	int status;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		exit(EXIT_IMPOSSIBLE);
+	}
+	r.wall = now() - start;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed:\n%s", argv[0], r.err.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	r.cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+	r.max_rss = ru.ru_maxrss;
+#else
+	r.max_rss = ru.ru_maxrss * 1024LL;
+#endif
+
+	return r;
+}
+
+// The lines of tippecanoe --json-progress output that are phase reports,
+// as a JSON array
+static std::string phases(std::string const &err) {
+	std::string out = "[";
+	size_t here = 0;
+
+	while (here < err.size()) {
+		size_t nl = err.find('\n', here);
+		if (nl == std::string::npos) {
+			nl = err.size();
+		}
+
+		std::string line = err.substr(here, nl - here);
+		if (line.compare(0, 10, "{\"phase\":\"") == 0) {
+			if (out.size() > 1) {
+				out += ",";
+			}
+			out += line;
+		}
+
+		here = nl + 1;
+	}
+
+	return out + "]";
+}
+
+static void report(const char *set, size_t scale, const char *program, size_t repetition, run_result const &r, std::string const &detail) {
+	printf("{\"dataset\":\"%s\",\"scale\":%zu,\"program\":\"%s\",\"run\":%zu,\"wall\":%.3f,\"cpu\":%.3f,\"max_rss\":%lld", set, scale, program, repetition, r.wall, r.cpu, r.max_rss);
+	if (detail.size() > 0) {
+		printf(",\"phases\":%s", detail.c_str());
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-s scale] [-d datadir] [-b bindir] [-r runs] [dataset ...]\n", argv[0]);
+	exit(EXIT_ARGS);
+}
+
+// A whole positive number from the command line, or the usage message
+static size_t positive_arg(char **argv, const char *arg) {
+	char *end;
+	errno = 0;
+	long n = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || n < 1) {
+		fprintf(stderr, "%s: %s: expected a positive whole number\n", argv[0], arg);
+		usage(argv);
+	}
+	return n;
+}
+
+int main(int argc, char **argv) {
+	size_t scale = 1;
+	size_t runs = 1;
+	std::string datadir = "/tmp/tippecanoe-benchmark";
+	std::string bindir = ".";
+
+	int i;
+	while ((i = getopt(argc, argv, "s:d:b:r:")) != -1) {
+		switch (i) {
+		case 's':
+			scale = positive_arg(argv, optarg);
+			break;
+
+		case 'd':
+			datadir = optarg;
+			break;
+
+		case 'b':
+			bindir = optarg;
+			break;
+
+		case 'r':
+			runs = positive_arg(argv, optarg);
+			break;
+
+		default:
+			usage(argv);
+		}
+	}
+
+	if (mkdir(datadir.c_str(), 0777) != 0 && errno != EEXIST) {
+		perror(datadir.c_str());
+		exit(EXIT_OPEN);
+	}
+
+	for (auto const &d : datasets) {
+		bool wanted = (optind == argc);
+		for (int a = optind; a < argc; a++) {
+			if (strcmp(argv[a], d.name) == 0) {
+				wanted = true;
+			}
+		}
+		if (!wanted) {
+			continue;
+		}
+
+		// The generated input is the same every time, so it is only made once
+		std::string input = datadir + "/" + d.name + "-" + std::to_string(scale) + ".json";
+		struct stat st;
+		if (stat(input.c_str(), &st) != 0) {
+			std::string tmp = input + ".tmp";
+			FILE *f = fopen(tmp.c_str(), "w");
+			if (f == NULL) {
+				perror(tmp.c_str());
+				exit(EXIT_OPEN);
+			}
+			d.make(f, scale);
+			if (fclose(f) != 0) {
+				perror(tmp.c_str());
+				exit(EXIT_CLOSE);
+			}
+			if (rename(tmp.c_str(), input.c_str()) != 0) {
+				perror(input.c_str());
+				exit(EXIT_OPEN);
+			}
+		}
+
+		std::string tiles = datadir + "/" + d.name + ".mbtiles";
+		std::string joined = datadir + "/" + d.name + "-joined.mbtiles";
+
+		for (size_t repetition = 0; repetition < runs; repetition++) {
+			std::vector<std::string> args = {bindir + "/tippecanoe", "--json-progress", "-f", "-o", tiles};
+			args.insert(args.end(), d.options.begin(), d.options.end());
+			args.push_back(input);
+
+			run_result r = run(args);
+			report(d.name, scale, "tippecanoe", repetition, r, phases(r.err));
+
+			r = run({bindir + "/tile-join", "-q", "-f", "-o", joined, tiles});
+			report(d.name, scale, "tile-join", repetition, r, "");
+
+			r = run({bindir + "/tippecanoe-decode", tiles});
+			report(d.name, scale, "tippecanoe-decode", repetition, r, "");
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
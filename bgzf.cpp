@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <algorithm>
+#include "bgzf.hpp"
+#include "task_pool.hpp"
+#include "errors.hpp"
+
+// The largest a BGZF member can be, compressed or not
+#define BGZF_MAX_MEMBER 65536
+
+// How many members each thread decompresses in a batch, memory permitting
+#define BGZF_MEMBERS_PER_THREAD 64
+
+// How long the BGZF member at p is, or 0 if more than the n bytes there
+// are needed to tell. Sets *bgzf to false if it is not a BGZF member.
+static size_t member_length(const unsigned char *p, size_t n, bool *bgzf) {
+	if (n < 12) {
+		return 0;
+	}
+	if (p[0] != 0x1F || p[1] != 0x8B || p[2] != 8 || (p[3] & 4) == 0) {
+		*bgzf = false;
+		return 0;
+	}
+
+	size_t xlen = p[10] | (p[11] << 8);
+	if (n < 12 + xlen) {
+		return 0;
+	}
+
+	for (size_t i = 12; i + 4 <= 12 + xlen;) {
+		size_t slen = p[i + 2] | (p[i + 3] << 8);
+
+		if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2 && i + 6 <= 12 + xlen) {
+			size_t len = (p[i + 4] | (p[i + 5] << 8)) + 1;
+			if (len < 12 + xlen + 8) {
+				*bgzf = false;
+				return 0;
+			}
+			if (n < len) {
+				return 0;
+			}
+			return len;
+		}
+
+		i += 4 + slen;
+	}
+
+	*bgzf = false;
+	return 0;
+}
+
+bool is_bgzf(int fd) {
+	off_t off = lseek(fd, 0, SEEK_CUR);
+	if (off < 0) {
+		return false;
+	}
+
+	std::string buf;
+	buf.resize(12 + BGZF_MAX_MEMBER);
+	ssize_t n = pread(fd, (void *) buf.data(), buf.size(), off);
+	if (n <= 0) {
+		return false;
+	}
+
+	bool bgzf = true;
+	member_length((const unsigned char *) buf.data(), n, &bgzf);
+	return bgzf && n >= 12;
+}
+
+bgzf_reader::bgzf_reader(int fd1, std::string const &fname1, size_t threads1, size_t budget)
+    : fd(fd1), fname(fname1), threads(std::max(threads1, (size_t) 1)) {
+	// Each member of a batch can take BGZF_MAX_MEMBER bytes both packed
+	// and unpacked, but each thread still gets at least one member
+	batch = std::min(threads * BGZF_MEMBERS_PER_THREAD, budget / (2 * BGZF_MAX_MEMBER));
+	batch = std::max(batch, threads);
+}
+
+struct bgzf_task {
+	bgzf_reader *reader;
+	size_t start;
+	size_t end;
+};
+
+static void *run_bgzf_task(void *v) {
+	bgzf_task *task = (bgzf_task *) v;
+	bgzf_reader *r = task->reader;
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+		fprintf(stderr, "%s: Decompression error\n", r->fname.c_str());
+		exit(EXIT_READ);
+	}
+
+	for (size_t i = task->start; i < task->end; i++) {
+		bgzf_member const &m = r->members[i];
+		if (m.size == 0) {
+			continue;
+		}
+
+		zs.next_in = (Bytef *) r->packed.data() + m.off;
+		zs.avail_in = m.len;
+		zs.next_out = (Bytef *) r->unpacked.data() + m.out;
+		zs.avail_out = m.size;
+
+		int ret = inflate(&zs, Z_FINISH);
+		if (ret != Z_STREAM_END || zs.avail_out != 0) {
+			fprintf(stderr, "%s: Error reading compressed data\n", r->fname.c_str());
+			exit(EXIT_READ);
+		}
+
+		inflateReset(&zs);
+	}
+
+	inflateEnd(&zs);
+	return NULL;
+}
+
+// Decompress the next batch of members into unpacked, or return false
+// at the end of the input
+bool bgzf_reader::next_batch() {
+	unpacked.clear();
+	unpacked_off = 0;
+
+	size_t want = batch;
+	while (!eof && packed_len < want * BGZF_MAX_MEMBER) {
+		if (packed.size() < want * BGZF_MAX_MEMBER) {
+			packed.resize(want * BGZF_MAX_MEMBER);
+		}
+
+		ssize_t n = ::read(fd, (void *) (packed.data() + packed_len), packed.size() - packed_len);
+		if (n < 0) {
+			perror(fname.c_str());
+			exit(EXIT_READ);
+		}
+		if (n == 0) {
+			eof = true;
+		}
+		packed_len += n;
+	}
+
+	// Find the members, which are all complete since the buffer
+	// has room for the largest possible member for each of them
+
+	members.clear();
+	size_t off = 0;
+	size_t out = 0;
+	while (members.size() < want && off < packed_len) {
+		bool bgzf = true;
+		size_t len = member_length((const unsigned char *) packed.data() + off, packed_len - off, &bgzf);
+		if (!bgzf) {
+			fprintf(stderr, "%s: Compressed data is not all BGZF\n", fname.c_str());
+			exit(EXIT_READ);
+		}
+		if (len == 0) {
+			fprintf(stderr, "%s: Compressed data is truncated\n", fname.c_str());
+			exit(EXIT_READ);
+		}
+
+		const unsigned char *trailer = (const unsigned char *) packed.data() + off + len - 4;
+		size_t size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((size_t) trailer[3] << 24);
+		if (size > BGZF_MAX_MEMBER) {
+			fprintf(stderr, "%s: Compressed data is not all BGZF\n", fname.c_str());
+			exit(EXIT_READ);
+		}
+
+		members.push_back(bgzf_member{off, len, out, size});
+		off += len;
+		out += size;
+	}
+
+	if (members.size() == 0) {
+		return false;
+	}
+
+	unpacked.resize(out);
+
+	size_t nthreads = std::min(threads, members.size());
+	std::vector<bgzf_task> tasks(nthreads);
+
+	for (size_t i = 0; i < nthreads; i++) {
+		tasks[i].reader = this;
+		tasks[i].start = members.size() * i / nthreads;
+		tasks[i].end = members.size() * (i + 1) / nthreads;
+	}
+
+	if (nthreads == 1) {
+		run_bgzf_task(&tasks[0]);
+	} else {
+		task_group decompressing;
+		for (size_t i = 0; i < nthreads; i++) {
+			task_run(&decompressing, run_bgzf_task, &tasks[i]);
+		}
+		task_wait(&decompressing);
+	}
+
+	// Keep the input that hasn't been decompressed yet
+	memmove((void *) packed.data(), packed.data() + off, packed_len - off);
+	packed_len -= off;
+
+	// A batch of empty members has nothing to return, so go on to the next
+	if (unpacked.size() == 0) {
+		return next_batch();
+	}
+
+	return true;
+}
+
+size_t bgzf_reader::read(char *buf, size_t count) {
+	size_t got = 0;
+
+	while (got < count) {
+		if (unpacked_off >= unpacked.size()) {
+			if (!next_batch()) {
+				break;
+			}
+		}
+
+		size_t n = std::min(count - got, unpacked.size() - unpacked_off);
+		memcpy(buf + got, unpacked.data() + unpacked_off, n);
+		unpacked_off += n;
+		got += n;
+	}
+
+	return got;
+}
+
+int bgzf_reader::peekc() {
+	if (unpacked_off >= unpacked.size()) {
+		if (!next_batch()) {
+			return EOF;
+		}
+	}
+
+	return (unsigned char) unpacked[unpacked_off];
+}
@@ -0,0 +1,52 @@
+#ifndef BGZF_HPP
+#define BGZF_HPP
+
+#include <string>
+#include <vector>
+
+// BGZF is gzip in independent members of at most 64K each, with the
+// compressed size of each member recorded in its header, as written by
+// bgzip. Any gzip reader can read it, but it can also be split into its
+// members without decompressing anything, so that the members can be
+// decompressed in parallel.
+//
+// bgzf_reader reads the members in batches, one range of members per
+// thread, and hands back the decompressed bytes in order. A batch is
+// kept small enough that its compressed and decompressed buffers fit
+// in the memory budget it is given.
+
+struct bgzf_member {
+	size_t off;	 // in packed
+	size_t len;	 // compressed, including the header and trailer
+	size_t out;	 // in unpacked
+	size_t size;	 // decompressed
+};
+
+struct bgzf_reader {
+	int fd = -1;
+	std::string fname;
+	size_t threads = 1;
+	size_t batch = 1;  // members per batch
+
+	std::string packed;  // compressed input that has been read
+	size_t packed_len = 0;
+	bool eof = false;
+
+	std::string unpacked;  // decompressed output of the current batch
+	size_t unpacked_off = 0;
+
+	std::vector<bgzf_member> members;
+
+	bgzf_reader(int fd, std::string const &fname, size_t threads, size_t budget);
+
+	size_t read(char *out, size_t count);
+	int peekc();
+
+       private:
+	bool next_batch();
+};
+
+// Whether the gzip file open on fd, at its current position, is BGZF
+bool is_bgzf(int fd);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+#include "binary_filter.hpp"
+#include "mvt.hpp"
+#include "errors.hpp"
+
+static void put32(unsigned char *p, unsigned long v) {
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+static unsigned long get32(unsigned char const *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+// Reads exactly len bytes, or as many as there are before the end of the input
+static size_t read_fully(int fd, char *buf, size_t len) {
+	size_t off = 0;
+
+	while (off < len) {
+		ssize_t n = read(fd, buf + off, len - off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read binary filter frame");
+			exit(EXIT_READ);
+		}
+		if (n == 0) {
+			break;
+		}
+		off += n;
+	}
+
+	return off;
+}
+
+bool read_binary_frame(int fd, unsigned &z, unsigned &x, unsigned &y, std::string &data) {
+	unsigned char header[BINARY_FILTER_HEADER];
+
+	size_t n = read_fully(fd, (char *) header, BINARY_FILTER_HEADER);
+	if (n == 0) {
+		return false;
+	}
+	if (n != BINARY_FILTER_HEADER) {
+		fprintf(stderr, "Binary filter frame header is truncated\n");
+		exit(EXIT_READ);
+	}
+
+	z = get32(header);
+	x = get32(header + 4);
+	y = get32(header + 8);
+	size_t len = get32(header + 12);
+
+	data.resize(len);
+	if (read_fully(fd, &data[0], len) != len) {
+		fprintf(stderr, "Binary filter frame for %u/%u/%u is truncated\n", z, x, y);
+		exit(EXIT_READ);
+	}
+
+	return true;
+}
+
+bool write_binary_frame(FILE *fp, unsigned z, unsigned x, unsigned y, std::string const &data) {
+	if (data.size() > 0xFFFFFFFFUL) {
+		fprintf(stderr, "Tile %u/%u/%u is too large (%zu bytes) for a binary filter frame\n", z, x, y, data.size());
+		exit(EXIT_WRITE);
+	}
+
+	unsigned char header[BINARY_FILTER_HEADER];
+	put32(header, z);
+	put32(header + 4, x);
+	put32(header + 8, y);
+	put32(header + 12, data.size());
+
+	if (fwrite(header, 1, BINARY_FILTER_HEADER, fp) != BINARY_FILTER_HEADER ||
+	    fwrite(data.c_str(), 1, data.size(), fp) != data.size() ||
+	    fflush(fp) != 0) {
+		if (errno == EPIPE) {
+			return false;
+		}
+		perror("write binary filter frame");
+		exit(EXIT_WRITE);
+	}
+
+	return true;
+}
+
+void run_binary_filter(std::function<void(unsigned z, unsigned x, unsigned y, mvt_tile &tile)> const &filter) {
+	unsigned z, x, y;
+	std::string data;
+
+	while (read_binary_frame(0, z, x, y, data)) {
+		mvt_tile tile;
+		bool was_compressed;
+		if (!tile.decode(data, was_compressed)) {
+			fprintf(stderr, "Couldn't decode tile %u/%u/%u\n", z, x, y);
+			exit(EXIT_MVT);
+		}
+
+		filter(z, x, y, tile);
+
+		if (!write_binary_frame(stdout, z, x, y, tile.encode())) {
+			exit(EXIT_WRITE);
+		}
+	}
+}
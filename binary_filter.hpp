@@ -0,0 +1,31 @@
+#ifndef BINARY_FILTER_HPP
+#define BINARY_FILTER_HPP
+
+#include <stdio.h>
+#include <string>
+#include <functional>
+#include "mvt.hpp"
+
+// With --binary-filters, each tile goes to and comes back from the filter
+// as a frame: a 16-byte header of the tile's zoom, x, y, and the length
+// of the data that follows, each a little-endian 32-bit unsigned integer,
+// and then an uncompressed vector tile of that many bytes.
+//
+// The prefilter's tiles have an extent of 2^(32 - zoom - geometry scale),
+// which is at most 2^30, so that they keep the full resolution of the
+// features. Each prefilter feature has $index, $sequence, $extent, and
+// $dropped attributes that should be passed through.
+
+#define BINARY_FILTER_HEADER 16
+
+// Returns false at the end of the input, if it comes before a frame begins
+bool read_binary_frame(int fd, unsigned &z, unsigned &x, unsigned &y, std::string &data);
+
+// Returns false if the reader has gone away
+bool write_binary_frame(FILE *fp, unsigned z, unsigned x, unsigned y, std::string const &data);
+
+// The main loop of a filter: reads each tile from the standard input,
+// calls the function to change it, and writes it to the standard output.
+void run_binary_filter(std::function<void(unsigned z, unsigned x, unsigned y, mvt_tile &tile)> const &filter);
+
+#endif
@@ -2,74 +2,288 @@
 #define _DARWIN_UNLIMITED_STREAMS
 #endif
 
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "compression.hpp"
 #include "errors.hpp"
 #include "protozero/varint.hpp"
 #include "serial.hpp"
 
+#if defined(HAVE_ZSTD)
+int temp_codec = TEMP_CODEC_ZSTD;
+#elif defined(HAVE_LZ4)
+int temp_codec = TEMP_CODEC_LZ4;
+#else
+int temp_codec = TEMP_CODEC_DEFLATE;
+#endif
+
+struct codec_name {
+	const char *name;
+	int codec;
+} codec_names[] = {
+	{"none", TEMP_CODEC_NONE},
+	{"deflate", TEMP_CODEC_DEFLATE},
+#ifdef HAVE_LZ4
+	{"lz4", TEMP_CODEC_LZ4},
+#endif
+#ifdef HAVE_ZSTD
+	{"zstd", TEMP_CODEC_ZSTD},
+#endif
+};
+
+bool set_temp_codec(const char *name) {
+	for (auto const &c : codec_names) {
+		if (strcmp(c.name, name) == 0) {
+			temp_codec = c.codec;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+std::string temp_codec_names() {
+	std::string out;
+	for (auto const &c : codec_names) {
+		if (out.size() != 0) {
+			out += ", ";
+		}
+		out += c.name;
+	}
+	return out;
+}
+
+// Compress the contents of in, replacing the contents of out
+static void pack(std::string const &in, std::string &out, const char *fname) {
+	switch (temp_codec) {
+	case TEMP_CODEC_NONE:
+		out = in;
+		return;
+
+	case TEMP_CODEC_DEFLATE: {
+		uLongf len = compressBound(in.size());
+		out.resize(len);
+		int d = compress2((Bytef *) out.data(), &len, (const Bytef *) in.data(), in.size(), Z_BEST_SPEED);
+		if (d != Z_OK) {
+			fprintf(stderr, "%s: deflate: %d\n", fname, d);
+			exit(EXIT_IMPOSSIBLE);
+		}
+		out.resize(len);
+		return;
+	}
+
+#ifdef HAVE_LZ4
+	case TEMP_CODEC_LZ4: {
+		out.resize(LZ4_compressBound(in.size()));
+		int len = LZ4_compress_default(in.data(), (char *) out.data(), in.size(), out.size());
+		if (len <= 0) {
+			fprintf(stderr, "%s: lz4 compression failed\n", fname);
+			exit(EXIT_IMPOSSIBLE);
+		}
+		out.resize(len);
+		return;
+	}
+#endif
+
+#ifdef HAVE_ZSTD
+	case TEMP_CODEC_ZSTD: {
+		static thread_local ZSTD_CCtx *ctx = ZSTD_createCCtx();
+		out.resize(ZSTD_compressBound(in.size()));
+		size_t len = ZSTD_compressCCtx(ctx, (void *) out.data(), out.size(), in.data(), in.size(), 1);
+		if (ZSTD_isError(len)) {
+			fprintf(stderr, "%s: zstd compression: %s\n", fname, ZSTD_getErrorName(len));
+			exit(EXIT_IMPOSSIBLE);
+		}
+		out.resize(len);
+		return;
+	}
+#endif
+	}
+
+	fprintf(stderr, "Internal error: unknown temporary file codec %d\n", temp_codec);
+	exit(EXIT_IMPOSSIBLE);
+}
+
+// Decompress the contents of in into out, which is already the right size
+static void unpack(std::string const &in, std::string &out) {
+	switch (temp_codec) {
+	case TEMP_CODEC_NONE:
+		if (in.size() != out.size()) {
+			break;
+		}
+		out = in;
+		return;
+
+	case TEMP_CODEC_DEFLATE: {
+		uLongf len = out.size();
+		int d = uncompress((Bytef *) out.data(), &len, (const Bytef *) in.data(), in.size());
+		if (d != Z_OK || len != out.size()) {
+			fprintf(stderr, "decompression error %d\n", d);
+			exit(EXIT_IMPOSSIBLE);
+		}
+		return;
+	}
+
+#ifdef HAVE_LZ4
+	case TEMP_CODEC_LZ4: {
+		int len = LZ4_decompress_safe(in.data(), (char *) out.data(), in.size(), out.size());
+		if (len < 0 || (size_t) len != out.size()) {
+			break;
+		}
+		return;
+	}
+#endif
+
+#ifdef HAVE_ZSTD
+	case TEMP_CODEC_ZSTD: {
+		static thread_local ZSTD_DCtx *ctx = ZSTD_createDCtx();
+		size_t len = ZSTD_decompressDCtx(ctx, (void *) out.data(), out.size(), in.data(), in.size());
+		if (ZSTD_isError(len)) {
+			fprintf(stderr, "decompression error: %s\n", ZSTD_getErrorName(len));
+			exit(EXIT_IMPOSSIBLE);
+		}
+		if (len != out.size()) {
+			break;
+		}
+		return;
+	}
+#endif
+	}
+
+	fprintf(stderr, "decompression error: block did not decompress to %zu bytes\n", out.size());
+	exit(EXIT_IMPOSSIBLE);
+}
+
 void decompressor::begin() {
 	within = true;
+	block.clear();
+	block_off = 0;
+}
+
+// Forget any data read ahead, because the caller has moved fp
+void decompressor::reset() {
+	buf_off = 0;
+	buf_len = 0;
+	block.clear();
+	block_off = 0;
+}
+
+size_t decompressor::read_raw(char *p, size_t n, std::atomic<long long> *geompos) {
+	size_t got = 0;
+
+	while (got < n) {
+		if (buf_off == buf_len) {
+			if (n - got >= buf.size()) {
+				// big enough not to be worth buffering
+				size_t r = ::fread(p + got, sizeof(char), n - got, fp);
+				got += r;
+				*geompos += r;
+				break;
+			}
+
+			buf_off = 0;
+			buf_len = ::fread((void *) buf.data(), sizeof(char), buf.size(), fp);
+			if (buf_len == 0) {
+				break;
+			}
+		}
+
+		size_t r = std::min(n - got, buf_len - buf_off);
+		memcpy(p + got, buf.data() + buf_off, r);
+		buf_off += r;
+		got += r;
+		*geompos += r;
+	}
+
+	return got;
+}
+
+bool decompressor::read_raw_varint(unsigned long long *n, std::atomic<long long> *geompos) {
+	*n = 0;
+	int shift = 0;
+
+	while (true) {
+		unsigned char c;
+		if (read_raw((char *) &c, 1, geompos) != 1) {
+			return false;
+		}
+
+		*n |= ((unsigned long long) (c & 0x7F)) << shift;
+		shift += 7;
+
+		if ((c & 0x80) == 0) {
+			return true;
+		}
+	}
+}
+
+// Decompress the next block of the stream into block, or return false
+// if the stream has ended
+bool decompressor::next_block(std::atomic<long long> *geompos) {
+	unsigned long long len, packed_len;
+
+	if (!read_raw_varint(&len, geompos)) {
+		fprintf(stderr, "Reached EOF while decompressing\n");
+		exit(EXIT_IMPOSSIBLE);
+	}
 
-	zs.zalloc = NULL;
-	zs.zfree = NULL;
-	zs.opaque = NULL;
-	zs.msg = (char *) "";
+	if (len == 0) {
+		within = false;
+		block.clear();
+		block_off = 0;
+		return false;
+	}
 
-	int d = inflateInit(&zs);
-	if (d != Z_OK) {
-		fprintf(stderr, "initialize decompression: %d %s\n", d, zs.msg);
+	if (!read_raw_varint(&packed_len, geompos)) {
+		fprintf(stderr, "Reached EOF while decompressing\n");
 		exit(EXIT_IMPOSSIBLE);
 	}
+
+	packed.resize(packed_len);
+	if (read_raw((char *) packed.data(), packed_len, geompos) != packed_len) {
+		fprintf(stderr, "Reached EOF while decompressing\n");
+		exit(EXIT_IMPOSSIBLE);
+	}
+
+	block.resize(len);
+	unpack(packed, block);
+	block_off = 0;
+	return true;
 }
 
 int decompressor::fread(void *p, size_t size, size_t nmemb, std::atomic<long long> *geompos) {
-	zs.next_out = (Bytef *) p;
-	zs.avail_out = size * nmemb;
+	size_t want = size * nmemb;
+	size_t got = 0;
 
-	while (zs.avail_out > 0) {
-		if (zs.avail_in == 0) {
-			size_t n = ::fread((Bytef *) buf.c_str(), sizeof(char), buf.size(), fp);
-			if (n == 0) {
-				if (within) {
-					fprintf(stderr, "Reached EOF while decompressing\n");
-					exit(EXIT_IMPOSSIBLE);
-				} else {
+	while (got < want) {
+		if (within) {
+			if (block_off == block.size()) {
+				if (!next_block(geompos)) {
+					// the stream ended, so the read is short
 					break;
 				}
 			}
-			zs.next_in = (Bytef *) buf.c_str();
-			zs.avail_in = n;
-		}
-
-		size_t avail_before = zs.avail_in;
 
-		if (within) {
-			int d = inflate(&zs, Z_NO_FLUSH);
-			*geompos += avail_before - zs.avail_in;
-
-			if (d == Z_OK) {
-				// it made some progress
-			} else if (d == Z_STREAM_END) {
-				// it may have made some progress and now we are done
-				within = false;
+			size_t n = std::min(want - got, block.size() - block_off);
+			memcpy((char *) p + got, block.data() + block_off, n);
+			block_off += n;
+			got += n;
+		} else {
+			size_t n = read_raw((char *) p + got, want - got, geompos);
+			got += n;
+			if (n == 0) {
 				break;
-			} else {
-				fprintf(stderr, "decompression error %d %s\n", d, zs.msg);
-				exit(EXIT_IMPOSSIBLE);
 			}
-		} else {
-			size_t n = std::min(zs.avail_in, zs.avail_out);
-			memcpy(zs.next_out, zs.next_in, n);
-			*geompos += n;
-
-			zs.avail_out -= n;
-			zs.avail_in -= n;
-			zs.next_out += n;
-			zs.next_in += n;
 		}
 	}
 
-	return (size * nmemb - zs.avail_out) / size;
+	return got / size;
 }
 
 void decompressor::end(std::atomic<long long> *geompos) {
@@ -79,39 +293,12 @@ void decompressor::end(std::atomic<long long> *geompos) {
 	// the end of the feature stream (because it got a 0-length
 	// feature) but the decompressor doesn't know yet.
 
-	if (within) {
-		while (true) {
-			if (zs.avail_in == 0) {
-				size_t n = ::fread((Bytef *) buf.c_str(), sizeof(char), buf.size(), fp);
-				zs.next_in = (Bytef *) buf.c_str();
-				zs.avail_in = n;
-			}
-
-			zs.avail_out = 0;
-
-			size_t avail_before = zs.avail_in;
-			int d = inflate(&zs, Z_NO_FLUSH);
-			*geompos += avail_before - zs.avail_in;
-
-			if (d == Z_STREAM_END) {
-				break;
-			}
-			if (d == Z_OK) {
-				continue;
-			}
-
-			fprintf(stderr, "decompression: got %d, not Z_STREAM_END\n", d);
-			exit(EXIT_IMPOSSIBLE);
-		}
-
-		within = false;
+	while (within) {
+		next_block(geompos);
 	}
 
-	int d = inflateEnd(&zs);
-	if (d != Z_OK) {
-		fprintf(stderr, "end decompression: %d %s\n", d, zs.msg);
-		exit(EXIT_IMPOSSIBLE);
-	}
+	block.clear();
+	block_off = 0;
 }
 
 int decompressor::deserialize_ulong_long(unsigned long long *zigzag, std::atomic<long long> *geompos) {
@@ -120,7 +307,10 @@ int decompressor::deserialize_ulong_long(unsigned long long *zigzag, std::atomic
 
 	while (1) {
 		char c;
-		if (fread(&c, sizeof(char), 1, geompos) != 1) {
+		if (within && block_off < block.size()) {
+			// fast path within the current block
+			c = block[block_off++];
+		} else if (fread(&c, sizeof(char), 1, geompos) != 1) {
 			return 0;
 		}
 
@@ -159,60 +349,26 @@ int decompressor::deserialize_uint(unsigned *n, std::atomic<long long> *geompos)
 }
 
 void compressor::begin() {
-	zs.zalloc = NULL;
-	zs.zfree = NULL;
-	zs.opaque = NULL;
-	zs.msg = (char *) "";
-
-	int d = deflateInit(&zs, Z_DEFAULT_COMPRESSION);
-	if (d != Z_OK) {
-		fprintf(stderr, "initialize compression: %d %s\n", d, zs.msg);
-		exit(EXIT_IMPOSSIBLE);
-	}
+	block.clear();
 }
 
-void compressor::compressor::end(std::atomic<long long> *fpos, const char *fname) {
-	std::string buf;
-	buf.resize(5000);
-
-	if (zs.avail_in != 0) {
-		fprintf(stderr, "compression end called with data available\n");
-		exit(EXIT_IMPOSSIBLE);
+void compressor::flush_block(std::atomic<long long> *fpos, const char *fname) {
+	if (block.size() == 0) {
+		return;
 	}
 
-	zs.next_in = (Bytef *) buf.c_str();
-	zs.avail_in = 0;
+	pack(block, packed, fname);
 
-	while (true) {
-		zs.next_out = (Bytef *) buf.c_str();
-		zs.avail_out = buf.size();
+	::serialize_ulong_long(fp, block.size(), fpos, fname);
+	::serialize_ulong_long(fp, packed.size(), fpos, fname);
+	::fwrite_check(packed.data(), sizeof(char), packed.size(), fp, fpos, fname);
 
-		int d = deflate(&zs, Z_FINISH);
-		::fwrite_check(buf.c_str(), sizeof(char), zs.next_out - (Bytef *) buf.c_str(), fp, fpos, fname);
-
-		if (d == Z_OK || d == Z_BUF_ERROR) {
-			// it can take several calls to flush out all the buffered data
-			continue;
-		}
-
-		if (d != Z_STREAM_END) {
-			fprintf(stderr, "%s: finish compression: %d %s\n", fname, d, zs.msg);
-			exit(EXIT_IMPOSSIBLE);
-		}
-
-		break;
-	}
-
-	zs.next_out = (Bytef *) buf.c_str();
-	zs.avail_out = buf.size();
-
-	int d = deflateEnd(&zs);
-	if (d != Z_OK) {
-		fprintf(stderr, "%s: end compression: %d %s\n", fname, d, zs.msg);
-		exit(EXIT_IMPOSSIBLE);
-	}
+	block.clear();
+}
 
-	::fwrite_check(buf.c_str(), sizeof(char), zs.next_out - (Bytef *) buf.c_str(), fp, fpos, fname);
+void compressor::end(std::atomic<long long> *fpos, const char *fname) {
+	flush_block(fpos, fname);
+	::serialize_ulong_long(fp, 0, fpos, fname);  // end of stream
 }
 
 int compressor::fclose() {
@@ -220,23 +376,17 @@ int compressor::fclose() {
 }
 
 void compressor::fwrite_check(const char *p, size_t size, size_t nmemb, std::atomic<long long> *fpos, const char *fname) {
-	std::string buf;
-	buf.resize(size * nmemb * 2 + 200);
+	size_t n = size * nmemb;
 
-	zs.next_in = (Bytef *) p;
-	zs.avail_in = size * nmemb;
+	while (n > 0) {
+		size_t here = std::min(n, (size_t) COMPRESSION_BLOCK - block.size());
+		block.append(p, here);
+		p += here;
+		n -= here;
 
-	while (zs.avail_in > 0) {
-		zs.next_out = (Bytef *) buf.c_str();
-		zs.avail_out = buf.size();
-
-		int d = deflate(&zs, Z_NO_FLUSH);
-		if (d != Z_OK) {
-			fprintf(stderr, "%s: deflate: %d %s\n", fname, d, zs.msg);
-			exit(EXIT_IMPOSSIBLE);
+		if (block.size() >= COMPRESSION_BLOCK) {
+			flush_block(fpos, fname);
 		}
-
-		::fwrite_check(buf.c_str(), sizeof(char), zs.next_out - (Bytef *) buf.c_str(), fp, fpos, fname);
 	}
 }
 
@@ -5,12 +5,39 @@
 #include <stdio.h>
 #include <string>
 #include <atomic>
-#include <zlib.h>
+
+// Codecs for the feature streams in the temporary files between zoom levels.
+// These files never leave the machine, so speed matters more than size.
+// LZ4 and Zstandard are only available if built with LZ4=1 or ZSTD=1.
+enum temp_codec {
+	TEMP_CODEC_NONE,
+	TEMP_CODEC_DEFLATE,
+	TEMP_CODEC_LZ4,
+	TEMP_CODEC_ZSTD,
+};
+
+extern int temp_codec;
+
+// Returns false if there is no codec by that name in this build
+bool set_temp_codec(const char *name);
+std::string temp_codec_names();
+
+// A compressed stream is a sequence of blocks, each independently
+// compressed with temp_codec, that decompress to at most this many bytes
+#define COMPRESSION_BLOCK (64 * 1024)
 
 struct decompressor {
 	FILE *fp = NULL;
-	z_stream zs;
+
+	// data read from fp but not yet consumed
 	std::string buf;
+	size_t buf_off = 0;
+	size_t buf_len = 0;
+
+	// the decompressed block being read from, and the compressed form it came from
+	std::string block;
+	size_t block_off = 0;
+	std::string packed;
 
 	// from begin() to receiving end-of-stream
 	bool within = false;
@@ -18,26 +45,32 @@ struct decompressor {
 	decompressor(FILE *f) {
 		fp = f;
 		buf.resize(5000);
-
-		zs.next_in = (Bytef *) buf.c_str();
-		zs.avail_in = 0;
 	}
 
 	decompressor() {
 	}
 
 	void begin();
+	void reset();
 	int fread(void *p, size_t size, size_t nmemb, std::atomic<long long> *geompos);
 	void end(std::atomic<long long> *geompos);
 	int deserialize_ulong_long(unsigned long long *zigzag, std::atomic<long long> *geompos);
 	int deserialize_long_long(long long *n, std::atomic<long long> *geompos);
 	int deserialize_int(int *n, std::atomic<long long> *geompos);
 	int deserialize_uint(unsigned *n, std::atomic<long long> *geompos);
+
+       private:
+	size_t read_raw(char *p, size_t n, std::atomic<long long> *geompos);
+	bool read_raw_varint(unsigned long long *n, std::atomic<long long> *geompos);
+	bool next_block(std::atomic<long long> *geompos);
 };
 
 struct compressor {
 	FILE *fp = NULL;
-	z_stream zs;
+
+	// data written since the last block was compressed
+	std::string block;
+	std::string packed;
 
 	compressor(FILE *f) {
 		fp = f;
@@ -55,4 +88,7 @@ struct compressor {
 	void serialize_long_long(long long val, std::atomic<long long> *fpos, const char *fname);
 	void serialize_int(int val, std::atomic<long long> *fpos, const char *fname);
 	void serialize_uint(unsigned val, std::atomic<long long> *fpos, const char *fname);
+
+       private:
+	void flush_block(std::atomic<long long> *fpos, const char *fname);
 };
@@ -9,7 +9,8 @@ std::vector<std::string> csv_split(const char *s) {
 		const char *start = s;
 		int within = 0;
 
-		for (; *s && *s != '\n' && *s != '\r'; s++) {
+		// Newlines within quotes are part of the field
+		for (; *s && (within || (*s != '\n' && *s != '\r')); s++) {
 			if (*s == '"') {
 				within = !within;
 			}
@@ -53,18 +54,34 @@ std::string csv_dequote(std::string s) {
 	return out;
 }
 
+// Read one record, which continues past newlines that are within quotes
 std::string csv_getline(FILE *f) {
 	std::string out;
 	int c;
+	int within = 0;
 	while ((c = getc(f)) != EOF) {
 		out.push_back(c);
-		if (c == '\n') {
+		if (c == '"') {
+			within = !within;
+		} else if (c == '\n' && !within) {
 			break;
 		}
 	}
 	return out;
 }
 
+size_t csv_record_length(const char *s, size_t n) {
+	int within = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (s[i] == '"') {
+			within = !within;
+		} else if (s[i] == '\n' && !within) {
+			return i + 1;
+		}
+	}
+	return n;
+}
+
 void readcsv(const char *fn, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping) {
 	FILE *f = fopen(fn, "r");
 	if (f == NULL) {
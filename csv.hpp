@@ -11,6 +11,7 @@ std::vector<std::string> csv_split(const char *s);
 std::string csv_dequote(std::string s);
 void readcsv(const char *fn, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping);
 std::string csv_getline(FILE *f);
+size_t csv_record_length(const char *s, size_t n);
 bool is_number(std::string const &s);
 
 #endif
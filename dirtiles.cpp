@@ -84,9 +84,14 @@ static bool pbfname(const char *s) {
 	return strcmp(s, ".pbf") == 0 || strcmp(s, ".mvt") == 0;
 }
 
-void check_dir(const char *dir, char **argv, bool force, bool forcetable) {
+void check_dir(const char *dir, char **argv, bool force, bool forcetable, bool update) {
 	struct stat st;
 
+	if (update) {
+		// The tiles are changed in place
+		return;
+	}
+
 	mkdir(dir, S_IRWXU | S_IRWXG | S_IRWXO);
 	std::string meta = std::string(dir) + "/" + "metadata.json";
 	if (force) {
@@ -228,6 +233,15 @@ void dir_erase_zoom(const char *fname, int zoom) {
 	}
 }
 
+void dir_erase_tile(const char *outdir, int z, int tx, int ty) {
+	std::string tile = std::string(outdir) + "/" + std::to_string(z) + "/" + std::to_string(tx) + "/" + std::to_string(ty) + ".pbf";
+
+	if (unlink(tile.c_str()) != 0 && errno != ENOENT) {
+		perror(tile.c_str());
+		exit(EXIT_UNLINK);
+	}
+}
+
 sqlite3 *dirmeta2tmp(const char *fname) {
 	sqlite3 *db;
 	char *err = NULL;
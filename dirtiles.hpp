@@ -7,9 +7,10 @@
 
 void dir_write_tile(const char *outdir, int z, int tx, int ty, std::string const &pbf);
 void dir_erase_zoom(const char *outdir, int z);
+void dir_erase_tile(const char *outdir, int z, int tx, int ty);
 void dir_write_metadata(const char *outdir, const metadata &m);
 
-void check_dir(const char *d, char **argv, bool force, bool forcetable);
+void check_dir(const char *d, char **argv, bool force, bool forcetable, bool update);
 
 struct zxy {
 	long long z;
@@ -6,38 +6,296 @@
 #include "evaluator.hpp"
 #include "errors.hpp"
 
-int compare(mvt_value one, json_object *two, bool &fail) {
-	if (one.type == mvt_string) {
+enum filter_op {
+	OP_HAS,
+	OP_NOT_HAS,
+	OP_EQ,
+	OP_NE,
+	OP_GT,
+	OP_GE,
+	OP_LT,
+	OP_LE,
+	OP_ALL,
+	OP_ANY,
+	OP_NONE,
+	OP_IN,
+	OP_NOT_IN,
+	OP_ATTRIBUTE_FILTER,
+};
+
+compiled_filter::~compiled_filter() {
+	if (json != NULL) {
+		json_free(json);
+	}
+}
+
+static size_t add_slot(compiled_filter *cf, const char *key) {
+	auto f = cf->slots.find(key);
+	if (f != cf->slots.end()) {
+		return f->second;
+	}
+
+	size_t slot = cf->keys.size();
+	cf->keys.push_back(key);
+	cf->slots.insert(std::pair<std::string, size_t>(key, slot));
+	return slot;
+}
+
+static size_t compile(compiled_filter *cf, json_object *f) {
+	if (f == NULL || f->type != JSON_ARRAY) {
+		fprintf(stderr, "Filter is not an array: %s\n", json_stringify(f));
+		exit(EXIT_FILTER);
+	}
+
+	if (f->value.array.length < 1) {
+		fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
+		exit(EXIT_FILTER);
+	}
+
+	if (f->value.array.array[0]->type != JSON_STRING) {
+		fprintf(stderr, "Filter operation is not a string: %s\n", json_stringify(f));
+		exit(EXIT_FILTER);
+	}
+
+	const char *op = f->value.array.array[0]->value.string.string;
+	filter_node n;
+	n.source = f;
+
+	if (strcmp(op, "has") == 0 || strcmp(op, "!has") == 0) {
+		if (f->value.array.length != 2) {
+			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
+			exit(EXIT_FILTER);
+		}
+
+		if (f->value.array.array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"%s\" key is not a string: %s\n", op, json_stringify(f));
+			exit(EXIT_FILTER);
+		}
+
+		n.op = strcmp(op, "has") == 0 ? OP_HAS : OP_NOT_HAS;
+		n.slot = add_slot(cf, f->value.array.array[1]->value.string.string);
+	} else if (strcmp(op, "==") == 0 || strcmp(op, "!=") == 0 ||
+		   strcmp(op, ">") == 0 || strcmp(op, ">=") == 0 ||
+		   strcmp(op, "<") == 0 || strcmp(op, "<=") == 0) {
+		if (f->value.array.length != 3) {
+			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
+			exit(EXIT_FILTER);
+		}
+		if (f->value.array.array[1]->type != JSON_STRING) {
+			fprintf(stderr, "comparison key is not a string: %s\n", json_stringify(f));
+			exit(EXIT_FILTER);
+		}
+
+		if (strcmp(op, "==") == 0) {
+			n.op = OP_EQ;
+		} else if (strcmp(op, "!=") == 0) {
+			n.op = OP_NE;
+		} else if (strcmp(op, ">") == 0) {
+			n.op = OP_GT;
+		} else if (strcmp(op, ">=") == 0) {
+			n.op = OP_GE;
+		} else if (strcmp(op, "<") == 0) {
+			n.op = OP_LT;
+		} else {
+			n.op = OP_LE;
+		}
+
+		n.slot = add_slot(cf, f->value.array.array[1]->value.string.string);
+		n.first = cf->constants.size();
+		n.count = 1;
+		cf->constants.push_back(f->value.array.array[2]);
+	} else if (strcmp(op, "all") == 0 || strcmp(op, "any") == 0 || strcmp(op, "none") == 0) {
+		if (strcmp(op, "all") == 0) {
+			n.op = OP_ALL;
+		} else if (strcmp(op, "any") == 0) {
+			n.op = OP_ANY;
+		} else {
+			n.op = OP_NONE;
+		}
+
+		std::vector<size_t> kids;
+		for (size_t i = 1; i < f->value.array.length; i++) {
+			kids.push_back(compile(cf, f->value.array.array[i]));
+		}
+
+		n.first = cf->children.size();
+		n.count = kids.size();
+		cf->children.insert(cf->children.end(), kids.begin(), kids.end());
+	} else if (strcmp(op, "in") == 0 || strcmp(op, "!in") == 0) {
+		if (f->value.array.length < 2) {
+			fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
+			exit(EXIT_FILTER);
+		}
+
+		if (f->value.array.array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"!in\" key is not a string: %s\n", json_stringify(f));
+			exit(EXIT_FILTER);
+		}
+
+		n.op = strcmp(op, "in") == 0 ? OP_IN : OP_NOT_IN;
+		n.slot = add_slot(cf, f->value.array.array[1]->value.string.string);
+		n.first = cf->constants.size();
+		n.count = f->value.array.length - 2;
+		for (size_t i = 2; i < f->value.array.length; i++) {
+			cf->constants.push_back(f->value.array.array[i]);
+		}
+	} else if (strcmp(op, "attribute-filter") == 0) {
+		if (f->value.array.length != 3) {
+			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
+			exit(EXIT_FILTER);
+		}
+
+		if (f->value.array.array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"attribute-filter\" key is not a string: %s\n", json_stringify(f));
+			exit(EXIT_FILTER);
+		}
+
+		n.op = OP_ATTRIBUTE_FILTER;
+		n.slot = add_slot(cf, f->value.array.array[1]->value.string.string);
+
+		size_t kid = compile(cf, f->value.array.array[2]);
+		n.first = cf->children.size();
+		n.count = 1;
+		cf->children.push_back(kid);
+	} else {
+		fprintf(stderr, "Unknown filter %s\n", json_stringify(f));
+		exit(EXIT_FILTER);
+	}
+
+	cf->nodes.push_back(n);
+	return cf->nodes.size() - 1;
+}
+
+compiled_filter *compile_filter(json_object *filter) {
+	if (filter == NULL || filter->type != JSON_HASH) {
+		fprintf(stderr, "Error: filter is not a hash: %s\n", json_stringify(filter));
+		exit(EXIT_JSON);
+	}
+
+	compiled_filter *cf = new compiled_filter;
+	cf->json = filter;
+
+	for (size_t i = 0; i < filter->value.object.length; i++) {
+		json_object *k = filter->value.object.keys[i];
+		if (k == NULL || k->type != JSON_STRING) {
+			continue;
+		}
+
+		// As with json_hash_get(), the first filter for a layer is the one that counts
+		if (cf->layers.count(k->value.string.string) != 0) {
+			continue;
+		}
+
+		size_t root = compile(cf, filter->value.object.values[i]);
+		cf->layers.insert(std::pair<std::string, size_t>(k->value.string.string, root));
+
+		if (strcmp(k->value.string.string, "*") == 0) {
+			cf->all_layers = root;
+		}
+	}
+
+	return cf;
+}
+
+ssize_t filter_slot(compiled_filter const *filter, const char *key) {
+	auto f = filter->slots.find(key);
+	if (f == filter->slots.end()) {
+		return -1;
+	}
+	return f->second;
+}
+
+void filter_feature::set_string(size_t slot, const char *s) {
+	if (values[slot].type == FILTER_MISSING) {
+		values[slot].type = FILTER_STRING;
+		values[slot].string = s;
+	}
+}
+
+void filter_feature::set_number(size_t slot, double d) {
+	if (values[slot].type == FILTER_MISSING) {
+		values[slot].type = FILTER_NUMBER;
+		values[slot].number = d;
+		values[slot].parsed = true;
+	}
+}
+
+void filter_feature::set_stringified(size_t slot, int type, const char *s) {
+	if (values[slot].type == FILTER_MISSING) {
+		if (type == mvt_double) {
+			// parsed only if something compares against it
+			values[slot].type = FILTER_NUMBER;
+			values[slot].string = s;
+			values[slot].parsed = false;
+		} else if (type == mvt_bool) {
+			values[slot].type = FILTER_BOOL;
+			values[slot].boolean = (s[0] == 't');
+		} else if (type == mvt_null) {
+			values[slot].type = FILTER_NULL;
+		} else {
+			values[slot].type = FILTER_STRING;
+			values[slot].string = s;
+		}
+	}
+}
+
+static double mvt_number(mvt_value const &v) {
+	if (v.type == mvt_double) {
+		return v.numeric_value.double_value;
+	} else if (v.type == mvt_float) {
+		return v.numeric_value.float_value;
+	} else if (v.type == mvt_int) {
+		return v.numeric_value.int_value;
+	} else if (v.type == mvt_uint) {
+		return v.numeric_value.uint_value;
+	} else if (v.type == mvt_sint) {
+		return v.numeric_value.sint_value;
+	} else {
+		fprintf(stderr, "Internal error: bad mvt type %d\n", v.type);
+		exit(EXIT_IMPOSSIBLE);
+	}
+}
+
+void filter_feature::set(size_t slot, mvt_value const &v) {
+	if (v.type == mvt_string) {
+		set_string(slot, v.string_value.c_str());
+	} else if (v.type == mvt_bool) {
+		if (values[slot].type == FILTER_MISSING) {
+			values[slot].type = FILTER_BOOL;
+			values[slot].boolean = v.numeric_value.bool_value;
+		}
+	} else if (v.type == mvt_null) {
+		if (values[slot].type == FILTER_MISSING) {
+			values[slot].type = FILTER_NULL;
+		}
+	} else {
+		set_number(slot, mvt_number(v));
+	}
+}
+
+static int compare(filter_value const &one, json_object *two, bool &fail) {
+	if (one.type == FILTER_STRING) {
 		if (two->type != JSON_STRING) {
 			fail = true;
 			return false;  // string vs non-string
 		}
 
-		return strcmp(one.string_value.c_str(), two->value.string.string);
+		return strcmp(one.string, two->value.string.string);
 	}
 
-	if (one.type == mvt_double || one.type == mvt_float || one.type == mvt_int || one.type == mvt_uint || one.type == mvt_sint) {
+	if (one.type == FILTER_NUMBER) {
 		if (two->type != JSON_NUMBER) {
 			fail = true;
 			return false;  // number vs non-number
 		}
 
-		double v;
-		if (one.type == mvt_double) {
-			v = one.numeric_value.double_value;
-		} else if (one.type == mvt_float) {
-			v = one.numeric_value.float_value;
-		} else if (one.type == mvt_int) {
-			v = one.numeric_value.int_value;
-		} else if (one.type == mvt_uint) {
-			v = one.numeric_value.uint_value;
-		} else if (one.type == mvt_sint) {
-			v = one.numeric_value.sint_value;
-		} else {
-			fprintf(stderr, "Internal error: bad mvt type %d\n", one.type);
-			exit(EXIT_IMPOSSIBLE);
+		if (!one.parsed) {
+			// the same conversion that the attribute would get in the tile
+			one.number = mvt_number(stringified_to_mvt_value(mvt_double, one.string));
+			one.parsed = true;
 		}
 
+		double v = one.number;
 		if (v < two->value.number.number) {
 			return -1;
 		} else if (v > two->value.number.number) {
@@ -47,17 +305,17 @@ int compare(mvt_value one, json_object *two, bool &fail) {
 		}
 	}
 
-	if (one.type == mvt_bool) {
+	if (one.type == FILTER_BOOL) {
 		if (two->type != JSON_TRUE && two->type != JSON_FALSE) {
 			fail = true;
 			return false;  // bool vs non-bool
 		}
 
 		bool b = two->type != JSON_FALSE;
-		return one.numeric_value.bool_value > b;
+		return one.boolean > b;
 	}
 
-	if (one.type == mvt_null) {
+	if (one.type == FILTER_NULL) {
 		if (two->type != JSON_NULL) {
 			fail = true;
 			return false;  // null vs non-null
@@ -66,194 +324,104 @@ int compare(mvt_value one, json_object *two, bool &fail) {
 		return 0;  // null equals null
 	}
 
-	fprintf(stderr, "Internal error: bad mvt type %d\n", one.type);
+	fprintf(stderr, "Internal error: bad filter value type %d\n", one.type);
 	exit(EXIT_IMPOSSIBLE);
 }
 
-bool eval(std::map<std::string, mvt_value> const &feature, json_object *f, std::set<std::string> &exclude_attributes) {
-	if (f == NULL || f->type != JSON_ARRAY) {
-		fprintf(stderr, "Filter is not an array: %s\n", json_stringify(f));
-		exit(EXIT_FILTER);
-	}
-
-	if (f->value.array.length < 1) {
-		fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
-		exit(EXIT_FILTER);
-	}
-
-	if (f->value.array.array[0]->type != JSON_STRING) {
-		fprintf(stderr, "Filter operation is not a string: %s\n", json_stringify(f));
-		exit(EXIT_FILTER);
+static void warn_once(bool &warned, const char *message, json_object *f) {
+	if (!warned) {
+		const char *s = json_stringify(f);
+		fprintf(stderr, "%s: %s\n", message, s);
+		free((void *) s);
+		warned = true;
 	}
+}
 
-	if (strcmp(f->value.array.array[0]->value.string.string, "has") == 0 ||
-	    strcmp(f->value.array.array[0]->value.string.string, "!has") == 0) {
-		if (f->value.array.length != 2) {
-			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
-			exit(EXIT_FILTER);
-		}
+static bool eval(compiled_filter const *cf, size_t node, filter_feature const &feature, std::set<std::string> &exclude_attributes) {
+	filter_node const &n = cf->nodes[node];
 
-		if (strcmp(f->value.array.array[0]->value.string.string, "has") == 0) {
-			if (f->value.array.array[1]->type != JSON_STRING) {
-				fprintf(stderr, "\"has\" key is not a string: %s\n", json_stringify(f));
-				exit(EXIT_FILTER);
-			}
-			return feature.count(std::string(f->value.array.array[1]->value.string.string)) != 0;
-		}
+	switch (n.op) {
+	case OP_HAS:
+		return feature.values[n.slot].type != FILTER_MISSING;
 
-		if (strcmp(f->value.array.array[0]->value.string.string, "!has") == 0) {
-			if (f->value.array.array[1]->type != JSON_STRING) {
-				fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
-				exit(EXIT_FILTER);
-			}
-			return feature.count(std::string(f->value.array.array[1]->value.string.string)) == 0;
-		}
-	}
-
-	if (strcmp(f->value.array.array[0]->value.string.string, "==") == 0 ||
-	    strcmp(f->value.array.array[0]->value.string.string, "!=") == 0 ||
-	    strcmp(f->value.array.array[0]->value.string.string, ">") == 0 ||
-	    strcmp(f->value.array.array[0]->value.string.string, ">=") == 0 ||
-	    strcmp(f->value.array.array[0]->value.string.string, "<") == 0 ||
-	    strcmp(f->value.array.array[0]->value.string.string, "<=") == 0) {
-		if (f->value.array.length != 3) {
-			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
-			exit(EXIT_FILTER);
-		}
-		if (f->value.array.array[1]->type != JSON_STRING) {
-			fprintf(stderr, "comparison key is not a string: %s\n", json_stringify(f));
-			exit(EXIT_FILTER);
-		}
+	case OP_NOT_HAS:
+		return feature.values[n.slot].type == FILTER_MISSING;
 
-		auto ff = feature.find(std::string(f->value.array.array[1]->value.string.string));
-		if (ff == feature.end()) {
+	case OP_EQ:
+	case OP_NE:
+	case OP_GT:
+	case OP_GE:
+	case OP_LT:
+	case OP_LE: {
+		filter_value const &val = feature.values[n.slot];
+		if (val.type == FILTER_MISSING) {
 			static bool warned = false;
-			if (!warned) {
-				const char *s = json_stringify(f);
-				fprintf(stderr, "Warning: attribute not found for comparison: %s\n", s);
-				free((void *) s);
-				warned = true;
-			}
-			if (strcmp(f->value.array.array[0]->value.string.string, "!=") == 0) {
-				return true;  //  attributes that aren't found are not equal
-			}
-			return false;  // not found: comparison is false
+			warn_once(warned, "Warning: attribute not found for comparison", n.source);
+			return n.op == OP_NE;  // attributes that aren't found are not equal, and not comparable
 		}
 
 		bool fail = false;
-		int cmp = compare(ff->second, f->value.array.array[2], fail);
+		int cmp = compare(val, cf->constants[n.first], fail);
 
 		if (fail) {
 			static bool warned = false;
-			if (!warned) {
-				const char *s = json_stringify(f);
-				fprintf(stderr, "Warning: mismatched type in comparison: %s\n", s);
-				free((void *) s);
-				warned = true;
-			}
-			if (strcmp(f->value.array.array[0]->value.string.string, "!=") == 0) {
-				return true;  // mismatched types are not equal
-			}
-			return false;
+			warn_once(warned, "Warning: mismatched type in comparison", n.source);
+			return n.op == OP_NE;  // mismatched types are not equal
 		}
 
-		if (strcmp(f->value.array.array[0]->value.string.string, "==") == 0) {
+		switch (n.op) {
+		case OP_EQ:
 			return cmp == 0;
-		}
-		if (strcmp(f->value.array.array[0]->value.string.string, "!=") == 0) {
+		case OP_NE:
 			return cmp != 0;
-		}
-		if (strcmp(f->value.array.array[0]->value.string.string, ">") == 0) {
+		case OP_GT:
 			return cmp > 0;
-		}
-		if (strcmp(f->value.array.array[0]->value.string.string, ">=") == 0) {
+		case OP_GE:
 			return cmp >= 0;
-		}
-		if (strcmp(f->value.array.array[0]->value.string.string, "<") == 0) {
+		case OP_LT:
 			return cmp < 0;
-		}
-		if (strcmp(f->value.array.array[0]->value.string.string, "<=") == 0) {
+		default:
 			return cmp <= 0;
 		}
-
-		fprintf(stderr, "Internal error: can't happen: %s\n", json_stringify(f));
-		exit(EXIT_IMPOSSIBLE);
 	}
 
-	if (strcmp(f->value.array.array[0]->value.string.string, "all") == 0 ||
-	    strcmp(f->value.array.array[0]->value.string.string, "any") == 0 ||
-	    strcmp(f->value.array.array[0]->value.string.string, "none") == 0) {
-		bool v;
-
-		if (strcmp(f->value.array.array[0]->value.string.string, "all") == 0) {
-			v = true;
-		} else {
-			v = false;
-		}
-
-		for (size_t i = 1; i < f->value.array.length; i++) {
-			bool out = eval(feature, f->value.array.array[i], exclude_attributes);
-
-			if (strcmp(f->value.array.array[0]->value.string.string, "all") == 0) {
-				v = v && out;
-				if (!v) {
-					break;
-				}
-			} else {
-				v = v || out;
-				if (v) {
-					break;
-				}
+	case OP_ALL:
+		for (size_t i = 0; i < n.count; i++) {
+			if (!eval(cf, cf->children[n.first + i], feature, exclude_attributes)) {
+				return false;
 			}
 		}
+		return true;
 
-		if (strcmp(f->value.array.array[0]->value.string.string, "none") == 0) {
-			return !v;
-		} else {
-			return v;
+	case OP_ANY:
+	case OP_NONE: {
+		bool v = false;
+		for (size_t i = 0; i < n.count; i++) {
+			if (eval(cf, cf->children[n.first + i], feature, exclude_attributes)) {
+				v = true;
+				break;
+			}
 		}
+		return n.op == OP_ANY ? v : !v;
 	}
 
-	if (strcmp(f->value.array.array[0]->value.string.string, "in") == 0 ||
-	    strcmp(f->value.array.array[0]->value.string.string, "!in") == 0) {
-		if (f->value.array.length < 2) {
-			fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
-			exit(EXIT_FILTER);
-		}
-
-		if (f->value.array.array[1]->type != JSON_STRING) {
-			fprintf(stderr, "\"!in\" key is not a string: %s\n", json_stringify(f));
-			exit(EXIT_FILTER);
-		}
-
-		auto ff = feature.find(std::string(f->value.array.array[1]->value.string.string));
-		if (ff == feature.end()) {
+	case OP_IN:
+	case OP_NOT_IN: {
+		filter_value const &val = feature.values[n.slot];
+		if (val.type == FILTER_MISSING) {
 			static bool warned = false;
-			if (!warned) {
-				const char *s = json_stringify(f);
-				fprintf(stderr, "Warning: attribute not found for comparison: %s\n", s);
-				free((void *) s);
-				warned = true;
-			}
-			if (strcmp(f->value.array.array[0]->value.string.string, "!in") == 0) {
-				return true;  // attributes that aren't found are not in
-			}
-			return false;  // not found: comparison is false
+			warn_once(warned, "Warning: attribute not found for comparison", n.source);
+			return n.op == OP_NOT_IN;  // attributes that aren't found are not in
 		}
 
 		bool found = false;
-		for (size_t i = 2; i < f->value.array.length; i++) {
+		for (size_t i = 0; i < n.count; i++) {
 			bool fail = false;
-			int cmp = compare(ff->second, f->value.array.array[i], fail);
+			int cmp = compare(val, cf->constants[n.first + i], fail);
 
 			if (fail) {
 				static bool warned = false;
-				if (!warned) {
-					const char *s = json_stringify(f);
-					fprintf(stderr, "Warning: mismatched type in comparison: %s\n", s);
-					free((void *) s);
-					warned = true;
-				}
+				warn_once(warned, "Warning: mismatched type in comparison", n.source);
 				cmp = 1;
 			}
 
@@ -263,53 +431,30 @@ bool eval(std::map<std::string, mvt_value> const &feature, json_object *f, std::
 			}
 		}
 
-		if (strcmp(f->value.array.array[0]->value.string.string, "in") == 0) {
-			return found;
-		} else {
-			return !found;
-		}
+		return n.op == OP_IN ? found : !found;
 	}
 
-	if (strcmp(f->value.array.array[0]->value.string.string, "attribute-filter") == 0) {
-		if (f->value.array.length != 3) {
-			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
-			exit(EXIT_FILTER);
+	case OP_ATTRIBUTE_FILTER:
+		if (!eval(cf, cf->children[n.first], feature, exclude_attributes)) {
+			exclude_attributes.insert(cf->keys[n.slot]);
 		}
-
-		if (f->value.array.array[1]->type != JSON_STRING) {
-			fprintf(stderr, "\"attribute-filter\" key is not a string: %s\n", json_stringify(f));
-			exit(EXIT_FILTER);
-		}
-
-		bool ok = eval(feature, f->value.array.array[2], exclude_attributes);
-		if (!ok) {
-			exclude_attributes.insert(f->value.array.array[1]->value.string.string);
-		}
-
 		return true;
 	}
 
-	fprintf(stderr, "Unknown filter %s\n", json_stringify(f));
-	exit(EXIT_FILTER);
+	fprintf(stderr, "Internal error: can't happen: %s\n", json_stringify(n.source));
+	exit(EXIT_IMPOSSIBLE);
 }
 
-bool evaluate(std::map<std::string, mvt_value> const &feature, std::string const &layer, json_object *filter, std::set<std::string> &exclude_attributes) {
-	if (filter == NULL || filter->type != JSON_HASH) {
-		fprintf(stderr, "Error: filter is not a hash: %s\n", json_stringify(filter));
-		exit(EXIT_JSON);
-	}
-
+bool evaluate(compiled_filter const *filter, filter_feature const &feature, std::string const &layer, std::set<std::string> &exclude_attributes) {
 	bool ok = true;
-	json_object *f;
 
-	f = json_hash_get(filter, layer.c_str());
-	if (ok && f != NULL) {
-		ok = eval(feature, f, exclude_attributes);
+	auto f = filter->layers.find(layer);
+	if (ok && f != filter->layers.end()) {
+		ok = eval(filter, f->second, feature, exclude_attributes);
 	}
 
-	f = json_hash_get(filter, "*");
-	if (ok && f != NULL) {
-		ok = eval(feature, f, exclude_attributes);
+	if (ok && filter->all_layers >= 0) {
+		ok = eval(filter, filter->all_layers, feature, exclude_attributes);
 	}
 
 	return ok;
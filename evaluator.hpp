@@ -4,10 +4,74 @@
 #include <map>
 #include <string>
 #include <set>
+#include <vector>
+#include <unordered_map>
 #include "jsonpull/jsonpull.h"
 #include "mvt.hpp"
 
-bool evaluate(std::map<std::string, mvt_value> const &feature, std::string const &layer, json_object *filter, std::set<std::string> &exclude_attributes);
+// A feature filter is checked and compiled once, into a flat tree of
+// operations whose attribute keys have been resolved to slots. To filter
+// a feature, fill in a filter_feature with the values of the attributes
+// that have slots (filter_slot() finds the slot for a key) and evaluate it.
+
+enum filter_value_type {
+	FILTER_MISSING,
+	FILTER_STRING,
+	FILTER_NUMBER,
+	FILTER_BOOL,
+	FILTER_NULL,
+};
+
+struct filter_value {
+	filter_value_type type = FILTER_MISSING;
+	const char *string = NULL;  // for strings, and for numbers until they are parsed
+	mutable double number = 0;
+	mutable bool parsed = false;
+	bool boolean = false;
+};
+
+struct filter_node {
+	int op = 0;
+	size_t slot = 0;   // of the attribute being tested
+	size_t first = 0;  // of the children, or of the constants being compared against
+	size_t count = 0;
+	json_object *source = NULL;  // for warnings
+};
+
+struct compiled_filter {
+	std::vector<std::string> keys;	// one for each slot
+	std::unordered_map<std::string, size_t> slots;
+
+	std::vector<filter_node> nodes;
+	std::vector<size_t> children;
+	std::vector<json_object *> constants;
+
+	std::unordered_map<std::string, size_t> layers;	 // root node of each layer's filter
+	ssize_t all_layers = -1;			 // root node of the "*" filter
+
+	json_object *json = NULL;
+
+	~compiled_filter();
+};
+
+struct filter_feature {
+	std::vector<filter_value> values;  // one for each slot
+
+	void clear(compiled_filter const *filter) {
+		values.clear();
+		values.resize(filter->keys.size());
+	}
+
+	// Like inserting into a map, these leave an attribute that is already set alone
+	void set_string(size_t slot, const char *s);
+	void set_number(size_t slot, double d);
+	void set_stringified(size_t slot, int type, const char *s);
+	void set(size_t slot, mvt_value const &v);
+};
+
+compiled_filter *compile_filter(json_object *filter);
+ssize_t filter_slot(compiled_filter const *filter, const char *key);
+bool evaluate(compiled_filter const *filter, filter_feature const &feature, std::string const &layer, std::set<std::string> &exclude_attributes);
 json_object *parse_filter(const char *s);
 json_object *read_filter(const char *fname);
 
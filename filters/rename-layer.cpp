@@ -0,0 +1,47 @@
+// An example filter for tippecanoe's --binary-filters.
+// It moves all the features in each tile into a layer with the specified name.
+//
+//     tippecanoe -aB -c './filters/rename-layer roads' -o out.mbtiles in.json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "binary_filter.hpp"
+#include "mvt.hpp"
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s layername\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	std::string name = argv[1];
+
+	run_binary_filter([&](unsigned, unsigned, unsigned, mvt_tile &tile) {
+		mvt_layer out;
+		out.name = name;
+		out.version = 2;
+
+		for (auto const &layer : tile.layers) {
+			out.extent = layer.extent;
+
+			for (auto const &feature : layer.features) {
+				mvt_feature copy = feature;
+				copy.tags.clear();
+
+				for (size_t t = 0; t + 1 < feature.tags.size(); t += 2) {
+					out.tag(copy, layer.keys[feature.tags[t]], layer.values[feature.tags[t + 1]]);
+				}
+
+				out.features.push_back(copy);
+			}
+		}
+
+		tile.layers.clear();
+		if (out.features.size() > 0) {
+			tile.layers.push_back(out);
+		}
+	});
+
+	return EXIT_SUCCESS;
+}
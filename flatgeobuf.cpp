@@ -1,11 +1,17 @@
 #include <stdio.h>
+#include <math.h>
+#include <pthread.h>
 #include "serial.hpp"
 #include <iostream>
+#include <deque>
+#include <algorithm>
 #include "projection.hpp"
 #include "flatgeobuf/feature_generated.h"
 #include "flatgeobuf/header_generated.h"
 #include "milo/dtoa_milo.h"
 #include "main.hpp"
+#include "options.hpp"
+#include "task_pool.hpp"
 #include "errors.hpp"
 
 static constexpr uint8_t magicbytes[8] = { 0x66, 0x67, 0x62, 0x03, 0x66, 0x67, 0x62, 0x01 };
@@ -249,95 +255,247 @@ void readFeature(const FlatGeobuf::Feature *feature, long long feature_sequence_
 	serialize_feature(sst, sf);
 }
 
+// How many features the reader hands to a decoding thread at a time,
+// and how many of these batches may be waiting for each thread
+#define FGB_BATCH 64
+#define FGB_BATCHES_PER_THREAD 4
+
 struct fgb_queued_feature {
-	const FlatGeobuf::Feature *feature = NULL;
-	long long feature_sequence_id = -1;
-	FlatGeobuf::GeometryType h_geometry_type = FlatGeobuf::GeometryType_Unknown;
-	const std::vector<std::string> *h_column_names = NULL;
-	const std::vector<FlatGeobuf::ColumnType> *h_column_types = NULL;
-	std::vector<struct serialization_state> *sst = NULL;
-	int layer = 0;
-	std::string layername = "";
+	const char *start = NULL;	     // size-prefixed feature buffer
+	long long feature_sequence_id = -1;  // for the feature ID, if the file is indexed
+	long long seq = 0;		     // for the feature order
 };
 
-static std::vector<fgb_queued_feature> feature_queue;
+// The features of a FlatGeobuf file, passed from the thread that finds them
+// to the threads that decode and serialize them
+struct fgb_pipeline {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t wake = PTHREAD_COND_INITIALIZER;  // something queued, or no more to come
+	pthread_cond_t room = PTHREAD_COND_INITIALIZER;  // a batch taken from the queue
+	std::deque<std::vector<fgb_queued_feature>> queue;
+	bool finished = false;
+
+	FlatGeobuf::GeometryType h_geometry_type;
+	const std::vector<std::string> *h_column_names;
+	const std::vector<FlatGeobuf::ColumnType> *h_column_types;
+	std::vector<struct serialization_state> *sst;
+	int layer;
+	std::string layername;
+};
 
-struct queue_run_arg {
-	size_t start;
-	size_t end;
+struct fgb_run_arg {
+	fgb_pipeline *pipeline;
 	size_t segment;
-
-	queue_run_arg(size_t start1, size_t end1, size_t segment1)
-	    : start(start1), end(end1), segment(segment1) {
-	}
 };
 
-void *fgb_run_parse_feature(void *v) {
-	struct queue_run_arg *qra = (struct queue_run_arg *) v;
+static void *fgb_run_parse_feature(void *v) {
+	fgb_run_arg *a = (fgb_run_arg *) v;
+	fgb_pipeline *p = a->pipeline;
+	struct serialization_state *sst = &(*p->sst)[a->segment];
+
+	while (true) {
+		if (pthread_mutex_lock(&p->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_PTHREAD);
+		}
+
+		while (p->queue.empty() && !p->finished) {
+			task_blocking_begin();
+			if (pthread_cond_wait(&p->wake, &p->lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_PTHREAD);
+			}
+			task_blocking_end();
+		}
+
+		if (p->queue.empty()) {
+			if (pthread_mutex_unlock(&p->lock) != 0) {
+				perror("pthread_mutex_unlock");
+				exit(EXIT_PTHREAD);
+			}
+			break;
+		}
+
+		std::vector<fgb_queued_feature> batch = std::move(p->queue.front());
+		p->queue.pop_front();
+		pthread_cond_signal(&p->room);
+
+		if (pthread_mutex_unlock(&p->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_PTHREAD);
+		}
+
+		for (auto const &qf : batch) {
+			auto feature_size = flatbuffers::GetPrefixedSize((const uint8_t *) qf.start);
 
-	for (size_t i = qra->start; i < qra->end; i++) {
-		struct fgb_queued_feature &qf = feature_queue[i];
-		readFeature(qf.feature, qf.feature_sequence_id, qf.h_geometry_type, *qf.h_column_names, *qf.h_column_types, &(*qf.sst)[qra->segment], qf.layer, qf.layername);
+			flatbuffers::Verifier v2((const uint8_t *) qf.start, feature_size + sizeof(uint32_t));
+			const auto ok2 = FlatGeobuf::VerifySizePrefixedFeatureBuffer(v2);
+			if (!ok2) {
+				fprintf(stderr, "flatgeobuf feature buffer verification failed\n");
+				exit(EXIT_IMPOSSIBLE);
+			}
+
+			auto feature = FlatGeobuf::GetSizePrefixedFeature(qf.start);
+
+			// Each thread has its own sequence counter, so this is
+			// safe, and keeps the features in their order in the file
+			*(sst->layer_seq) = qf.seq;
+			readFeature(feature, qf.feature_sequence_id, p->h_geometry_type, *p->h_column_names, *p->h_column_types, sst, p->layer, p->layername);
+		}
 	}
 
 	return NULL;
 }
 
-void fgbRunQueue() {
-	if (feature_queue.size() == 0) {
-		return;
+static void fgb_queue_batch(fgb_pipeline *p, std::vector<fgb_queued_feature> &batch) {
+	if (pthread_mutex_lock(&p->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
 	}
 
-	std::vector<struct queue_run_arg> qra;
+	while (p->queue.size() >= CPUS * FGB_BATCHES_PER_THREAD) {
+		task_blocking_begin();
+		if (pthread_cond_wait(&p->room, &p->lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_PTHREAD);
+		}
+		task_blocking_end();
+	}
 
-	std::vector<pthread_t> pthreads;
-	pthreads.resize(CPUS);
+	p->queue.push_back(std::move(batch));
+	batch.clear();
+	pthread_cond_signal(&p->wake);
 
-	for (size_t i = 0; i < CPUS; i++) {
-		*((*(feature_queue[0].sst))[i].layer_seq) = *((*(feature_queue[0].sst))[0].layer_seq) + feature_queue.size() * i / CPUS;
+	if (pthread_mutex_unlock(&p->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+}
 
-		qra.push_back(queue_run_arg(
-			feature_queue.size() * i / CPUS,
-			feature_queue.size() * (i + 1) / CPUS,
-			i));
+// The feature bounding boxes of the parts of the spatial index that
+// were skipped, to count toward the bounds of the file the way that
+// serialize_feature() would have counted the features themselves
+struct fgb_skipped_bbox {
+	long long file_bbox1[4] = {0xFFFFFFFF, 0xFFFFFFFF, 0, 0};
+	long long file_bbox2[4] = {0x1FFFFFFFF, 0xFFFFFFFF, 0x100000000, 0};
+};
+
+static NodeItem readNode(const char *nodes, uint64_t i) {
+	NodeItem n;
+	memcpy(&n, nodes + i * sizeof(NodeItem), sizeof(NodeItem));
+	return n;
+}
+
+// Whether everything within the node would be clipped away by one of the
+// clipping bounding boxes. If so, and its bounds can be counted without
+// looking at the features, count them.
+static bool fgb_clipped_away(NodeItem const &n, fgb_skipped_bbox &skipped) {
+	if (!std::isfinite(n.minX) || !std::isfinite(n.minY) || !std::isfinite(n.maxX) || !std::isfinite(n.maxY)) {
+		return false;
+	}
+	if (additional[A_DETECT_WRAPAROUND]) {
+		return false;
 	}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		if (pthread_create(&pthreads[i], NULL, fgb_run_parse_feature, &qra[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_PTHREAD);
+	long long minx, miny, maxx, maxy;
+	projection->project(n.minX, n.maxY, 32, &minx, &miny);
+	projection->project(n.maxX, n.minY, 32, &maxx, &maxy);
+
+	// Only where the features' own bounds would be the same as the node's:
+	// within the world, and all on one side of the prime meridian
+	if (minx < 0 || maxx > 0xFFFFFFFF || miny <= 0 || maxy >= 0xFFFFFFFF) {
+		return false;
+	}
+	if (minx < 0x80000000 && maxx >= 0x80000000) {
+		return false;
+	}
+
+	// With a margin for the rounding when the geometry is scaled
+	long long margin = 2LL << geometry_scale;
+	bool outside = false;
+	for (auto const &c : clipbboxes) {
+		if (maxx + margin < c.minx || minx - margin > c.maxx || maxy + margin < c.miny || miny - margin > c.maxy) {
+			outside = true;
+			break;
 		}
 	}
+	if (!outside) {
+		return false;
+	}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
+	skipped.file_bbox1[0] = std::min(skipped.file_bbox1[0], minx);
+	skipped.file_bbox1[1] = std::min(skipped.file_bbox1[1], miny);
+	skipped.file_bbox1[2] = std::max(skipped.file_bbox1[2], maxx);
+	skipped.file_bbox1[3] = std::max(skipped.file_bbox1[3], maxy);
 
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join");
-		}
+	// shift the western hemisphere 360 degrees to the east
+	if (minx < 0x80000000) {
+		minx += 0x100000000;
+		maxx += 0x100000000;
 	}
 
-	// Lack of atomicity is OK, since we are single-threaded again here
-	long long was = *((*(feature_queue[0].sst))[CPUS - 1].layer_seq);
-	*((*(feature_queue[0].sst))[0].layer_seq) = was;
-	feature_queue.clear();
+	skipped.file_bbox2[0] = std::min(skipped.file_bbox2[0], minx);
+	skipped.file_bbox2[1] = std::min(skipped.file_bbox2[1], miny);
+	skipped.file_bbox2[2] = std::max(skipped.file_bbox2[2], maxx);
+	skipped.file_bbox2[3] = std::max(skipped.file_bbox2[3], maxy);
+
+	return true;
 }
 
-void queueFeature(const FlatGeobuf::Feature *feature, long long feature_sequence_id, FlatGeobuf::GeometryType h_geometry_type, const std::vector<std::string> &h_column_names, const std::vector<FlatGeobuf::ColumnType> &h_column_types, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
-	struct fgb_queued_feature qf;
-	qf.feature = feature;
-	qf.feature_sequence_id = feature_sequence_id;
-	qf.h_geometry_type = h_geometry_type;
-	qf.h_column_names = &h_column_names;
-	qf.h_column_types = &h_column_types;
-	qf.sst = sst;
-	qf.layer = layer;
-	qf.layername = layername;
-
-	feature_queue.push_back(qf);
-
-	if (feature_queue.size() > CPUS * 500) {
-		fgbRunQueue();
+// Search the packed R-tree, which is stored a level at a time from the root
+// down to the leaves, for the features that may survive clipping, in the
+// order of the features in the file. Each leaf's offset is its feature's
+// position in the data; each other node's offset is the index of its
+// first child.
+static void fgb_search_index(const char *nodes, uint64_t features_count, uint16_t node_size, std::vector<std::pair<uint64_t, uint64_t>> &found, fgb_skipped_bbox &skipped) {
+	// node counts and bounds of each level, from the leaves up
+	std::vector<uint64_t> level_nodes;
+	uint64_t n = features_count;
+	uint64_t num_nodes = n;
+	level_nodes.push_back(n);
+	do {
+		n = (n + node_size - 1) / node_size;
+		num_nodes += n;
+		level_nodes.push_back(n);
+	} while (n != 1);
+
+	std::vector<std::pair<uint64_t, uint64_t>> level_bounds;
+	n = num_nodes;
+	for (auto count : level_nodes) {
+		n -= count;
+		level_bounds.push_back(std::make_pair(n, n + count));
+	}
+	uint64_t leaves = level_bounds[0].first;
+
+	// depth-first, so the leaves come out in order
+	std::vector<std::pair<uint64_t, size_t>> stack;  // first node, level
+	stack.push_back(std::make_pair(0, level_bounds.size() - 1));
+
+	while (stack.size() > 0) {
+		auto next = stack.back();
+		stack.pop_back();
+
+		uint64_t end = std::min((uint64_t) (next.first + node_size), level_bounds[next.second].second);
+		std::vector<std::pair<uint64_t, size_t>> children;
+
+		for (uint64_t i = next.first; i < end; i++) {
+			NodeItem node = readNode(nodes, i);
+			if (fgb_clipped_away(node, skipped)) {
+				continue;
+			}
+
+			if (next.second == 0) {
+				found.push_back(std::make_pair(i - leaves, node.offset));
+			} else {
+				if (node.offset < level_bounds[next.second - 1].first || node.offset >= level_bounds[next.second - 1].second) {
+					fprintf(stderr, "flatgeobuf spatial index is corrupt\n");
+					exit(EXIT_IMPOSSIBLE);
+				}
+				children.push_back(std::make_pair(node.offset, next.second - 1));
+			}
+		}
+
+		stack.insert(stack.end(), children.rbegin(), children.rend());
 	}
 }
 
@@ -376,25 +534,104 @@ void parse_flatgeobuf(std::vector<struct serialization_state> *sst, const char *
 		index_size = PackedRTreeSize(features_count,node_size);
 		feature_sequence_id = 0;
 	}
-	const char* start = src + sizeof(magicbytes) + sizeof(uint32_t) + header_size + index_size;
+	const char *index = src + sizeof(magicbytes) + sizeof(uint32_t) + header_size;
+	const char *data = index + index_size;
 
-	while (start < src + len) {
-		auto feature_size = flatbuffers::GetPrefixedSize((const uint8_t *)start);
+	if (data > src + len) {
+		fprintf(stderr, "flatgeobuf spatial index is truncated\n");
+		exit(EXIT_IMPOSSIBLE);
+	}
 
-		flatbuffers::Verifier v2((const uint8_t *)start,feature_size+sizeof(uint32_t));
-		const auto ok2 = FlatGeobuf::VerifySizePrefixedFeatureBuffer(v2);
-		if (!ok2) {
-			fprintf(stderr, "flatgeobuf feature buffer verification failed\n");
-			exit(EXIT_IMPOSSIBLE);
+	fgb_pipeline pipeline;
+	pipeline.h_geometry_type = h_geometry_type;
+	pipeline.h_column_names = &h_column_names;
+	pipeline.h_column_types = &h_column_types;
+	pipeline.sst = sst;
+	pipeline.layer = layer;
+	pipeline.layername = layername;
+
+	std::vector<fgb_run_arg> args(CPUS);
+	task_group decoding;
+
+	for (size_t i = 0; i < CPUS; i++) {
+		args[i].pipeline = &pipeline;
+		args[i].segment = i;
+
+		task_run(&decoding, fgb_run_parse_feature, &args[i]);
+	}
+
+	// Lack of atomicity is OK, since the other threads only touch their own
+	long long initial_seq = *((*sst)[0].layer_seq);
+	long long count = 0;
+	std::vector<fgb_queued_feature> batch;
+	fgb_skipped_bbox skipped;
+
+	if (node_size > 0 && features_count > 0 && clipbboxes.size() > 0) {
+		// Use the spatial index to skip the features that would be clipped away
+		std::vector<std::pair<uint64_t, uint64_t>> found;  // feature sequence, offset
+		fgb_search_index(index, features_count, node_size, found, skipped);
+
+		for (auto const &f : found) {
+			fgb_queued_feature qf;
+			qf.start = data + f.second;
+			qf.feature_sequence_id = f.first;
+			qf.seq = initial_seq + count++;
+
+			if (qf.start + sizeof(uint32_t) > src + len || qf.start + sizeof(uint32_t) + flatbuffers::GetPrefixedSize((const uint8_t *) qf.start) > src + len) {
+				fprintf(stderr, "flatgeobuf spatial index is corrupt\n");
+				exit(EXIT_IMPOSSIBLE);
+			}
+
+			batch.push_back(qf);
+			if (batch.size() >= FGB_BATCH) {
+				fgb_queue_batch(&pipeline, batch);
+			}
 		}
+	} else {
+		const char *start = data;
+
+		while (start < src + len) {
+			auto feature_size = flatbuffers::GetPrefixedSize((const uint8_t *)start);
 
-		auto feature = FlatGeobuf::GetSizePrefixedFeature(start);
+			fgb_queued_feature qf;
+			qf.start = start;
+			qf.feature_sequence_id = feature_sequence_id;
+			qf.seq = initial_seq + count++;
 
-		queueFeature(feature, feature_sequence_id, h_geometry_type, h_column_names, h_column_types, sst, layer, layername);
+			batch.push_back(qf);
+			if (batch.size() >= FGB_BATCH) {
+				fgb_queue_batch(&pipeline, batch);
+			}
+
+			if (feature_sequence_id >= 0) feature_sequence_id ++;
+			start += sizeof(uint32_t) + feature_size;
+		}
+	}
+
+	if (batch.size() > 0) {
+		fgb_queue_batch(&pipeline, batch);
+	}
 
-		if (feature_sequence_id >= 0) feature_sequence_id ++;
-		start += sizeof(uint32_t) + feature_size;
+	if (pthread_mutex_lock(&pipeline.lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+	pipeline.finished = true;
+	pthread_cond_broadcast(&pipeline.wake);
+	if (pthread_mutex_unlock(&pipeline.lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
 	}
 
-	fgbRunQueue();
+	task_wait(&decoding);
+
+	*((*sst)[0].layer_seq) = initial_seq + count;
+
+	struct reader *r = &(*(*sst)[0].readers)[(*sst)[0].segment];
+	for (size_t i = 0; i < 2; i++) {
+		r->file_bbox1[i] = std::min(r->file_bbox1[i], skipped.file_bbox1[i]);
+		r->file_bbox1[i + 2] = std::max(r->file_bbox1[i + 2], skipped.file_bbox1[i + 2]);
+		r->file_bbox2[i] = std::min(r->file_bbox2[i], skipped.file_bbox2[i]);
+		r->file_bbox2[i + 2] = std::max(r->file_bbox2[i + 2], skipped.file_bbox2[i + 2]);
+	}
 }
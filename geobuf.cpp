@@ -2,6 +2,7 @@
 #include <string>
 #include <limits.h>
 #include <pthread.h>
+#include <deque>
 #include "mvt.hpp"
 #include "serial.hpp"
 #include "geobuf.hpp"
@@ -14,6 +15,7 @@
 #include "milo/dtoa_milo.h"
 #include "jsonpull/jsonpull.h"
 #include "text.hpp"
+#include "task_pool.hpp"
 #include "errors.hpp"
 
 #define POINT 0
@@ -23,17 +25,44 @@
 #define POLYGON 4
 #define MULTIPOLYGON 5
 
+// How many features the reader hands to a decoding thread at a time,
+// and how many of these batches may be waiting for each thread
+#define GEOBUF_BATCH 64
+#define GEOBUF_BATCHES_PER_THREAD 4
+
 struct queued_feature {
 	protozero::pbf_reader pbf{};
 	size_t dim = 0;
 	double e = 0;
 	std::vector<std::string> *keys = NULL;
+	long long seq = 0;  // for the feature order
+};
+
+struct queue_run_arg {
+	struct geobuf_pipeline *pipeline;
+	size_t segment;
+};
+
+// The features of a geobuf file, passed from the thread that finds them
+// to the threads that decode and serialize them
+struct geobuf_pipeline {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t wake = PTHREAD_COND_INITIALIZER;  // something queued, or no more to come
+	pthread_cond_t room = PTHREAD_COND_INITIALIZER;  // a batch taken from the queue
+	std::deque<std::vector<queued_feature>> queue;
+	bool finished = false;
+
 	std::vector<struct serialization_state> *sst = NULL;
 	int layer = 0;
 	std::string layername = "";
-};
 
-static std::vector<queued_feature> feature_queue;
+	// used only by the reading thread
+	bool started = false;
+	task_group decoding;
+	std::vector<queue_run_arg> qra;
+	std::vector<queued_feature> batch;
+	long long seq = 0;
+};
 
 void ensureDim(size_t dim) {
 	if (dim < 2) {
@@ -269,6 +298,52 @@ std::vector<drawvec_type> readGeometry(protozero::pbf_reader &pbf, size_t dim, d
 	return ret;
 }
 
+// How many features readGeometry() will make from a geometry, without
+// decoding its coordinates
+static long long countGeometry(protozero::pbf_reader pbf) {
+	long long count = 0;
+	int type = -1;
+
+	while (pbf.next()) {
+		switch (pbf.tag()) {
+		case 1:
+			type = pbf.get_enum();
+			break;
+
+		case 4:
+			count += countGeometry(protozero::pbf_reader(pbf.get_message()));
+			break;
+
+		default:
+			pbf.skip();
+		}
+	}
+
+	if (type >= POINT && type <= MULTIPOLYGON) {
+		count++;
+	}
+	return count;
+}
+
+// How many features readFeature() will serialize from a feature, each
+// of which takes a sequence number
+static long long countFeature(protozero::pbf_reader pbf) {
+	long long count = 0;
+
+	while (pbf.next()) {
+		switch (pbf.tag()) {
+		case 1:
+			count += countGeometry(protozero::pbf_reader(pbf.get_message()));
+			break;
+
+		default:
+			pbf.skip();
+		}
+	}
+
+	return count;
+}
+
 void readFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, struct serialization_state *sst, int layer, std::string layername) {
 	std::vector<drawvec_type> dv;
 	long long id = 0;
@@ -424,81 +499,143 @@ void readFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<s
 	}
 }
 
-struct queue_run_arg {
-	size_t start;
-	size_t end;
-	size_t segment;
+static void *run_parse_feature(void *v) {
+	struct queue_run_arg *qra = (struct queue_run_arg *) v;
+	geobuf_pipeline *p = qra->pipeline;
+	struct serialization_state *sst = &(*p->sst)[qra->segment];
 
-	queue_run_arg(size_t start1, size_t end1, size_t segment1)
-	    : start(start1), end(end1), segment(segment1) {
-	}
-};
+	while (true) {
+		if (pthread_mutex_lock(&p->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_PTHREAD);
+		}
 
-void *run_parse_feature(void *v) {
-	struct queue_run_arg *qra = (struct queue_run_arg *) v;
+		while (p->queue.empty() && !p->finished) {
+			task_blocking_begin();
+			if (pthread_cond_wait(&p->wake, &p->lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_PTHREAD);
+			}
+			task_blocking_end();
+		}
 
-	for (size_t i = qra->start; i < qra->end; i++) {
-		struct queued_feature &qf = feature_queue[i];
-		readFeature(qf.pbf, qf.dim, qf.e, *qf.keys, &(*qf.sst)[qra->segment], qf.layer, qf.layername);
+		if (p->queue.empty()) {
+			if (pthread_mutex_unlock(&p->lock) != 0) {
+				perror("pthread_mutex_unlock");
+				exit(EXIT_PTHREAD);
+			}
+			break;
+		}
+
+		std::vector<queued_feature> batch = std::move(p->queue.front());
+		p->queue.pop_front();
+		pthread_cond_signal(&p->room);
+
+		if (pthread_mutex_unlock(&p->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_PTHREAD);
+		}
+
+		for (auto &qf : batch) {
+			// Each thread has its own sequence counter, so this is
+			// safe, and keeps the features in their order in the file
+			*(sst->layer_seq) = qf.seq;
+			readFeature(qf.pbf, qf.dim, qf.e, *qf.keys, sst, p->layer, p->layername);
+		}
 	}
 
 	return NULL;
 }
 
-void runQueue() {
-	if (feature_queue.size() == 0) {
-		return;
-	}
-
-	std::vector<struct queue_run_arg> qra;
+// Start the decoding tasks, which keep running until finishQueue()
+static void startQueue(geobuf_pipeline *p) {
+	p->finished = false;
+	// Lack of atomicity is OK, since the decoding tasks aren't running yet
+	p->seq = *((*p->sst)[0].layer_seq);
 
-	std::vector<pthread_t> pthreads;
-	pthreads.resize(CPUS);
+	p->started = true;
+	p->qra.resize(CPUS);
 
 	for (size_t i = 0; i < CPUS; i++) {
-		*((*(feature_queue[0].sst))[i].layer_seq) = *((*(feature_queue[0].sst))[0].layer_seq) + feature_queue.size() * i / CPUS;
+		p->qra[i].pipeline = p;
+		p->qra[i].segment = i;
 
-		qra.push_back(queue_run_arg(
-			feature_queue.size() * i / CPUS,
-			feature_queue.size() * (i + 1) / CPUS,
-			i));
+		task_run(&p->decoding, run_parse_feature, &p->qra[i]);
 	}
+}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		if (pthread_create(&pthreads[i], NULL, run_parse_feature, &qra[i]) != 0) {
-			perror("pthread_create");
+static void queueBatch(geobuf_pipeline *p) {
+	if (pthread_mutex_lock(&p->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+
+	// Wait for the decoding threads to catch up, so that the whole file
+	// isn't queued at once
+	while (p->queue.size() >= CPUS * GEOBUF_BATCHES_PER_THREAD) {
+		task_blocking_begin();
+		if (pthread_cond_wait(&p->room, &p->lock) != 0) {
+			perror("pthread_cond_wait");
 			exit(EXIT_PTHREAD);
 		}
+		task_blocking_end();
 	}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
+	p->queue.push_back(std::move(p->batch));
+	p->batch.clear();
+	pthread_cond_signal(&p->wake);
 
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join");
-		}
+	if (pthread_mutex_unlock(&p->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+}
+
+// Wait for the decoding tasks to finish what has been queued, and stop them
+static void finishQueue(geobuf_pipeline *p) {
+	if (!p->started) {
+		return;
 	}
 
+	if (p->batch.size() > 0) {
+		queueBatch(p);
+	}
+
+	if (pthread_mutex_lock(&p->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+	p->finished = true;
+	pthread_cond_broadcast(&p->wake);
+	if (pthread_mutex_unlock(&p->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+
+	task_wait(&p->decoding);
+	p->started = false;
+
 	// Lack of atomicity is OK, since we are single-threaded again here
-	long long was = *((*(feature_queue[0].sst))[CPUS - 1].layer_seq);
-	*((*(feature_queue[0].sst))[0].layer_seq) = was;
-	feature_queue.clear();
+	*((*p->sst)[0].layer_seq) = p->seq;
 }
 
-void queueFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
+static void queueFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, geobuf_pipeline *p) {
+	if (!p->started) {
+		startQueue(p);
+	}
+
 	struct queued_feature qf;
 	qf.pbf = pbf;
 	qf.dim = dim;
 	qf.e = e;
 	qf.keys = &keys;
-	qf.sst = sst;
-	qf.layer = layer;
-	qf.layername = layername;
+	qf.seq = p->seq;
+	p->seq += countFeature(pbf);
 
-	feature_queue.push_back(qf);
+	p->batch.push_back(qf);
 
-	if (feature_queue.size() > CPUS * 500) {
-		runQueue();
+	if (p->batch.size() >= GEOBUF_BATCH) {
+		queueBatch(p);
 	}
 }
 
@@ -519,12 +656,12 @@ void outBareGeometry(drawvec const &dv, int type, struct serialization_state *ss
 	serialize_feature(sst, sf);
 }
 
-void readFeatureCollection(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
+void readFeatureCollection(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, geobuf_pipeline *p) {
 	while (pbf.next()) {
 		switch (pbf.tag()) {
 		case 1: {
 			protozero::pbf_reader feature_reader(pbf.get_message());
-			queueFeature(feature_reader, dim, e, keys, sst, layer, layername);
+			queueFeature(feature_reader, dim, e, keys, p);
 			break;
 		}
 
@@ -541,6 +678,11 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 	double e = 1e6;
 	std::vector<std::string> keys;
 
+	geobuf_pipeline p;
+	p.sst = sst;
+	p.layer = layer;
+	p.layername = layername;
+
 	while (pbf.next()) {
 		switch (pbf.tag()) {
 		case 1:
@@ -557,17 +699,20 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 
 		case 4: {
 			protozero::pbf_reader feature_collection_reader(pbf.get_message());
-			readFeatureCollection(feature_collection_reader, dim, e, keys, sst, layer, layername);
+			readFeatureCollection(feature_collection_reader, dim, e, keys, &p);
 			break;
 		}
 
 		case 5: {
 			protozero::pbf_reader feature_reader(pbf.get_message());
-			queueFeature(feature_reader, dim, e, keys, sst, layer, layername);
+			queueFeature(feature_reader, dim, e, keys, &p);
 			break;
 		}
 
 		case 6: {
+			// The decoding threads must be finished with thread 0 first
+			finishQueue(&p);
+
 			protozero::pbf_reader geometry_reader(pbf.get_message());
 			std::vector<drawvec_type> dv = readGeometry(geometry_reader, dim, e, keys);
 			for (size_t i = 0; i < dv.size(); i++) {
@@ -582,5 +727,5 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 		}
 	}
 
-	runQueue();
+	finishQueue(&p);
 }
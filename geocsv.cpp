@@ -1,5 +1,10 @@
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <algorithm>
+#include <atomic>
 #include "geocsv.hpp"
 #include "mvt.hpp"
 #include "serial.hpp"
@@ -9,126 +14,251 @@
 #include "csv.hpp"
 #include "milo/dtoa_milo.h"
 #include "options.hpp"
+#include "task_pool.hpp"
 #include "errors.hpp"
 
-void parse_geocsv(std::vector<struct serialization_state> &sst, std::string fname, int layer, std::string layername) {
-	FILE *f;
-
-	if (fname.size() == 0) {
-		f = stdin;
-	} else {
-		f = fopen(fname.c_str(), "r");
-		if (f == NULL) {
-			perror(fname.c_str());
-			exit(EXIT_OPEN);
-		}
-	}
-
-	std::string s;
+// The header of the CSV file, and which of its columns hold the location
+struct geocsv_header {
 	std::vector<std::string> header;
-	ssize_t latcol = -1, loncol = -1;
+	ssize_t latcol = -1;
+	ssize_t loncol = -1;
+};
 
-	if ((s = csv_getline(f)).size() > 0) {
+static void parse_header(std::string const &s, std::string const &fname, geocsv_header &h) {
+	if (s.size() > 0) {
 		std::string err = check_utf8(s);
 		if (err != "") {
 			fprintf(stderr, "%s: %s\n", fname.c_str(), err.c_str());
 			exit(EXIT_UTF8);
 		}
 
-		header = csv_split(s.c_str());
+		h.header = csv_split(s.c_str());
 
-		for (size_t i = 0; i < header.size(); i++) {
-			header[i] = csv_dequote(header[i]);
+		for (size_t i = 0; i < h.header.size(); i++) {
+			h.header[i] = csv_dequote(h.header[i]);
 
-			std::string lower(header[i]);
+			std::string lower(h.header[i]);
 			std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
 
 			if (lower == "y" || lower == "lat" || (lower.find("latitude") != std::string::npos)) {
-				latcol = i;
+				h.latcol = i;
 			}
 			if (lower == "x" || lower == "lon" || lower == "lng" || lower == "long" || (lower.find("longitude") != std::string::npos)) {
-				loncol = i;
+				h.loncol = i;
 			}
 		}
 	}
 
-	if (latcol < 0 || loncol < 0) {
+	if (h.latcol < 0 || h.loncol < 0) {
 		fprintf(stderr, "%s: Can't find \"lat\" and \"lon\" columns\n", fname.c_str());
 		exit(EXIT_CSV);
 	}
+}
 
-	size_t seq = 0;
-	while ((s = csv_getline(f)).size() > 0) {
-		std::string err = check_utf8(s);
-		if (err != "") {
-			fprintf(stderr, "%s: %s\n", fname.c_str(), err.c_str());
-			exit(EXIT_UTF8);
+// Serialize the feature from one record, which is record number seq
+// after the header
+static void parse_record(struct serialization_state *sst, std::string const &s, size_t seq, geocsv_header const &h, std::string const &fname, int layer, std::string const &layername) {
+	static std::atomic<int> warned(0);
+
+	std::string err = check_utf8(s);
+	if (err != "") {
+		fprintf(stderr, "%s: %s\n", fname.c_str(), err.c_str());
+		exit(EXIT_UTF8);
+	}
+
+	std::vector<std::string> line = csv_split(s.c_str());
+
+	if (line.size() != h.header.size()) {
+		fprintf(stderr, "%s:%zu: Mismatched column count: %zu in line, %zu in header\n", fname.c_str(), seq + 1, line.size(), h.header.size());
+		exit(EXIT_CSV);
+	}
+
+	if (line[h.loncol].empty() || line[h.latcol].empty()) {
+		if (!warned.exchange(1)) {
+			fprintf(stderr, "%s:%zu: null geometry (additional not reported)\n", fname.c_str(), seq + 1);
 		}
+		return;
+	}
+	double lon = atof(line[h.loncol].c_str());
+	double lat = atof(line[h.latcol].c_str());
+
+	long long x, y;
+	projection->project(lon, lat, 32, &x, &y);
+	drawvec dv;
+	dv.push_back(draw(VT_MOVETO, x, y));
+
+	std::vector<std::string> full_keys;
+	std::vector<serial_val> full_values;
+
+	for (size_t i = 0; i < line.size(); i++) {
+		if (i != (size_t) h.latcol && i != (size_t) h.loncol) {
+			line[i] = csv_dequote(line[i]);
+
+			serial_val sv;
+			if (is_number(line[i])) {
+				sv.type = mvt_double;
+			} else if (line[i].size() == 0 && prevent[P_EMPTY_CSV_COLUMNS]) {
+				sv.type = mvt_null;
+				line[i] = "null";
+			} else {
+				sv.type = mvt_string;
+			}
+			sv.s = line[i];
+
+			full_keys.push_back(h.header[i]);
+			full_values.push_back(sv);
+		}
+	}
+
+	serial_feature sf;
+
+	sf.layer = layer;
+	sf.layername = layername;
+	sf.segment = sst->segment;
+	sf.has_id = false;
+	sf.id = 0;
+	sf.has_tippecanoe_minzoom = false;
+	sf.has_tippecanoe_maxzoom = false;
+	sf.feature_minzoom = false;
+	sf.seq = *(sst->layer_seq);
+	sf.geometry = dv;
+	sf.t = 1;  // POINT
+	sf.full_keys = full_keys;
+	sf.full_values = full_values;
+
+	serialize_feature(sst, sf);
+}
+
+// One thread's share of the records of a mapped CSV file
+struct geocsv_segment {
+	struct serialization_state *sst;
+	const char *map;
+	size_t start;
+	size_t end;
+	size_t seq;  // of the record before the first one in the segment
+
+	geocsv_header const *h;
+	std::string const *fname;
+	int layer;
+	std::string const *layername;
+};
+
+static void *run_parse_records(void *v) {
+	geocsv_segment *gs = (geocsv_segment *) v;
+	size_t seq = gs->seq;
+
+	for (size_t off = gs->start; off < gs->end;) {
+		size_t len = csv_record_length(gs->map + off, gs->end - off);
+		std::string s(gs->map + off, len);
+		off += len;
 
 		seq++;
-		std::vector<std::string> line = csv_split(s.c_str());
+		parse_record(gs->sst, s, seq, *gs->h, *gs->fname, gs->layer, *gs->layername);
+	}
+
+	return NULL;
+}
+
+// Split the records of a mapped CSV file among the threads, at record
+// boundaries so that quoted newlines stay within their fields, and parse
+// them in parallel. As in do_read_parallel(), each segment's sequence numbers
+// start at its offset into the input, to keep the features in order.
+static void parse_mapped_geocsv(std::vector<struct serialization_state> &sst, const char *map, size_t len, std::string const &fname, int layer, std::string const &layername) {
+	size_t header_len = csv_record_length(map, len);
+	geocsv_header h;
+	parse_header(std::string(map, header_len), fname, h);
+
+	std::vector<geocsv_segment> segs(CPUS);
+	long long initial_offset = *(sst[0].layer_seq);
 
-		if (line.size() != header.size()) {
-			fprintf(stderr, "%s:%zu: Mismatched column count: %zu in line, %zu in header\n", fname.c_str(), seq + 1, line.size(), header.size());
-			exit(EXIT_CSV);
+	// Only the quotes need to be followed to find the record boundaries,
+	// so this is quick compared to the parsing. It also counts the records
+	// before each segment for the error messages.
+	size_t off = header_len;
+	size_t seq = 0;
+	for (size_t i = 0; i < CPUS; i++) {
+		size_t want = header_len + (len - header_len) * i / CPUS;
+		while (off < want) {
+			off += csv_record_length(map + off, len - off);
+			seq++;
 		}
 
-		if (line[loncol].empty() || line[latcol].empty()) {
-			static int warned = 0;
-			if (!warned) {
-				fprintf(stderr, "%s:%zu: null geometry (additional not reported)\n", fname.c_str(), seq + 1);
-				warned = 1;
-			}
-			continue;
+		segs[i].start = off;
+		segs[i].seq = seq;
+		if (i > 0) {
+			segs[i - 1].end = off;
 		}
-		double lon = atof(line[loncol].c_str());
-		double lat = atof(line[latcol].c_str());
-
-		long long x, y;
-		projection->project(lon, lat, 32, &x, &y);
-		drawvec dv;
-		dv.push_back(draw(VT_MOVETO, x, y));
-
-		std::vector<std::string> full_keys;
-		std::vector<serial_val> full_values;
-
-		for (size_t i = 0; i < line.size(); i++) {
-			if (i != (size_t) latcol && i != (size_t) loncol) {
-				line[i] = csv_dequote(line[i]);
-
-				serial_val sv;
-				if (is_number(line[i])) {
-					sv.type = mvt_double;
-				} else if (line[i].size() == 0 && prevent[P_EMPTY_CSV_COLUMNS]) {
-					sv.type = mvt_null;
-					line[i] = "null";
-				} else {
-					sv.type = mvt_string;
-				}
-				sv.s = line[i];
+	}
+	segs[CPUS - 1].end = len;
+
+	task_group parsing;
+
+	for (size_t i = 0; i < CPUS; i++) {
+		*(sst[i].layer_seq) = initial_offset + segs[i].start;
+
+		segs[i].sst = &sst[i];
+		segs[i].map = map;
+		segs[i].h = &h;
+		segs[i].fname = &fname;
+		segs[i].layer = layer;
+		segs[i].layername = &layername;
+
+		task_run(&parsing, run_parse_records, &segs[i]);
+	}
+
+	task_wait(&parsing);
+
+	// The caller continues from the first segment's sequence number,
+	// which must come after all the features of this file
+	*(sst[0].layer_seq) = initial_offset + len;
+}
+
+void parse_geocsv(std::vector<struct serialization_state> &sst, std::string fname, int layer, std::string layername) {
+	FILE *f;
 
-				full_keys.push_back(header[i]);
-				full_values.push_back(sv);
+	if (fname.size() == 0) {
+		f = stdin;
+	} else {
+		int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			perror(fname.c_str());
+			exit(EXIT_OPEN);
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			char *map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			// Read it as a stream instead if it can't be mapped
+			if (map != MAP_FAILED) {
+				parse_mapped_geocsv(sst, map, st.st_size, fname, layer, layername);
+
+				if (munmap(map, st.st_size) != 0) {
+					perror("munmap source file");
+					exit(EXIT_MEMORY);
+				}
+				if (close(fd) != 0) {
+					perror("close");
+					exit(EXIT_CLOSE);
+				}
+				return;
 			}
 		}
 
-		serial_feature sf;
-
-		sf.layer = layer;
-		sf.layername = layername;
-		sf.segment = sst[0].segment;
-		sf.has_id = false;
-		sf.id = 0;
-		sf.has_tippecanoe_minzoom = false;
-		sf.has_tippecanoe_maxzoom = false;
-		sf.feature_minzoom = false;
-		sf.seq = *(sst[0].layer_seq);
-		sf.geometry = dv;
-		sf.t = 1;  // POINT
-		sf.full_keys = full_keys;
-		sf.full_values = full_values;
-
-		serialize_feature(&sst[0], sf);
+		f = fdopen(fd, "r");
+		if (f == NULL) {
+			perror(fname.c_str());
+			exit(EXIT_OPEN);
+		}
+	}
+
+	geocsv_header h;
+	parse_header(csv_getline(f), fname, h);
+
+	std::string s;
+	size_t seq = 0;
+	while ((s = csv_getline(f)).size() > 0) {
+		seq++;
+		parse_record(&sst[0], s, seq, h, fname, layer, layername);
 	}
 
 	if (fname.size() != 0) {
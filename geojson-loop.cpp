@@ -36,6 +36,43 @@ static void json_context(json_object *j) {
 	free(s);  // stringify
 }
 
+// Whether the key just read is the "coordinates" of the geometry of a Feature
+// at the top level or in a top-level FeatureCollection, whose type has
+// already been read, and if so, what the type is
+static int coordinates_type(json_object *key) {
+	json_object *geometry = key->parent;
+	if (geometry == NULL || geometry->type != JSON_HASH || geometry->expect != JSON_COLON ||
+	    strcmp(key->value.string.string, "coordinates") != 0 ||
+	    json_hash_get(geometry, "coordinates") != NULL) {  // the value for this key is still NULL
+		return -1;
+	}
+
+	json_object *feature = geometry->parent;
+	if (feature == NULL || json_hash_get(feature, "geometry") != geometry) {
+		return -1;
+	}
+	if (feature->parent != NULL) {
+		json_object *features = feature->parent;
+		if (features->type != JSON_ARRAY || features->parent == NULL || features->parent->parent != NULL ||
+		    json_hash_get(features->parent, "features") != features) {
+			return -1;
+		}
+	}
+
+	json_object *type = json_hash_get(geometry, "type");
+	if (type == NULL || type->type != JSON_STRING) {
+		return -1;
+	}
+
+	for (int i = 0; i < GEOM_TYPES; i++) {
+		if (strcmp(type->value.string.string, geometry_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
 void parse_json(json_feature_action *jfa, json_pull *jp) {
 	long long found_hashes = 0;
 	long long found_features = 0;
@@ -57,6 +94,14 @@ void parse_json(json_feature_action *jfa, json_pull *jp) {
 			break;
 		}
 
+		if (j->type == JSON_STRING) {
+			int t = coordinates_type(j);
+			if (t >= 0) {
+				jfa->read_coordinates(jp, t);
+			}
+			continue;
+		}
+
 		if (j->type == JSON_HASH) {
 			found_hashes++;
 
@@ -6,6 +6,12 @@ struct json_feature_action {
 
 	virtual int add_feature(json_object *geometry, bool geometrycollection, json_object *properties, json_object *id, json_object *tippecanoe, json_object *feature) = 0;
 	virtual void check_crs(json_object *j) = 0;
+
+	// Called when the parser has just read the "coordinates" key of a
+	// Feature's geometry of type t, to read them some faster way than
+	// into the JSON tree if the action can
+	virtual void read_coordinates(json_pull *, int) {
+	}
 };
 
 void parse_json(json_feature_action *action, json_pull *jp);
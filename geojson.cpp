@@ -27,7 +27,6 @@
 #include "jsonpull/jsonpull.h"
 #include "pool.hpp"
 #include "projection.hpp"
-#include "memfile.hpp"
 #include "main.hpp"
 #include "mbtiles.hpp"
 #include "geojson.hpp"
@@ -41,65 +40,8 @@
 #include "milo/dtoa_milo.h"
 #include "errors.hpp"
 
-int serialize_geojson_feature(struct serialization_state *sst, json_object *geometry, json_object *properties, json_object *id, int layer, json_object *tippecanoe, json_object *feature, std::string layername) {
-	json_object *geometry_type = json_hash_get(geometry, "type");
-	if (geometry_type == NULL) {
-		static int warned = 0;
-		if (!warned) {
-			fprintf(stderr, "%s:%d: null geometry (additional not reported): ", sst->fname, sst->line);
-			json_context(feature);
-			warned = 1;
-		}
-
-		return 0;
-	}
-
-	if (geometry_type->type != JSON_STRING) {
-		fprintf(stderr, "%s:%d: geometry type is not a string: ", sst->fname, sst->line);
-		json_context(feature);
-		return 0;
-	}
-
-	json_object *coordinates = json_hash_get(geometry, "coordinates");
-	if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
-		fprintf(stderr, "%s:%d: feature without coordinates array: ", sst->fname, sst->line);
-		json_context(feature);
-		return 0;
-	}
-
-	int t;
-	for (t = 0; t < GEOM_TYPES; t++) {
-		if (strcmp(geometry_type->value.string.string, geometry_names[t]) == 0) {
-			break;
-		}
-	}
-	if (t >= GEOM_TYPES) {
-		fprintf(stderr, "%s:%d: Can't handle geometry type %s: ", sst->fname, sst->line, geometry_type->value.string.string);
-		json_context(feature);
-		return 0;
-	}
-
-	int tippecanoe_minzoom = -1;
-	int tippecanoe_maxzoom = -1;
-	std::string tippecanoe_layername;
-
-	if (tippecanoe != NULL) {
-		json_object *min = json_hash_get(tippecanoe, "minzoom");
-		if (min != NULL && (min->type == JSON_NUMBER)) {
-			tippecanoe_minzoom = integer_zoom(sst->fname, milo::dtoa_milo(min->value.number.number));
-		}
-
-		json_object *max = json_hash_get(tippecanoe, "maxzoom");
-		if (max != NULL && (max->type == JSON_NUMBER)) {
-			tippecanoe_maxzoom = integer_zoom(sst->fname, milo::dtoa_milo(max->value.number.number));
-		}
-
-		json_object *ln = json_hash_get(tippecanoe, "layer");
-		if (ln != NULL && (ln->type == JSON_STRING)) {
-			tippecanoe_layername = std::string(ln->value.string.string);
-		}
-	}
-
+// The feature ID, if it can be represented as one
+static bool geojson_id(json_object *id, unsigned long long *id_out) {
 	bool has_id = false;
 	unsigned long long id_value = 0;
 	if (id != NULL) {
@@ -177,6 +119,102 @@ int serialize_geojson_feature(struct serialization_state *sst, json_object *geom
 		}
 	}
 
+	*id_out = id_value;
+	return has_id;
+}
+
+// With --update-intermediate, a feature with a null geometry
+// deletes the features with the same layer and ID
+static int serialize_geojson_deletion(struct serialization_state *sst, json_object *properties, json_object *id, json_object *tippecanoe, json_object *feature, std::string layername) {
+	serial_feature sf;
+	sf.has_id = geojson_id(id, &sf.id);
+	sf.layername = layername;
+
+	if (tippecanoe != NULL) {
+		json_object *ln = json_hash_get(tippecanoe, "layer");
+		if (ln != NULL && (ln->type == JSON_STRING)) {
+			sf.layername = std::string(ln->value.string.string);
+		}
+	}
+
+	if (attribute_for_id.size() != 0 && properties != NULL && properties->type == JSON_HASH) {
+		json_object *attr = json_hash_get(properties, attribute_for_id.c_str());
+		if (attr != NULL) {
+			serial_val sv;
+			stringify_value(attr, sv.type, sv.s, sst->fname, sst->line, feature);
+			if (sv.type >= 0) {
+				sf.full_keys.push_back(attribute_for_id);
+				sf.full_values.push_back(sv);
+			}
+		}
+	}
+
+	serialize_deletion(sst, sf);
+	return 1;
+}
+
+int serialize_geojson_feature(struct serialization_state *sst, json_object *geometry, json_object *properties, json_object *id, int layer, json_object *tippecanoe, json_object *feature, std::string layername, drawvec *coordinates_read) {
+	json_object *geometry_type = json_hash_get(geometry, "type");
+	if (geometry_type == NULL) {
+		static int warned = 0;
+		if (!warned) {
+			fprintf(stderr, "%s:%d: null geometry (additional not reported): ", sst->fname, sst->line);
+			json_context(feature);
+			warned = 1;
+		}
+
+		return 0;
+	}
+
+	if (geometry_type->type != JSON_STRING) {
+		fprintf(stderr, "%s:%d: geometry type is not a string: ", sst->fname, sst->line);
+		json_context(feature);
+		return 0;
+	}
+
+	json_object *coordinates = json_hash_get(geometry, "coordinates");
+	if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
+		fprintf(stderr, "%s:%d: feature without coordinates array: ", sst->fname, sst->line);
+		json_context(feature);
+		return 0;
+	}
+
+	int t;
+	for (t = 0; t < GEOM_TYPES; t++) {
+		if (strcmp(geometry_type->value.string.string, geometry_names[t]) == 0) {
+			break;
+		}
+	}
+	if (t >= GEOM_TYPES) {
+		fprintf(stderr, "%s:%d: Can't handle geometry type %s: ", sst->fname, sst->line, geometry_type->value.string.string);
+		json_context(feature);
+		return 0;
+	}
+
+	int tippecanoe_minzoom = -1;
+	int tippecanoe_maxzoom = -1;
+	std::string tippecanoe_layername;
+
+	if (tippecanoe != NULL) {
+		json_object *min = json_hash_get(tippecanoe, "minzoom");
+		if (min != NULL && (min->type == JSON_NUMBER)) {
+			tippecanoe_minzoom = integer_zoom(sst->fname, milo::dtoa_milo(min->value.number.number));
+		}
+
+		json_object *max = json_hash_get(tippecanoe, "maxzoom");
+		if (max != NULL && (max->type == JSON_NUMBER)) {
+			tippecanoe_maxzoom = integer_zoom(sst->fname, milo::dtoa_milo(max->value.number.number));
+		}
+
+		json_object *ln = json_hash_get(tippecanoe, "layer");
+		if (ln != NULL && (ln->type == JSON_STRING)) {
+			tippecanoe_layername = std::string(ln->value.string.string);
+		}
+	}
+
+	unsigned long long id_value = 0;
+	bool has_id = geojson_id(id, &id_value);
+
 	size_t nprop = 0;
 	if (properties != NULL && properties->type == JSON_HASH) {
 		nprop = properties->value.object.length;
@@ -215,10 +253,14 @@ int serialize_geojson_feature(struct serialization_state *sst, json_object *geom
 		}
 	}
 
-	drawvec dv;
-	parse_geometry(t, coordinates, dv, VT_MOVETO, sst->fname, sst->line, feature);
-
 	serial_feature sf;
+	if (coordinates_read != NULL) {
+		sf.geometry = *coordinates_read;
+	} else {
+		parse_geometry(t, coordinates, sf.geometry, VT_MOVETO, sst->fname, sst->line, feature);
+	}
+
+
 	sf.layer = layer;
 	sf.segment = sst->segment;
 	sf.t = mb_geometry[t];
@@ -228,7 +270,6 @@ int serialize_geojson_feature(struct serialization_state *sst, json_object *geom
 	sf.tippecanoe_minzoom = tippecanoe_minzoom;
 	sf.has_tippecanoe_maxzoom = (tippecanoe_maxzoom != -1);
 	sf.tippecanoe_maxzoom = tippecanoe_maxzoom;
-	sf.geometry = dv;
 	sf.feature_minzoom = 0;	 // Will be filled in during index merging
 	sf.seq = *(sst->layer_seq);
 
@@ -274,16 +315,41 @@ struct json_serialize_action : json_feature_action {
 	int layer;
 	std::string layername;
 
+	// The coordinates most recently read straight from the parser,
+	// and the empty array that stands for them in the JSON tree
+	json_object *read_coordinates_array = NULL;
+	drawvec coordinates_read;
+
 	int add_feature(json_object *geometry, bool geometrycollection, json_object *properties, json_object *id, json_object *tippecanoe, json_object *feature) {
 		sst->line = geometry->parser->line;
+		if (update_intermediate_dir != NULL && geometry->type == JSON_NULL) {
+			return serialize_geojson_deletion(sst, properties, id, tippecanoe, feature, layername);
+		}
 		if (geometrycollection) {
 			int ret = 1;
 			for (size_t g = 0; g < geometry->value.array.length; g++) {
-				ret &= serialize_geojson_feature(sst, geometry->value.array.array[g], properties, id, layer, tippecanoe, feature, layername);
+				ret &= serialize_geojson_feature(sst, geometry->value.array.array[g], properties, id, layer, tippecanoe, feature, layername, NULL);
 			}
 			return ret;
 		} else {
-			return serialize_geojson_feature(sst, geometry, properties, id, layer, tippecanoe, feature, layername);
+			// The array's expectation shows that it is still the same one,
+			// not a new one that has been allocated in its place
+			drawvec *dv = NULL;
+			json_object *coordinates = json_hash_get(geometry, "coordinates");
+			if (coordinates != NULL && coordinates == read_coordinates_array && coordinates->expect == JSON_POSITIONS) {
+				dv = &coordinates_read;
+				read_coordinates_array = NULL;
+			}
+
+			return serialize_geojson_feature(sst, geometry, properties, id, layer, tippecanoe, feature, layername, dv);
+		}
+	}
+
+	void read_coordinates(json_pull *jp, int t) {
+		coordinates_read.clear();
+		json_object *o = ::read_coordinates(jp, t, coordinates_read);
+		if (o != NULL) {
+			read_coordinates_array = o;
 		}
 	}
 
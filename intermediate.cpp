@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "intermediate.hpp"
+#include "serial.hpp"
+#include "main.hpp"
+#include "errors.hpp"
+#include "version.hpp"
+#include "protozero/varint.hpp"
+
+static std::string intermediate_path(const char *dir, const char *name) {
+	return std::string(dir) + "/" + name;
+}
+
+int create_intermediate_file(const char *dir, const char *name, FILE **fp) {
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		perror(dir);
+		exit(EXIT_OPEN);
+	}
+
+	std::string path = intermediate_path(dir, name);
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		perror(path.c_str());
+		exit(EXIT_OPEN);
+	}
+
+	if (fp != NULL) {
+		*fp = fopen_oflag(path.c_str(), "wb", O_WRONLY | O_CLOEXEC);
+		if (*fp == NULL) {
+			perror(path.c_str());
+			exit(EXIT_OPEN);
+		}
+	}
+
+	return fd;
+}
+
+int open_intermediate_file(const char *dir, const char *name, int oflag) {
+	std::string path = intermediate_path(dir, name);
+	int fd = open(path.c_str(), oflag | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path.c_str());
+		exit(EXIT_OPEN);
+	}
+	return fd;
+}
+
+// The header goes first and comes back last, so that the directory is
+// never complete while some of its files are old and some are new
+void replace_intermediate_files(const char *dir, std::vector<std::pair<std::string, std::string>> const &renames) {
+	std::string header = intermediate_path(dir, "header");
+	if (unlink(header.c_str()) != 0) {
+		perror(header.c_str());
+		exit(EXIT_WRITE);
+	}
+
+	for (auto const &r : renames) {
+		std::string from = intermediate_path(dir, r.first.c_str());
+		std::string to = intermediate_path(dir, r.second.c_str());
+		if (rename(from.c_str(), to.c_str()) != 0) {
+			perror(to.c_str());
+			exit(EXIT_WRITE);
+		}
+	}
+}
+
+// A varint that always takes 5 bytes, which is enough for 32 bits,
+// because the ones that it doesn't need are continuation bytes of 0
+static void fixed_varint(std::string &out, unsigned long long n) {
+	for (size_t i = 0; i < 5; i++) {
+		unsigned char b = n & 0x7F;
+		n >>= 7;
+		if (i + 1 < 5) {
+			b |= 0x80;
+		}
+		out.push_back(b);
+	}
+}
+
+static std::string first_tile(unsigned z, unsigned x, unsigned y) {
+	std::string out;
+	fixed_varint(out, protozero::encode_zigzag64(z));
+	fixed_varint(out, x);
+	fixed_varint(out, y);
+	return out;
+}
+
+void serialize_first_tile(FILE *fp, unsigned z, unsigned x, unsigned y, std::atomic<long long> *geompos, const char *fname) {
+	std::string tile = first_tile(z, x, y);
+	fwrite_check(tile.c_str(), sizeof(char), tile.size(), fp, geompos, fname);
+}
+
+void rewrite_first_tile(int fd, unsigned z, unsigned x, unsigned y) {
+	std::string tile = first_tile(z, x, y);
+	if (pwrite(fd, tile.c_str(), tile.size(), 0) != (ssize_t) tile.size()) {
+		perror("rewrite first tile of intermediate geometry");
+		exit(EXIT_WRITE);
+	}
+}
+
+static void serialize_double(std::string &out, double d) {
+	unsigned long long bits;
+	memcpy(&bits, &d, sizeof(bits));
+	serialize_ulong_long(out, bits);
+}
+
+static void deserialize_double(char **f, double *d) {
+	unsigned long long bits;
+	deserialize_ulong_long(f, &bits);
+	memcpy(d, &bits, sizeof(bits));
+}
+
+static void serialize_string(std::string &out, std::string const &s) {
+	serialize_ulong_long(out, s.size());
+	out.append(s);
+}
+
+static void deserialize_string(char **f, std::string *s) {
+	unsigned long long len;
+	deserialize_ulong_long(f, &len);
+	s->assign(*f, len);
+	*f += len;
+}
+
+static void serialize_bbox(std::string &out, const long long *bbox) {
+	for (size_t i = 0; i < 4; i++) {
+		serialize_long_long(out, bbox[i]);
+	}
+}
+
+static void deserialize_bbox(char **f, long long *bbox) {
+	for (size_t i = 0; i < 4; i++) {
+		deserialize_long_long(f, &bbox[i]);
+	}
+}
+
+static void serialize_strategy(std::string &out, strategy const &s) {
+	serialize_ulong_long(out, s.dropped_by_rate);
+	serialize_ulong_long(out, s.dropped_by_gamma);
+	serialize_ulong_long(out, s.dropped_as_needed);
+	serialize_ulong_long(out, s.coalesced_as_needed);
+	serialize_ulong_long(out, s.detail_reduced);
+	serialize_ulong_long(out, s.tile_size);
+	serialize_ulong_long(out, s.feature_count);
+	serialize_ulong_long(out, s.tiny_polygons);
+}
+
+static void deserialize_size(char **f, size_t *n) {
+	unsigned long long v;
+	deserialize_ulong_long(f, &v);
+	*n = v;
+}
+
+static void deserialize_strategy(char **f, strategy &s) {
+	deserialize_size(f, &s.dropped_by_rate);
+	deserialize_size(f, &s.dropped_by_gamma);
+	deserialize_size(f, &s.dropped_as_needed);
+	deserialize_size(f, &s.coalesced_as_needed);
+	deserialize_size(f, &s.detail_reduced);
+	deserialize_size(f, &s.tile_size);
+	deserialize_size(f, &s.feature_count);
+	deserialize_size(f, &s.tiny_polygons);
+}
+
+static void serialize_layermap(std::string &out, std::map<std::string, layermap_entry> const &layermap) {
+	serialize_ulong_long(out, layermap.size());
+
+	for (auto const &layer : layermap) {
+		serialize_string(out, layer.first);
+		serialize_ulong_long(out, layer.second.id);
+		serialize_string(out, layer.second.description);
+		serialize_int(out, layer.second.minzoom);
+		serialize_int(out, layer.second.maxzoom);
+		serialize_ulong_long(out, layer.second.points);
+		serialize_ulong_long(out, layer.second.lines);
+		serialize_ulong_long(out, layer.second.polygons);
+		serialize_ulong_long(out, layer.second.retain);
+
+		serialize_ulong_long(out, layer.second.file_keys.size());
+		for (auto const &key : layer.second.file_keys) {
+			serialize_string(out, key.first);
+			serialize_int(out, key.second.type);
+			serialize_double(out, key.second.min);
+			serialize_double(out, key.second.max);
+
+			serialize_ulong_long(out, key.second.sample_values.size());
+			for (auto const &sample : key.second.sample_values) {
+				serialize_int(out, sample.type);
+				serialize_string(out, sample.string);
+			}
+		}
+	}
+}
+
+static void deserialize_layermap(char **f, std::map<std::string, layermap_entry> &layermap) {
+	unsigned long long layers;
+	deserialize_ulong_long(f, &layers);
+
+	for (unsigned long long i = 0; i < layers; i++) {
+		std::string name;
+		unsigned long long id;
+		deserialize_string(f, &name);
+		deserialize_ulong_long(f, &id);
+
+		layermap_entry e(id);
+		unsigned long long n;
+		deserialize_string(f, &e.description);
+		deserialize_int(f, &e.minzoom);
+		deserialize_int(f, &e.maxzoom);
+		deserialize_ulong_long(f, &n);
+		e.points = n;
+		deserialize_ulong_long(f, &n);
+		e.lines = n;
+		deserialize_ulong_long(f, &n);
+		e.polygons = n;
+		deserialize_ulong_long(f, &n);
+		e.retain = n;
+
+		unsigned long long keys;
+		deserialize_ulong_long(f, &keys);
+		for (unsigned long long k = 0; k < keys; k++) {
+			std::string key;
+			type_and_string_stats stats;
+			deserialize_string(f, &key);
+			deserialize_int(f, &stats.type);
+			deserialize_double(f, &stats.min);
+			deserialize_double(f, &stats.max);
+
+			unsigned long long samples;
+			deserialize_ulong_long(f, &samples);
+			for (unsigned long long s = 0; s < samples; s++) {
+				type_and_string sample;
+				deserialize_int(f, &sample.type);
+				deserialize_string(f, &sample.string);
+				stats.sample_values.push_back(sample);
+			}
+
+			e.file_keys.insert(std::pair<std::string, type_and_string_stats>(key, stats));
+		}
+
+		layermap.insert(std::pair<std::string, layermap_entry>(name, e));
+	}
+}
+
+void save_intermediate(const char *dir, intermediate const &im) {
+	std::string out = INTERMEDIATE_MAGIC;
+	out.push_back('\0');
+	serialize_uint(out, INTERMEDIATE_VERSION);
+	serialize_uint(out, sizeof(struct index));
+	serialize_string(out, VERSION);
+
+	serialize_int(out, im.geometry_scale);
+	serialize_bbox(out, im.file_bbox);
+	serialize_bbox(out, im.file_bbox1);
+	serialize_bbox(out, im.file_bbox2);
+	serialize_double(out, im.dist_sum);
+	serialize_ulong_long(out, im.dist_count);
+	serialize_double(out, im.area_sum);
+
+	serialize_ulong_long(out, im.layermaps.size());
+	for (size_t i = 0; i < im.layermaps.size(); i++) {
+		serialize_uint(out, im.initial_x[i]);
+		serialize_uint(out, im.initial_y[i]);
+		serialize_layermap(out, im.layermaps[i]);
+	}
+
+	serialize_int(out, im.tiled);
+	serialize_string(out, im.tileset);
+	serialize_int(out, im.minzoom);
+	serialize_int(out, im.maxzoom);
+	serialize_int(out, im.buffer);
+	serialize_int(out, im.basezoom);
+	serialize_double(out, im.droprate);
+	serialize_double(out, im.gamma);
+	serialize_int(out, im.full_detail);
+	serialize_int(out, im.low_detail);
+	serialize_int(out, im.min_detail);
+	serialize_double(out, im.simplification);
+	serialize_double(out, im.maxzoom_simplification);
+	serialize_uint(out, im.midx);
+	serialize_uint(out, im.midy);
+	serialize_ulong_long(out, im.strategies.size());
+	for (auto const &s : im.strategies) {
+		serialize_strategy(out, s);
+	}
+	serialize_layermap(out, im.tiled_layermap);
+
+	// Written under another name and then renamed, so that there is
+	// never a header for features that were not all written
+	std::string path = intermediate_path(dir, "header");
+	std::string tmp = path + ".tmp";
+
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (fp == NULL) {
+		perror(tmp.c_str());
+		exit(EXIT_OPEN);
+	}
+	std::atomic<long long> pos(0);
+	fwrite_check(out.c_str(), sizeof(char), out.size(), fp, &pos, tmp.c_str());
+	if (fclose(fp) != 0) {
+		perror(tmp.c_str());
+		exit(EXIT_CLOSE);
+	}
+	if (rename(tmp.c_str(), path.c_str()) != 0) {
+		perror(path.c_str());
+		exit(EXIT_WRITE);
+	}
+}
+
+void load_intermediate(const char *dir, intermediate &im) {
+	std::string path = intermediate_path(dir, "header");
+
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (fp == NULL) {
+		perror(path.c_str());
+		exit(EXIT_OPEN);
+	}
+	std::string in;
+	char buf[8192];
+	size_t n;
+	while ((n = fread(buf, sizeof(char), sizeof(buf), fp)) > 0) {
+		in.append(buf, n);
+	}
+	if (ferror(fp)) {
+		perror(path.c_str());
+		exit(EXIT_READ);
+	}
+	if (fclose(fp) != 0) {
+		perror(path.c_str());
+		exit(EXIT_CLOSE);
+	}
+
+	if (in.size() <= strlen(INTERMEDIATE_MAGIC) || memcmp(in.c_str(), INTERMEDIATE_MAGIC, strlen(INTERMEDIATE_MAGIC) + 1) != 0) {
+		fprintf(stderr, "%s: not a tippecanoe intermediate\n", path.c_str());
+		exit(EXIT_READ);
+	}
+
+	// A few bytes of padding so that a truncated header can't be read past its end
+	size_t len = in.size();
+	in.append(16, '\0');
+	char *f = (char *) in.c_str() + strlen(INTERMEDIATE_MAGIC) + 1;
+
+	unsigned version, index_size;
+	deserialize_uint(&f, &version);
+	deserialize_uint(&f, &index_size);
+	std::string written_by;
+	deserialize_string(&f, &written_by);
+
+	if (version != INTERMEDIATE_VERSION || index_size != sizeof(struct index)) {
+		fprintf(stderr, "%s: intermediate was written by tippecanoe %s in a format that this tippecanoe (%s) can't read\n", path.c_str(), written_by.c_str(), VERSION);
+		exit(EXIT_READ);
+	}
+
+	deserialize_int(&f, &im.geometry_scale);
+	deserialize_bbox(&f, im.file_bbox);
+	deserialize_bbox(&f, im.file_bbox1);
+	deserialize_bbox(&f, im.file_bbox2);
+	deserialize_double(&f, &im.dist_sum);
+	unsigned long long count;
+	deserialize_ulong_long(&f, &count);
+	im.dist_count = count;
+	deserialize_double(&f, &im.area_sum);
+
+	unsigned long long segments;
+	deserialize_ulong_long(&f, &segments);
+	if (segments > 32767) {
+		fprintf(stderr, "%s: corrupt intermediate header\n", path.c_str());
+		exit(EXIT_READ);
+	}
+	im.initial_x.resize(segments);
+	im.initial_y.resize(segments);
+	im.layermaps.resize(segments);
+	for (size_t i = 0; i < segments && f <= in.c_str() + len; i++) {
+		deserialize_uint(&f, &im.initial_x[i]);
+		deserialize_uint(&f, &im.initial_y[i]);
+		deserialize_layermap(&f, im.layermaps[i]);
+	}
+
+	int tiled;
+	deserialize_int(&f, &tiled);
+	im.tiled = tiled;
+	deserialize_string(&f, &im.tileset);
+	deserialize_int(&f, &im.minzoom);
+	deserialize_int(&f, &im.maxzoom);
+	deserialize_int(&f, &im.buffer);
+	deserialize_int(&f, &im.basezoom);
+	deserialize_double(&f, &im.droprate);
+	deserialize_double(&f, &im.gamma);
+	deserialize_int(&f, &im.full_detail);
+	deserialize_int(&f, &im.low_detail);
+	deserialize_int(&f, &im.min_detail);
+	deserialize_double(&f, &im.simplification);
+	deserialize_double(&f, &im.maxzoom_simplification);
+	deserialize_uint(&f, &im.midx);
+	deserialize_uint(&f, &im.midy);
+	unsigned long long strategies;
+	deserialize_ulong_long(&f, &strategies);
+	if (strategies > MAX_ZOOM + 1) {
+		fprintf(stderr, "%s: corrupt intermediate header\n", path.c_str());
+		exit(EXIT_READ);
+	}
+	im.strategies.resize(strategies);
+	for (size_t i = 0; i < strategies; i++) {
+		deserialize_strategy(&f, im.strategies[i]);
+	}
+	if (f <= in.c_str() + len) {
+		deserialize_layermap(&f, im.tiled_layermap);
+	}
+
+	if (f != in.c_str() + len) {
+		fprintf(stderr, "%s: corrupt intermediate header\n", path.c_str());
+		exit(EXIT_READ);
+	}
+}
+
+// A marked area of more than this many tiles is kept as an area instead of tile by tile
+#define SELECTION_AREA 1024
+
+// Rounds toward negative infinity, since coordinates off the west
+// or north edge of the world are negative
+static long long floor_div(long long a, long long b) {
+	if (a < 0) {
+		return -((-a + b - 1) / b);
+	}
+	return a / b;
+}
+
+void tile_selection::add(long long const *bbox, int buffer) {
+	if (bbox[0] > bbox[2] || bbox[1] > bbox[3]) {
+		return;	 // no geometry
+	}
+
+	for (size_t z = 0; z < tiles.size(); z++) {
+		long long tile = 1LL << (32 - z);
+		long long edge = (1LL << z) - 1;
+
+		// Like rewrite() in tile.cpp, one pixel more than the buffer, and one more in case of rounding
+		long long margin = tile * (buffer + 1) / 256 + 1;
+
+		// Also the copies from wrapping around the antimeridian
+		for (long long wrap = -(1LL << 32); wrap <= (1LL << 32); wrap += 1LL << 32) {
+			long long minx = floor_div(bbox[0] + wrap - margin, tile);
+			long long miny = floor_div(bbox[1] - margin, tile);
+			long long maxx = floor_div(bbox[2] + wrap + margin, tile);
+			long long maxy = floor_div(bbox[3] + margin, tile);
+
+			if (maxx < 0 || maxy < 0 || minx > edge || miny > edge) {
+				continue;
+			}
+
+			minx = std::max(minx, 0LL);
+			miny = std::max(miny, 0LL);
+			maxx = std::min(maxx, edge);
+			maxy = std::min(maxy, edge);
+
+			if ((maxx - minx + 1) * (maxy - miny + 1) > SELECTION_AREA) {
+				areas[z].push_back(area{(unsigned) minx, (unsigned) miny, (unsigned) maxx, (unsigned) maxy});
+				continue;
+			}
+
+			for (long long x = minx; x <= maxx; x++) {
+				for (long long y = miny; y <= maxy; y++) {
+					tiles[z].insert((((unsigned long long) x) << 32) | y);
+				}
+			}
+		}
+	}
+}
+
+bool tile_selection::contains(int z, unsigned x, unsigned y) const {
+	if (z < 0 || (size_t) z >= tiles.size()) {
+		return false;
+	}
+
+	if (tiles[z].count((((unsigned long long) x) << 32) | y) != 0) {
+		return true;
+	}
+
+	for (auto const &a : areas[z]) {
+		if (x >= a.minx && x <= a.maxx && y >= a.miny && y <= a.maxy) {
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,109 @@
+#ifndef INTERMEDIATE_HPP
+#define INTERMEDIATE_HPP
+
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include "mbtiles.hpp"
+#include "tile.hpp"
+
+// An intermediate directory, from --write-intermediate, holds the input
+// as it is after reading and sorting, so that --read-intermediate can
+// start tiling from it without reading the input again:
+//
+//     geom    the sorted features, as they are given to traverse_zooms
+//     index   the sorted index of the features
+//     pool    the string pool of attribute keys and values
+//     header  everything else that tiling needs, below
+//
+// The header is written last, so a directory without one is incomplete.
+// It is written again after the writing run and each update have made
+// their tiles, to remember what --update-intermediate needs to know about
+// that tileset. --read-intermediate changes none of these files.
+// It starts with INTERMEDIATE_MAGIC and the INTERMEDIATE_VERSION, which
+// has to change whenever the format of any of these files changes.
+
+#define INTERMEDIATE_MAGIC "tippecanoe intermediate"
+#define INTERMEDIATE_VERSION 4
+
+// The first tile of the sorted features is written with its zoom, x, and y
+// padded to this many bytes, so that a later run can replace it with a
+// different first tile for its own minzoom and buffer.
+#define INTERMEDIATE_FIRST_TILE 15
+
+struct intermediate {
+	int geometry_scale = 0;
+	long long file_bbox[4] = {0, 0, 0, 0};
+	long long file_bbox1[4] = {0, 0, 0, 0};
+	long long file_bbox2[4] = {0, 0, 0, 0};
+
+	// for guessing the maxzoom
+	double dist_sum = 0;
+	size_t dist_count = 0;
+	double area_sum = 0;
+
+	// for each input segment
+	std::vector<unsigned> initial_x;
+	std::vector<unsigned> initial_y;
+	std::vector<std::map<std::string, layermap_entry>> layermaps;
+
+	// from the last tileset that was made from the intermediate
+	bool tiled = false;
+	std::string tileset;  // absolute path of the -o file or -e directory
+	int minzoom = 0;
+	int maxzoom = 0;
+	int buffer = 0;
+	int basezoom = 0;
+	double droprate = 0;
+	double gamma = 0;
+	int full_detail = 0;
+	int low_detail = 0;
+	int min_detail = 0;
+	double simplification = 0;
+	double maxzoom_simplification = 0;
+	unsigned midx = 0;  // center tile at maxzoom
+	unsigned midy = 0;
+	std::vector<strategy> strategies;
+	std::map<std::string, layermap_entry> tiled_layermap;  // attributes added during tiling
+};
+
+// The tiles that --update-intermediate has to make again, by zoom level.
+// Marking a feature marks every tile that it or its buffer could touch
+// at every zoom, so the parent of a marked tile is always marked too.
+struct tile_selection {
+	struct area {
+		unsigned minx, miny, maxx, maxy;
+	};
+
+	std::vector<std::unordered_set<unsigned long long>> tiles;  // (x << 32) | y
+	std::vector<std::vector<area>> areas;			    // too many tiles to list one by one
+
+	tile_selection(int maxzoom)
+	    : tiles(maxzoom + 1), areas(maxzoom + 1) {
+	}
+
+	// bbox is in world coordinates, and may be off the edge of the world
+	void add(long long const *bbox, int buffer);
+	bool contains(int z, unsigned x, unsigned y) const;
+};
+
+// Creates (or truncates) one of the files of the intermediate directory
+// and returns its descriptor, and also opens it for writing as *fp
+// unless fp is NULL
+int create_intermediate_file(const char *dir, const char *name, FILE **fp);
+int open_intermediate_file(const char *dir, const char *name, int oflag);
+
+// Renames (from, to) pairs of files of the intermediate directory, with its
+// header removed, so that it has to be saved again afterward
+void replace_intermediate_files(const char *dir, std::vector<std::pair<std::string, std::string>> const &renames);
+
+void serialize_first_tile(FILE *fp, unsigned z, unsigned x, unsigned y, std::atomic<long long> *geompos, const char *fname);
+void rewrite_first_tile(int fd, unsigned z, unsigned x, unsigned y);
+
+void save_intermediate(const char *dir, intermediate const &im);
+void load_intermediate(const char *dir, intermediate &im);
+
+#endif
@@ -1,8 +1,78 @@
 #include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <fstream>
 
 #include "json_logger.hpp"
+#include "errors.hpp"
+
+phase_clock phase_clock::now() {
+	phase_clock c;
+
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		perror("clock_gettime");
+		exit(EXIT_IMPOSSIBLE);
+	}
+	c.wall = ts.tv_sec + ts.tv_nsec / 1e9;
+
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0) {
+		perror("getrusage");
+		exit(EXIT_IMPOSSIBLE);
+	}
+	c.cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+	return c;
+}
+
+static long long max_rss() {
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0) {
+		perror("getrusage");
+		exit(EXIT_IMPOSSIBLE);
+	}
+
+#ifdef __APPLE__
+	return ru.ru_maxrss;  // already bytes
+#else
+	return ru.ru_maxrss * 1024LL;  // kilobytes
+#endif
+}
 
 void json_logger::progress_tile(double progress) {
 	fprintf(stderr, "{\"progress\":%3.1f}\n", progress);
 }
+
+void json_logger::phase(const char *name, phase_clock const &started, std::vector<std::pair<std::string, double>> const &counters) {
+	phase_clock now = phase_clock::now();
+	phase(name, now.wall - started.wall, now.cpu - started.cpu, counters);
+}
+
+void json_logger::phase(const char *name, double wall, double cpu, std::vector<std::pair<std::string, double>> const &counters) {
+	if (!json_enabled) {
+		return;
+	}
+
+	// Phase and counter names are all plain identifiers, so need no quoting
+	std::string out = "{\"phase\":\"" + std::string(name) + "\"";
+
+	char buf[100];
+	snprintf(buf, sizeof(buf), ",\"wall\":%.3f,\"cpu\":%.3f,\"max_rss\":%lld", wall, cpu, max_rss());
+	out += buf;
+
+	for (auto const &c : counters) {
+		if (c.second == floor(c.second) && fabs(c.second) < 1e18) {
+			snprintf(buf, sizeof(buf), "%lld", (long long) c.second);
+		} else {
+			snprintf(buf, sizeof(buf), "%.3f", c.second);
+		}
+		out += ",\"" + c.first + "\":" + buf;
+	}
+
+	out += "}\n";
+	fputs(out.c_str(), stderr);
+}
@@ -1,12 +1,29 @@
 #include <iostream>
+#include <string>
+#include <vector>
 
 #ifndef LOGGING_HPP
 #define LOGGING_HPP
 
+// Wall-clock and process CPU seconds at some moment, for timing a phase
+struct phase_clock {
+	double wall = 0;
+	double cpu = 0;
+
+	static phase_clock now();
+};
+
 struct json_logger {
 	bool json_enabled = false;
 
 	void progress_tile(double progress);
+
+	// One line of --json-progress telemetry: how much wall and CPU time a phase
+	// took since it started, the peak RSS so far, and whatever else the phase counted
+	void phase(const char *name, phase_clock const &started, std::vector<std::pair<std::string, double>> const &counters);
+
+	// For phases that did their own accounting of CPU time
+	void phase(const char *name, double wall, double cpu, std::vector<std::pair<std::string, double>> const &counters);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -5,6 +5,10 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <float.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "jsonpull.h"
 #include "../milo/milo.h"
 
@@ -219,6 +223,7 @@ struct string {
 	char *buf;
 	size_t n;
 	size_t nalloc;
+	int on_stack;  // buf is the caller's, not from malloc
 };
 
 static void string_init(struct string *s) {
@@ -230,42 +235,69 @@ static void string_init(struct string *s) {
 	}
 	s->n = 0;
 	s->buf[0] = '\0';
+	s->on_stack = 0;
 }
 
-static void string_append(struct string *s, char c) {
-	if (s->n + 2 >= s->nalloc) {
-		size_t prev = s->nalloc;
-		s->nalloc += 500;
-		if (s->nalloc <= prev) {
-			fprintf(stderr, "String size overflowed\n");
+// For strings that are usually short and don't outlive the caller,
+// start out in the caller's buffer
+static void string_init_stack(struct string *s, char *buf, size_t n) {
+	s->nalloc = n;
+	s->buf = buf;
+	s->n = 0;
+	s->buf[0] = '\0';
+	s->on_stack = 1;
+}
+
+static void string_grow(struct string *s, size_t add) {
+	size_t prev = s->nalloc;
+	s->nalloc += 500 + add;
+	if (s->nalloc <= prev) {
+		fprintf(stderr, "String size overflowed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (s->on_stack) {
+		char *buf = malloc(s->nalloc);
+		if (buf == NULL) {
+			perror("Out of memory");
 			exit(EXIT_FAILURE);
 		}
+		memcpy(buf, s->buf, s->n + 1);
+		s->buf = buf;
+		s->on_stack = 0;
+	} else {
 		s->buf = realloc(s->buf, s->nalloc);
 		if (s->buf == NULL) {
 			perror("Out of memory");
 			exit(EXIT_FAILURE);
 		}
 	}
+}
+
+static void string_append(struct string *s, char c) {
+	if (s->n + 2 >= s->nalloc) {
+		string_grow(s, 0);
+	}
 
 	s->buf[s->n++] = c;
 	s->buf[s->n] = '\0';
 }
 
+static void string_append_bytes(struct string *s, const char *add, size_t len) {
+	if (s->n + len + 1 >= s->nalloc) {
+		string_grow(s, len);
+	}
+
+	memcpy(s->buf + s->n, add, len);
+	s->n += len;
+	s->buf[s->n] = '\0';
+}
+
 static void string_append_string(struct string *s, char *add) {
 	size_t len = strlen(add);
 
 	if (s->n + len + 1 >= s->nalloc) {
-		size_t prev = s->nalloc;
-		s->nalloc += 500 + len;
-		if (s->nalloc <= prev) {
-			fprintf(stderr, "String size overflowed\n");
-			exit(EXIT_FAILURE);
-		}
-		s->buf = realloc(s->buf, s->nalloc);
-		if (s->buf == NULL) {
-			perror("Out of memory");
-			exit(EXIT_FAILURE);
-		}
+		string_grow(s, len);
 	}
 
 	for (; *add != '\0'; add++) {
@@ -275,8 +307,223 @@ static void string_append_string(struct string *s, char *add) {
 	s->buf[s->n] = '\0';
 }
 
+// The string's buffer, which now belongs to the caller to free
+static char *string_detach(struct string *s) {
+	if (s->on_stack) {
+		char *buf = malloc(s->n + 1);
+		if (buf == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(buf, s->buf, s->n + 1);
+		return buf;
+	}
+
+	return s->buf;
+}
+
 static void string_free(struct string *s) {
-	free(s->buf);
+	if (!s->on_stack) {
+		free(s->buf);
+	}
+}
+
+// Scanning ahead through the buffer in bulk, instead of one call to
+// next() per byte, for the runs of whitespace between tokens and the runs
+// of ordinary characters within strings. With SSE2, 16 bytes at a time.
+
+// How many of the n bytes at s are whitespace, counting the newlines among them
+static inline size_t whitespace_bytes(const char *s, size_t n, int *lines) {
+	size_t i = 0;
+
+	// Most runs of whitespace are a single space or newline, if any,
+	// so only go to vectors for indentation
+	for (; i < n && i < 4; i++) {
+		char c = s[i];
+		if (c == '\n') {
+			(*lines)++;
+		} else if (c != ' ' && c != '\t' && c != '\r' && c != 0x1E) {
+			return i;
+		}
+	}
+
+#if defined(__SSE2__)
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i rs = _mm_set1_epi8(0x1E);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i newlines = _mm_cmpeq_epi8(v, nl);
+		__m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+					  _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), newlines), _mm_cmpeq_epi8(v, rs)));
+
+		unsigned other = ~_mm_movemask_epi8(ws) & 0xFFFF;
+		unsigned nlmask = _mm_movemask_epi8(newlines);
+
+		if (other != 0) {
+			unsigned k = __builtin_ctz(other);
+			*lines += __builtin_popcount(nlmask & ((1U << k) - 1));
+			return i + k;
+		}
+
+		*lines += __builtin_popcount(nlmask);
+	}
+#endif
+
+	for (; i < n; i++) {
+		char c = s[i];
+		if (c == '\n') {
+			(*lines)++;
+		} else if (c != ' ' && c != '\t' && c != '\r' && c != 0x1E) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+// How many of the n bytes at s can go into a string as they are:
+// not a quote, a backslash, or a control character
+static size_t plain_string_bytes(const char *s, size_t n) {
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1F);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+					       _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+
+		unsigned mask = _mm_movemask_epi8(special);
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	for (; i < n; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\' || c < ' ') {
+			break;
+		}
+	}
+
+	return i;
+}
+
+// The length of the well-formed JSON number at s, or 0 if it isn't one
+// or might continue past the n bytes there
+static size_t number_bytes(const char *s, size_t n, int *decimal) {
+	size_t i = 0;
+
+#define DIGIT(i) ((i) < n && s[(i)] >= '0' && s[(i)] <= '9')
+
+	if (i < n && s[i] == '-') {
+		i++;
+	}
+	if (i < n && s[i] == '0') {
+		i++;
+	} else if (DIGIT(i)) {
+		while (DIGIT(i)) {
+			i++;
+		}
+	} else {
+		return 0;
+	}
+
+	if (i < n && s[i] == '.') {
+		i++;
+		if (!DIGIT(i)) {
+			return 0;
+		}
+		while (DIGIT(i)) {
+			i++;
+		}
+		*decimal = 1;
+	}
+
+	if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+		i++;
+		if (i < n && (s[i] == '+' || s[i] == '-')) {
+			i++;
+		}
+		if (!DIGIT(i)) {
+			return 0;
+		}
+		while (DIGIT(i)) {
+			i++;
+		}
+		*decimal = 1;
+	}
+
+#undef DIGIT
+
+	if (i >= n || (s[i] >= '0' && s[i] <= '9') || s[i] == '.' || s[i] == 'e' || s[i] == 'E' || s[i] == '+' || s[i] == '-') {
+		return 0;
+	}
+
+	return i;
+}
+
+// Powers of ten that a double represents exactly
+static const double exact_powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// atof() of a number that has already been checked to be valid JSON.
+//
+// Most numbers, and nearly all coordinates, have no exponent, at most 15
+// significant digits, and at most 22 digits after the decimal point. Those
+// digits as an integer, and the power of ten to divide them by, are both
+// exact as doubles, so the single division is already correctly rounded,
+// the same as from atof().
+static double json_atof(const char *s) {
+#if FLT_EVAL_METHOD == 0
+	const char *cp = s;
+	unsigned long long digits = 0;
+	int significant = 0;
+	int scale = 0;
+	int neg = 0;
+
+	if (*cp == '-') {
+		neg = 1;
+		cp++;
+	}
+	for (; *cp >= '0' && *cp <= '9'; cp++) {
+		if (significant > 0 || *cp != '0') {
+			significant++;
+		}
+		digits = digits * 10 + (*cp - '0');
+		if (significant > 15) {
+			return atof(s);
+		}
+	}
+	if (*cp == '.') {
+		for (cp++; *cp >= '0' && *cp <= '9'; cp++) {
+			if (significant > 0 || *cp != '0') {
+				significant++;
+			}
+			digits = digits * 10 + (*cp - '0');
+			scale++;
+			if (significant > 15 || scale > 22) {
+				return atof(s);
+			}
+		}
+	}
+
+	if (*cp == '\0') {
+		double d = (double) digits / exact_powers_of_ten[scale];
+		return neg ? -d : d;
+	}
+#endif
+
+	return atof(s);
 }
 
 json_object *json_read_separators(json_pull *j, json_separator_callback cb, void *state) {
@@ -294,6 +541,10 @@ json_object *json_read_separators(json_pull *j, json_separator_callback cb, void
 again:
 	/////////////////////////// Whitespace
 
+	if (j->buffer_head < j->buffer_tail) {
+		j->buffer_head += whitespace_bytes(j->buffer + j->buffer_head, j->buffer_tail - j->buffer_head, &j->line);
+	}
+
 	do {
 		c = read_wrap(j);
 		if (c == EOF) {
@@ -504,68 +755,83 @@ again:
 	/////////////////////////// Numbers
 
 	if (c == '-' || (c >= '0' && c <= '9')) {
+		char numbuf[64];
 		struct string val;
-		string_init(&val);
+		string_init_stack(&val, numbuf, sizeof(numbuf));
 		int decimal = 0;
 
-		if (c == '-') {
-			string_append(&val, c);
-			c = read_wrap(j);
+		// If the whole number is already in the buffer, take it all at once
+		// instead of a byte at a time. Anything unusual goes the slow way.
+		size_t len = 0;
+		if (j->buffer_head > 0) {
+			len = number_bytes(j->buffer + j->buffer_head - 1, j->buffer_tail - j->buffer_head + 1, &decimal);
 		}
 
-		if (c == '0') {
-			string_append(&val, c);
-		} else if (c >= '1' && c <= '9') {
-			string_append(&val, c);
-			c = peek(j);
+		if (len > 0 && len < sizeof(numbuf)) {
+			string_append_bytes(&val, j->buffer + j->buffer_head - 1, len);
+			j->buffer_head += len - 1;
+		} else {
+			decimal = 0;
 
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
+			if (c == '-') {
+				string_append(&val, c);
+				c = read_wrap(j);
 			}
-		}
 
-		if (peek(j) == '.') {
-			string_append(&val, read_wrap(j));
-			decimal = 1;
+			if (c == '0') {
+				string_append(&val, c);
+			} else if (c >= '1' && c <= '9') {
+				string_append(&val, c);
+				c = peek(j);
 
-			c = peek(j);
-			if (c < '0' || c > '9') {
-				j->error = "Decimal point without digits";
-				string_free(&val);
-				return NULL;
+				while (c >= '0' && c <= '9') {
+					string_append(&val, read_wrap(j));
+					c = peek(j);
+				}
 			}
-			while (c >= '0' && c <= '9') {
+
+			if (peek(j) == '.') {
 				string_append(&val, read_wrap(j));
+				decimal = 1;
+
 				c = peek(j);
+				if (c < '0' || c > '9') {
+					j->error = "Decimal point without digits";
+					string_free(&val);
+					return NULL;
+				}
+				while (c >= '0' && c <= '9') {
+					string_append(&val, read_wrap(j));
+					c = peek(j);
+				}
 			}
-		}
-
-		c = peek(j);
-		if (c == 'e' || c == 'E') {
-			string_append(&val, read_wrap(j));
-			decimal = 1;
 
 			c = peek(j);
-			if (c == '+' || c == '-') {
+			if (c == 'e' || c == 'E') {
 				string_append(&val, read_wrap(j));
-			}
+				decimal = 1;
+
+				c = peek(j);
+				if (c == '+' || c == '-') {
+					string_append(&val, read_wrap(j));
+				}
 
-			c = peek(j);
-			if (c < '0' || c > '9') {
-				j->error = "Exponent without digits";
-				string_free(&val);
-				return NULL;
-			}
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
 				c = peek(j);
+				if (c < '0' || c > '9') {
+					j->error = "Exponent without digits";
+					string_free(&val);
+					return NULL;
+				}
+				while (c >= '0' && c <= '9') {
+					string_append(&val, read_wrap(j));
+					c = peek(j);
+				}
 			}
 		}
 
 		json_object *n = add_object(j, JSON_NUMBER);
 		if (n != NULL) {
-			n->value.number.number = atof(val.buf);
+			n->value.number.number = json_atof(val.buf);
 			n->value.number.large_signed = 0;
 			n->value.number.large_unsigned = 0;
 
@@ -599,11 +865,22 @@ again:
 	/////////////////////////// Strings
 
 	if (c == '"') {
+		char strbuf[256];
 		struct string val;
-		string_init(&val);
+		string_init_stack(&val, strbuf, sizeof(strbuf));
 
 		int surrogate = -1;
-		while ((c = read_wrap(j)) != EOF) {
+		while (1) {
+			if (surrogate < 0 && j->buffer_head < j->buffer_tail) {
+				size_t n = plain_string_bytes(j->buffer + j->buffer_head, j->buffer_tail - j->buffer_head);
+				string_append_bytes(&val, j->buffer + j->buffer_head, n);
+				j->buffer_head += n;
+			}
+
+			if ((c = read_wrap(j)) == EOF) {
+				break;
+			}
+
 			if (c == '"') {
 				if (surrogate >= 0) {
 					string_append(&val, 0xE0 | (surrogate >> 12));
@@ -725,7 +1002,7 @@ again:
 
 		json_object *s = add_object(j, JSON_STRING);
 		if (s != NULL) {
-			s->value.string.string = val.buf;
+			s->value.string.string = string_detach(&val);
 		} else {
 			string_free(&val);
 		}
@@ -736,6 +1013,175 @@ again:
 	return NULL;
 }
 
+#define JSON_MAX_POSITION_DEPTH 8
+
+// Whether the bytes at s are a colon and then an array of positions nested
+// depth arrays deep, where each position is an array of two numbers.
+// Returns how long that is, or 0 if it is something else. If it might be
+// one but runs off the end of the n bytes, sets *more instead. Counts the
+// newlines along the way.
+static size_t positions_bytes(const char *s, size_t n, int depth, int *more, int *lines) {
+	size_t i = 0;
+	int level = 0;
+	size_t count[JSON_MAX_POSITION_DEPTH];
+
+#define WHITESPACE()                                  \
+	do {                                          \
+		i += whitespace_bytes(s + i, n - i, lines); \
+		if (i >= n) {                         \
+			*more = 1;                    \
+			return 0;                     \
+		}                                     \
+	} while (0)
+
+	WHITESPACE();
+	if (s[i] != ':') {
+		return 0;
+	}
+	i++;
+
+	WHITESPACE();
+	if (s[i] != '[') {
+		return 0;
+	}
+	i++;
+	count[0] = 0;
+
+	while (1) {
+		WHITESPACE();
+
+		if (s[i] == ']') {
+			// An empty array of positions is fine, but a position
+			// needs both its numbers
+			if (level == depth - 1 && count[level] != 2) {
+				return 0;
+			}
+			i++;
+
+			if (level == 0) {
+				return i;
+			}
+			level--;
+			count[level]++;
+			continue;
+		}
+
+		if (count[level] != 0) {
+			if (s[i] != ',') {
+				return 0;
+			}
+			i++;
+			WHITESPACE();
+		}
+
+		if (level == depth - 1) {
+			// More than two dimensions goes the slow way, to be warned about
+			if (count[level] >= 2) {
+				return 0;
+			}
+
+			int decimal = 0;
+			size_t len = number_bytes(s + i, n - i, &decimal);
+			if (len == 0 || len >= 64) {
+				if (len == 0 && n - i < 64) {
+					*more = 1;
+				}
+				return 0;
+			}
+			i += len;
+			count[level]++;
+		} else {
+			if (s[i] != '[') {
+				return 0;
+			}
+			i++;
+			level++;
+			count[level] = 0;
+		}
+	}
+
+#undef WHITESPACE
+}
+
+json_object *json_read_positions(json_pull *j, int depth, json_position_callback cb, void *state) {
+	if (j->container == NULL || j->container->type != JSON_HASH || j->container->expect != JSON_COLON ||
+	    depth < 1 || depth > JSON_MAX_POSITION_DEPTH) {
+		return NULL;
+	}
+
+	// Find out whether all of it is in the buffer, or can be once the
+	// buffer is refilled, before reading any of it
+	size_t len;
+	int lines;
+	while (1) {
+		int more = 0;
+		lines = 0;
+		len = positions_bytes(j->buffer + j->buffer_head, j->buffer_tail - j->buffer_head, depth, &more, &lines);
+		if (len != 0 || !more || (j->buffer_head == 0 && j->buffer_tail == BUFFER)) {
+			break;
+		}
+
+		memmove(j->buffer, j->buffer + j->buffer_head, j->buffer_tail - j->buffer_head);
+		j->buffer_tail -= j->buffer_head;
+		j->buffer_head = 0;
+
+		ssize_t n = j->read(j, j->buffer + j->buffer_tail, BUFFER - j->buffer_tail);
+		if (n <= 0) {
+			break;
+		}
+		j->buffer_tail += n;
+	}
+	if (len == 0) {
+		return NULL;
+	}
+
+	// Then read it for real, knowing that it is well-formed
+	const char *s = j->buffer + j->buffer_head;
+	int level = -1;
+	size_t index[JSON_MAX_POSITION_DEPTH];
+	double position[2];
+	int coord = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		char c = s[i];
+
+		if (c == '[') {
+			level++;
+			index[level] = 0;
+			coord = 0;
+		} else if (c == ']') {
+			if (level == depth - 1) {
+				cb(level, level == 0 ? 0 : index[level - 1], position, state);
+			} else {
+				cb(level, index[level], NULL, state);
+			}
+			level--;
+			if (level >= 0) {
+				index[level]++;
+			}
+		} else if (c == '-' || (c >= '0' && c <= '9')) {
+			char numbuf[64];
+			int decimal = 0;
+			size_t n = number_bytes(s + i, len - i, &decimal);
+			memcpy(numbuf, s + i, n);
+			numbuf[n] = '\0';
+			position[coord++] = json_atof(numbuf);
+			i += n - 1;
+		}
+	}
+
+	j->buffer_head += len;
+	j->line += lines;
+
+	// What is left in the tree in place of the positions is an empty array
+	j->container->expect = JSON_VALUE;
+	json_object *o = add_object(j, JSON_ARRAY);
+	if (o != NULL) {
+		o->expect = JSON_POSITIONS;
+	}
+	return o;
+}
+
 json_object *json_read(json_pull *j) {
 	return json_read_separators(j, NULL, NULL);
 }
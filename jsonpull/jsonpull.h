@@ -23,6 +23,9 @@ typedef enum json_type {
 	JSON_ITEM,
 	JSON_KEY,
 	JSON_VALUE,
+
+	// The expectation of the empty array that json_read_positions() leaves in the tree
+	JSON_POSITIONS,
 } json_type;
 
 typedef struct json_object {
@@ -81,6 +84,18 @@ typedef void (*json_separator_callback)(json_type type, json_pull *j, void *stat
 json_object *json_read_tree(json_pull *j);
 json_object *json_read(json_pull *j);
 json_object *json_read_separators(json_pull *j, json_separator_callback cb, void *state);
+
+// Called back by json_read_positions() with each position, as its depth
+// within the arrays, its index within the array that holds it, and its two
+// numbers; and with a NULL position at the end of each array that holds others,
+// with the number of things that it held.
+typedef void (*json_position_callback)(int depth, size_t index, double *position, void *state);
+
+// When the last thing read was a hash key, and what follows it is an array
+// of positions nested depth arrays deep, read it through the callback instead
+// of into the tree, and return the empty array that takes its place.
+// Otherwise, read nothing and return NULL.
+json_object *json_read_positions(json_pull *j, int depth, json_position_callback cb, void *state);
 void json_free(json_object *j);
 void json_disconnect(json_object *j);
 
@@ -46,16 +46,20 @@
 #include "jsonpull/jsonpull.h"
 #include "mbtiles.hpp"
 #include "pmtiles_file.hpp"
+#include "compression.hpp"
 #include "tile.hpp"
 #include "pool.hpp"
+#include "bgzf.hpp"
+#include "task_pool.hpp"
+#include "merge.hpp"
 #include "projection.hpp"
 #include "version.hpp"
-#include "memfile.hpp"
 #include "main.hpp"
 #include "geojson.hpp"
 #include "geobuf.hpp"
 #include "flatgeobuf.hpp"
 #include "geocsv.hpp"
+#include "intermediate.hpp"
 #include "geometry.hpp"
 #include "serial.hpp"
 #include "options.hpp"
@@ -76,13 +80,11 @@ int quiet_progress = 0;
 json_logger logger;
 double progress_interval = 0;
 std::atomic<double> last_progress(0);
-int geometry_scale = 0;
 double simplification = 1;
 double maxzoom_simplification = -1;
 size_t max_tile_size = 500000;
 size_t max_tile_features = 200000;
 int cluster_distance = 0;
-int tiny_polygon_size = 2;
 int cluster_maxzoom = MAX_ZOOM;
 long justx = -1, justy = -1;
 std::string attribute_for_id = "";
@@ -91,14 +93,16 @@ size_t limit_tile_feature_count_at_maxzoom = 0;
 unsigned int drop_denser = 0;
 std::map<std::string, serial_val> set_attributes;
 unsigned long long preserve_point_density_threshold = 0;
+const char *write_intermediate_dir = NULL;
+static const char *read_intermediate_dir = NULL;
+const char *update_intermediate_dir = NULL;
+static const char *output_tileset = NULL;  // the -o file or -e directory
+struct tile_selection *update_tiles = NULL;
 
 std::vector<order_field> order_by;
 bool order_reverse;
 bool order_by_size = false;
 
-int prevent[256];
-int additional[256];
-
 struct source {
 	std::string layer = "";
 	std::string file = "";
@@ -118,9 +122,12 @@ std::vector<clipbbox> clipbboxes;
 void checkdisk(std::vector<struct reader> *r) {
 	long long used = 0;
 	for (size_t i = 0; i < r->size(); i++) {
-		// Pool and tree are used once.
 		// Geometry and index will be duplicated during sorting and tiling.
-		used += 2 * (*r)[i].geompos + 2 * (*r)[i].indexpos + (*r)[i].poolfile->off + (*r)[i].treefile->off;
+		used += 2 * (*r)[i].geompos + 2 * (*r)[i].indexpos;
+	}
+	if (r->size() > 0) {
+		// The pool is shared and used once.
+		used += pool_size((*r)[0].pool);
 	}
 
 	static int warned = 0;
@@ -193,6 +200,8 @@ void init_cpus() {
 	// Round down to a power of 2
 	CPUS = 1 << (int) (log(CPUS) / log(2));
 
+	task_pool_init(CPUS);
+
 	struct rlimit rl;
 	if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
 		perror("getrlimit");
@@ -233,47 +242,14 @@ void init_cpus() {
 		exit(EXIT_OPEN);
 	}
 
-	TEMP_FILES = (MAX_FILES - 10) / 2;
+	// Three sets of temporary files can be open at once while
+	// tiling, because adjacent zoom levels overlap
+	TEMP_FILES = (MAX_FILES - 10) / 3;
 	if (TEMP_FILES > CPUS * 4) {
 		TEMP_FILES = CPUS * 4;
 	}
 }
 
-int indexcmp(const void *v1, const void *v2) {
-	const struct index *i1 = (const struct index *) v1;
-	const struct index *i2 = (const struct index *) v2;
-
-	if (i1->ix < i2->ix) {
-		return -1;
-	} else if (i1->ix > i2->ix) {
-		return 1;
-	}
-
-	if (i1->seq < i2->seq) {
-		return -1;
-	} else if (i1->seq > i2->seq) {
-		return 1;
-	}
-
-	return 0;
-}
-
-struct mergelist {
-	long long start;
-	long long end;
-
-	struct mergelist *next;
-};
-
-static void insert(struct mergelist *m, struct mergelist **head, unsigned char *map) {
-	while (*head != NULL && indexcmp(map + m->start, map + (*head)->start) > 0) {
-		head = &((*head)->next);
-	}
-
-	m->next = *head;
-	*head = m;
-}
-
 struct drop_state {
 	double gap;
 	unsigned long long previndex;
@@ -346,50 +322,145 @@ int calc_feature_minzoom(struct index *ix, struct drop_state *ds, int maxzoom, d
 	return feature_minzoom;
 }
 
-static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, FILE *indexfile, int bytes, char *geom_map, FILE *geom_out, std::atomic<long long> *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds) {
-	struct mergelist *head = NULL;
+struct merge_arg {
+	struct merge_partition *part = NULL;
+	char *geom_map = NULL;
+	int geomfd = -1;
+	long long geompos = 0;
+	struct index *merged = NULL;
+	unsigned char *minzooms = NULL;
+
+	// only reported by the thread for the first partition
+	std::atomic<long long> *copied = NULL;
+	long long *progress = NULL;
+	long long *progress_max = NULL;
+	long long *progress_reported = NULL;
+	bool report = false;
+};
 
-	for (size_t i = 0; i < nmerges; i++) {
-		if (merges[i].start < merges[i].end) {
-			insert(&(merges[i]), &head, map);
+static void flush_merge_geometry(struct merge_arg *a, std::string &buf, long long &written) {
+	long long off = a->geompos + a->part->geom_start + written;
+	size_t done = 0;
+
+	while (done < buf.size()) {
+		ssize_t n = pwrite(a->geomfd, buf.data() + done, buf.size() - done, off + done);
+		if (n < 0) {
+			perror("merge geometry");
+			exit(EXIT_WRITE);
 		}
+		done += n;
 	}
 
-	last_progress = 0;
+	written += buf.size();
+	buf.clear();
+}
+
+// Copy the partition's geometry into its section of the output,
+// and point its index entries at where the geometry went
+static void *run_merge_copy(void *v) {
+	struct merge_arg *a = (struct merge_arg *) v;
+	struct merge_partition *p = a->part;
 
-	while (head != NULL) {
-		struct index ix = *((struct index *) (map + head->start));
-		long long pos = *geompos;
+	std::string buf;
+	long long written = 0;
+
+	for (size_t i = p->first; i < p->first + p->count; i++) {
+		struct index &ix = a->merged[i];
+		long long len = ix.end - ix.start;
+		long long pos = a->geompos + p->geom_start + written + buf.size();
 
 		// MAGIC: This knows that the feature minzoom is the last byte of the serialized feature
 		// and is writing one byte less and then adding the byte for the minzoom.
 
-		fwrite_check(geom_map + ix.start, 1, ix.end - ix.start - 1, geom_out, geompos, "merge geometry");
-		int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
-		serialize_byte(geom_out, feature_minzoom, geompos, "merge geometry");
+		buf.append(a->geom_map + ix.start, len - 1);
+		buf.push_back(a->minzooms[i]);
 
-		// Count this as an 75%-accomplishment, since we already 25%-counted it
-		*progress += (ix.end - ix.start) * 3 / 4;
-		if (!quiet && !quiet_progress && progress_time() && 100 * *progress / *progress_max != *progress_reported) {
-			fprintf(stderr, "Reordering geometry: %lld%% \r", 100 * *progress / *progress_max);
-			fflush(stderr);
-			*progress_reported = 100 * *progress / *progress_max;
+		ix.start = pos;
+		ix.end = pos + len;
+
+		if (buf.size() >= 1024 * 1024) {
+			flush_merge_geometry(a, buf, written);
 		}
 
-		ix.start = pos;
-		ix.end = *geompos;
-		std::atomic<long long> indexpos;
-		fwrite_check(&ix, bytes, 1, indexfile, &indexpos, "merge temporary");
-		head->start += bytes;
+		// Count this as an 75%-accomplishment, since we already 25%-counted it
+		long long copied = (*a->copied += len * 3 / 4);
+		if (a->report && !quiet && !quiet_progress && progress_time()) {
+			long long progress = *a->progress + copied;
+			if (100 * progress / *a->progress_max != *a->progress_reported) {
+				fprintf(stderr, "Reordering geometry: %lld%% \r", 100 * progress / *a->progress_max);
+				fflush(stderr);
+				*a->progress_reported = 100 * progress / *a->progress_max;
+			}
+		}
+	}
 
-		struct mergelist *m = head;
-		head = m->next;
-		m->next = NULL;
+	flush_merge_geometry(a, buf, written);
+	return NULL;
+}
 
-		if (m->start < m->end) {
-			insert(m, &head, map);
+// Merge the sorted runs of the index into the output index and geometry.
+//
+// The runs are cut into CPUS ranges of keys, chosen from a sample of every run,
+// and each range is merged by its own thread. The feature minzooms then have to
+// be assigned in a single pass in the final order, because dropping depends on
+// the features that came before, but that pass only looks at the index. Finally
+// each thread copies its range's geometry into its own section of the output.
+static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, long long indexlen, FILE *indexfile, int bytes, char *geom_map, FILE *geom_out, std::atomic<long long> *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds) {
+	size_t nparts = CPUS;
+
+	std::vector<struct index> merged(indexlen / bytes);
+	std::vector<struct merge_partition> parts = merge_runs(merges, nmerges, map, bytes, nparts, merged.data());
+
+	std::vector<unsigned char> minzooms(merged.size());
+	std::atomic<long long> copied(0);
+
+	if (fflush(geom_out) != 0) {
+		perror("flush merge geometry");
+		exit(EXIT_WRITE);
+	}
+
+	std::vector<struct merge_arg> args(nparts);
+	for (size_t p = 0; p < nparts; p++) {
+		args[p].part = &parts[p];
+		args[p].geom_map = geom_map;
+		args[p].geomfd = fileno(geom_out);
+		args[p].geompos = *geompos;
+		args[p].merged = merged.data();
+		args[p].minzooms = minzooms.data();
+		args[p].copied = &copied;
+		args[p].progress = progress;
+		args[p].progress_max = progress_max;
+		args[p].progress_reported = progress_reported;
+		args[p].report = (p == 0);
+	}
+
+	long long geom_len = 0;
+	for (size_t p = 0; p < nparts; p++) {
+		parts[p].geom_start = geom_len;
+
+		for (size_t i = parts[p].first; i < parts[p].first + parts[p].count; i++) {
+			minzooms[i] = calc_feature_minzoom(&merged[i], ds, maxzoom, gamma);
+			geom_len += merged[i].end - merged[i].start;
 		}
 	}
+
+	last_progress = 0;
+
+	task_group copying;
+	for (size_t p = 0; p < nparts; p++) {
+		task_run(&copying, run_merge_copy, &args[p]);
+	}
+	task_wait(&copying);
+
+	*progress += copied;
+	*geompos += geom_len;
+	if (fseeko(geom_out, *geompos, SEEK_SET) != 0) {
+		perror("seek merge geometry");
+		exit(EXIT_SEEK);
+	}
+
+	std::atomic<long long> indexpos;
+	fwrite_check(merged.data(), bytes, merged.size(), indexfile, &indexpos, "merge temporary");
 }
 
 struct sort_arg {
@@ -419,7 +490,6 @@ void *run_sort(void *v) {
 
 		a->merges[start / a->unit].start = start;
 		a->merges[start / a->unit].end = end;
-		a->merges[start / a->unit].next = NULL;
 
 		// Read section of index into memory to sort and then use pwrite()
 		// to write it back out rather than sorting in mapped memory,
@@ -434,7 +504,10 @@ void *run_sort(void *v) {
 			exit(EXIT_READ);
 		}
 
-		qsort((void *) s.c_str(), (end - start) / a->bytes, a->bytes, indexcmp);
+		// Stable, to put features with the same key in the same order
+		// as the merge sort that glibc uses for qsort()
+		struct index *ixs = (struct index *) s.c_str();
+		std::stable_sort(ixs, ixs + (end - start) / a->bytes, index_before);
 
 		if (pwrite(a->indexfd, s.c_str(), end - start, start) != end - start) {
 			fprintf(stderr, "pwrite(index): %s\n", strerror(errno));
@@ -476,7 +549,6 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 	std::vector<serialization_state> sst;
 	sst.resize(CPUS);
 
-	pthread_t pthreads[CPUS];
 	std::vector<std::set<type_and_string> > file_subkeys;
 
 	for (size_t i = 0; i < CPUS; i++) {
@@ -514,20 +586,13 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 			&sst[i]));
 	}
 
+	task_group parsing;
 	for (size_t i = 0; i < CPUS; i++) {
-		if (pthread_create(&pthreads[i], NULL, run_parse_json, &pja[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_PTHREAD);
-		}
+		task_run(&parsing, run_parse_json, &pja[i]);
 	}
+	task_wait(&parsing);
 
 	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
-
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join 370");
-		}
-
 		*dist_sum += dist_sums[i];
 		*dist_count += dist_counts[i];
 		*area_sum += area_sums[i];
@@ -541,11 +606,15 @@ static ssize_t read_stream(json_pull *j, char *buffer, size_t n);
 struct STREAM {
 	FILE *fp = NULL;
 	gzFile gz = NULL;
+	bgzf_reader *bgzf = NULL;
 
 	int fclose() {
 		int ret;
 
-		if (gz != NULL) {
+		if (bgzf != NULL) {
+			ret = close(bgzf->fd);
+			delete bgzf;
+		} else if (gz != NULL) {
 			ret = gzclose(gz);
 		} else {
 			ret = ::fclose(fp);
@@ -556,7 +625,9 @@ struct STREAM {
 	}
 
 	int peekc() {
-		if (gz != NULL) {
+		if (bgzf != NULL) {
+			return bgzf->peekc();
+		} else if (gz != NULL) {
 			int c = gzgetc(gz);
 			if (c != EOF) {
 				gzungetc(c, gz);
@@ -572,7 +643,9 @@ struct STREAM {
 	}
 
 	size_t read(char *out, size_t count) {
-		if (gz != NULL) {
+		if (bgzf != NULL) {
+			return bgzf->read(out, count);
+		} else if (gz != NULL) {
 			int ret = gzread(gz, out, count);
 			if (ret < 0) {
 				fprintf(stderr, "%s: Error reading compressed data\n", *av);
@@ -598,7 +671,10 @@ STREAM *streamfdopen(int fd, const char *mode, std::string const &fname) {
 	s->fp = NULL;
 	s->gz = NULL;
 
-	if (fname.size() > 3 && fname.substr(fname.size() - 3) == std::string(".gz")) {
+	if (fname.size() > 3 && fname.substr(fname.size() - 3) == std::string(".gz") && is_bgzf(fd)) {
+		// Decompressed in parallel
+		s->bgzf = new bgzf_reader(fd, fname, CPUS, memsize / 10);
+	} else if (fname.size() > 3 && fname.substr(fname.size() - 3) == std::string(".gz")) {
 		s->gz = gzdopen(fd, mode);
 		if (s->gz == NULL) {
 			fprintf(stderr, "%s: %s: Decompression error\n", *av, fname.c_str());
@@ -912,7 +988,6 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					merges[a].start = merges[a].end = 0;
 				}
 
-				pthread_t pthreads[CPUS];
 				std::vector<sort_arg> args;
 
 				for (size_t a = 0; a < CPUS; a++) {
@@ -927,20 +1002,11 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 						bytes));
 				}
 
+				task_group sorting;
 				for (size_t a = 0; a < CPUS; a++) {
-					if (pthread_create(&pthreads[a], NULL, run_sort, &args[a]) != 0) {
-						perror("pthread_create");
-						exit(EXIT_PTHREAD);
-					}
-				}
-
-				for (size_t a = 0; a < CPUS; a++) {
-					void *retval;
-
-					if (pthread_join(pthreads[a], &retval) != 0) {
-						perror("pthread_join 679");
-					}
+					task_run(&sorting, run_sort, &args[a]);
 				}
+				task_wait(&sorting);
 
 				struct indexmap *indexmap = (struct indexmap *) mmap(NULL, indexst.st_size, PROT_READ, MAP_PRIVATE, indexfds[i], 0);
 				if (indexmap == MAP_FAILED) {
@@ -958,7 +1024,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				madvise(geommap, geomst.st_size, MADV_RANDOM);
 				madvise(geommap, geomst.st_size, MADV_WILLNEED);
 
-				merge(merges, nmerges, (unsigned char *) indexmap, indexfile, bytes, geommap, geomfile, geompos_out, progress, progress_max, progress_reported, maxzoom, gamma, ds);
+				merge(merges, nmerges, (unsigned char *) indexmap, indexst.st_size, indexfile, bytes, geommap, geomfile, geompos_out, progress, progress_max, progress_reported, maxzoom, gamma, ds);
 
 				madvise(indexmap, indexst.st_size, MADV_DONTNEED);
 				if (munmap(indexmap, indexst.st_size) < 0) {
@@ -1145,6 +1211,25 @@ void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FI
 	}
 }
 
+// The lowest zoom at which everything, with its buffer, is in a single tile
+void choose_first_tile(long long *file_bbox, unsigned *iz, unsigned *ix, unsigned *iy, int minzoom, int buffer) {
+	for (ssize_t z = minzoom; z >= 0; z--) {
+		long long shift = 1LL << (32 - z);
+
+		long long left = (file_bbox[0] - buffer * shift / 256) / shift;
+		long long top = (file_bbox[1] - buffer * shift / 256) / shift;
+		long long right = (file_bbox[2] + buffer * shift / 256) / shift;
+		long long bottom = (file_bbox[3] + buffer * shift / 256) / shift;
+
+		if (left == right && top == bottom) {
+			*iz = z;
+			*ix = left;
+			*iy = top;
+			break;
+		}
+	}
+}
+
 void choose_first_zoom(long long *file_bbox, long long *file_bbox1, long long *file_bbox2, std::vector<struct reader> &readers, unsigned *iz, unsigned *ix, unsigned *iy, int minzoom, int buffer) {
 	for (size_t i = 0; i < CPUS; i++) {
 		if (readers[i].file_bbox[0] < file_bbox[0]) {
@@ -1189,51 +1274,569 @@ void choose_first_zoom(long long *file_bbox, long long *file_bbox1, long long *f
 		file_bbox[3] = (1LL << 32) - 1;
 	}
 
-	for (ssize_t z = minzoom; z >= 0; z--) {
-		long long shift = 1LL << (32 - z);
+	choose_first_tile(file_bbox, iz, ix, iy, minzoom, buffer);
+}
 
-		long long left = (file_bbox[0] - buffer * shift / 256) / shift;
-		long long top = (file_bbox[1] - buffer * shift / 256) / shift;
-		long long right = (file_bbox[2] + buffer * shift / 256) / shift;
-		long long bottom = (file_bbox[3] + buffer * shift / 256) / shift;
+// The input once it has been read and sorted, which is where tiling starts
+struct sorted_input {
+	int poolfd = -1;
+	long long poolpos = 0;
+	char *stringpool = NULL;
 
-		if (left == right && top == bottom) {
-			*iz = z;
-			*ix = left;
-			*iy = top;
+	int geomfd = -1;
+	int indexfd = -1;
+	long long indexpos = 0;
+	unsigned iz = 0;
+
+	// by segment: one per input thread, then one per tiling thread
+	std::vector<long long> pool_off;
+	std::vector<unsigned> initial_x;
+	std::vector<unsigned> initial_y;
+
+	intermediate state;  // what --write-intermediate saves besides the files
+
+	// The feature minzooms in the geometry are from the run that wrote the
+	// intermediate, so they have to be assigned again for this run.
+	bool from_intermediate = false;
+
+	// Where to remember what the tiling made, for the tileset that
+	// --write-intermediate makes and that --update-intermediate updates
+	const char *intermediate_dir = NULL;
+};
+
+static std::pair<int, metadata> tile_sorted_input(sorted_input &si, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, pmtiles_writer *outpm, compiled_filter const *filter, double droprate, int buffer, const char *tmpdir, double gamma, int forcetable, const char *attribution, long long *file_bbox, long long *file_bbox1, long long *file_bbox2, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, bool guess_cluster_maxzoom, const char *pgm, std::map<std::string, attribute_op> const *attribute_accum, std::map<std::string, std::string> const &attribute_descriptions, std::string const &commandline, int minimum_maxzoom, int ret);
+
+// So that the tileset that an intermediate remembers is the same however it is named
+static std::string absolute_path(const char *fname) {
+	char *path = realpath(fname, NULL);
+	if (path == NULL) {
+		return fname;
+	}
+	std::string ret = path;
+	free(path);
+	return ret;
+}
+
+// Finer geometry than this run needs is fine, but coarser can't be made finer again
+static void use_intermediate_detail(const char *dir, intermediate const &im) {
+	if (im.geometry_scale > geometry_scale) {
+		fprintf(stderr, "%s: The intermediate has less detail than this maxzoom and detail need. Write it again with this maxzoom.\n", dir);
+		exit(EXIT_ARGS);
+	}
+	geometry_scale = im.geometry_scale;
+}
+
+// Copies the intermediate geometry to a temporary file, which this run
+// can then give its own first tile and feature minzooms
+static int copy_intermediate_geom(int fd, const char *tmpdir) {
+	char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX") + 1];
+	snprintf(geomname, sizeof(geomname), "%s%s", tmpdir, "/geom.XXXXXXXX");
+
+	int copyfd = mkstemp_cloexec(geomname);
+	if (copyfd < 0) {
+		perror(geomname);
+		exit(EXIT_OPEN);
+	}
+	unlink(geomname);
+
+	std::string buf(1024 * 1024, '\0');
+	off_t off = 0;
+	while (true) {
+		ssize_t n = pread(fd, (void *) buf.data(), buf.size(), off);
+		if (n < 0) {
+			perror("read intermediate geom");
+			exit(EXIT_READ);
+		}
+		if (n == 0) {
 			break;
 		}
+
+		for (ssize_t done = 0; done < n;) {
+			ssize_t w = write(copyfd, buf.data() + done, n - done);
+			if (w < 0) {
+				perror(geomname);
+				exit(EXIT_WRITE);
+			}
+			done += w;
+		}
+		off += n;
+	}
+
+	return copyfd;
+}
+
+// Starts from the sorted features of an earlier run instead of from the input.
+// With a tmpdir, the geometry is copied there, so that tiling it doesn't
+// change the intermediate; without, the intermediate's own geometry is used.
+static void load_sorted_input(sorted_input &si, const char *dir, long long *file_bbox, long long *file_bbox1, long long *file_bbox2, int minzoom, int buffer, const char *tmpdir) {
+	phase_clock loading_started = phase_clock::now();
+
+	load_intermediate(dir, si.state);
+	si.from_intermediate = true;
+
+	use_intermediate_detail(dir, si.state);
+
+	for (size_t i = 0; i < 4; i++) {
+		file_bbox[i] = si.state.file_bbox[i];
+		file_bbox1[i] = si.state.file_bbox1[i];
+		file_bbox2[i] = si.state.file_bbox2[i];
+	}
+
+	size_t segments = si.state.layermaps.size() + CPUS;
+	si.pool_off.resize(segments, 0);
+	si.initial_x = si.state.initial_x;
+	si.initial_y = si.state.initial_y;
+	si.initial_x.resize(segments, 0);
+	si.initial_y.resize(segments, 0);
+
+	si.poolfd = open_intermediate_file(dir, "pool", O_RDONLY);
+	si.indexfd = open_intermediate_file(dir, "index", O_RDONLY);
+	if (tmpdir != NULL) {
+		int geomfd = open_intermediate_file(dir, "geom", O_RDONLY);
+		si.geomfd = copy_intermediate_geom(geomfd, tmpdir);
+		if (close(geomfd) != 0) {
+			perror("close intermediate geom");
+			exit(EXIT_CLOSE);
+		}
+	} else {
+		si.geomfd = open_intermediate_file(dir, "geom", O_RDWR);
+	}
+
+	struct stat st;
+	if (fstat(si.poolfd, &st) != 0) {
+		perror("stat intermediate pool");
+		exit(EXIT_STAT);
+	}
+	si.poolpos = st.st_size;
+	if (si.poolpos > 0) {
+		si.stringpool = (char *) mmap(NULL, si.poolpos, PROT_READ, MAP_PRIVATE, si.poolfd, 0);
+		if (si.stringpool == MAP_FAILED) {
+			perror("mmap intermediate string pool");
+			exit(EXIT_MEMORY);
+		}
+		madvise(si.stringpool, si.poolpos, MADV_RANDOM);
+	}
+
+	if (fstat(si.indexfd, &st) != 0) {
+		perror("stat intermediate index");
+		exit(EXIT_STAT);
+	}
+	si.indexpos = st.st_size;
+	if (si.indexpos % sizeof(struct index) != 0) {
+		fprintf(stderr, "%s: The intermediate index is incomplete\n", dir);
+		exit(EXIT_READ);
+	}
+
+	if (fstat(si.geomfd, &st) != 0) {
+		perror("stat intermediate geom");
+		exit(EXIT_STAT);
+	}
+	if (st.st_size < INTERMEDIATE_FIRST_TILE) {
+		fprintf(stderr, "%s: The intermediate geometry is incomplete\n", dir);
+		exit(EXIT_READ);
+	}
+
+	// The first tile depends on this run's minzoom and buffer
+	unsigned ix = 0, iy = 0;
+	choose_first_tile(file_bbox, &si.iz, &ix, &iy, minzoom, buffer);
+	if (justx >= 0) {
+		si.iz = minzoom;
+		ix = justx;
+		iy = justy;
+	}
+	rewrite_first_tile(si.geomfd, si.iz, ix, iy);
+
+	long long features = si.indexpos / sizeof(struct index);
+	logger.phase("read_intermediate", loading_started, {{"features", features}, {"geom_read", st.st_size}, {"index_read", si.indexpos}, {"pool_read", si.poolpos}});
+
+	if (!quiet) {
+		fprintf(stderr, "%lld features, %lld bytes of geometry, %lld bytes of string pool\n", features, (long long) st.st_size, si.poolpos);
+	}
+}
+
+// Table to map segment and layer number back to layer name
+static std::vector<std::vector<std::string>> layer_names(std::vector<std::map<std::string, layermap_entry>> const &layermaps) {
+	std::vector<std::vector<std::string>> names(layermaps.size());
+
+	for (size_t seg = 0; seg < layermaps.size(); seg++) {
+		for (auto const &a : layermaps[seg]) {
+			if (a.second.id >= names[seg].size()) {
+				names[seg].resize(a.second.id + 1);
+			}
+			names[seg][a.second.id] = a.first;
+		}
+	}
+
+	return names;
+}
+
+// Adds the tilestats of one layer into another, the way that
+// merge_layermaps() does, but without renumbering the layer
+static void add_layer_stats(layermap_entry &out, layermap_entry const &in) {
+	for (auto const &fk : in.file_keys) {
+		auto fk2 = out.file_keys.find(fk.first);
+
+		if (fk2 == out.file_keys.end()) {
+			out.file_keys.insert(fk);
+			continue;
+		}
+
+		for (auto const &val : fk.second.sample_values) {
+			auto pt = std::lower_bound(fk2->second.sample_values.begin(), fk2->second.sample_values.end(), val);
+			if (pt == fk2->second.sample_values.end() || *pt != val) {  // not found
+				fk2->second.sample_values.insert(pt, val);
+
+				if (fk2->second.sample_values.size() > max_tilestats_sample_values) {
+					fk2->second.sample_values.pop_back();
+				}
+			}
+		}
+
+		fk2->second.type |= fk.second.type;
+		fk2->second.min = std::min(fk2->second.min, fk.second.min);
+		fk2->second.max = std::max(fk2->second.max, fk.second.max);
+	}
+
+	out.points += in.points;
+	out.lines += in.lines;
+	out.polygons += in.polygons;
+}
+
+// Maps a whole file for one pass of reading, or returns NULL if it is empty
+static char *map_sequential(int fd, long long *size, const char *what) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror(what);
+		exit(EXIT_STAT);
+	}
+
+	*size = st.st_size;
+	if (*size == 0) {
+		return NULL;
+	}
+
+	char *map = (char *) mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(what);
+		exit(EXIT_MEMORY);
+	}
+	madvise(map, *size, MADV_SEQUENTIAL);
+	return map;
+}
+
+// Where the feature that an index entry points to starts, after its length
+static char *indexed_feature(char *geom, struct index const &ix, long long *len) {
+	char *cp = geom + ix.start;
+	deserialize_long_long(&cp, len);
+
+	if (cp + *len != geom + ix.end) {
+		fprintf(stderr, "Internal error: feature length %lld doesn't match index %lld to %lld\n", *len, ix.start, ix.end);
+		exit(EXIT_IMPOSSIBLE);
+	}
+
+	return cp;
+}
+
+// For --update-intermediate: merges the features that were just read and
+// sorted into the intermediate in dir, replacing the earlier features that
+// have the same layer and ID as one of them or as one of the deletions, and
+// selects the tiles that the replaced and the new features could touch.
+//
+// The earlier features keep the minzooms from the last time they were tiled,
+// so that the tiles away from the changes come out the same as before.
+// The new features get theirs from where they fall in the sequence of dropping.
+static void update_sorted_input(sorted_input &changes, std::set<std::pair<std::string, unsigned long long>> const &deletions, const char *dir, intermediate &store, tile_selection &selection, int maxzoom, int basezoom, double droprate, double gamma, int buffer, const char *fname) {
+	phase_clock updating_started = phase_clock::now();
+
+	// The new features all go into segment 0, with its numbering of layers
+	size_t next_layer = 0;
+	for (auto const &l : store.layermaps[0]) {
+		next_layer = std::max(next_layer, l.second.id + 1);
+	}
+
+	std::vector<std::vector<size_t>> new_layers(changes.state.layermaps.size());
+	for (size_t seg = 0; seg < changes.state.layermaps.size(); seg++) {
+		for (auto const &l : changes.state.layermaps[seg]) {
+			auto found = store.layermaps[0].find(l.first);
+			if (found == store.layermaps[0].end()) {
+				found = store.layermaps[0].insert(std::make_pair(l.first, layermap_entry(next_layer++))).first;
+				found->second.description = l.second.description;
+			}
+			add_layer_stats(found->second, l.second);
+
+			if (l.second.id >= new_layers[seg].size()) {
+				new_layers[seg].resize(l.second.id + 1);
+			}
+			new_layers[seg][l.second.id] = found->second.id;
+		}
+	}
+
+	store.dist_sum += changes.state.dist_sum;
+	store.dist_count += changes.state.dist_count;
+	store.area_sum += changes.state.area_sum;
+
+	// The string pool of the changes goes after the one that is already there
+	int poolfd = open_intermediate_file(dir, "pool", O_WRONLY | O_APPEND);
+	struct stat st;
+	if (fstat(poolfd, &st) != 0) {
+		perror("stat intermediate pool");
+		exit(EXIT_STAT);
+	}
+	long long pool_base = st.st_size;
+	for (long long off = 0; off < changes.poolpos;) {
+		ssize_t n = write(poolfd, changes.stringpool + off, changes.poolpos - off);
+		if (n <= 0) {
+			perror("write intermediate pool");
+			exit(EXIT_WRITE);
+		}
+		off += n;
+	}
+	if (close(poolfd) != 0) {
+		perror("close intermediate pool");
+		exit(EXIT_CLOSE);
+	}
+
+	int indexfd = open_intermediate_file(dir, "index", O_RDONLY);
+	int geomfd = open_intermediate_file(dir, "geom", O_RDONLY);
+	long long indexlen, geomlen;
+	struct index *index = (struct index *) map_sequential(indexfd, &indexlen, "mmap intermediate index");
+	char *geom = map_sequential(geomfd, &geomlen, "mmap intermediate geom");
+	long long indices = indexlen / sizeof(struct index);
+
+	// The new features come after all the earlier ones in the input sequence
+	unsigned long long seq_base = 0;
+	for (long long i = 0; i < indices; i++) {
+		seq_base = std::max(seq_base, (unsigned long long) index[i].seq + 1);
+	}
+
+	long long change_indexlen = 0, change_geomlen = 0;
+	struct index *change_index = NULL;
+	char *change_geom = NULL;
+	if (changes.indexpos > 0) {  // Will be 0 if there are only deletions
+		change_index = (struct index *) map_sequential(changes.indexfd, &change_indexlen, "mmap index of changes");
+		change_geom = map_sequential(changes.geomfd, &change_geomlen, "mmap geom of changes");
+	}
+	long long change_indices = change_indexlen / sizeof(struct index);
+
+	std::set<std::pair<std::string, unsigned long long>> replacing = deletions;
+	std::vector<std::vector<std::string>> change_names = layer_names(changes.state.layermaps);
+	std::vector<struct index> added_index;
+	std::vector<std::string> added;
+
+	for (long long i = 0; i < change_indices; i++) {
+		struct index ix = change_index[i];
+
+		long long len;
+		char *cp = indexed_feature(change_geom, ix, &len);
+		std::string feature(cp, len);
+		serial_feature sf = deserialize_feature(feature, 0, 0, 0, changes.initial_x.data(), changes.initial_y.data());
+
+		if (sf.has_id) {
+			replacing.insert(std::make_pair(change_names[sf.segment][sf.layer], sf.id));
+		}
+		selection.add(sf.bbox, buffer);
+
+		ix.seq += seq_base;
+		ix.segment = 0;
+		if (prevent[P_INPUT_ORDER]) {
+			sf.seq = ix.seq;
+		}
+		sf.layer = new_layers[sf.segment][sf.layer];
+		sf.segment = 0;
+		for (size_t j = 0; j < sf.keys.size(); j++) {
+			sf.keys[j] += pool_base;
+			sf.values[j] += pool_base;
+		}
+
+		added_index.push_back(ix);
+		added.push_back(reserialize_feature(sf, store.initial_x[0], store.initial_y[0]));
+	}
+
+	std::vector<std::vector<std::string>> names = layer_names(store.layermaps);
+
+	FILE *geomfile, *indexfile;
+	int newgeomfd = create_intermediate_file(dir, "geom.new", &geomfile);
+	int newindexfd = create_intermediate_file(dir, "index.new", &indexfile);
+	if (close(newgeomfd) != 0 || close(newindexfd) != 0) {
+		perror("close intermediate");
+		exit(EXIT_CLOSE);
+	}
+
+	std::atomic<long long> geompos(0), indexpos(0);
+	serialize_first_tile(geomfile, 0, 0, 0, &geompos, fname);
+
+	struct drop_state ds[maxzoom + 1];
+	prep_drop_states(ds, maxzoom, basezoom, droprate);
+
+	long long deleted = 0;
+	size_t a = 0;
+	for (long long i = 0; i < indices || a < added.size();) {
+		if (a >= added.size() || (i < indices && !index_before(added_index[a], index[i]))) {
+			struct index ix = index[i++];
+
+			long long len;
+			char *feature = indexed_feature(geom, ix, &len);
+			serial_feature sf;
+			deserialize_feature_header(feature, sf);
+
+			if (sf.has_id && replacing.count(std::make_pair(names[sf.segment][sf.layer], sf.id)) > 0) {
+				std::string s(feature, len);
+				serial_feature full = deserialize_feature(s, 0, 0, 0, store.initial_x.data(), store.initial_y.data());
+				selection.add(full.bbox, buffer);
+
+				layermap_entry &l = store.layermaps[sf.segment].find(names[sf.segment][sf.layer])->second;
+				size_t *count = sf.t == VT_POINT ? &l.points : sf.t == VT_LINE ? &l.lines : &l.polygons;
+				if (*count > 0) {
+					(*count)--;
+				}
+
+				deleted++;
+				continue;
+			}
+
+			// Only to keep the sequence of dropping; the feature keeps the minzoom it had
+			calc_feature_minzoom(&ix, ds, maxzoom, gamma);
+
+			long long start = geompos;
+			fwrite_check(geom + ix.start, sizeof(char), ix.end - ix.start, geomfile, &geompos, fname);
+			ix.start = start;
+			ix.end = geompos;
+			fwrite_check(&ix, sizeof(struct index), 1, indexfile, &indexpos, fname);
+		} else {
+			struct index ix = added_index[a];
+			std::string &feature = added[a];
+			a++;
+
+			// MAGIC: This knows that the feature minzoom is the last byte of the feature.
+			feature.back() = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
+
+			ix.start = geompos;
+			serialize_long_long(geomfile, feature.size(), &geompos, fname);
+			fwrite_check(feature.c_str(), sizeof(char), feature.size(), geomfile, &geompos, fname);
+			ix.end = geompos;
+			fwrite_check(&ix, sizeof(struct index), 1, indexfile, &indexpos, fname);
+		}
+	}
+
+	serialize_ulong_long(geomfile, 0, &geompos, fname);  // EOF
+
+	if (fclose(geomfile) != 0) {
+		perror("fclose intermediate geom");
+		exit(EXIT_CLOSE);
+	}
+	if (fclose(indexfile) != 0) {
+		perror("fclose intermediate index");
+		exit(EXIT_CLOSE);
+	}
+
+	if (index != NULL) {
+		munmap(index, indexlen);
+	}
+	if (geom != NULL) {
+		munmap(geom, geomlen);
+	}
+	if (change_index != NULL) {
+		munmap(change_index, change_indexlen);
+	}
+	if (change_geom != NULL) {
+		munmap(change_geom, change_geomlen);
+	}
+	if (close(indexfd) != 0 || close(geomfd) != 0) {
+		perror("close intermediate");
+		exit(EXIT_CLOSE);
+	}
+
+	replace_intermediate_files(dir, {{"geom.new", "geom"}, {"index.new", "index"}});
+	save_intermediate(dir, store);
+
+	long long features = indexpos / sizeof(struct index);
+	logger.phase("update_intermediate", updating_started, {{"features", features}, {"added", (long long) added.size()}, {"deleted", deleted}, {"geom_written", geompos}, {"index_written", indexpos}});
+
+	if (!quiet) {
+		fprintf(stderr, "%zu features added, %lld replaced or deleted\n", added.size(), deleted);
 	}
 }
 
-std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, json_object *filter, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, long long *file_bbox1, long long *file_bbox2, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, bool guess_cluster_maxzoom, std::map<std::string, int> const *attribute_types, const char *pgm, std::map<std::string, attribute_op> const *attribute_accum, std::map<std::string, std::string> const &attribute_descriptions, std::string const &commandline, int minimum_maxzoom) {
+std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, pmtiles_writer *outpm, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, compiled_filter const *filter, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, long long *file_bbox1, long long *file_bbox2, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, bool guess_cluster_maxzoom, std::map<std::string, int> const *attribute_types, const char *pgm, std::map<std::string, attribute_op> const *attribute_accum, std::map<std::string, std::string> const &attribute_descriptions, std::string const &commandline, int minimum_maxzoom) {
 	int ret = EXIT_SUCCESS;
 
+	if (read_intermediate_dir != NULL) {
+		sorted_input si;
+		load_sorted_input(si, read_intermediate_dir, file_bbox, file_bbox1, file_bbox2, minzoom, buffer, tmpdir);
+		return tile_sorted_input(si, fname, maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, outdir, outpm, filter, droprate, buffer, tmpdir, gamma, forcetable, attribution, file_bbox, file_bbox1, file_bbox2, prefilter, postfilter, description, guess_maxzoom, guess_cluster_maxzoom, pgm, attribute_accum, attribute_descriptions, commandline, minimum_maxzoom, ret);
+	}
+
+	// The changes are read to match the features that they will be merged with
+	intermediate updating;
+	if (update_intermediate_dir != NULL) {
+		load_intermediate(update_intermediate_dir, updating);
+
+		if (!updating.tiled) {
+			fprintf(stderr, "%s: No tileset has been made from the intermediate yet, so there is nothing to update\n", update_intermediate_dir);
+			exit(EXIT_ARGS);
+		}
+		if (updating.tileset != absolute_path(output_tileset)) {
+			fprintf(stderr, "%s: The tileset that can be updated from the intermediate is %s, not %s\n", update_intermediate_dir, updating.tileset.c_str(), output_tileset);
+			exit(EXIT_ARGS);
+		}
+		if (updating.minzoom != minzoom || updating.maxzoom != maxzoom) {
+			fprintf(stderr, "%s: The tileset was made from the intermediate with -Z%d -z%d, so it has to be updated with the same zooms\n", update_intermediate_dir, updating.minzoom, updating.maxzoom);
+			exit(EXIT_ARGS);
+		}
+		// These decide which tiles a change can touch and which zooms the new features get
+		if (updating.buffer != buffer || updating.basezoom != basezoom || updating.droprate != droprate || updating.gamma != gamma ||
+		    updating.full_detail != full_detail || updating.low_detail != low_detail || updating.min_detail != min_detail ||
+		    updating.simplification != simplification || updating.maxzoom_simplification != maxzoom_simplification) {
+			fprintf(stderr, "%s: The tileset was made from the intermediate with -b%d -B%d -r%g -g%g -d%d -D%d -m%d -S%g", update_intermediate_dir, updating.buffer, updating.basezoom, updating.droprate, updating.gamma, updating.full_detail, updating.low_detail, updating.min_detail, updating.simplification);
+			if (updating.maxzoom_simplification >= 0) {
+				fprintf(stderr, " --simplification-at-maximum-zoom=%g", updating.maxzoom_simplification);
+			}
+			fprintf(stderr, ", so it has to be updated with the same options\n");
+			exit(EXIT_ARGS);
+		}
+		use_intermediate_detail(update_intermediate_dir, updating);
+
+		for (size_t i = 0; i < 4; i++) {
+			file_bbox[i] = updating.file_bbox[i];
+			file_bbox1[i] = updating.file_bbox1[i];
+			file_bbox2[i] = updating.file_bbox2[i];
+		}
+	}
+
+	phase_clock reading_started = phase_clock::now();
+
+	int poolfd;
+	if (write_intermediate_dir != NULL) {
+		poolfd = create_intermediate_file(write_intermediate_dir, "pool", NULL);
+	} else {
+		char poolname[strlen(tmpdir) + strlen("/pool.XXXXXXXX") + 1];
+		snprintf(poolname, sizeof(poolname), "%s%s", tmpdir, "/pool.XXXXXXXX");
+
+		poolfd = mkstemp_cloexec(poolname);
+		if (poolfd < 0) {
+			perror(poolname);
+			exit(EXIT_OPEN);
+		}
+		unlink(poolname);
+	}
+
+	// Size of memory divided by 10 from observation of OOM errors (when supposedly
+	// 20% of memory is full) and onset of thrashing (when supposedly 15% of memory
+	// is full) on ECS.
+	struct string_pool pool;
+	pool_init(&pool, poolfd, memsize / 10);
+
 	std::vector<struct reader> readers;
 	readers.resize(CPUS);
 	for (size_t i = 0; i < CPUS; i++) {
 		struct reader *r = &readers[i];
 
-		char poolname[strlen(tmpdir) + strlen("/pool.XXXXXXXX") + 1];
-		char treename[strlen(tmpdir) + strlen("/tree.XXXXXXXX") + 1];
 		char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX") + 1];
 		char indexname[strlen(tmpdir) + strlen("/index.XXXXXXXX") + 1];
 
-		snprintf(poolname, sizeof(poolname), "%s%s", tmpdir, "/pool.XXXXXXXX");
-		snprintf(treename, sizeof(treename), "%s%s", tmpdir, "/tree.XXXXXXXX");
 		snprintf(geomname, sizeof(geomname), "%s%s", tmpdir, "/geom.XXXXXXXX");
 		snprintf(indexname, sizeof(indexname), "%s%s", tmpdir, "/index.XXXXXXXX");
 
-		r->poolfd = mkstemp_cloexec(poolname);
-		if (r->poolfd < 0) {
-			perror(poolname);
-			exit(EXIT_OPEN);
-		}
-		r->treefd = mkstemp_cloexec(treename);
-		if (r->treefd < 0) {
-			perror(treename);
-			exit(EXIT_OPEN);
-		}
 		r->geomfd = mkstemp_cloexec(geomname);
 		if (r->geomfd < 0) {
 			perror(geomname);
@@ -1245,16 +1848,7 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 			exit(EXIT_OPEN);
 		}
 
-		r->poolfile = memfile_open(r->poolfd);
-		if (r->poolfile == NULL) {
-			perror(poolname);
-			exit(EXIT_OPEN);
-		}
-		r->treefile = memfile_open(r->treefd);
-		if (r->treefile == NULL) {
-			perror(treename);
-			exit(EXIT_OPEN);
-		}
+		r->pool = &pool;
 		r->geomfile = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
 		if (r->geomfile == NULL) {
 			perror(geomname);
@@ -1268,17 +1862,9 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 		r->geompos = 0;
 		r->indexpos = 0;
 
-		unlink(poolname);
-		unlink(treename);
 		unlink(geomname);
 		unlink(indexname);
 
-		// To distinguish a null value
-		{
-			struct stringpool p;
-			memfile_write(r->treefile, &p, sizeof(struct stringpool));
-		}
-
 		r->file_bbox[0] = r->file_bbox[1] = UINT_MAX;
 		r->file_bbox[2] = r->file_bbox[3] = 0;
 	}
@@ -1601,6 +2187,12 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 
 			parse_geocsv(sst, sources[source].file, layer, sources[layer].layer);
 
+			for (size_t i = 0; i < CPUS; i++) {
+				dist_sum += dist_sums[i];
+				dist_count += dist_counts[i];
+				area_sum += area_sums[i];
+			}
+
 			if (close(fd) != 0) {
 				perror("close");
 				exit(EXIT_CLOSE);
@@ -1850,7 +2442,7 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 			perror("fclose index");
 			exit(EXIT_CLOSE);
 		}
-		memfile_close(readers[i].treefile);
+		pool_finish_cursor(&pool, &readers[i].pool_cursor);
 
 		if (fstat(readers[i].geomfd, &readers[i].geomst) != 0) {
 			perror("stat geom\n");
@@ -1858,9 +2450,15 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 		}
 	}
 
-	// Create a combined string pool
-	// but keep track of the offsets into it since we still need
-	// segment+offset to find the data.
+	long long read_geom_bytes = 0, read_index_bytes = 0;
+	for (size_t i = 0; i < CPUS; i++) {
+		read_geom_bytes += readers[i].geomst.st_size;
+		read_index_bytes += readers[i].indexpos;
+	}
+	logger.phase("read", reading_started, {{"features", progress_seq}, {"geom_written", read_geom_bytes}, {"index_written", read_index_bytes}});
+
+	// All the input threads shared one string pool, so the offsets
+	// from every segment are into the same place.
 
 	// 2 * CPUS: One per input thread, one per tiling thread
 	long long pool_off[2 * CPUS];
@@ -1868,75 +2466,9 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 		pool_off[i] = 0;
 	}
 
-	char poolname[strlen(tmpdir) + strlen("/pool.XXXXXXXX") + 1];
-	snprintf(poolname, sizeof(poolname), "%s%s", tmpdir, "/pool.XXXXXXXX");
-
-	int poolfd = mkstemp_cloexec(poolname);
-	if (poolfd < 0) {
-		perror(poolname);
-		exit(EXIT_OPEN);
-	}
-
-	FILE *poolfile = fopen_oflag(poolname, "wb", O_WRONLY | O_CLOEXEC);
-	if (poolfile == NULL) {
-		perror(poolname);
-		exit(EXIT_OPEN);
-	}
-
-	unlink(poolname);
-
-	std::atomic<long long> poolpos(0);
-
-	for (size_t i = 0; i < CPUS; i++) {
-		// If the memfile is not done yet, it is in memory, so just copy the memory.
-		// Otherwise, we need to merge memory and file.
-
-		if (readers[i].poolfile->fp == NULL) {
-			// still in memory
-
-			if (readers[i].poolfile->map.size() > 0) {
-				if (fwrite(readers[i].poolfile->map.c_str(), readers[i].poolfile->map.size(), 1, poolfile) != 1) {
-					perror("Reunify string pool");
-					exit(EXIT_WRITE);
-				}
-			}
-
-			pool_off[i] = poolpos;
-			poolpos += readers[i].poolfile->map.size();
-		} else {
-			// split into memory and file
-
-			if (fflush(readers[i].poolfile->fp) != 0) {
-				perror("fflush poolfile");
-				exit(EXIT_WRITE);
-			}
-
-			char *s = (char *) mmap(NULL, readers[i].poolfile->off, PROT_READ, MAP_PRIVATE, readers[i].poolfile->fd, 0);
-			if (s == MAP_FAILED) {
-				perror("mmap string pool for copy");
-				exit(EXIT_MEMORY);
-			}
-			madvise(s, readers[i].poolfile->off, MADV_SEQUENTIAL);
-			if (fwrite(s, sizeof(char), readers[i].poolfile->off, poolfile) != readers[i].poolfile->off) {
-				perror("Reunify string pool (split)");
-				exit(EXIT_WRITE);
-			}
-			if (munmap(s, readers[i].poolfile->off) != 0) {
-				perror("unmap string pool for copy");
-				exit(EXIT_MEMORY);
-			}
-
-			pool_off[i] = poolpos;
-			poolpos += readers[i].poolfile->off;
-		}
-
-		memfile_close(readers[i].poolfile);
-	}
-
-	if (fclose(poolfile) != 0) {
-		perror("fclose pool");
-		exit(EXIT_CLOSE);
-	}
+	phase_clock pooling_started = phase_clock::now();
+	long long poolpos = pool_finish(&pool);
+	logger.phase("pool", pooling_started, {{"pool_written", poolpos}});
 
 	char *stringpool = NULL;
 	if (poolpos > 0) {  // Will be 0 if -X was specified
@@ -1948,36 +2480,44 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 		madvise(stringpool, poolpos, MADV_RANDOM);
 	}
 
-	char indexname[strlen(tmpdir) + strlen("/index.XXXXXXXX") + 1];
-	snprintf(indexname, sizeof(indexname), "%s%s", tmpdir, "/index.XXXXXXXX");
+	int indexfd, geomfd;
+	FILE *indexfile, *geomfile;
 
-	int indexfd = mkstemp_cloexec(indexname);
-	if (indexfd < 0) {
-		perror(indexname);
-		exit(EXIT_OPEN);
-	}
-	FILE *indexfile = fopen_oflag(indexname, "wb", O_WRONLY | O_CLOEXEC);
-	if (indexfile == NULL) {
-		perror(indexname);
-		exit(EXIT_OPEN);
-	}
+	if (write_intermediate_dir != NULL) {
+		indexfd = create_intermediate_file(write_intermediate_dir, "index", &indexfile);
+		geomfd = create_intermediate_file(write_intermediate_dir, "geom", &geomfile);
+	} else {
+		char indexname[strlen(tmpdir) + strlen("/index.XXXXXXXX") + 1];
+		snprintf(indexname, sizeof(indexname), "%s%s", tmpdir, "/index.XXXXXXXX");
+
+		indexfd = mkstemp_cloexec(indexname);
+		if (indexfd < 0) {
+			perror(indexname);
+			exit(EXIT_OPEN);
+		}
+		indexfile = fopen_oflag(indexname, "wb", O_WRONLY | O_CLOEXEC);
+		if (indexfile == NULL) {
+			perror(indexname);
+			exit(EXIT_OPEN);
+		}
 
-	unlink(indexname);
+		unlink(indexname);
 
-	char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX") + 1];
-	snprintf(geomname, sizeof(geomname), "%s%s", tmpdir, "/geom.XXXXXXXX");
+		char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX") + 1];
+		snprintf(geomname, sizeof(geomname), "%s%s", tmpdir, "/geom.XXXXXXXX");
 
-	int geomfd = mkstemp_cloexec(geomname);
-	if (geomfd < 0) {
-		perror(geomname);
-		exit(EXIT_CLOSE);
-	}
-	FILE *geomfile = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
-	if (geomfile == NULL) {
-		perror(geomname);
-		exit(EXIT_OPEN);
+		geomfd = mkstemp_cloexec(geomname);
+		if (geomfd < 0) {
+			perror(geomname);
+			exit(EXIT_CLOSE);
+		}
+		geomfile = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
+		if (geomfile == NULL) {
+			perror(geomname);
+			exit(EXIT_OPEN);
+		}
+		unlink(geomname);
 	}
-	unlink(geomname);
 
 	unsigned iz = 0, ix = 0, iy = 0;
 	choose_first_zoom(file_bbox, file_bbox1, file_bbox2, readers, &iz, &ix, &iy, minzoom, buffer);
@@ -1989,11 +2529,16 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 	}
 
 	std::atomic<long long> geompos(0);
+	phase_clock sorting_started = phase_clock::now();
 
 	/* initial tile is normally 0/0/0 but can be iz/ix/iy if limited to one tile */
-	serialize_int(geomfile, iz, &geompos, fname);
-	serialize_uint(geomfile, ix, &geompos, fname);
-	serialize_uint(geomfile, iy, &geompos, fname);
+	if (write_intermediate_dir != NULL) {
+		serialize_first_tile(geomfile, iz, ix, iy, &geompos, fname);
+	} else {
+		serialize_int(geomfile, iz, &geompos, fname);
+		serialize_uint(geomfile, ix, &geompos, fname);
+		serialize_uint(geomfile, iy, &geompos, fname);
+	}
 
 	radix(readers, CPUS, geomfile, indexfile, tmpdir, &geompos, maxzoom, basezoom, droprate, gamma);
 
@@ -2017,14 +2562,122 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 	std::atomic<long long> indexpos(indexst.st_size);
 	progress_seq = indexpos / sizeof(struct index);
 
+	logger.phase("sort", sorting_started, {{"features", progress_seq}, {"geom_read", read_geom_bytes}, {"index_read", read_index_bytes}, {"geom_written", geompos}, {"index_written", indexpos}});
+
 	last_progress = 0;
 	if (!quiet) {
 		long long s = progress_seq;
 		long long geompos_print = geompos;
-		long long poolpos_print = poolpos;
+		long long poolpos_print = pool.bytes;
 		fprintf(stderr, "%lld features, %lld bytes of geometry, %lld bytes of string pool\n", s, geompos_print, poolpos_print);
 	}
 
+	sorted_input si;
+	si.poolfd = poolfd;
+	si.poolpos = poolpos;
+	si.stringpool = stringpool;
+	si.geomfd = geomfd;
+	si.indexfd = indexfd;
+	si.indexpos = indexpos;
+	si.iz = iz;
+	si.pool_off.assign(pool_off, pool_off + 2 * CPUS);
+	si.initial_x.assign(initial_x, initial_x + 2 * CPUS);
+	si.initial_y.assign(initial_y, initial_y + 2 * CPUS);
+
+	si.state.geometry_scale = geometry_scale;
+	for (size_t i = 0; i < 4; i++) {
+		si.state.file_bbox[i] = file_bbox[i];
+		si.state.file_bbox1[i] = file_bbox1[i];
+		si.state.file_bbox2[i] = file_bbox2[i];
+	}
+	si.state.dist_sum = dist_sum;
+	si.state.dist_count = dist_count;
+	si.state.area_sum = area_sum;
+	si.state.initial_x.assign(initial_x, initial_x + CPUS);
+	si.state.initial_y.assign(initial_y, initial_y + CPUS);
+	si.state.layermaps.swap(layermaps);
+
+	if (write_intermediate_dir != NULL) {
+		save_intermediate(write_intermediate_dir, si.state);
+		si.intermediate_dir = write_intermediate_dir;
+	}
+
+	if (update_intermediate_dir != NULL) {
+		std::set<std::pair<std::string, unsigned long long>> deletions;
+		for (size_t i = 0; i < CPUS; i++) {
+			deletions.insert(readers[i].deletions.begin(), readers[i].deletions.end());
+		}
+
+		for (size_t i = 0; i < 4; i++) {
+			updating.file_bbox[i] = file_bbox[i];
+			updating.file_bbox1[i] = file_bbox1[i];
+			updating.file_bbox2[i] = file_bbox2[i];
+		}
+
+		tile_selection selection(maxzoom);
+		update_sorted_input(si, deletions, update_intermediate_dir, updating, selection, maxzoom, basezoom, droprate, gamma, buffer, fname);
+
+		if (poolpos > 0) {
+			munmap(stringpool, poolpos);
+		}
+		if (close(poolfd) != 0 || close(indexfd) != 0 || close(geomfd) != 0) {
+			perror("close changes");
+			exit(EXIT_CLOSE);
+		}
+
+		// The features keep the minzooms that the update gave them
+		sorted_input updated;
+		load_sorted_input(updated, update_intermediate_dir, file_bbox, file_bbox1, file_bbox2, minzoom, buffer, NULL);
+		updated.from_intermediate = false;
+		updated.intermediate_dir = update_intermediate_dir;
+
+		update_tiles = &selection;
+		auto result = tile_sorted_input(updated, fname, maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, outdir, outpm, filter, droprate, buffer, tmpdir, gamma, forcetable, attribution, file_bbox, file_bbox1, file_bbox2, prefilter, postfilter, description, guess_maxzoom, guess_cluster_maxzoom, pgm, attribute_accum, attribute_descriptions, commandline, minimum_maxzoom, ret);
+		update_tiles = NULL;
+		return result;
+	}
+
+	return tile_sorted_input(si, fname, maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, outdir, outpm, filter, droprate, buffer, tmpdir, gamma, forcetable, attribution, file_bbox, file_bbox1, file_bbox2, prefilter, postfilter, description, guess_maxzoom, guess_cluster_maxzoom, pgm, attribute_accum, attribute_descriptions, commandline, minimum_maxzoom, ret);
+}
+
+// For --update-intermediate, before the selected tiles are made again
+static void erase_selected_tiles(sqlite3 *outdb, const char *outdir, tile_selection const &selection) {
+	int maxzoom = selection.tiles.size() - 1;
+
+	if (outdb != NULL) {
+		for (int z = 0; z <= maxzoom; z++) {
+			for (auto xy : selection.tiles[z]) {
+				mbtiles_erase_tile(outdb, z, xy >> 32, xy & 0xFFFFFFFF);
+			}
+			for (auto const &a : selection.areas[z]) {
+				mbtiles_erase_area(outdb, z, a.minx, a.miny, a.maxx, a.maxy);
+			}
+		}
+	} else if (outdir != NULL) {
+		for (auto const &tile : enumerate_dirtiles(outdir, 0, maxzoom)) {
+			if (selection.contains(tile.z, tile.x, tile.y)) {
+				dir_erase_tile(outdir, tile.z, tile.x, tile.y);
+			}
+		}
+	}
+}
+
+static std::pair<int, metadata> tile_sorted_input(sorted_input &si, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, pmtiles_writer *outpm, compiled_filter const *filter, double droprate, int buffer, const char *tmpdir, double gamma, int forcetable, const char *attribution, long long *file_bbox, long long *file_bbox1, long long *file_bbox2, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, bool guess_cluster_maxzoom, const char *pgm, std::map<std::string, attribute_op> const *attribute_accum, std::map<std::string, std::string> const &attribute_descriptions, std::string const &commandline, int minimum_maxzoom, int ret) {
+	int poolfd = si.poolfd;
+	long long poolpos = si.poolpos;
+	char *stringpool = si.stringpool;
+	int geomfd = si.geomfd;
+	int indexfd = si.indexfd;
+	long long indexpos = si.indexpos;
+	unsigned iz = si.iz;
+	long long *pool_off = si.pool_off.data();
+	unsigned *initial_x = si.initial_x.data();
+	unsigned *initial_y = si.initial_y.data();
+	double dist_sum = si.state.dist_sum;
+	size_t dist_count = si.state.dist_count;
+	double area_sum = si.state.area_sum;
+	std::vector<std::map<std::string, layermap_entry> > &layermaps = si.state.layermaps;
+
 	if (indexpos == 0) {
 		fprintf(stderr, "Did not read any valid geometries\n");
 		if (outdb != NULL) {
@@ -2043,6 +2696,34 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 	long long indices = indexpos / sizeof(struct index);
 	bool fix_dropping = false;
 
+	if (si.from_intermediate) {
+		// Assign the minzooms again the way that the sort would have,
+		// before any guessing below, for this run's zooms and drop rate
+		phase_clock assigning_started = phase_clock::now();
+
+		struct stat geomst;
+		if (fstat(geomfd, &geomst) != 0) {
+			perror("stat intermediate geom\n");
+			exit(EXIT_STAT);
+		}
+		char *geom = (char *) mmap(NULL, geomst.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, geomfd, 0);
+		if (geom == MAP_FAILED) {
+			perror("mmap intermediate geom");
+			exit(EXIT_MEMORY);
+		}
+
+		struct drop_state ds[maxzoom + 1];
+		prep_drop_states(ds, maxzoom, basezoom, droprate);
+
+		for (long long ip = 0; ip < indices; ip++) {
+			geom[map[ip].end - 1] = calc_feature_minzoom(&map[ip], ds, maxzoom, gamma);
+		}
+
+		munmap(geom, geomst.st_size);
+
+		logger.phase("feature_minzoom", assigning_started, {{"features", indices}, {"geom_read", geomst.st_size}});
+	}
+
 	if (guess_maxzoom) {
 		double mean = 0;
 		size_t count = 0;
@@ -2436,6 +3117,7 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 	if (fix_dropping || drop_denser > 0) {
 		// Fix up the minzooms for features, now that we really know the base zoom
 		// and drop rate.
+		phase_clock fixup_started = phase_clock::now();
 
 		struct stat geomst;
 		if (fstat(geomfd, &geomst) != 0) {
@@ -2500,6 +3182,8 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 		}
 
 		munmap(geom, geomst.st_size);
+
+		logger.phase("feature_minzoom", fixup_started, {{"features", indices}, {"geom_read", geomst.st_size}});
 	}
 
 	madvise(map, indexpos, MADV_DONTNEED);
@@ -2528,10 +3212,35 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 		size[j] = 0;
 	}
 
+	if (update_tiles != NULL) {
+		// The tiles near the changes might not have anything in them any more
+		erase_selected_tiles(outdb, outdir, *update_tiles);
+	}
+	size_t read_segments = layermaps.size();
+
 	std::atomic<unsigned> midx(0);
 	std::atomic<unsigned> midy(0);
 	std::vector<strategy> strategies;
-	int written = traverse_zooms(fd, size, stringpool, &midx, &midy, maxzoom, minzoom, outdb, outdir, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, pool_off, initial_x, initial_y, simplification, maxzoom_simplification, layermaps, prefilter, postfilter, attribute_accum, filter, strategies, iz);
+	int written = traverse_zooms(fd, size, stringpool, &midx, &midy, maxzoom, minzoom, outdb, outdir, outpm, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, pool_off, initial_x, initial_y, simplification, maxzoom_simplification, layermaps, prefilter, postfilter, attribute_accum, filter, strategies, iz);
+
+	if (update_tiles != NULL) {
+		if (maxzoom != written) {
+			fprintf(stderr, "%s: Could not make the tiles near the changes through zoom %d. Make the tileset again with --read-intermediate.\n", *av, maxzoom);
+			exit(EXIT_INCOMPLETE);
+		}
+
+		// The tiles that weren't made again are still the ones from the last full tiling
+		midx = si.state.midx;
+		midy = si.state.midy;
+		strategies = si.state.strategies;
+		layermaps.push_back(si.state.tiled_layermap);
+
+		if (outdb != NULL) {
+			for (int z = minzoom; z <= maxzoom; z++) {
+				mbtiles_erase_unused_images(outdb, z);
+			}
+		}
+	}
 
 	if (maxzoom != written) {
 		if (written > minzoom) {
@@ -2590,6 +3299,34 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 		tile2lonlat(file_bbox1[2], file_bbox1[3], 32, &maxlon2, &minlat2);
 	}
 
+	if (si.intermediate_dir != NULL) {
+		// Remember what --update-intermediate will need to keep
+		// from this tiling for the tiles that it doesn't make again
+		intermediate tiled = si.state;
+		tiled.layermaps.resize(read_segments);
+		tiled.tiled = true;
+		tiled.tileset = absolute_path(output_tileset);
+		tiled.minzoom = minzoom;
+		tiled.maxzoom = maxzoom;
+		tiled.buffer = buffer;
+		tiled.basezoom = basezoom;
+		tiled.droprate = droprate;
+		tiled.gamma = gamma;
+		tiled.full_detail = full_detail;
+		tiled.low_detail = low_detail;
+		tiled.min_detail = min_detail;
+		tiled.simplification = simplification;
+		tiled.maxzoom_simplification = maxzoom_simplification;
+		tiled.midx = midx;
+		tiled.midy = midy;
+		tiled.strategies = strategies;
+		tiled.tiled_layermap = merge_layermaps(std::vector<std::map<std::string, layermap_entry>>(layermaps.begin() + read_segments, layermaps.end()));
+		for (auto &l : tiled.tiled_layermap) {
+			l.second.retain = 1;
+		}
+		save_intermediate(si.intermediate_dir, tiled);
+	}
+
 	std::map<std::string, layermap_entry> merged_lm = merge_layermaps(layermaps);
 
 	for (auto ai = merged_lm.begin(); ai != merged_lm.end(); ++ai) {
@@ -2598,9 +3335,22 @@ std::pair<int, metadata> read_input(std::vector<source> &sources, char *fname, i
 	}
 
 	metadata m = make_metadata(fname, minzoom, maxzoom, minlat, minlon, maxlat, maxlon, minlat2, minlon2, maxlat2, maxlon2, midlat, midlon, attribution, merged_lm, true, description, !prevent[P_TILE_STATS], attribute_descriptions, "tippecanoe", commandline, strategies);
+	if (update_tiles != NULL) {
+		// Written again from the start, instead of left in place as with --allow-existing
+		if (outdb != NULL) {
+			mbtiles_erase_metadata(outdb);
+		} else if (outdir != NULL) {
+			std::string metadata = std::string(outdir) + "/metadata.json";
+			if (unlink(metadata.c_str()) != 0) {
+				perror(metadata.c_str());
+				exit(EXIT_UNLINK);
+			}
+		}
+	}
+
 	if (outdb != NULL) {
 		mbtiles_write_metadata(outdb, m, forcetable);
-	} else {
+	} else if (outdir != NULL) {
 		dir_write_metadata(outdir, m);
 	}
 
@@ -2814,6 +3564,8 @@ void parse_json_source(const char *arg, struct source &src) {
 }
 
 int main(int argc, char **argv) {
+	phase_clock started = phase_clock::now();
+
 #ifdef MTRACE
 	mtrace();
 #endif
@@ -2831,6 +3583,7 @@ int main(int argc, char **argv) {
 	char *out_mbtiles = NULL;
 	char *out_dir = NULL;
 	sqlite3 *outdb = NULL;
+	pmtiles_writer *outpm = NULL;
 	int maxzoom = 14;
 	int minzoom = 0;
 	int basezoom = -1;
@@ -2856,7 +3609,7 @@ int main(int argc, char **argv) {
 	int exclude_all = 0;
 	int read_parallel = 0;
 	int files_open_at_start;
-	json_object *filter = NULL;
+	compiled_filter *filter = NULL;
 
 	memsize = calc_memsize();
 
@@ -2939,6 +3692,7 @@ int main(int argc, char **argv) {
 		{"coalesce-smallest-as-needed", no_argument, &additional[A_COALESCE_SMALLEST_AS_NEEDED], 1},
 		{"force-feature-limit", no_argument, &prevent[P_DYNAMIC_DROP], 1},
 		{"cluster-densest-as-needed", no_argument, &additional[A_CLUSTER_DENSEST_AS_NEEDED], 1},
+		{"retry-changed-tiles-only", no_argument, &additional[A_RETRY_CHANGED_TILES], 1},
 
 		{"Dropping tightly overlapping features", 0, 0, 0},
 		{"gamma", required_argument, 0, 'g'},
@@ -2988,6 +3742,8 @@ int main(int argc, char **argv) {
 		{"Filtering tile contents", 0, 0, 0},
 		{"prefilter", required_argument, 0, 'C'},
 		{"postfilter", required_argument, 0, 'c'},
+		{"persistent-filters", no_argument, &additional[A_PERSISTENT_FILTERS], 1},
+		{"binary-filters", no_argument, &additional[A_BINARY_FILTERS], 1},
 
 		{"Setting or disabling tile size limits", 0, 0, 0},
 		{"maximum-tile-bytes", required_argument, 0, 'M'},
@@ -3004,6 +3760,10 @@ int main(int argc, char **argv) {
 
 		{"Temporary storage", 0, 0, 0},
 		{"temporary-directory", required_argument, 0, 't'},
+		{"temporary-compression", required_argument, 0, '~'},
+		{"write-intermediate", required_argument, 0, '~'},
+		{"read-intermediate", required_argument, 0, '~'},
+		{"update-intermediate", required_argument, 0, '~'},
 
 		{"Progress indicator", 0, 0, 0},
 		{"quiet", no_argument, 0, 'q'},
@@ -3138,6 +3898,17 @@ int main(int argc, char **argv) {
 				}
 			} else if (strcmp(opt, "preserve-point-density-threshold") == 0) {
 				preserve_point_density_threshold = atoll_require(optarg, "Preserve point density threshold");
+			} else if (strcmp(opt, "temporary-compression") == 0) {
+				if (!set_temp_codec(optarg)) {
+					fprintf(stderr, "%s: Unknown --temporary-compression %s; this build supports %s\n", argv[0], optarg, temp_codec_names().c_str());
+					exit(EXIT_ARGS);
+				}
+			} else if (strcmp(opt, "write-intermediate") == 0) {
+				write_intermediate_dir = optarg;
+			} else if (strcmp(opt, "read-intermediate") == 0) {
+				read_intermediate_dir = optarg;
+			} else if (strcmp(opt, "update-intermediate") == 0) {
+				update_intermediate_dir = optarg;
 			} else {
 				fprintf(stderr, "%s: Unrecognized option --%s\n", argv[0], opt);
 				exit(EXIT_ARGS);
@@ -3317,11 +4088,11 @@ int main(int argc, char **argv) {
 		} break;
 
 		case 'J':
-			filter = read_filter(optarg);
+			filter = compile_filter(read_filter(optarg));
 			break;
 
 		case 'j':
-			filter = parse_filter(optarg);
+			filter = compile_filter(parse_filter(optarg));
 			break;
 
 		case 'r':
@@ -3614,6 +4385,46 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "%s: Options -o and -e cannot be used together\n", argv[0]);
 		exit(EXIT_ARGS);
 	}
+	output_tileset = out_mbtiles != NULL ? out_mbtiles : out_dir;
+
+	if (update_intermediate_dir != NULL) {
+		if (read_intermediate_dir != NULL || write_intermediate_dir != NULL) {
+			fprintf(stderr, "%s: --update-intermediate can't be used with --read-intermediate or --write-intermediate\n", argv[0]);
+			exit(EXIT_ARGS);
+		}
+
+		// The tiles that aren't made again have to come out the same as before,
+		// so nothing about the tiling can depend on all the features together
+		if (guess_maxzoom || basezoom < 0 || droprate < 0 || drop_denser > 0 || additional[A_GENERATE_IDS] || additional[A_EXTEND_ZOOMS]) {
+			fprintf(stderr, "%s: --update-intermediate can't be used with -zg, -Bg, -rg, --drop-denser, --generate-ids, or --extend-zooms-if-still-dropping\n", argv[0]);
+			exit(EXIT_ARGS);
+		}
+		if (additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED] ||
+		    additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_COALESCE_FRACTION_AS_NEEDED] ||
+		    additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED] ||
+		    additional[A_INCREASE_GAMMA_AS_NEEDED]) {
+			fprintf(stderr, "%s: --update-intermediate can't be used with the options that drop or coalesce features as needed\n", argv[0]);
+			exit(EXIT_ARGS);
+		}
+
+		// The tileset is changed in place
+		if (force) {
+			fprintf(stderr, "%s: --update-intermediate can't be used with --force, which would delete the tileset\n", argv[0]);
+			exit(EXIT_ARGS);
+		}
+		if (out_mbtiles != NULL && pmtiles_has_suffix(out_mbtiles)) {
+			fprintf(stderr, "%s: --update-intermediate can't update PMTiles in place\n", argv[0]);
+			exit(EXIT_ARGS);
+		}
+
+		struct stat st;
+		std::string existing = out_mbtiles != NULL ? std::string(out_mbtiles) : std::string(out_dir) + "/metadata.json";
+		if (stat(existing.c_str(), &st) != 0) {
+			fprintf(stderr, "%s: --update-intermediate needs the tileset from the earlier run: %s: %s\n", argv[0], existing.c_str(), strerror(errno));
+			exit(EXIT_ARGS);
+		}
+		forcetable = 1;
+	}
 
 	if (out_mbtiles != NULL) {
 		if (force) {
@@ -3624,14 +4435,29 @@ int main(int argc, char **argv) {
 			}
 		}
 
-		outdb = mbtiles_open(out_mbtiles, argv, forcetable);
+		if (pmtiles_has_suffix(out_mbtiles)) {
+			outpm = pmtiles_open(out_mbtiles, argv);
+		} else {
+			outdb = mbtiles_open(out_mbtiles, argv, forcetable, update_intermediate_dir != NULL);
+		}
 	}
 	if (out_dir != NULL) {
-		check_dir(out_dir, argv, force, forcetable);
+		check_dir(out_dir, argv, force, forcetable, update_intermediate_dir != NULL);
 	}
 
 	int ret = EXIT_SUCCESS;
 
+	if (read_intermediate_dir != NULL) {
+		if (write_intermediate_dir != NULL) {
+			fprintf(stderr, "%s: --read-intermediate and --write-intermediate can't be used together\n", argv[0]);
+			exit(EXIT_ARGS);
+		}
+		if (optind < argc) {
+			fprintf(stderr, "%s: --read-intermediate can't be used with input files\n", argv[0]);
+			exit(EXIT_ARGS);
+		}
+	}
+
 	for (i = optind; i < argc; i++) {
 		struct source src;
 		src.layer = "";
@@ -3659,18 +4485,30 @@ int main(int argc, char **argv) {
 
 	auto input_ret = read_input(sources, name ? name : out_mbtiles ? out_mbtiles
 								       : out_dir,
-				    maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, out_dir, &exclude, &include, exclude_all, filter, droprate, buffer, tmpdir, gamma, read_parallel, forcetable, attribution, gamma != 0, file_bbox, file_bbox1, file_bbox2, prefilter, postfilter, description, guess_maxzoom, guess_cluster_maxzoom, &attribute_types, argv[0], &attribute_accum, attribute_descriptions, commandline, minimum_maxzoom);
+				    maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, out_dir, outpm, &exclude, &include, exclude_all, filter, droprate, buffer, tmpdir, gamma, read_parallel, forcetable, attribution, gamma != 0, file_bbox, file_bbox1, file_bbox2, prefilter, postfilter, description, guess_maxzoom, guess_cluster_maxzoom, &attribute_types, argv[0], &attribute_accum, attribute_descriptions, commandline, minimum_maxzoom);
 
 	ret = std::get<0>(input_ret);
 
+	phase_clock finishing_started = phase_clock::now();
+
 	if (outdb != NULL) {
 		mbtiles_close(outdb, argv[0]);
+		logger.phase("mbtiles_finalize", finishing_started, {});
 	}
 
-	if (pmtiles_has_suffix(out_mbtiles)) {
-		mbtiles_map_image_to_pmtiles(out_mbtiles, std::get<1>(input_ret), prevent[P_TILE_COMPRESSION] == 0, quiet, quiet_progress);
+	if (outpm != NULL) {
+		pmtiles_close(outpm, std::get<1>(input_ret), prevent[P_TILE_COMPRESSION] == 0, quiet, quiet_progress);
+
+		struct stat st;
+		if (stat(out_mbtiles, &st) == 0) {
+			logger.phase("pmtiles_finalize", finishing_started, {{"pmtiles_written", st.st_size}});
+		} else {
+			logger.phase("pmtiles_finalize", finishing_started, {});
+		}
 	}
 
+	logger.phase("total", started, {});
+
 #ifdef MTRACE
 	muntrace();
 #endif
@@ -3683,7 +4521,7 @@ int main(int argc, char **argv) {
 	}
 
 	if (filter != NULL) {
-		json_free(filter);
+		delete filter;
 	}
 
 	return ret;
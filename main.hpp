@@ -24,6 +24,14 @@ struct index {
 	}
 };
 
+// Index order: by position along the curve, then by input sequence
+inline bool index_before(struct index const &i1, struct index const &i2) {
+	if (i1.ix != i2.ix) {
+		return i1.ix < i2.ix;
+	}
+	return i1.seq < i2.seq;
+}
+
 struct clipbbox {
 	double lon1;
 	double lat1;
@@ -61,6 +69,9 @@ extern int tiny_polygon_size;
 extern size_t limit_tile_feature_count;
 extern size_t limit_tile_feature_count_at_maxzoom;
 extern std::map<std::string, serial_val> set_attributes;
+extern const char *write_intermediate_dir;
+extern const char *update_intermediate_dir;
+extern struct tile_selection *update_tiles;  // NULL unless only some tiles are being made again
 
 struct order_field {
 	std::string name;
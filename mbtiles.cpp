@@ -7,10 +7,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sqlite3.h>
+#include <pthread.h>
 #include <vector>
+#include <deque>
 #include <string>
 #include <set>
 #include <map>
+#include <functional>
 #include <sys/stat.h>
 #include "mvt.hpp"
 #include "mbtiles.hpp"
@@ -24,7 +27,278 @@ size_t max_tilestats_attributes = 1000;
 size_t max_tilestats_sample_values = 1000;
 size_t max_tilestats_values = 100;
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
+// Tiles are written to the output database by a writer thread, which keeps
+// its statements prepared and commits in batches, so that tiling threads only
+// have to queue each tile rather than wait for SQLite.
+//
+// The writer thread is the only one that uses the database connection while
+// it is running: everything else that touches the database (erasing zooms and
+// images, metadata) is queued to it as a function with mbtiles_run(), so it
+// runs in order with the tiles and never interleaves with a batch.
+
+// Bytes of tile data that may be waiting for the writer before queueing blocks
+#define MBTILES_QUEUE_BYTES (64 * 1024 * 1024)
+// Tiles written per transaction
+#define MBTILES_BATCH 10000
+
+struct mbtiles_op {
+	bool erase;
+	int z;
+	int tx;
+	int ty;
+	unsigned long long hash;
+	std::string data;
+	std::function<void()> run;  // if set, run this instead of writing a tile
+	bool *ran = NULL;	    // set once run has finished
+};
+
+struct mbtiles_writer {
+	sqlite3 *outdb;
+	pthread_t thread;
+
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t wake = PTHREAD_COND_INITIALIZER;	 // something queued, or flush or stop requested
+	pthread_cond_t done = PTHREAD_COND_INITIALIZER;	 // room in the queue, or flush finished
+	std::deque<mbtiles_op> queue;
+	size_t queued_bytes = 0;
+	bool stop = false;
+
+	// used only by the writer thread
+	sqlite3_stmt *images = NULL;
+	sqlite3_stmt *map = NULL;
+	sqlite3_stmt *erase = NULL;
+	size_t uncommitted = 0;
+};
+
+static pthread_mutex_t writers_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<sqlite3 *, mbtiles_writer *> writers;
+
+static sqlite3_stmt *mbtiles_prepare(sqlite3 *outdb, const char *query) {
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 prep failed: %s: %s\n", query, sqlite3_errmsg(outdb));
+		exit(EXIT_SQLITE);
+	}
+	return stmt;
+}
+
+static void mbtiles_step(sqlite3 *outdb, sqlite3_stmt *stmt, const char *what) {
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "sqlite3 %s failed: %s\n", what, sqlite3_errmsg(outdb));
+		exit(EXIT_SQLITE);
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+static void mbtiles_exec(sqlite3 *outdb, const char *query) {
+	char *err = NULL;
+	if (sqlite3_exec(outdb, query, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 %s failed: %s\n", query, err);
+		exit(EXIT_SQLITE);
+	}
+}
+
+static void mbtiles_apply(mbtiles_writer *w, mbtiles_op const &op) {
+	if (op.run) {
+		// Outside any batch, as if it had been called directly
+		if (w->uncommitted > 0) {
+			mbtiles_exec(w->outdb, "COMMIT");
+			w->uncommitted = 0;
+		}
+
+		op.run();
+
+		if (pthread_mutex_lock(&w->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_PTHREAD);
+		}
+		*op.ran = true;
+		pthread_cond_broadcast(&w->done);
+		if (pthread_mutex_unlock(&w->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_PTHREAD);
+		}
+		return;
+	}
+
+	if (w->uncommitted == 0) {
+		mbtiles_exec(w->outdb, "BEGIN");
+	}
+
+	if (op.erase) {
+		sqlite3_bind_int(w->erase, 1, op.z);
+		sqlite3_bind_int(w->erase, 2, op.tx);
+		sqlite3_bind_int(w->erase, 3, (1 << op.z) - 1 - op.ty);
+		mbtiles_step(w->outdb, w->erase, "delete tile");
+	} else {
+		// The hash is stored as decimal text, as it always has been, so that
+		// tiles written with --allow-existing share images with older ones
+		std::string hash = std::to_string(op.hash);
+
+		// following https://github.com/mapbox/node-mbtiles/blob/master/lib/mbtiles.js
+		sqlite3_bind_int(w->images, 1, op.z);
+		sqlite3_bind_text(w->images, 2, hash.c_str(), hash.size(), SQLITE_STATIC);
+		sqlite3_bind_blob(w->images, 3, op.data.data(), op.data.size(), SQLITE_STATIC);
+		mbtiles_step(w->outdb, w->images, "images insert");
+
+		sqlite3_bind_int(w->map, 1, op.z);
+		sqlite3_bind_int(w->map, 2, op.tx);
+		sqlite3_bind_int(w->map, 3, (1 << op.z) - 1 - op.ty);
+		sqlite3_bind_text(w->map, 4, hash.c_str(), hash.size(), SQLITE_STATIC);
+		mbtiles_step(w->outdb, w->map, "map insert");
+	}
+
+	w->uncommitted++;
+	if (w->uncommitted >= MBTILES_BATCH) {
+		mbtiles_exec(w->outdb, "COMMIT");
+		w->uncommitted = 0;
+	}
+}
+
+static void *mbtiles_writer_run(void *v) {
+	mbtiles_writer *w = (mbtiles_writer *) v;
+
+	w->images = mbtiles_prepare(w->outdb, "replace into images (zoom_level, tile_id, tile_data) values (?, ?, ?)");
+	w->map = mbtiles_prepare(w->outdb, "insert into map (zoom_level, tile_column, tile_row, tile_id) values (?, ?, ?, ?)");
+	w->erase = mbtiles_prepare(w->outdb, "delete from map where zoom_level = ? and tile_column = ? and tile_row = ?");
+
+	if (pthread_mutex_lock(&w->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+
+	while (true) {
+		if (!w->queue.empty()) {
+			std::deque<mbtiles_op> batch;
+			batch.swap(w->queue);
+			w->queued_bytes = 0;
+			pthread_cond_broadcast(&w->done);
+
+			if (pthread_mutex_unlock(&w->lock) != 0) {
+				perror("pthread_mutex_unlock");
+				exit(EXIT_PTHREAD);
+			}
+
+			for (auto const &op : batch) {
+				mbtiles_apply(w, op);
+			}
+
+			if (pthread_mutex_lock(&w->lock) != 0) {
+				perror("pthread_mutex_lock");
+				exit(EXIT_PTHREAD);
+			}
+		} else if (w->stop) {
+			if (w->uncommitted > 0) {
+				mbtiles_exec(w->outdb, "COMMIT");
+				w->uncommitted = 0;
+			}
+			break;
+		} else {
+			if (pthread_cond_wait(&w->wake, &w->lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_PTHREAD);
+			}
+		}
+	}
+
+	if (pthread_mutex_unlock(&w->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+
+	sqlite3_finalize(w->images);
+	sqlite3_finalize(w->map);
+	sqlite3_finalize(w->erase);
+	return NULL;
+}
+
+static mbtiles_writer *mbtiles_find_writer(sqlite3 *outdb) {
+	if (pthread_mutex_lock(&writers_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+
+	mbtiles_writer *w = NULL;
+	auto f = writers.find(outdb);
+	if (f != writers.end()) {
+		w = f->second;
+	}
+
+	if (pthread_mutex_unlock(&writers_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+
+	return w;
+}
+
+static void mbtiles_queue(sqlite3 *outdb, mbtiles_op &&op) {
+	mbtiles_writer *w = mbtiles_find_writer(outdb);
+	if (w == NULL) {
+		fprintf(stderr, "Internal error: no writer for output database\n");
+		exit(EXIT_IMPOSSIBLE);
+	}
+
+	if (pthread_mutex_lock(&w->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+
+	while (w->queued_bytes >= MBTILES_QUEUE_BYTES) {
+		if (pthread_cond_wait(&w->done, &w->lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_PTHREAD);
+		}
+	}
+
+	w->queued_bytes += op.data.size() + sizeof(mbtiles_op);
+	w->queue.push_back(std::move(op));
+	pthread_cond_signal(&w->wake);
+
+	if (pthread_mutex_unlock(&w->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+}
+
+// Runs fn on the writer thread, after everything queued so far,
+// and waits for it to finish
+static void mbtiles_run(sqlite3 *outdb, std::function<void()> fn) {
+	mbtiles_writer *w = mbtiles_find_writer(outdb);
+	if (w == NULL) {
+		fn();
+		return;
+	}
+
+	bool ran = false;
+	mbtiles_op op;
+	op.erase = false;
+	op.z = op.tx = op.ty = 0;
+	op.hash = 0;
+	op.run = std::move(fn);
+	op.ran = &ran;
+	mbtiles_queue(outdb, std::move(op));
+
+	if (pthread_mutex_lock(&w->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+
+	while (!ran) {
+		if (pthread_cond_wait(&w->done, &w->lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_PTHREAD);
+		}
+	}
+
+	if (pthread_mutex_unlock(&w->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+}
+
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool update) {
 	sqlite3 *outdb;
 
 	if (sqlite3_open(dbname, &outdb) != SQLITE_OK) {
@@ -45,57 +319,83 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 		fprintf(stderr, "%s: async: %s\n", argv[0], err);
 		exit(EXIT_SQLITE);
 	}
-	if (sqlite3_exec(outdb, "CREATE TABLE metadata (name text, value text);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: Tileset \"%s\" already exists. You can use --force if you want to delete the old tileset.\n", argv[0], dbname);
-		fprintf(stderr, "%s: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_EXISTS);
+	if (update) {
+		// The tables are already there from the run that made the tileset
+		if (sqlite3_exec(outdb, "SELECT zoom_level FROM tiles LIMIT 1;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: %s: can't update: %s\n", argv[0], dbname, err);
+			exit(EXIT_SQLITE);
 		}
-	}
-	if (sqlite3_exec(outdb, "create unique index name on metadata (name);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: index metadata: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_EXISTS);
+	} else {
+		if (sqlite3_exec(outdb, "CREATE TABLE metadata (name text, value text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: Tileset \"%s\" already exists. You can use --force if you want to delete the old tileset.\n", argv[0], dbname);
+			fprintf(stderr, "%s: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_EXISTS);
+			}
+		}
+		if (sqlite3_exec(outdb, "create unique index name on metadata (name);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index metadata: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_EXISTS);
+			}
 		}
-	}
 
-	// "map" maps z/x/y coordinates to a content hash
-	if (sqlite3_exec(outdb, "CREATE TABLE map (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_id TEXT);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create map table: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_EXISTS);
+		// "map" maps z/x/y coordinates to a content hash
+		if (sqlite3_exec(outdb, "CREATE TABLE map (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_id TEXT);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create map table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_EXISTS);
+			}
 		}
-	}
-	if (sqlite3_exec(outdb, "CREATE UNIQUE INDEX map_index ON map (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create map index: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_EXISTS);
+		if (sqlite3_exec(outdb, "CREATE UNIQUE INDEX map_index ON map (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create map index: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_EXISTS);
+			}
 		}
-	}
 
-	// "images" maps a content hash to tile contents, per zoom level
-	if (sqlite3_exec(outdb, "CREATE TABLE images (zoom_level integer, tile_data blob, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create images table: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_EXISTS);
+		// "images" maps a content hash to tile contents, per zoom level
+		if (sqlite3_exec(outdb, "CREATE TABLE images (zoom_level integer, tile_data blob, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create images table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_EXISTS);
+			}
 		}
-	}
-	if (sqlite3_exec(outdb, "CREATE UNIQUE INDEX images_id ON images (zoom_level, tile_id);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create images index: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_EXISTS);
+		if (sqlite3_exec(outdb, "CREATE UNIQUE INDEX images_id ON images (zoom_level, tile_id);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create images index: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_EXISTS);
+			}
 		}
-	}
 
-	// "tiles" is a view that retrieves content from "images"
-	// via the content hash looked up from "map".
-	if (sqlite3_exec(outdb, "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id and images.zoom_level = map.zoom_level;", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create tiles view: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_EXISTS);
+		// "tiles" is a view that retrieves content from "images"
+		// via the content hash looked up from "map".
+		if (sqlite3_exec(outdb, "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id and images.zoom_level = map.zoom_level;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles view: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_EXISTS);
+			}
 		}
 	}
 
+	mbtiles_writer *w = new mbtiles_writer;
+	w->outdb = outdb;
+
+	if (pthread_mutex_lock(&writers_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+	writers.emplace(outdb, w);
+	if (pthread_mutex_unlock(&writers_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+
+	if (pthread_create(&w->thread, NULL, mbtiles_writer_run, w) != 0) {
+		perror("pthread_create");
+		exit(EXIT_PTHREAD);
+	}
+
 	return outdb;
 }
 
@@ -109,85 +409,127 @@ void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data,
 		h ^= (unsigned char) data[i];
 		h *= fnv_prime;
 	}
-	std::string hash = std::to_string(h);
 
-	// following https://github.com/mapbox/node-mbtiles/blob/master/lib/mbtiles.js
+	mbtiles_op op;
+	op.erase = false;
+	op.z = z;
+	op.tx = tx;
+	op.ty = ty;
+	op.hash = h;
+	op.data = std::string(data, size);
+	mbtiles_queue(outdb, std::move(op));
+}
 
-	sqlite3_stmt *stmt;
-	const char *images = "replace into images (zoom_level, tile_id, tile_data) values (?, ?, ?)";
-	if (sqlite3_prepare_v2(outdb, images, -1, &stmt, NULL) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 images prep failed\n");
-		exit(EXIT_SQLITE);
-	}
+void mbtiles_erase_zoom(sqlite3 *outdb, int z) {
+	mbtiles_run(outdb, [&]() {
+		sqlite3_stmt *stmt;
 
-	sqlite3_bind_int(stmt, 1, z);
-	sqlite3_bind_text(stmt, 2, hash.c_str(), hash.size(), NULL);
-	sqlite3_bind_blob(stmt, 3, data, size, NULL);
+		const char *query = "delete from map where zoom_level = ?";
+		if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete map prep failed\n");
+			exit(EXIT_SQLITE);
+		}
 
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		fprintf(stderr, "sqlite3 images insert failed: %s\n", sqlite3_errmsg(outdb));
-		exit(EXIT_SQLITE);
-	}
-	if (sqlite3_finalize(stmt) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 images finalize failed: %s\n", sqlite3_errmsg(outdb));
-		exit(EXIT_SQLITE);
-	}
+		sqlite3_bind_int(stmt, 1, z);
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 delete map failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_SQLITE);
+		}
+		if (sqlite3_finalize(stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete map finalize failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_SQLITE);
+		}
 
-	const char *map = "insert into map (zoom_level, tile_column, tile_row, tile_id) values (?, ?, ?, ?)";
-	if (sqlite3_prepare_v2(outdb, map, -1, &stmt, NULL) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 map prep failed\n");
-		exit(EXIT_SQLITE);
-	}
+		query = "delete from images where zoom_level = ?";
+		if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete images prep failed\n");
+			exit(EXIT_SQLITE);
+		}
 
-	sqlite3_bind_int(stmt, 1, z);
-	sqlite3_bind_int(stmt, 2, tx);
-	sqlite3_bind_int(stmt, 3, (1 << z) - 1 - ty);
-	sqlite3_bind_text(stmt, 4, hash.c_str(), hash.size(), NULL);
+		sqlite3_bind_int(stmt, 1, z);
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 delete images failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_SQLITE);
+		}
+		if (sqlite3_finalize(stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete images finalize failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_SQLITE);
+		}
+	});
+}
 
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		fprintf(stderr, "sqlite3 map insert failed: %s\n", sqlite3_errmsg(outdb));
-		exit(EXIT_SQLITE);
-	}
-	if (sqlite3_finalize(stmt) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(outdb));
-		exit(EXIT_SQLITE);
-	}
+// Leaves the tile's image behind, since other tiles may share it,
+// for mbtiles_erase_unused_images() to clean up later
+void mbtiles_erase_tile(sqlite3 *outdb, int z, int tx, int ty) {
+	// Queued like a write, so that it happens after any earlier write of the same tile
+	mbtiles_op op;
+	op.erase = true;
+	op.z = z;
+	op.tx = tx;
+	op.ty = ty;
+	op.hash = 0;
+	mbtiles_queue(outdb, std::move(op));
 }
 
-void mbtiles_erase_zoom(sqlite3 *outdb, int z) {
-	sqlite3_stmt *stmt;
+void mbtiles_erase_unused_images(sqlite3 *outdb, int z) {
+	mbtiles_run(outdb, [&]() {
+		sqlite3_stmt *stmt;
 
-	const char *query = "delete from map where zoom_level = ?";
-	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 delete map prep failed\n");
-		exit(EXIT_SQLITE);
-	}
+		const char *query = "delete from images where zoom_level = ? and tile_id not in (select tile_id from map where zoom_level = ?)";
+		if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete unused images prep failed\n");
+			exit(EXIT_SQLITE);
+		}
 
-	sqlite3_bind_int(stmt, 1, z);
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		fprintf(stderr, "sqlite3 delete map failed: %s\n", sqlite3_errmsg(outdb));
-		exit(EXIT_SQLITE);
-	}
-	if (sqlite3_finalize(stmt) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 delete map finalize failed: %s\n", sqlite3_errmsg(outdb));
-		exit(EXIT_SQLITE);
-	}
+		sqlite3_bind_int(stmt, 1, z);
+		sqlite3_bind_int(stmt, 2, z);
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 delete unused images failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_SQLITE);
+		}
+		if (sqlite3_finalize(stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete unused images finalize failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_SQLITE);
+		}
+	});
+}
 
-	query = "delete from images where zoom_level = ?";
-	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 delete images prep failed\n");
-		exit(EXIT_SQLITE);
-	}
+// Erases the tiles from minx,miny to maxx,maxy (in XYZ, not TMS) at zoom z
+void mbtiles_erase_area(sqlite3 *outdb, int z, unsigned minx, unsigned miny, unsigned maxx, unsigned maxy) {
+	mbtiles_run(outdb, [&]() {
+		sqlite3_stmt *stmt;
 
-	sqlite3_bind_int(stmt, 1, z);
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		fprintf(stderr, "sqlite3 delete images failed: %s\n", sqlite3_errmsg(outdb));
-		exit(EXIT_SQLITE);
-	}
-	if (sqlite3_finalize(stmt) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 delete images finalize failed: %s\n", sqlite3_errmsg(outdb));
-		exit(EXIT_SQLITE);
-	}
+		const char *query = "delete from map where zoom_level = ? and tile_column >= ? and tile_column <= ? and tile_row >= ? and tile_row <= ?";
+		if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete area prep failed\n");
+			exit(EXIT_SQLITE);
+		}
+
+		sqlite3_bind_int(stmt, 1, z);
+		sqlite3_bind_int64(stmt, 2, minx);
+		sqlite3_bind_int64(stmt, 3, maxx);
+		sqlite3_bind_int64(stmt, 4, (1LL << z) - 1 - maxy);
+		sqlite3_bind_int64(stmt, 5, (1LL << z) - 1 - miny);
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 delete area failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_SQLITE);
+		}
+		if (sqlite3_finalize(stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete area finalize failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_SQLITE);
+		}
+	});
+}
+
+// So that mbtiles_write_metadata() can write all of it again
+void mbtiles_erase_metadata(sqlite3 *outdb) {
+	mbtiles_run(outdb, [&]() {
+		char *err = NULL;
+		if (sqlite3_exec(outdb, "DELETE FROM metadata;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "delete metadata: %s\n", err);
+			exit(EXIT_SQLITE);
+		}
+	});
 }
 
 bool type_and_string::operator<(const type_and_string &o) const {
@@ -464,7 +806,7 @@ std::string stringify_strategies(std::vector<strategy> const &strategies) {
 	}
 }
 
-void mbtiles_write_metadata(sqlite3 *db, const metadata &m, bool forcetable) {
+static void mbtiles_write_metadata_now(sqlite3 *db, const metadata &m, bool forcetable) {
 	char *sql, *err;
 
 	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('name', %Q);", m.name.c_str());
@@ -638,6 +980,12 @@ void mbtiles_write_metadata(sqlite3 *db, const metadata &m, bool forcetable) {
 	}
 }
 
+void mbtiles_write_metadata(sqlite3 *db, const metadata &m, bool forcetable) {
+	mbtiles_run(db, [&]() {
+		mbtiles_write_metadata_now(db, m, forcetable);
+	});
+}
+
 metadata make_metadata(const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double minlat2, double minlon2, double maxlat2, double maxlon2, double midlat, double midlon, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats, std::map<std::string, std::string> const &attribute_descriptions, std::string const &program, std::string const &commandline, std::vector<strategy> const &strategies) {
 	metadata m;
 
@@ -780,6 +1128,38 @@ metadata make_metadata(const char *fname, int minzoom, int maxzoom, double minla
 }
 
 void mbtiles_close(sqlite3 *outdb, const char *pgm) {
+	mbtiles_writer *w = mbtiles_find_writer(outdb);
+	if (w != NULL) {
+		if (pthread_mutex_lock(&w->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_PTHREAD);
+		}
+		w->stop = true;
+		pthread_cond_signal(&w->wake);
+		if (pthread_mutex_unlock(&w->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_PTHREAD);
+		}
+
+		void *retval;
+		if (pthread_join(w->thread, &retval) != 0) {
+			perror("pthread_join");
+			exit(EXIT_PTHREAD);
+		}
+
+		if (pthread_mutex_lock(&writers_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_PTHREAD);
+		}
+		writers.erase(outdb);
+		if (pthread_mutex_unlock(&writers_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_PTHREAD);
+		}
+
+		delete w;
+	}
+
 	char *err;
 
 	if (sqlite3_exec(outdb, "ANALYZE;", NULL, NULL, &err) != SQLITE_OK) {
@@ -70,10 +70,14 @@ struct metadata {
 
 #include "tile.hpp"
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable);
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool update);
 
 void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size);
 void mbtiles_erase_zoom(sqlite3 *outdb, int z);
+void mbtiles_erase_tile(sqlite3 *outdb, int z, int tx, int ty);
+void mbtiles_erase_unused_images(sqlite3 *outdb, int z);
+void mbtiles_erase_area(sqlite3 *outdb, int z, unsigned minx, unsigned miny, unsigned maxx, unsigned maxy);
+void mbtiles_erase_metadata(sqlite3 *outdb);
 
 metadata make_metadata(const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double minlat2, double minlon2, double maxlat2, double maxlon2, double midlat, double midlon, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats, std::map<std::string, std::string> const &attribute_descriptions, std::string const &program, std::string const &commandline, std::vector<strategy> const &strategies);
 void mbtiles_write_metadata(sqlite3 *db, const metadata &m, bool forcetable);
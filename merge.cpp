@@ -0,0 +1,116 @@
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "merge.hpp"
+#include "task_pool.hpp"
+
+struct merge_run_arg {
+	struct merge_partition *part = NULL;
+	unsigned char *map = NULL;
+	int bytes = 0;
+	struct index *merged = NULL;
+};
+
+// K-way merge of the partition's slice of each run, through a heap of the runs
+// ordered by their next key. Ties go to the lower-numbered run.
+static void *run_merge_partition(void *v) {
+	struct merge_run_arg *a = (struct merge_run_arg *) v;
+	struct merge_partition *p = a->part;
+	std::vector<long long> pos = p->start;
+
+	auto after = [&](size_t r1, size_t r2) {
+		struct index const &i1 = *(struct index *) (a->map + pos[r1]);
+		struct index const &i2 = *(struct index *) (a->map + pos[r2]);
+		if (index_before(i2, i1)) {
+			return true;
+		} else if (index_before(i1, i2)) {
+			return false;
+		}
+		return r1 > r2;
+	};
+
+	std::vector<size_t> heap;
+	for (size_t r = 0; r < pos.size(); r++) {
+		if (pos[r] < p->end[r]) {
+			heap.push_back(r);
+		}
+	}
+	std::make_heap(heap.begin(), heap.end(), after);
+
+	struct index *out = a->merged + p->first;
+	while (heap.size() > 0) {
+		std::pop_heap(heap.begin(), heap.end(), after);
+		size_t r = heap.back();
+
+		memcpy(out++, a->map + pos[r], a->bytes);
+		pos[r] += a->bytes;
+
+		if (pos[r] < p->end[r]) {
+			std::push_heap(heap.begin(), heap.end(), after);
+		} else {
+			heap.pop_back();
+		}
+	}
+
+	return NULL;
+}
+
+std::vector<merge_partition> merge_runs(struct mergelist *merges, size_t nmerges, unsigned char *map, int bytes, size_t nparts, struct index *merged) {
+	std::vector<struct index> samples;
+	for (size_t r = 0; r < nmerges; r++) {
+		long long n = (merges[r].end - merges[r].start) / bytes;
+		long long step = std::max(1LL, n / (long long) (nparts * 16));
+		for (long long j = step / 2; j < n; j += step) {
+			struct index ix;
+			memcpy(&ix, map + merges[r].start + j * bytes, bytes);
+			samples.push_back(ix);
+		}
+	}
+	std::sort(samples.begin(), samples.end(), index_before);
+
+	std::vector<struct merge_partition> parts(nparts);
+	size_t first = 0;
+	for (size_t p = 0; p < nparts; p++) {
+		parts[p].start.resize(nmerges);
+		parts[p].end.resize(nmerges);
+
+		for (size_t r = 0; r < nmerges; r++) {
+			parts[p].start[r] = (p == 0) ? merges[r].start : parts[p - 1].end[r];
+
+			if (p + 1 == nparts || samples.size() == 0) {
+				parts[p].end[r] = merges[r].end;
+			} else {
+				// The first feature in the run that is not before the splitter
+				struct index const &splitter = samples[samples.size() * (p + 1) / nparts];
+				long long lo = parts[p].start[r] / bytes, hi = merges[r].end / bytes;
+				while (lo < hi) {
+					long long mid = lo + (hi - lo) / 2;
+					if (index_before(*(struct index *) (map + mid * bytes), splitter)) {
+						lo = mid + 1;
+					} else {
+						hi = mid;
+					}
+				}
+				parts[p].end[r] = lo * bytes;
+			}
+
+			parts[p].count += (parts[p].end[r] - parts[p].start[r]) / bytes;
+		}
+
+		parts[p].first = first;
+		first += parts[p].count;
+	}
+
+	std::vector<struct merge_run_arg> args(nparts);
+	task_group merging;
+	for (size_t p = 0; p < nparts; p++) {
+		args[p].part = &parts[p];
+		args[p].map = map;
+		args[p].bytes = bytes;
+		args[p].merged = merged;
+		task_run(&merging, run_merge_partition, &args[p]);
+	}
+	task_wait(&merging);
+
+	return parts;
+}
@@ -0,0 +1,30 @@
+#ifndef MERGE_HPP
+#define MERGE_HPP
+
+#include <stddef.h>
+#include <vector>
+#include "main.hpp"
+
+// A sorted run of the index, as byte offsets into it
+struct mergelist {
+	long long start;
+	long long end;
+};
+
+// One range of index keys to be merged from every sorted run
+// into its own section of the output
+struct merge_partition {
+	std::vector<long long> start;  // for each run, byte offsets into the index
+	std::vector<long long> end;
+	size_t first = 0;  // position of the partition's first feature in the merged index
+	size_t count = 0;
+	long long geom_start = 0;  // where its geometry goes, relative to the start of the merge
+};
+
+// Cuts the sorted runs of the index in map into nparts ranges of keys,
+// chosen from a sample of every run, and merges each range into its own
+// section of merged on a task of its own. Features with the same key stay
+// in the order of their runs.
+std::vector<merge_partition> merge_runs(struct mergelist *merges, size_t nmerges, unsigned char *map, int bytes, size_t nparts, struct index *merged);
+
+#endif
@@ -0,0 +1,383 @@
+// Microbenchmarks of the inner loops of tippecanoe, each run on synthetic
+// input that is the same from one run to the next, so that the times can
+// be compared across changes to the code.
+//
+//     ./microbench [name ...]
+//
+// runs the benchmarks whose names are given, or all of them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include "jsonpull/jsonpull.h"
+#include "geometry.hpp"
+#include "geojson-loop.hpp"
+#include "read_json.hpp"
+#include "serial.hpp"
+#include "options.hpp"
+#include "errors.hpp"
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run fn, which does count units of work, enough times to take a while,
+// and report the fastest time per unit
+static void measure(const char *name, const char *unit, size_t count, std::function<void()> fn) {
+	double best = INFINITY;
+	double total = 0;
+
+	for (size_t i = 0; i < 5 || total < 1; i++) {
+		double start = now();
+		fn();
+		double elapsed = now() - start;
+
+		best = std::min(best, elapsed);
+		total += elapsed;
+	}
+
+	printf("%-48s %10.3f ms %10.2f ns/%s\n", name, best * 1000, best * 1e9 / count, unit);
+}
+
+// GeoJSON features with polygons of 5 to 40 vertices each, like buildings
+static std::string make_polygons(size_t n) {
+	std::string out;
+	unsigned seed = 5;
+
+	for (size_t i = 0; i < n; i++) {
+		double cx = -120 + (rand_r(&seed) % 50000) / 1000.0;
+		double cy = 25 + (rand_r(&seed) % 23000) / 1000.0;
+		double r = 0.0002 + (rand_r(&seed) % 1800) / 1e6;
+		int vertices = 5 + rand_r(&seed) % 36;
+
+		out += "{\"type\":\"Feature\",\"properties\":{\"id\":" + std::to_string(i) + "},";
+		out += "\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[[";
+		for (int k = 0; k <= vertices; k++) {
+			char buf[100];
+			double a = 2 * M_PI * (k % vertices) / vertices;
+			snprintf(buf, sizeof(buf), "%s[%.6f,%.6f]", k == 0 ? "" : ",", cx + r * cos(a), cy + r * sin(a));
+			out += buf;
+		}
+		out += "]]}}\n";
+	}
+
+	return out;
+}
+
+// Reads the geometries of the features the way that tippecanoe does,
+// either through the JSON tree or straight from the parser
+struct coordinates_action : json_feature_action {
+	bool direct;
+	json_object *read_coordinates_array = NULL;
+	drawvec coordinates_read;
+
+	drawvec dv;
+	size_t vertices = 0;
+	unsigned long long checksum = 0;
+
+	int add_feature(json_object *geometry, bool, json_object *, json_object *, json_object *, json_object *feature) {
+		json_object *type = json_hash_get(geometry, "type");
+		json_object *coordinates = json_hash_get(geometry, "coordinates");
+
+		int t;
+		for (t = 0; t < GEOM_TYPES; t++) {
+			if (strcmp(type->value.string.string, geometry_names[t]) == 0) {
+				break;
+			}
+		}
+
+		drawvec *out = &coordinates_read;
+		if (coordinates != read_coordinates_array || coordinates->expect != JSON_POSITIONS) {
+			dv.clear();
+			parse_geometry(t, coordinates, dv, VT_MOVETO, fname.c_str(), 0, feature);
+			out = &dv;
+		}
+		read_coordinates_array = NULL;
+
+		for (auto const &d : *out) {
+			checksum = checksum * 31 + d.op + d.x * 7 + d.y;
+		}
+		vertices += out->size();
+		return 1;
+	}
+
+	void check_crs(json_object *) {
+	}
+
+	void read_coordinates(json_pull *jp, int t) {
+		if (direct) {
+			coordinates_read.clear();
+			json_object *o = ::read_coordinates(jp, t, coordinates_read);
+			if (o != NULL) {
+				read_coordinates_array = o;
+			}
+		}
+	}
+};
+
+static void bench_geojson_coordinates() {
+	std::string json = make_polygons(20000);
+
+	unsigned long long checksum[2];
+	size_t vertices[2];
+
+	for (int direct = 0; direct < 2; direct++) {
+		coordinates_action ca;
+		ca.fname = "polygons";
+		ca.direct = direct;
+
+		json_pull *jp = json_begin_string(json.c_str());
+		parse_json(&ca, jp);
+		json_end(jp);
+
+		checksum[direct] = ca.checksum;
+		vertices[direct] = ca.vertices;
+	}
+
+	if (checksum[0] != checksum[1] || vertices[0] != vertices[1]) {
+		fprintf(stderr, "GeoJSON coordinates read from the tree and from the parser differ\n");
+		exit(EXIT_IMPOSSIBLE);
+	}
+
+	for (int direct = 0; direct < 2; direct++) {
+		measure(direct ? "geojson coordinates, direct" : "geojson coordinates, tree", "vertex", vertices[0], [&]() {
+			coordinates_action ca;
+			ca.fname = "polygons";
+			ca.direct = direct;
+
+			json_pull *jp = json_begin_string(json.c_str());
+			parse_json(&ca, jp);
+			json_end(jp);
+		});
+	}
+}
+
+// A real-world line or polygon, translated to be relative to the tile at
+// the lowest zoom at which it spans more than one tile, as write_tile()
+// would see it there
+struct canned_geometry {
+	int t;
+	int z;
+	drawvec geom;
+};
+
+struct geometry_collector : json_feature_action {
+	std::vector<canned_geometry> *out;
+
+	int add_feature(json_object *geometry, bool, json_object *, json_object *, json_object *, json_object *feature) {
+		json_object *type = json_hash_get(geometry, "type");
+		json_object *coordinates = json_hash_get(geometry, "coordinates");
+		if (type == NULL || type->type != JSON_STRING || coordinates == NULL) {
+			return 1;
+		}
+
+		int t;
+		for (t = 0; t < GEOM_TYPES; t++) {
+			if (strcmp(type->value.string.string, geometry_names[t]) == 0) {
+				break;
+			}
+		}
+		if (t >= GEOM_TYPES || mb_geometry[t] == VT_POINT) {
+			return 1;
+		}
+
+		canned_geometry c;
+		c.t = mb_geometry[t];
+		parse_geometry(t, coordinates, c.geom, VT_MOVETO, fname.c_str(), 0, feature);
+
+		if (c.t == VT_POLYGON) {
+			// As serialize_feature() does, which also takes out the closepaths
+			c.geom = fix_polygon(c.geom);
+		}
+
+		long long bbox[4] = {LLONG_MAX, LLONG_MAX, LLONG_MIN, LLONG_MIN};
+		for (auto const &d : c.geom) {
+			bbox[0] = std::min(bbox[0], (long long) d.x);
+			bbox[1] = std::min(bbox[1], (long long) d.y);
+			bbox[2] = std::max(bbox[2], (long long) d.x);
+			bbox[3] = std::max(bbox[3], (long long) d.y);
+		}
+		if (c.geom.size() < 2) {
+			return 1;
+		}
+
+		long long extent = std::max(bbox[2] - bbox[0], bbox[3] - bbox[1]);
+		c.z = 0;
+		while (c.z < 24 && (1LL << (32 - c.z)) > extent) {
+			c.z++;
+		}
+
+		long long tx = ((bbox[0] + bbox[2]) / 2) >> (32 - c.z);
+		long long ty = ((bbox[1] + bbox[3]) / 2) >> (32 - c.z);
+		for (auto &d : c.geom) {
+			d.x -= tx << (32 - c.z);
+			d.y -= ty << (32 - c.z);
+		}
+
+		if (c.t == VT_POLYGON) {
+			// The boundaries also make good long lines
+			canned_geometry l = c;
+			l.t = VT_LINE;
+			out->push_back(std::move(l));
+		}
+
+		out->push_back(std::move(c));
+		return 1;
+	}
+
+	void check_crs(json_object *) {
+	}
+};
+
+// Test inputs with detailed lines and polygons, relative to the top of the source
+static const char *canned_files[] = {
+	"tests/tl_2018_51685_roads/in.json",
+	"tests/ne_110m_admin_1_states_provinces_lines/in.json",
+	"tests/tl_2015_us_county/piscataquis.json",
+	"tests/tl_2015_us_county/somerset.json",
+	"tests/ne_110m_admin_0_countries/in.json.gz",
+};
+
+// Reads the canned files through zlib, which passes uncompressed files through as they are
+static ssize_t canned_read(json_pull *j, char *buffer, size_t n) {
+	int len = gzread((gzFile) j->source, buffer, n);
+	if (len < 0) {
+		int errnum;
+		fprintf(stderr, "Error reading canned geometry: %s\n", gzerror((gzFile) j->source, &errnum));
+		exit(EXIT_READ);
+	}
+	return len;
+}
+
+static std::vector<canned_geometry> load_canned_geometries() {
+	std::vector<canned_geometry> out;
+
+	for (auto name : canned_files) {
+		gzFile gz = gzopen(name, "rb");
+		if (gz == NULL) {
+			fprintf(stderr, "%s: can't open; run microbench from the top of the source\n", name);
+			exit(EXIT_OPEN);
+		}
+
+		geometry_collector gc;
+		gc.fname = name;
+		gc.out = &out;
+
+		json_pull *jp = json_begin(canned_read, gz);
+		parse_json(&gc, jp);
+		json_end(jp);
+
+		if (gzclose(gz) != Z_OK) {
+			fprintf(stderr, "%s: Error closing compressed data\n", name);
+			exit(EXIT_CLOSE);
+		}
+	}
+
+	return out;
+}
+
+static void bench_geometry_kernels() {
+	std::vector<canned_geometry> canned = load_canned_geometries();
+
+	struct kernel {
+		const char *name;
+		int t;
+		std::function<drawvec(drawvec &, int)> run;
+	};
+
+	std::vector<kernel> kernels = {
+		{"clip_lines", VT_LINE, [](drawvec &g, int z) { return clip_lines(g, z, 5); }},
+		{"simplify_lines, douglas-peucker", VT_LINE, [](drawvec &g, int z) { return simplify_lines(g, z, 12, true, 1, 0, drawvec()); }},
+		{"simplify_lines, visvalingam", VT_LINE, [](drawvec &g, int z) {
+			 additional[A_VISVALINGAM] = 1;
+			 drawvec out = simplify_lines(g, z, 12, true, 1, 0, drawvec());
+			 additional[A_VISVALINGAM] = 0;
+			 return out;
+		 }},
+		{"stairstep, lines", VT_LINE, [](drawvec &g, int z) { return stairstep(g, z, 12); }},
+		{"simple_clip_poly", VT_POLYGON, [](drawvec &g, int z) { return simple_clip_poly(g, z, 5); }},
+		{"clean_or_clip_poly", VT_POLYGON, [](drawvec &g, int z) { return clean_or_clip_poly(g, z, 5, true); }},
+		{"simplify_lines, polygons", VT_POLYGON, [](drawvec &g, int z) { return simplify_lines(g, z, 12, true, 1, 4, drawvec()); }},
+		{"polygon_to_anchor", VT_POLYGON, [](drawvec &g, int) { return polygon_to_anchor(g); }},
+		{"stairstep, polygons", VT_POLYGON, [](drawvec &g, int z) { return stairstep(g, z, 12); }},
+	};
+
+	// Small, medium, and large geometries separately, since the
+	// kernels don't all scale linearly with the number of vertices
+	struct size_class {
+		const char *name;
+		size_t min;
+		size_t max;
+	} size_classes[] = {
+		{"<100", 0, 100},
+		{"100-999", 100, 1000},
+		{"1000+", 1000, SIZE_MAX},
+	};
+
+	for (auto const &k : kernels) {
+		for (auto const &sc : size_classes) {
+			std::vector<canned_geometry const *> todo;
+			size_t vertices = 0;
+
+			for (auto const &c : canned) {
+				if (c.t == k.t && c.geom.size() >= sc.min && c.geom.size() < sc.max) {
+					todo.push_back(&c);
+					vertices += c.geom.size();
+				}
+			}
+			if (todo.size() == 0) {
+				continue;
+			}
+
+			std::string name = std::string(k.name) + ", " + sc.name + " (" + std::to_string(todo.size()) + ")";
+			size_t checksum = 0;
+
+			measure(name.c_str(), "vertex", vertices, [&]() {
+				for (auto c : todo) {
+					drawvec g = c->geom;
+					checksum += k.run(g, c->z).size();
+				}
+			});
+
+			if (checksum == 0) {
+				fprintf(stderr, "%s: no output\n", name.c_str());
+			}
+		}
+	}
+}
+
+struct microbenchmark {
+	const char *name;
+	void (*run)();
+} microbenchmarks[] = {
+	{"geojson-coordinates", bench_geojson_coordinates},
+	{"geometry-kernels", bench_geometry_kernels},
+};
+
+int main(int argc, char **argv) {
+	for (auto const &b : microbenchmarks) {
+		bool wanted = (argc == 1);
+		for (int i = 1; i < argc; i++) {
+			if (strcmp(argv[i], b.name) == 0) {
+				wanted = true;
+			}
+		}
+
+		if (wanted) {
+			b.run();
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
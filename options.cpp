@@ -0,0 +1,10 @@
+#include "options.hpp"
+
+// The options that the geometry kernels read. main.cpp sets them from the
+// command line; they are defined here so that programs other than
+// tippecanoe itself can link the kernels.
+
+int prevent[256];
+int additional[256];
+int geometry_scale = 0;
+int tiny_polygon_size = 2;
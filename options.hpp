@@ -26,6 +26,9 @@
 #define A_HILBERT ((int) 'h')
 #define A_VISVALINGAM ((int) 'v')
 #define A_GENERATE_POLYGON_LABEL_POINTS ((int) 'P')
+#define A_RETRY_CHANGED_TILES ((int) 'T')
+#define A_PERSISTENT_FILTERS ((int) 'F')
+#define A_BINARY_FILTERS ((int) 'B')
 
 #define P_SIMPLIFY ((int) 's')
 #define P_SIMPLIFY_LOW ((int) 'S')
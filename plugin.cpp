@@ -25,17 +25,20 @@
 #include "geometry.hpp"
 #include "serial.hpp"
 #include "errors.hpp"
+#include "options.hpp"
 
 extern "C" {
 #include "jsonpull/jsonpull.h"
 }
 
 #include "plugin.hpp"
+#include "binary_filter.hpp"
 #include "write_json.hpp"
 #include "read_json.hpp"
 
 struct writer_arg {
-	int write_to;
+	FILE *fp;
+	bool persistent;
 	std::vector<mvt_layer> *layers;
 	unsigned z;
 	unsigned x;
@@ -45,11 +48,10 @@ struct writer_arg {
 
 void *run_writer(void *a) {
 	writer_arg *wa = (writer_arg *) a;
+	FILE *fp = wa->fp;
 
-	FILE *fp = fdopen(wa->write_to, "w");
-	if (fp == NULL) {
-		perror("fdopen (pipe writer)");
-		exit(EXIT_OPEN);
+	if (wa->persistent) {
+		persistent_filter_begin_tile(fp, wa->z, wa->x, wa->y);
 	}
 
 	json_writer state(fp);
@@ -57,6 +59,11 @@ void *run_writer(void *a) {
 		layer_to_geojson((*(wa->layers))[i], wa->z, wa->x, wa->y, false, true, false, true, 0, 0, 0, true, state, 0);
 	}
 
+	if (wa->persistent) {
+		persistent_filter_end_tile(fp, wa->z, wa->x, wa->y, "postfilter");
+		return NULL;
+	}
+
 	if (fclose(fp) != 0) {
 		if (errno == EPIPE) {
 			static bool warned = false;
@@ -73,6 +80,19 @@ void *run_writer(void *a) {
 	return NULL;
 }
 
+// Writes to the postfilter with -aB. It is in a thread of its own, like the
+// GeoJSON writer, so that filters like cat that write before they have read
+// the whole tile can't fill the pipe back and block.
+void *run_binary_writer(void *a) {
+	writer_arg *wa = (writer_arg *) a;
+
+	mvt_tile tile;
+	tile.layers = *(wa->layers);
+	write_binary_tile(wa->fp, wa->z, wa->x, wa->y, tile, "postfilter");
+
+	return NULL;
+}
+
 // XXX deduplicate
 static std::vector<mvt_geometry> to_feature(drawvec &geom) {
 	std::vector<mvt_geometry> out;
@@ -84,16 +104,63 @@ static std::vector<mvt_geometry> to_feature(drawvec &geom) {
 	return out;
 }
 
-// Reads from the postfilter
-std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
-	std::map<std::string, mvt_layer> ret;
+// Finds the layermap entry for a layer that comes out of a filter, adding it if it is new
+static std::map<std::string, layermap_entry>::iterator filtered_layer(std::string const &layername, int z, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps) {
+	std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
 
-	FILE *f = fdopen(fd, "r");
-	if (f == NULL) {
-		perror("fdopen filter output");
-		exit(EXIT_OPEN);
+	if (layermap.count(layername) == 0) {
+		layermap_entry lme = layermap_entry(layermap.size());
+		lme.minzoom = z;
+		lme.maxzoom = z;
+
+		layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
+
+		if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
+			(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
+			(*layer_unmaps)[tiling_seg][lme.id] = layername;
+		}
+	}
+
+	auto fk = layermap.find(layername);
+	if (fk == layermap.end()) {
+		fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
+		exit(EXIT_IMPOSSIBLE);
 	}
-	json_pull *jp = json_begin_file(f);
+
+	if (z < fk->second.minzoom) {
+		fk->second.minzoom = z;
+	}
+	if (z > fk->second.maxzoom) {
+		fk->second.maxzoom = z;
+	}
+
+	return fk;
+}
+
+// Is this the object that a persistent filter passes through to mark the end of the tile's features?
+static bool is_end_of_tile(json_object *j, json_pull *jp, unsigned z, unsigned x, unsigned y) {
+	json_object *type = json_hash_get(j, "type");
+	if (type == NULL || type->type != JSON_STRING || strcmp(type->value.string.string, "TileEnd") != 0) {
+		return false;
+	}
+
+	json_object *jz = json_hash_get(j, "zoom");
+	json_object *jx = json_hash_get(j, "x");
+	json_object *jy = json_hash_get(j, "y");
+	if (jz == NULL || jz->type != JSON_NUMBER || jz->value.number.number != z ||
+	    jx == NULL || jx->type != JSON_NUMBER || jx->value.number.number != x ||
+	    jy == NULL || jy->type != JSON_NUMBER || jy->value.number.number != y) {
+		fprintf(stderr, "Filter output:%d: end of tile does not match tile %u/%u/%u: ", jp->line, z, x, y);
+		json_context(j);
+		exit(EXIT_JSON);
+	}
+
+	return true;
+}
+
+// Reads from the postfilter
+std::vector<mvt_layer> parse_layers(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent, bool persistent) {
+	std::map<std::string, mvt_layer> ret;
 
 	while (1) {
 		json_object *j = json_read(jp);
@@ -108,10 +175,20 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 				exit(EXIT_JSON);
 			}
 
+			if (persistent) {
+				fprintf(stderr, "Filter output:%d: postfilter exited before the end of tile %d/%u/%u\n", jp->line, z, x, y);
+				exit(EXIT_JSON);
+			}
+
 			json_free(jp->root);
 			break;
 		}
 
+		if (persistent && is_end_of_tile(j, jp, z, x, y)) {
+			json_free(j);
+			break;
+		}
+
 		json_object *type = json_hash_get(j, "type");
 		if (type == NULL || type->type != JSON_STRING) {
 			continue;
@@ -226,31 +303,7 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 				feature.has_id = true;
 			}
 
-			std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
-			if (layermap.count(layername) == 0) {
-				layermap_entry lme = layermap_entry(layermap.size());
-				lme.minzoom = z;
-				lme.maxzoom = z;
-
-				layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
-
-				if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
-					(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
-					(*layer_unmaps)[tiling_seg][lme.id] = layername;
-				}
-			}
-
-			auto fk = layermap.find(layername);
-			if (fk == layermap.end()) {
-				fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
-				exit(EXIT_IMPOSSIBLE);
-			}
-			if (z < fk->second.minzoom) {
-				fk->second.minzoom = z;
-			}
-			if (z > fk->second.maxzoom) {
-				fk->second.maxzoom = z;
-			}
+			auto fk = filtered_layer(layername, z, layermaps, tiling_seg, layer_unmaps);
 
 			if (feature.type == mvt_point) {
 				fk->second.points++;
@@ -287,12 +340,6 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 		json_free(j);
 	}
 
-	json_end(jp);
-	if (fclose(f) != 0) {
-		perror("fclose postfilter output");
-		exit(EXIT_CLOSE);
-	}
-
 	std::vector<mvt_layer> final;
 	for (auto a : ret) {
 		final.push_back(a.second);
@@ -300,8 +347,46 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 	return final;
 }
 
+static void set_bbox(serial_feature &sf) {
+	sf.bbox[0] = sf.bbox[1] = LLONG_MAX;
+	sf.bbox[2] = sf.bbox[3] = LLONG_MIN;
+
+	for (size_t i = 0; i < sf.geometry.size(); i++) {
+		if (sf.geometry[i].op == VT_MOVETO || sf.geometry[i].op == VT_LINETO) {
+			if (sf.geometry[i].x < sf.bbox[0]) {
+				sf.bbox[0] = sf.geometry[i].x;
+			}
+			if (sf.geometry[i].y < sf.bbox[1]) {
+				sf.bbox[1] = sf.geometry[i].y;
+			}
+			if (sf.geometry[i].x > sf.bbox[2]) {
+				sf.bbox[2] = sf.geometry[i].x;
+			}
+			if (sf.geometry[i].y > sf.bbox[3]) {
+				sf.bbox[3] = sf.geometry[i].y;
+			}
+		}
+	}
+}
+
+static long long mvt_value_to_long_long(mvt_value const &v) {
+	if (v.type == mvt_int) {
+		return v.numeric_value.int_value;
+	} else if (v.type == mvt_uint) {
+		return v.numeric_value.uint_value;
+	} else if (v.type == mvt_sint) {
+		return v.numeric_value.sint_value;
+	} else if (v.type == mvt_double) {
+		return v.numeric_value.double_value;
+	} else if (v.type == mvt_float) {
+		return v.numeric_value.float_value;
+	} else {
+		return 0;
+	}
+}
+
 // Reads from the prefilter
-serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter) {
+serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter, bool persistent) {
 	serial_feature sf;
 
 	while (1) {
@@ -317,11 +402,22 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 				exit(EXIT_JSON);
 			}
 
+			if (persistent) {
+				fprintf(stderr, "Filter output:%d: prefilter exited before the end of tile %d/%u/%u\n", jp->line, z, x, y);
+				exit(EXIT_JSON);
+			}
+
 			json_free(jp->root);
 			sf.t = -1;
 			return sf;
 		}
 
+		if (persistent && is_end_of_tile(j, jp, z, x, y)) {
+			json_free(j);
+			sf.t = -1;
+			return sf;
+		}
+
 		json_object *type = json_hash_get(j, "type");
 		if (type == NULL || type->type != JSON_STRING) {
 			continue;
@@ -402,8 +498,6 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 			sf.geometry = dv;
 			sf.seq = 0;
 			sf.index = 0;
-			sf.bbox[0] = sf.bbox[1] = LLONG_MAX;
-			sf.bbox[2] = sf.bbox[3] = LLONG_MIN;
 			sf.extent = 0;
 			sf.has_id = false;
 
@@ -436,22 +530,7 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 				}
 			}
 
-			for (size_t i = 0; i < dv.size(); i++) {
-				if (dv[i].op == VT_MOVETO || dv[i].op == VT_LINETO) {
-					if (dv[i].x < sf.bbox[0]) {
-						sf.bbox[0] = dv[i].x;
-					}
-					if (dv[i].y < sf.bbox[1]) {
-						sf.bbox[1] = dv[i].y;
-					}
-					if (dv[i].x > sf.bbox[2]) {
-						sf.bbox[2] = dv[i].x;
-					}
-					if (dv[i].y > sf.bbox[3]) {
-						sf.bbox[3] = dv[i].y;
-					}
-				}
-			}
+			set_bbox(sf);
 
 			json_object *id = json_hash_get(j, "id");
 			if (id != NULL && id->type == JSON_NUMBER) {
@@ -462,35 +541,9 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 				sf.has_id = true;
 			}
 
-			std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
-
-			if (layermap.count(layername) == 0) {
-				layermap_entry lme = layermap_entry(layermap.size());
-				lme.minzoom = z;
-				lme.maxzoom = z;
-
-				layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
-
-				if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
-					(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
-					(*layer_unmaps)[tiling_seg][lme.id] = layername;
-				}
-			}
-
-			auto fk = layermap.find(layername);
-			if (fk == layermap.end()) {
-				fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
-				exit(EXIT_IMPOSSIBLE);
-			}
+			auto fk = filtered_layer(layername, z, layermaps, tiling_seg, layer_unmaps);
 			sf.layer = fk->second.id;
 
-			if (z < fk->second.minzoom) {
-				fk->second.minzoom = z;
-			}
-			if (z > fk->second.maxzoom) {
-				fk->second.maxzoom = z;
-			}
-
 			if (!postfilter) {
 				if (sf.t == mvt_point) {
 					fk->second.points++;
@@ -534,7 +587,8 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 
 static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
+// Starts the filter command with the specified arguments
+static void start_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, std::vector<std::string> const &args) {
 	// This will create two pipes, a new thread, and a new process.
 	//
 	// The new process will read from one pipe and write to the other, and execute the filter.
@@ -556,10 +610,6 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 		exit(EXIT_OPEN);
 	}
 
-	std::string z_str = std::to_string(z);
-	std::string x_str = std::to_string(x);
-	std::string y_str = std::to_string(y);
-
 	*pid = fork();
 	if (*pid < 0) {
 		perror("fork");
@@ -594,7 +644,13 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 
 		// XXX close other fds?
 
-		if (execlp("sh", "sh", "-c", filter, "sh", z_str.c_str(), x_str.c_str(), y_str.c_str(), NULL) != 0) {
+		std::vector<const char *> argv = {"sh", "-c", filter, "sh"};
+		for (auto const &arg : args) {
+			argv.push_back(arg.c_str());
+		}
+		argv.push_back(NULL);
+
+		if (execvp("sh", (char *const *) argv.data()) != 0) {
 			perror("exec");
 			exit(EXIT_PTHREAD);
 		}
@@ -628,26 +684,509 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 	}
 }
 
-std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layers, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
+	start_filter(filter, write_to, read_from, pid, {std::to_string(z), std::to_string(x), std::to_string(y)});
+}
+
+// Persistent filters are started once and then filter one tile after another,
+// instead of being started again for each tile. Each one is used by only one
+// tile at a time, so there are as many of them as tiles being filtered at once.
+
+static pthread_mutex_t persistent_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<persistent_filter *> persistent_filters;  // all of them
+static std::multimap<std::string, persistent_filter *> idle_filters;
+
+// Unlike fread(), which would wait for a full buffer, this returns whatever the filter
+// has written so far, so that the end of a tile can be seen before the next one begins.
+static ssize_t read_persistent(json_pull *jp, char *buffer, size_t n) {
+	persistent_filter *pf = (persistent_filter *) jp->source;
+
+	while (1) {
+		ssize_t len = read(pf->read_from, buffer, n);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read from persistent filter");
+			exit(EXIT_READ);
+		}
+		return len;
+	}
+}
+
+persistent_filter *persistent_filter_acquire(const char *filter) {
+	if (pthread_mutex_lock(&persistent_lock) != 0) {
+		perror("pthread_mutex_lock (persistent filters)");
+		exit(EXIT_PTHREAD);
+	}
+
+	persistent_filter *pf = NULL;
+	auto f = idle_filters.find(filter);
+	if (f != idle_filters.end()) {
+		pf = f->second;
+		idle_filters.erase(f);
+	}
+
+	if (pthread_mutex_unlock(&persistent_lock) != 0) {
+		perror("pthread_mutex_unlock (persistent filters)");
+		exit(EXIT_PTHREAD);
+	}
+
+	if (pf != NULL) {
+		return pf;
+	}
+
+	pf = new persistent_filter;
+	pf->command = filter;
+
 	int write_to, read_from;
-	pid_t pid;
-	setup_filter(filter, &write_to, &read_from, &pid, z, x, y);
+	start_filter(filter, &write_to, &read_from, &pf->pid, {});
+
+	pf->write_fp = fdopen(write_to, "w");
+	if (pf->write_fp == NULL) {
+		perror("fdopen output to persistent filter");
+		exit(EXIT_OPEN);
+	}
+	pf->read_from = read_from;
+	pf->jp = json_begin(read_persistent, pf);
+
+	if (pthread_mutex_lock(&persistent_lock) != 0) {
+		perror("pthread_mutex_lock (persistent filters)");
+		exit(EXIT_PTHREAD);
+	}
+	persistent_filters.push_back(pf);
+	if (pthread_mutex_unlock(&persistent_lock) != 0) {
+		perror("pthread_mutex_unlock (persistent filters)");
+		exit(EXIT_PTHREAD);
+	}
+
+	return pf;
+}
+
+void persistent_filter_release(persistent_filter *pf) {
+	if (pthread_mutex_lock(&persistent_lock) != 0) {
+		perror("pthread_mutex_lock (persistent filters)");
+		exit(EXIT_PTHREAD);
+	}
+
+	idle_filters.insert(std::pair<std::string, persistent_filter *>(pf->command, pf));
+
+	if (pthread_mutex_unlock(&persistent_lock) != 0) {
+		perror("pthread_mutex_unlock (persistent filters)");
+		exit(EXIT_PTHREAD);
+	}
+}
+
+void persistent_filter_begin_tile(FILE *fp, unsigned z, unsigned x, unsigned y) {
+	fprintf(fp, "{\"type\":\"TileStart\",\"zoom\":%u,\"x\":%u,\"y\":%u}\n", z, x, y);
+}
+
+void persistent_filter_end_tile(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which) {
+	fprintf(fp, "{\"type\":\"TileEnd\",\"zoom\":%u,\"x\":%u,\"y\":%u}\n", z, x, y);
+
+	if (fflush(fp) != 0) {
+		if (errno == EPIPE) {
+			fprintf(stderr, "Persistent %s exited before the end of tile %u/%u/%u\n", which, z, x, y);
+			exit(EXIT_WRITE);
+		} else {
+			perror("fflush output to persistent filter");
+			exit(EXIT_WRITE);
+		}
+	}
+}
+
+// Called once tiling is done, to let the persistent filters finish and exit
+void persistent_filters_finish() {
+	for (auto pf : persistent_filters) {
+		if (fclose(pf->write_fp) != 0) {
+			perror("fclose output to persistent filter");
+			exit(EXIT_CLOSE);
+		}
+
+		// Anything that the filter writes after the end of its last tile is ignored
+		while (1) {
+			json_object *j = json_read(pf->jp);
+			if (j == NULL) {
+				break;
+			}
+			json_free(j);
+		}
+
+		json_end(pf->jp);
+		if (close(pf->read_from) != 0) {
+			perror("fclose input from persistent filter");
+			exit(EXIT_CLOSE);
+		}
 
+		while (1) {
+			int stat_loc;
+			if (waitpid(pf->pid, &stat_loc, 0) < 0) {
+				perror("waitpid for persistent filter\n");
+				exit(EXIT_PTHREAD);
+			}
+			if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
+				break;
+			}
+		}
+
+		delete pf;
+	}
+
+	persistent_filters.clear();
+	idle_filters.clear();
+}
+
+// The binary filter protocol (-aB): tiles go to and from the filter as vector tiles
+
+// The number of bits that prefilter coordinates are shifted right in the binary
+// protocol, to keep the tile's extent within what a vector tile can represent
+int binary_prefilter_shift(int z) {
+	return std::max(geometry_scale, 2 - z);
+}
+
+void write_binary_tile(FILE *fp, unsigned z, unsigned x, unsigned y, mvt_tile &tile, const char *which) {
+	if (!write_binary_frame(fp, z, x, y, tile.encode())) {
+		fprintf(stderr, "Persistent %s exited before the end of tile %u/%u/%u\n", which, z, x, y);
+		exit(EXIT_WRITE);
+	}
+}
+
+static void read_binary_tile(persistent_filter *pf, unsigned z, unsigned x, unsigned y, const char *which) {
+	unsigned fz, fx, fy;
+	std::string data;
+
+	if (!read_binary_frame(pf->read_from, fz, fx, fy, data)) {
+		fprintf(stderr, "Persistent %s exited before the end of tile %u/%u/%u\n", which, z, x, y);
+		exit(EXIT_READ);
+	}
+	if (fz != z || fx != x || fy != y) {
+		fprintf(stderr, "Filter output: tile %u/%u/%u does not match tile %u/%u/%u\n", fz, fx, fy, z, x, y);
+		exit(EXIT_READ);
+	}
+
+	bool was_compressed;
+	pf->frame.layers.clear();
+	if (!pf->frame.decode(data, was_compressed)) {
+		fprintf(stderr, "Filter output: couldn't decode tile %u/%u/%u\n", z, x, y);
+		exit(EXIT_MVT);
+	}
+}
+
+// Converts vector tile geometry, scaled from the specified extent, to a drawvec.
+// Polygon rings that were closed with closepath get their closing point back.
+static drawvec from_binary_feature(mvt_feature const &feature, double scale) {
+	drawvec dv;
+	size_t ring = 0;
+
+	for (size_t i = 0; i < feature.geometry.size(); i++) {
+		mvt_geometry const &g = feature.geometry[i];
+
+		if (g.op == mvt_moveto || g.op == mvt_lineto) {
+			if (g.op == mvt_moveto) {
+				ring = dv.size();
+			}
+			dv.push_back(draw(g.op == mvt_moveto ? VT_MOVETO : VT_LINETO, std::round(g.x * scale), std::round(g.y * scale)));
+		} else if (g.op == mvt_closepath && ring < dv.size()) {
+			dv.push_back(draw(VT_LINETO, dv[ring].x, dv[ring].y));
+		}
+	}
+
+	return dv;
+}
+
+// The type and string of an attribute value, as the GeoJSON reader would have stringified it
+static bool stringify_binary_value(mvt_value const &v, int &type, std::string &s) {
+	if (v.type == mvt_string) {
+		type = mvt_string;
+		s = v.string_value;
+	} else if (v.type == mvt_bool) {
+		type = mvt_bool;
+		s = v.numeric_value.bool_value ? "true" : "false";
+	} else if (v.type == mvt_null) {
+		return false;
+	} else {
+		type = mvt_double;
+		s = v.toString();
+	}
+
+	return true;
+}
+
+// Reads from the postfilter
+static std::vector<mvt_layer> parse_binary_layers(persistent_filter *pf, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	std::map<std::string, mvt_layer> ret;
+
+	read_binary_tile(pf, z, x, y, "postfilter");
+
+	for (auto const &in : pf->frame.layers) {
+		if (in.extent <= 0) {
+			fprintf(stderr, "Filter output: layer %s in tile %d/%u/%u has no extent\n", in.name.c_str(), z, x, y);
+			exit(EXIT_MVT);
+		}
+
+		for (auto const &infeature : in.features) {
+			if (infeature.type != mvt_point && infeature.type != mvt_linestring && infeature.type != mvt_polygon) {
+				continue;
+			}
+
+			drawvec dv = from_binary_feature(infeature, (double) extent / in.extent);
+
+			if (infeature.type == mvt_polygon) {
+				dv = clean_or_clip_poly(dv, 0, 0, false);
+				if (dv.size() < 3) {
+					dv.clear();
+				}
+			}
+			dv = remove_noop(dv, infeature.type, 0);
+			if (infeature.type == mvt_polygon) {
+				dv = close_poly(dv);
+			}
+
+			if (dv.size() == 0) {
+				continue;
+			}
+
+			if (ret.count(in.name) == 0) {
+				mvt_layer l;
+				l.name = in.name;
+				l.version = 2;
+				l.extent = extent;
+
+				ret.insert(std::pair<std::string, mvt_layer>(in.name, l));
+			}
+			auto l = ret.find(in.name);
+
+			mvt_feature feature;
+			feature.type = infeature.type;
+			feature.geometry = to_feature(dv);
+			feature.id = infeature.id;
+			feature.has_id = infeature.has_id;
+
+			auto fk = filtered_layer(in.name, z, layermaps, tiling_seg, layer_unmaps);
+
+			if (feature.type == mvt_point) {
+				fk->second.points++;
+			} else if (feature.type == mvt_linestring) {
+				fk->second.lines++;
+			} else if (feature.type == mvt_polygon) {
+				fk->second.polygons++;
+			}
+
+			for (size_t t = 0; t + 1 < infeature.tags.size(); t += 2) {
+				std::string const &key = in.keys[infeature.tags[t]];
+				mvt_value const &v = in.values[infeature.tags[t + 1]];
+
+				type_and_string attrib;
+				if (stringify_binary_value(v, attrib.type, attrib.string)) {
+					l->second.tag(feature, key, v);
+					add_to_file_keys(fk->second.file_keys, key, attrib);
+				}
+			}
+
+			l->second.features.push_back(feature);
+		}
+	}
+
+	std::vector<mvt_layer> final;
+	for (auto a : ret) {
+		final.push_back(a.second);
+	}
+	return final;
+}
+
+// Reads from the prefilter, one feature at a time from the tile that it sent back
+serial_feature parse_binary_feature(persistent_filter *pf, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter) {
+	serial_feature sf;
+
+	if (!pf->in_frame) {
+		read_binary_tile(pf, z, x, y, "prefilter");
+		pf->in_frame = true;
+		pf->frame_layer = 0;
+		pf->frame_feature = 0;
+	}
+
+	while (pf->frame_layer < pf->frame.layers.size()) {
+		mvt_layer const &in = pf->frame.layers[pf->frame_layer];
+		if (pf->frame_feature >= in.features.size()) {
+			pf->frame_layer++;
+			pf->frame_feature = 0;
+			continue;
+		}
+		mvt_feature const &infeature = in.features[pf->frame_feature++];
+
+		if (infeature.type != mvt_point && infeature.type != mvt_linestring && infeature.type != mvt_polygon) {
+			continue;
+		}
+		if (in.extent <= 0) {
+			fprintf(stderr, "Filter output: layer %s in tile %d/%u/%u has no extent\n", in.name.c_str(), z, x, y);
+			exit(EXIT_MVT);
+		}
+
+		drawvec dv = from_binary_feature(infeature, (double) (1LL << (32 - z)) / in.extent);
+
+		// Round to the precision of the serialized geometry
+		double scale = 1LL << geometry_scale;
+		for (size_t i = 0; i < dv.size(); i++) {
+			dv[i].x = std::round(dv[i].x / scale) * scale;
+			dv[i].y = std::round(dv[i].y / scale) * scale;
+		}
+
+		if (dv.size() == 0) {
+			continue;
+		}
+
+		sf.t = infeature.type;
+		sf.segment = tiling_seg;
+		sf.geometry = dv;
+		sf.seq = 0;
+		sf.index = 0;
+		sf.extent = 0;
+		sf.has_id = infeature.has_id;
+		sf.id = infeature.id;
+		set_bbox(sf);
+
+		auto fk = filtered_layer(in.name, z, layermaps, tiling_seg, layer_unmaps);
+		sf.layer = fk->second.id;
+
+		if (!postfilter) {
+			if (sf.t == mvt_point) {
+				fk->second.points++;
+			} else if (sf.t == mvt_linestring) {
+				fk->second.lines++;
+			} else if (sf.t == mvt_polygon) {
+				fk->second.polygons++;
+			}
+		}
+
+		for (size_t t = 0; t + 1 < infeature.tags.size(); t += 2) {
+			std::string const &key = in.keys[infeature.tags[t]];
+			mvt_value const &v = in.values[infeature.tags[t + 1]];
+
+			// The prefilter's equivalents of the GeoJSON "tippecanoe" element
+			if (key == "$index") {
+				sf.index = mvt_value_to_long_long(v);
+				continue;
+			} else if (key == "$sequence") {
+				sf.seq = mvt_value_to_long_long(v);
+				continue;
+			} else if (key == "$extent") {
+				sf.extent = mvt_value_to_long_long(v);
+				continue;
+			} else if (key == "$dropped") {
+				if (v.type == mvt_bool && v.numeric_value.bool_value) {
+					sf.dropped = true;
+				}
+				continue;
+			}
+
+			serial_val sv;
+			if (stringify_binary_value(v, sv.type, sv.s)) {
+				sf.full_keys.push_back(key);
+				sf.full_values.push_back(sv);
+
+				if (!postfilter) {
+					type_and_string attrib;
+					attrib.string = sv.s;
+					attrib.type = sv.type;
+					add_to_file_keys(fk->second.file_keys, key, attrib);
+				}
+			}
+		}
+
+		return sf;
+	}
+
+	pf->in_frame = false;
+	pf->frame.layers.clear();
+	sf.t = -1;
+	return sf;
+}
+
+std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layers, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
 	writer_arg wa;
-	wa.write_to = write_to;
 	wa.layers = &layers;
 	wa.z = z;
 	wa.x = x;
 	wa.y = y;
 	wa.extent = extent;
 
+	if (additional[A_BINARY_FILTERS]) {
+		persistent_filter *pf = persistent_filter_acquire(filter);
+		wa.fp = pf->write_fp;
+		wa.persistent = true;
+
+		pthread_t writer;
+		if (pthread_create(&writer, NULL, run_binary_writer, &wa) != 0) {
+			perror("pthread_create (filter writer)");
+			exit(EXIT_PTHREAD);
+		}
+
+		std::vector<mvt_layer> nlayers = parse_binary_layers(pf, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+
+		void *ret;
+		if (pthread_join(writer, &ret) != 0) {
+			perror("pthread_join filter writer");
+			exit(EXIT_PTHREAD);
+		}
+
+		persistent_filter_release(pf);
+		return nlayers;
+	}
+
+	if (additional[A_PERSISTENT_FILTERS]) {
+		persistent_filter *pf = persistent_filter_acquire(filter);
+		wa.fp = pf->write_fp;
+		wa.persistent = true;
+
+		pthread_t writer;
+		if (pthread_create(&writer, NULL, run_writer, &wa) != 0) {
+			perror("pthread_create (filter writer)");
+			exit(EXIT_PTHREAD);
+		}
+
+		std::vector<mvt_layer> nlayers = parse_layers(pf->jp, z, x, y, layermaps, tiling_seg, layer_unmaps, extent, true);
+
+		void *ret;
+		if (pthread_join(writer, &ret) != 0) {
+			perror("pthread_join filter writer");
+			exit(EXIT_PTHREAD);
+		}
+
+		persistent_filter_release(pf);
+		return nlayers;
+	}
+
+	int write_to, read_from;
+	pid_t pid;
+	setup_filter(filter, &write_to, &read_from, &pid, z, x, y);
+
+	wa.fp = fdopen(write_to, "w");
+	if (wa.fp == NULL) {
+		perror("fdopen (pipe writer)");
+		exit(EXIT_OPEN);
+	}
+	wa.persistent = false;
+
 	pthread_t writer;
 	if (pthread_create(&writer, NULL, run_writer, &wa) != 0) {
 		perror("pthread_create (filter writer)");
 		exit(EXIT_PTHREAD);
 	}
 
-	std::vector<mvt_layer> nlayers = parse_layers(read_from, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+	FILE *f = fdopen(read_from, "r");
+	if (f == NULL) {
+		perror("fdopen filter output");
+		exit(EXIT_OPEN);
+	}
+	json_pull *jp = json_begin_file(f);
+
+	std::vector<mvt_layer> nlayers = parse_layers(jp, z, x, y, layermaps, tiling_seg, layer_unmaps, extent, false);
+
+	json_end(jp);
+	if (fclose(f) != 0) {
+		perror("fclose postfilter output");
+		exit(EXIT_CLOSE);
+	}
 
 	while (1) {
 		int stat_loc;
@@ -1,3 +1,28 @@
 std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layer, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent);
 void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y);
-serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool filters);
+serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool filters, bool persistent);
+
+// A filter process that is kept running to filter one tile after another (-aF or -aB)
+struct persistent_filter {
+	std::string command;
+	pid_t pid;
+	FILE *write_fp;
+	int read_from;
+	json_pull *jp;
+
+	// With -aB, the tile that the prefilter sent back, and the next feature to be read from it
+	mvt_tile frame;
+	bool in_frame = false;
+	size_t frame_layer = 0;
+	size_t frame_feature = 0;
+};
+
+persistent_filter *persistent_filter_acquire(const char *filter);
+void persistent_filter_release(persistent_filter *pf);
+void persistent_filter_begin_tile(FILE *fp, unsigned z, unsigned x, unsigned y);
+void persistent_filter_end_tile(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which);
+void persistent_filters_finish();
+
+int binary_prefilter_shift(int z);
+void write_binary_tile(FILE *fp, unsigned z, unsigned x, unsigned y, mvt_tile &tile, const char *which);
+serial_feature parse_binary_feature(persistent_filter *pf, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter);
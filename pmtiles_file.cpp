@@ -1,7 +1,7 @@
 #include <unordered_map>
 #include <vector>
-#include <fstream>
 #include <string.h>
+#include <errno.h>
 #include <algorithm>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -129,203 +129,202 @@ std::string metadata_to_pmtiles_json(metadata m) {
 	return compressed;
 }
 
-void mbtiles_map_image_to_pmtiles(char *fname, metadata m, bool tile_compression, bool fquiet, bool fquiet_progress) {
-	sqlite3 *db;
-
-	if (sqlite3_open(fname, &db) != SQLITE_OK) {
-		fprintf(stderr, "%s: %s\n", fname, sqlite3_errmsg(db));
-		exit(EXIT_SQLITE);
-	}
-
-	char *err = NULL;
-	if (sqlite3_exec(db, "PRAGMA integrity_check;", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: integrity_check: %s\n", fname, err);
-		exit(EXIT_SQLITE);
+static void pmtiles_fwrite(const char *data, size_t len, FILE *fp, const char *fname) {
+	if (fwrite(data, sizeof(char), len, fp) != len) {
+		fprintf(stderr, "%s: Write failed: %s\n", fname, strerror(errno));
+		exit(EXIT_WRITE);
 	}
+}
 
-	// materialize list of all tile IDs
-	std::vector<uint64_t> tile_ids;
-
-	{
-		const char *sql = "SELECT zoom_level, tile_column, tile_row FROM map";
-		sqlite3_stmt *stmt;
-
-		if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-			fprintf(stderr, "%s: select failed: %s\n", fname, sqlite3_errmsg(db));
-			exit(EXIT_SQLITE);
-		}
-
-		while (sqlite3_step(stmt) == SQLITE_ROW) {
-			int zoom = sqlite3_column_int(stmt, 0);
-			int x = sqlite3_column_int(stmt, 1);
-			int sorty = sqlite3_column_int(stmt, 2);
-			int y = (1LL << zoom) - 1 - sorty;
-			uint64_t res = pmtiles::zxy_to_tileid(zoom, x, y);
-			tile_ids.push_back(res);
-		}
+pmtiles_writer *pmtiles_open(const char *fname, char **argv) {
+	pmtiles_writer *pw = new pmtiles_writer;
+	pw->fname = fname;
 
-		sqlite3_finalize(stmt);
+	pw->out = fopen(fname, "wb");
+	if (pw->out == NULL) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], fname, strerror(errno));
+		exit(EXIT_OPEN);
 	}
 
-	std::sort(tile_ids.begin(), tile_ids.end());
+	// Tile data is appended here as the tiles are made, and copied
+	// into the archive in clustered order once all tiles are known.
+	std::string tmpname = std::string(fname) + ".tmp";
+	pw->tmp = fopen(tmpname.c_str(), "w+b");
+	if (pw->tmp == NULL) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], tmpname.c_str(), strerror(errno));
+		exit(EXIT_OPEN);
+	}
+	if (unlink(tmpname.c_str()) != 0) {
+		perror(tmpname.c_str());
+		exit(EXIT_UNLINK);
+	}
 
-	std::unordered_map<std::string, std::pair<unsigned long long, unsigned long>> hash_to_offset_len;
-	std::vector<pmtiles::entryv3> entries;
-	unsigned long long offset = 0;
+	return pw;
+}
 
-	std::string tmpname = (std::string(fname) + ".tmp");
+void pmtiles_write_tile(pmtiles_writer *pw, int z, int tx, int ty, const char *data, int size) {
+	// Store tiles by a hash of their contents (fnv1a 64-bit),
+	// as mbtiles_write_tile() does, so repeated tiles are written once
+	const unsigned long long fnv_offset_basis = 14695981039346656037u;
+	const unsigned long long fnv_prime = 1099511628211u;
+	unsigned long long h = fnv_offset_basis;
+	for (int i = 0; i < size; i++) {
+		h ^= (unsigned char) data[i];
+		h *= fnv_prime;
+	}
 
-	// write tile data to tempfile in clustered order
-	{
-		const char *map_sql = "SELECT tile_id FROM map WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?";
-		sqlite3_stmt *map_stmt;
+	if (pw->images.count(h) == 0) {
+		pw->images.emplace(h, std::make_pair(pw->tmp_len, (unsigned long) size));
+		pmtiles_fwrite(data, size, pw->tmp, pw->fname.c_str());
+		pw->tmp_len += size;
+	}
 
-		if (sqlite3_prepare_v2(db, map_sql, -1, &map_stmt, NULL) != SQLITE_OK) {
-			fprintf(stderr, "%s: select failed: %s\n", fname, sqlite3_errmsg(db));
-			exit(EXIT_SQLITE);
-		}
+	pw->tiles[pmtiles::zxy_to_tileid(z, tx, ty)] = h;
+}
 
-		const char *image_sql = "SELECT tile_data FROM images WHERE tile_id = ?";
-		sqlite3_stmt *image_stmt;
+void pmtiles_erase_tile(pmtiles_writer *pw, int z, int tx, int ty) {
+	pw->tiles.erase(pmtiles::zxy_to_tileid(z, tx, ty));
+}
 
-		if (sqlite3_prepare_v2(db, image_sql, -1, &image_stmt, NULL) != SQLITE_OK) {
-			fprintf(stderr, "%s: select failed: %s\n", fname, sqlite3_errmsg(db));
-			exit(EXIT_SQLITE);
+void pmtiles_erase_zoom(pmtiles_writer *pw, int z) {
+	// The tile data stays in the temporary file, but nothing
+	// refers to it anymore, so it is not copied into the archive
+	for (auto ti = pw->tiles.begin(); ti != pw->tiles.end();) {
+		if (pmtiles::tileid_to_zxy(ti->first).z == z) {
+			ti = pw->tiles.erase(ti);
+		} else {
+			++ti;
 		}
+	}
+}
 
-		std::ofstream tmp_ostream;
-
-		tmp_ostream.open(tmpname.c_str(), std::ios::out | std::ios::binary);
+void pmtiles_close(pmtiles_writer *pw, metadata m, bool tile_compression, bool fquiet, bool fquiet_progress) {
+	const char *fname = pw->fname.c_str();
 
-		int idx = 0;
-		int progress_reported = -1;
-		for (auto const &tile_id : tile_ids) {
-			idx = idx + 1;
-			double progress = ((double) idx / tile_ids.size()) * 100;
-			pmtiles::zxy zxy = pmtiles::tileid_to_zxy(tile_id);
-			if (!fquiet && !fquiet_progress && progress_time() && (int) progress != progress_reported) {
-				fprintf(stderr, "  %3.1f%%  %d/%u/%u  \r", progress, zxy.z, zxy.x, zxy.y);
-				progress_reported = (int) progress;
-				fflush(stderr);
-			}
-			sqlite3_bind_int(map_stmt, 1, zxy.z);
-			sqlite3_bind_int(map_stmt, 2, zxy.x);
-			sqlite3_bind_int(map_stmt, 3, (1LL << zxy.z) - 1 - zxy.y);
+	std::vector<std::pair<uint64_t, unsigned long long>> tiles(pw->tiles.begin(), pw->tiles.end());
+	pw->tiles.clear();
+	std::sort(tiles.begin(), tiles.end());
 
-			if (sqlite3_step(map_stmt) != SQLITE_ROW) {
-				fprintf(stderr, "Corrupt mbtiles file: null entry in map table\n");
-				exit(EXIT_SQLITE);
-			}
+	// lay out the distinct tile contents in clustered order
+	std::unordered_map<unsigned long long, std::pair<unsigned long long, unsigned long>> hash_to_offset_len;
+	std::vector<std::pair<uint64_t, unsigned long long>> copies;  // tile ID, hash of each distinct tile, in archive order
+	std::vector<pmtiles::entryv3> entries;
+	unsigned long long offset = 0;
 
-			std::string hsh{reinterpret_cast<const char *>(sqlite3_column_text(map_stmt, 0))};
+	for (auto const &tile : tiles) {
+		uint64_t tile_id = tile.first;
+		auto f = hash_to_offset_len.find(tile.second);
 
-			if (hash_to_offset_len.count(hsh) > 0) {
-				auto offset_len = hash_to_offset_len.at(hsh);
-				if (entries.size() > 0 && tile_id == entries[entries.size() - 1].tile_id + 1 && entries[entries.size() - 1].offset == std::get<0>(offset_len)) {
-					entries[entries.size() - 1].run_length++;
-				} else {
-					entries.emplace_back(tile_id, std::get<0>(offset_len), std::get<1>(offset_len), 1);
-				}
+		if (f != hash_to_offset_len.end()) {
+			if (entries.size() > 0 && tile_id == entries[entries.size() - 1].tile_id + entries[entries.size() - 1].run_length && entries[entries.size() - 1].offset == f->second.first) {
+				entries[entries.size() - 1].run_length++;
 			} else {
-				sqlite3_bind_text(image_stmt, 1, hsh.data(), hsh.size(), SQLITE_STATIC);
-				if (sqlite3_step(image_stmt) != SQLITE_ROW) {
-					fprintf(stderr, "Corrupt mbtiles file: null entry in image table\n");
-					exit(EXIT_SQLITE);
-				}
-
-				int len = sqlite3_column_bytes(image_stmt, 0);
-				const char *blob = (const char *) sqlite3_column_blob(image_stmt, 0);
-
-				tmp_ostream.write(blob, len);
-
-				entries.emplace_back(tile_id, offset, len, 1);
-				hash_to_offset_len.emplace(hsh, std::make_pair(offset, len));
-				offset += len;
-
-				sqlite3_reset(image_stmt);
-				sqlite3_clear_bindings(image_stmt);
+				entries.emplace_back(tile_id, f->second.first, f->second.second, 1);
 			}
+		} else {
+			unsigned long len = pw->images.at(tile.second).second;
 
-			sqlite3_reset(map_stmt);
-			sqlite3_clear_bindings(map_stmt);
+			entries.emplace_back(tile_id, offset, len, 1);
+			hash_to_offset_len.emplace(tile.second, std::make_pair(offset, len));
+			copies.emplace_back(tile_id, tile.second);
+			offset += len;
 		}
-		tmp_ostream.close();
-		sqlite3_finalize(map_stmt);
-		sqlite3_finalize(image_stmt);
 	}
 
 	// finalize PMTiles archive.
-	{
-		std::sort(entries.begin(), entries.end(), pmtiles::entryv3_cmp);
-
-		std::string root_bytes;
-		std::string leaves_bytes;
-		int num_leaves;
-		std::tie(root_bytes, leaves_bytes, num_leaves) = make_root_leaves(&compress_fn, pmtiles::COMPRESSION_GZIP, entries);
-
-		pmtiles::headerv3 header;
-
-		header.min_zoom = m.minzoom;
-		header.max_zoom = m.maxzoom;
-		header.min_lon_e7 = m.minlon * 10000000;
-		header.min_lat_e7 = m.minlat * 10000000;
-		header.max_lon_e7 = m.maxlon * 10000000;
-		header.max_lat_e7 = m.maxlat * 10000000;
-		header.center_zoom = m.center_z;
-		header.center_lon_e7 = m.center_lon * 10000000;
-		header.center_lat_e7 = m.center_lat * 10000000;
-
-		std::string json_metadata = metadata_to_pmtiles_json(m);
+	std::string root_bytes;
+	std::string leaves_bytes;
+	int num_leaves;
+	std::tie(root_bytes, leaves_bytes, num_leaves) = make_root_leaves(&compress_fn, pmtiles::COMPRESSION_GZIP, entries);
+
+	pmtiles::headerv3 header;
+
+	header.min_zoom = m.minzoom;
+	header.max_zoom = m.maxzoom;
+	header.min_lon_e7 = m.minlon * 10000000;
+	header.min_lat_e7 = m.minlat * 10000000;
+	header.max_lon_e7 = m.maxlon * 10000000;
+	header.max_lat_e7 = m.maxlat * 10000000;
+	header.center_zoom = m.center_z;
+	header.center_lon_e7 = m.center_lon * 10000000;
+	header.center_lat_e7 = m.center_lat * 10000000;
+
+	std::string json_metadata = metadata_to_pmtiles_json(m);
+
+	header.clustered = 0x1;
+	header.internal_compression = pmtiles::COMPRESSION_GZIP;
+
+	if (tile_compression) {
+		header.tile_compression = pmtiles::COMPRESSION_GZIP;
+	} else {
+		header.tile_compression = pmtiles::COMPRESSION_NONE;
+	}
 
-		sqlite3_close(db);
+	if (m.format == "pbf") {
+		header.tile_type = pmtiles::TILETYPE_MVT;
+	} else if (m.format == "png") {
+		header.tile_type = pmtiles::TILETYPE_PNG;
+	} else {
+		header.tile_type = pmtiles::TILETYPE_UNKNOWN;
+	}
 
-		header.clustered = 0x1;
-		header.internal_compression = pmtiles::COMPRESSION_GZIP;
+	header.root_dir_offset = 127;
+	header.root_dir_bytes = root_bytes.size();
+
+	header.json_metadata_offset = header.root_dir_offset + header.root_dir_bytes;
+	header.json_metadata_bytes = json_metadata.size();
+	header.leaf_dirs_offset = header.json_metadata_offset + header.json_metadata_bytes;
+	header.leaf_dirs_bytes = leaves_bytes.size();
+	header.tile_data_offset = header.leaf_dirs_offset + header.leaf_dirs_bytes;
+	header.tile_data_bytes = offset;
+
+	header.addressed_tiles_count = tiles.size();
+	header.tile_entries_count = entries.size();
+	header.tile_contents_count = hash_to_offset_len.size();
+
+	auto header_str = header.serialize();
+	pmtiles_fwrite(header_str.data(), header_str.size(), pw->out, fname);
+	pmtiles_fwrite(root_bytes.data(), root_bytes.size(), pw->out, fname);
+	pmtiles_fwrite(json_metadata.data(), json_metadata.size(), pw->out, fname);
+	pmtiles_fwrite(leaves_bytes.data(), leaves_bytes.size(), pw->out, fname);
+
+	// copy the tile data from the temporary file
+	if (fflush(pw->tmp) != 0) {
+		perror("flush pmtiles tile data");
+		exit(EXIT_WRITE);
+	}
 
-		if (tile_compression) {
-			header.tile_compression = pmtiles::COMPRESSION_GZIP;
-		} else {
-			header.tile_compression = pmtiles::COMPRESSION_NONE;
+	std::string buf;
+	int progress_reported = -1;
+	for (size_t i = 0; i < copies.size(); i++) {
+		double progress = ((double) (i + 1) / copies.size()) * 100;
+		if (!fquiet && !fquiet_progress && progress_time() && (int) progress != progress_reported) {
+			pmtiles::zxy zxy = pmtiles::tileid_to_zxy(copies[i].first);
+			fprintf(stderr, "  %3.1f%%  %d/%u/%u  \r", progress, zxy.z, zxy.x, zxy.y);
+			progress_reported = (int) progress;
+			fflush(stderr);
 		}
 
-		if (m.format == "pbf") {
-			header.tile_type = pmtiles::TILETYPE_MVT;
-		} else if (m.format == "png") {
-			header.tile_type = pmtiles::TILETYPE_PNG;
-		} else {
-			header.tile_type = pmtiles::TILETYPE_UNKNOWN;
+		auto const &image = pw->images.at(copies[i].second);
+		buf.resize(image.second);
+		if (pread(fileno(pw->tmp), (void *) buf.data(), image.second, image.first) != (ssize_t) image.second) {
+			perror("read pmtiles tile data");
+			exit(EXIT_READ);
 		}
 
-		header.root_dir_offset = 127;
-		header.root_dir_bytes = root_bytes.size();
-
-		header.json_metadata_offset = header.root_dir_offset + header.root_dir_bytes;
-		header.json_metadata_bytes = json_metadata.size();
-		header.leaf_dirs_offset = header.json_metadata_offset + header.json_metadata_bytes;
-		header.leaf_dirs_bytes = leaves_bytes.size();
-		header.tile_data_offset = header.leaf_dirs_offset + header.leaf_dirs_bytes;
-		header.tile_data_bytes = offset;
-
-		header.addressed_tiles_count = tile_ids.size();
-		header.tile_entries_count = entries.size();
-		header.tile_contents_count = hash_to_offset_len.size();
-
-		std::ifstream tmp_istream(tmpname.c_str(), std::ios::in | std::ios_base::binary);
-
-		std::ofstream ostream;
-		ostream.open(fname, std::ios::out | std::ios::binary);
-
-		auto header_str = header.serialize();
-		ostream.write(header_str.data(), header_str.length());
-		ostream.write(root_bytes.data(), root_bytes.length());
-		ostream.write(json_metadata.data(), json_metadata.size());
-		ostream.write(leaves_bytes.data(), leaves_bytes.length());
-		ostream << tmp_istream.rdbuf();
+		pmtiles_fwrite(buf.data(), buf.size(), pw->out, fname);
+	}
 
-		tmp_istream.close();
-		unlink(tmpname.c_str());
-		ostream.close();
+	if (fclose(pw->tmp) != 0) {
+		perror("close pmtiles tile data");
+		exit(EXIT_CLOSE);
+	}
+	if (fclose(pw->out) != 0) {
+		fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+		exit(EXIT_CLOSE);
 	}
+
+	delete pw;
 }
 
 // this should go away if we get rid of temporary metadata DBs.
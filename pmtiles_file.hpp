@@ -1,13 +1,31 @@
 #ifndef PMTILES_FILE_HPP
 #define PMTILES_FILE_HPP
 
+#include <stdio.h>
+#include <unordered_map>
 #include "pmtiles/pmtiles.hpp"
 #include "mbtiles.hpp"
 
+struct pmtiles_writer {
+	std::string fname;
+	FILE *out = NULL;  // the archive
+	FILE *tmp = NULL;  // tile data, in the order the tiles were written
+	unsigned long long tmp_len = 0;
+
+	// content hash -> offset and length of that content in the temporary file
+	std::unordered_map<unsigned long long, std::pair<unsigned long long, unsigned long>> images;
+	// tile ID -> content hash of that tile
+	std::unordered_map<uint64_t, unsigned long long> tiles;
+};
+
 bool pmtiles_has_suffix(const char *filename);
 void check_pmtiles(const char *filename, char **argv, bool forcetable);
 
-void mbtiles_map_image_to_pmtiles(char *dbname, metadata m, bool tile_compression, bool quiet, bool quiet_progress);
+pmtiles_writer *pmtiles_open(const char *fname, char **argv);
+void pmtiles_write_tile(pmtiles_writer *pw, int z, int tx, int ty, const char *data, int size);
+void pmtiles_erase_tile(pmtiles_writer *pw, int z, int tx, int ty);
+void pmtiles_erase_zoom(pmtiles_writer *pw, int z);
+void pmtiles_close(pmtiles_writer *pw, metadata m, bool tile_compression, bool quiet, bool quiet_progress);
 
 std::vector<pmtiles::entry_zxy> pmtiles_entries_tms(const char *pmtiles_map, int minzoom, int maxzoom);
 std::pair<uint64_t, uint32_t> pmtiles_get_tile(const char *pmtiles_map, int z, int x, int y);
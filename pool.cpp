@@ -1,154 +1,192 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
-#include <math.h>
-#include "main.hpp"
-#include "memfile.hpp"
+#include <unistd.h>
+#include <string_view>
+#include <functional>
 #include "pool.hpp"
 #include "errors.hpp"
 
-int swizzlecmp(const char *a, const char *b) {
-	ssize_t alen = strlen(a);
-	ssize_t blen = strlen(b);
+static unsigned long long pool_hash(const char *s, size_t len, char type) {
+	unsigned long long h = std::hash<std::string_view>{}(std::string_view(s, len));
+	return h ^ (((unsigned long long) (unsigned char) type + 1) * 0x9E3779B97F4A7C15ULL);
+}
 
-	if (strcmp(a, b) == 0) {
-		return 0;
-	}
+static void pool_pwrite(int fd, const char *buf, size_t len, long long off) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0) {
+			perror("write string pool");
+			exit(EXIT_WRITE);
+		}
 
-	long long hash1 = 0, hash2 = 0;
-	for (ssize_t i = alen - 1; i >= 0; i--) {
-		hash1 = (hash1 * 37 + a[i]) & INT_MAX;
+		buf += n;
+		len -= n;
+		off += n;
 	}
-	for (ssize_t i = blen - 1; i >= 0; i--) {
-		hash2 = (hash2 * 37 + b[i]) & INT_MAX;
+}
+
+void pool_init(struct string_pool *pool, int fd, size_t budget) {
+	pool->fd = fd;
+	pool->budget = budget;
+	pool->chunks.resize(budget / POOL_CHUNK + 1, NULL);
+}
+
+static void pool_count_memory(struct string_pool *pool, size_t bytes) {
+	if ((pool->memory += bytes) > pool->budget) {
+		// If the pool and hash table get to be larger than their share of
+		// physical memory, lookups will start thrashing. Stop keeping new
+		// strings in memory, and write them to the file instead.
+		pool->spilling = true;
 	}
+}
 
-	int h1 = hash1, h2 = hash2;
-	if (h1 == h2) {
-		return strcmp(a, b);
+void pool_finish_cursor(struct string_pool *pool, struct pool_cursor *cursor) {
+	if (cursor->buf != NULL && cursor->spilled) {
+		pool_pwrite(pool->fd, cursor->buf, cursor->used, cursor->chunk * POOL_CHUNK);
+		delete[] cursor->buf;
 	}
 
-	return h1 - h2;
+	cursor->chunk = -1;
+	cursor->buf = NULL;
+	cursor->len = 0;
+	cursor->used = 0;
+	cursor->spilled = false;
 }
 
-long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
-	unsigned long *sp = &treefile->tree;
-	size_t depth = 0;
+// Give the cursor a region with room for at least need bytes
+static void pool_new_region(struct string_pool *pool, struct pool_cursor *cursor, size_t need) {
+	pool_finish_cursor(pool, cursor);
 
-	// In typical data, traversal depth generally stays under 2.5x
-	size_t max = 3 * log(treefile->off / sizeof(struct stringpool)) / log(2);
-	if (max < 30) {
-		max = 30;
-	}
+	size_t n = (need + POOL_CHUNK - 1) / POOL_CHUNK;
+	long long chunk = pool->next_chunk.fetch_add(n);
 
-	while (*sp != 0) {
-		int cmp = swizzlecmp(s, poolfile->map.c_str() + ((struct stringpool *) (treefile->map.c_str() + *sp))->off + 1);
+	cursor->chunk = chunk;
+	cursor->len = n * POOL_CHUNK;
+	cursor->buf = new char[cursor->len]();
+	cursor->spilled = pool->spilling || chunk + n > pool->chunks.size();
 
-		if (cmp == 0) {
-			cmp = type - (poolfile->map.c_str() + ((struct stringpool *) (treefile->map.c_str() + *sp))->off)[0];
+	if (!cursor->spilled) {
+		// Chunks that have been claimed are never claimed again, so no one
+		// else will touch these entries
+		for (size_t i = 0; i < n; i++) {
+			pool->chunks[chunk + i] = cursor->buf + i * POOL_CHUNK;
 		}
 
-		if (cmp < 0) {
-			sp = &(((struct stringpool *) (treefile->map.c_str() + *sp))->left);
-		} else if (cmp > 0) {
-			sp = &(((struct stringpool *) (treefile->map.c_str() + *sp))->right);
-		} else {
-			return ((struct stringpool *) (treefile->map.c_str() + *sp))->off;
-		}
+		pthread_mutex_lock(&pool->regions_lock);
+		pool->regions.push_back(pool_region{chunk, cursor->buf, cursor->len});
+		pthread_mutex_unlock(&pool->regions_lock);
 
-		depth++;
-		if (depth > max) {
-			// Search is very deep, so string is probably unique.
-			// Add it to the pool without adding it to the search tree.
-			// This might go either to memory or the file, depending on whether
-			// the pool is full yet.
-
-			long long off = poolfile->off;
-			if (memfile_write(poolfile, &type, 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_WRITE);
-			}
-			if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_WRITE);
-			}
-			return off;
-		}
+		pool_count_memory(pool, cursor->len);
 	}
+}
 
-	// Size of memory divided by 10 from observation of OOM errors (when supposedly
-	// 20% of memory is full) and onset of thrashing (when supposedly 15% of memory
-	// is full) on ECS.
-	if ((size_t) (poolfile->off + treefile->off) > memsize / CPUS / 10) {
-		// If the pool and search tree get to be larger than physical memory,
-		// then searching will start thrashing. Switch to appending strings
-		// to the file instead of keeping them in memory.
+static void pool_grow(struct string_pool *pool, struct pool_shard *shard) {
+	std::vector<pool_entry> table;
+	table.resize(shard->table.size() == 0 ? 256 : shard->table.size() * 2, pool_entry{0, -1});
+	size_t mask = table.size() - 1;
 
-		if (poolfile->fp == NULL) {
-			memfile_full(poolfile);
+	for (auto const &e : shard->table) {
+		if (e.off >= 0) {
+			size_t i = e.hash & mask;
+			while (table[i].off >= 0) {
+				i = (i + 1) & mask;
+			}
+			table[i] = e;
 		}
 	}
 
-	if (poolfile->fp != NULL) {
-		// We are now appending to the file, so don't try to keep tree references
-		// to the newly-added strings.
+	pool_count_memory(pool, (table.size() - shard->table.size()) * sizeof(pool_entry));
+	shard->table.swap(table);
+}
 
-		long long off = poolfile->off;
-		if (memfile_write(poolfile, &type, 1) < 0) {
-			perror("memfile write");
-			exit(EXIT_WRITE);
-		}
-		if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
-			perror("memfile write");
-			exit(EXIT_WRITE);
+long long addpool(struct string_pool *pool, struct pool_cursor *cursor, const char *s, char type) {
+	size_t len = strlen(s);
+	unsigned long long hash = pool_hash(s, len, type);
+	struct pool_shard *shard = &pool->shards[hash >> 56];
+
+	pthread_mutex_lock(&shard->lock);
+
+	size_t mask = shard->table.size() - 1;
+	size_t i = hash & mask;
+	if (shard->table.size() != 0) {
+		while (shard->table[i].off >= 0) {
+			if (shard->table[i].hash == hash) {
+				long long off = shard->table[i].off;
+				const char *there = pool->chunks[off / POOL_CHUNK] + off % POOL_CHUNK;
+
+				if (there[0] == type && strcmp(there + 1, s) == 0) {
+					pthread_mutex_unlock(&shard->lock);
+					return off;
+				}
+			}
+
+			i = (i + 1) & mask;
 		}
-		return off;
 	}
 
-	// *sp is probably in the memory-mapped file, and will move if the file grows.
-	long long ssp;
-	if (sp == &treefile->tree) {
-		ssp = -1;
-	} else {
-		ssp = ((char *) sp) - treefile->map.c_str();
-	}
+	// Not there yet, so add it to this thread's region of the pool.
+	// The shard stays locked so that no other thread can add it too.
 
-	long long off = poolfile->off;
-	if (memfile_write(poolfile, &type, 1) < 0) {
-		perror("memfile write");
-		exit(EXIT_WRITE);
-	}
-	if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
-		perror("memfile write");
-		exit(EXIT_WRITE);
+	if (cursor->buf == NULL || cursor->used + len + 2 > cursor->len) {
+		pool_new_region(pool, cursor, len + 2);
 	}
 
-	if (off >= LONG_MAX || treefile->off >= LONG_MAX) {
-		// Tree or pool is bigger than 2GB
-		static bool warned = false;
-		if (!warned) {
-			fprintf(stderr, "Warning: string pool is very large.\n");
-			warned = true;
+	long long off = cursor->chunk * POOL_CHUNK + cursor->used;
+	cursor->buf[cursor->used] = type;
+	memcpy(cursor->buf + cursor->used + 1, s, len + 1);
+	cursor->used += len + 2;
+	pool->bytes += len + 2;
+
+	// Strings that have been spilled to the file can't be looked up again,
+	// and once memory is full the table doesn't grow any more.
+	if (!cursor->spilled) {
+		if ((shard->count + 1) * 2 > shard->table.size()) {
+			if (pool->spilling && shard->table.size() != 0) {
+				pthread_mutex_unlock(&shard->lock);
+				return off;
+			}
+
+			pool_grow(pool, shard);
+			mask = shard->table.size() - 1;
+			i = hash & mask;
+			while (shard->table[i].off >= 0) {
+				i = (i + 1) & mask;
+			}
 		}
-		return off;
+
+		shard->table[i] = pool_entry{hash, off};
+		shard->count++;
 	}
 
-	struct stringpool tsp;
-	tsp.left = 0;
-	tsp.right = 0;
-	tsp.off = off;
+	pthread_mutex_unlock(&shard->lock);
+	return off;
+}
 
-	long long p = treefile->off;
-	if (memfile_write(treefile, &tsp, sizeof(struct stringpool)) < 0) {
-		perror("memfile write");
-		exit(EXIT_WRITE);
+long long pool_size(struct string_pool *pool) {
+	return pool->next_chunk * POOL_CHUNK;
+}
+
+// Once every cursor is finished, write the regions that were kept in memory
+// to the pool file, and return the size of the file
+long long pool_finish(struct string_pool *pool) {
+	for (auto const &r : pool->regions) {
+		pool_pwrite(pool->fd, r.buf, r.len, r.chunk * POOL_CHUNK);
+		delete[] r.buf;
 	}
+	std::vector<pool_region>().swap(pool->regions);
+	std::vector<char *>().swap(pool->chunks);
 
-	if (ssp == -1) {
-		treefile->tree = p;
-	} else {
-		*((long long *) (treefile->map.c_str() + ssp)) = p;
+	for (size_t i = 0; i < POOL_SHARDS; i++) {
+		std::vector<pool_entry>().swap(pool->shards[i].table);
+		pool->shards[i].count = 0;
 	}
-	return off;
+
+	long long size = pool_size(pool);
+	if (ftruncate(pool->fd, size) != 0) {
+		perror("resize string pool");
+		exit(EXIT_WRITE);
+	}
+
+	return size;
 }
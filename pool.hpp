@@ -1,12 +1,77 @@
 #ifndef POOL_HPP
 #define POOL_HPP
 
-struct stringpool {
-	unsigned long left = 0;
-	unsigned long right = 0;
-	unsigned long off = 0;
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+// The string pool holds every attribute key and value from the input,
+// each as a type byte followed by the NUL-terminated string, and features
+// refer to them by offset. All the input threads share one pool, so a
+// string that appears in many places is stored once.
+//
+// The pool is laid out in chunks of POOL_CHUNK bytes. Each input thread
+// claims a region of one or more chunks at a time and fills it with the
+// strings it adds, so threads only contend for the hash table, not for the
+// space. Regions are kept in memory while the pool fits in its share of
+// memory, and written straight to the pool file at their final position
+// once it doesn't.
+#define POOL_CHUNK (64 * 1024)
+#define POOL_SHARDS 256
+
+struct pool_entry {
+	unsigned long long hash;
+	long long off;	// -1 if the slot is empty
+};
+
+// A region of one or more chunks that is kept in memory
+struct pool_region {
+	long long chunk;
+	char *buf;
+	size_t len;
+};
+
+// One piece of the hash table from strings to their offsets,
+// chosen by the top bits of the hash
+struct pool_shard {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	std::vector<pool_entry> table;
+	size_t count = 0;
+};
+
+// The region of the pool that one input thread is filling
+struct pool_cursor {
+	long long chunk = -1;  // the first chunk of the region
+	char *buf = NULL;
+	size_t len = 0;
+	size_t used = 0;
+	bool spilled = false;  // written to the file when full instead of kept in memory
+};
+
+struct string_pool {
+	int fd = -1;
+	size_t budget = 0;  // bytes of memory for the kept chunks and the hash table
+	std::atomic<size_t> memory;
+	std::atomic<bool> spilling;
+	std::atomic<long long> bytes;  // of the strings themselves, without the ends of regions
+
+	std::atomic<long long> next_chunk;
+	std::vector<char *> chunks;  // memory of each kept chunk, by chunk number
+
+	pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+	std::vector<pool_region> regions;  // to be written and freed by pool_finish
+
+	pool_shard shards[POOL_SHARDS];
+
+	string_pool()
+	    : memory(0), spilling(false), bytes(0), next_chunk(0) {
+	}
 };
 
-long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type);
+void pool_init(struct string_pool *pool, int fd, size_t budget);
+long long addpool(struct string_pool *pool, struct pool_cursor *cursor, const char *s, char type);
+void pool_finish_cursor(struct string_pool *pool, struct pool_cursor *cursor);
+long long pool_finish(struct string_pool *pool);
+long long pool_size(struct string_pool *pool);
 
 #endif
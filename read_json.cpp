@@ -116,6 +116,42 @@ void parse_geometry(int t, json_object *j, drawvec &out, int op, const char *fna
 	}
 }
 
+struct position_reader {
+	int t;
+	drawvec *out;
+};
+
+static void read_position(int depth, size_t index, double *position, void *v) {
+	position_reader *pr = (position_reader *) v;
+
+	if (position != NULL) {
+		// The same choice of operation as parse_geometry() makes
+		int op = VT_LINETO;
+		if (pr->t == GEOM_POINT || pr->t == GEOM_MULTIPOINT || index == 0) {
+			op = VT_MOVETO;
+		}
+
+		long long x, y;
+		projection->project(position[0], position[1], 32, &x, &y);
+		pr->out->push_back(draw(op, x, y));
+	} else if ((pr->t == GEOM_POLYGON && depth == 0) || (pr->t == GEOM_MULTIPOLYGON && depth == 1)) {
+		pr->out->push_back(draw(VT_CLOSEPATH, 0, 0));
+	}
+}
+
+json_object *read_coordinates(json_pull *jp, int t, drawvec &out) {
+	int depth = 1;
+	for (int within = geometry_within[t]; within >= 0; within = geometry_within[within]) {
+		depth++;
+	}
+
+	position_reader pr;
+	pr.t = t;
+	pr.out = &out;
+
+	return json_read_positions(jp, depth, read_position, &pr);
+}
+
 void stringify_value(json_object *value, int &type, std::string &stringified, const char *reading, int line, json_object *feature) {
 	if (value != NULL) {
 		int vt = value->type;
@@ -13,4 +13,9 @@ extern int mb_geometry[GEOM_TYPES];
 void json_context(json_object *j);
 void parse_geometry(int t, json_object *j, drawvec &out, int op, const char *fname, int line, json_object *feature);
 
+// Read the coordinates of a geometry of type t, whose key the parser has just
+// read, straight into out instead of into the JSON tree. Returns the empty
+// array left in their place, or NULL if they have to be read the ordinary way.
+json_object *read_coordinates(json_pull *jp, int t, drawvec &out);
+
 void stringify_value(json_object *value, int &type, std::string &stringified, const char *reading, int line, json_object *feature);
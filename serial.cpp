@@ -29,140 +29,6 @@
 #define SHIFT_RIGHT(a) ((long long) std::round((double) (a) / (1LL << geometry_scale)))
 #define SHIFT_LEFT(a) ((((a) + (COORD_OFFSET >> geometry_scale)) << geometry_scale) - COORD_OFFSET)
 
-// write to file
-
-size_t fwrite_check(const void *ptr, size_t size, size_t nitems, FILE *stream, std::atomic<long long> *fpos, const char *fname) {
-	size_t w = fwrite(ptr, size, nitems, stream);
-	if (w != nitems) {
-		fprintf(stderr, "%s: Write to temporary file failed: %s\n", fname, strerror(errno));
-		exit(EXIT_WRITE);
-	}
-	*fpos += size * nitems;
-	return w;
-}
-
-void serialize_int(FILE *out, int n, std::atomic<long long> *fpos, const char *fname) {
-	serialize_long_long(out, n, fpos, fname);
-}
-
-void serialize_long_long(FILE *out, long long n, std::atomic<long long> *fpos, const char *fname) {
-	unsigned long long zigzag = protozero::encode_zigzag64(n);
-
-	serialize_ulong_long(out, zigzag, fpos, fname);
-}
-
-void serialize_ulong_long(FILE *out, unsigned long long zigzag, std::atomic<long long> *fpos, const char *fname) {
-	while (1) {
-		unsigned char b = zigzag & 0x7F;
-		if ((zigzag >> 7) != 0) {
-			b |= 0x80;
-			if (putc(b, out) == EOF) {
-				fprintf(stderr, "%s: Write to temporary file failed: %s\n", fname, strerror(errno));
-				exit(EXIT_WRITE);
-			}
-			*fpos += 1;
-			zigzag >>= 7;
-		} else {
-			if (putc(b, out) == EOF) {
-				fprintf(stderr, "%s: Write to temporary file failed: %s\n", fname, strerror(errno));
-				exit(EXIT_WRITE);
-			}
-			*fpos += 1;
-			break;
-		}
-	}
-}
-
-void serialize_byte(FILE *out, signed char n, std::atomic<long long> *fpos, const char *fname) {
-	fwrite_check(&n, sizeof(signed char), 1, out, fpos, fname);
-}
-
-void serialize_uint(FILE *out, unsigned n, std::atomic<long long> *fpos, const char *fname) {
-	serialize_ulong_long(out, n, fpos, fname);
-}
-
-// write to memory
-
-size_t fwrite_check(const void *ptr, size_t size, size_t nitems, std::string &stream) {
-	stream += std::string((char *) ptr, size * nitems);
-	return nitems;
-}
-
-void serialize_ulong_long(std::string &out, unsigned long long zigzag) {
-	while (1) {
-		unsigned char b = zigzag & 0x7F;
-		if ((zigzag >> 7) != 0) {
-			b |= 0x80;
-			out += b;
-			zigzag >>= 7;
-		} else {
-			out += b;
-			break;
-		}
-	}
-}
-
-void serialize_long_long(std::string &out, long long n) {
-	unsigned long long zigzag = protozero::encode_zigzag64(n);
-
-	serialize_ulong_long(out, zigzag);
-}
-
-void serialize_int(std::string &out, int n) {
-	serialize_long_long(out, n);
-}
-
-void serialize_byte(std::string &out, signed char n) {
-	out += n;
-}
-
-void serialize_uint(std::string &out, unsigned n) {
-	serialize_ulong_long(out, n);
-}
-
-// read from memory
-
-void deserialize_int(char **f, int *n) {
-	long long ll;
-	deserialize_long_long(f, &ll);
-	*n = ll;
-}
-
-void deserialize_long_long(char **f, long long *n) {
-	unsigned long long zigzag = 0;
-	deserialize_ulong_long(f, &zigzag);
-	*n = protozero::decode_zigzag64(zigzag);
-}
-
-void deserialize_ulong_long(char **f, unsigned long long *zigzag) {
-	*zigzag = 0;
-	int shift = 0;
-
-	while (1) {
-		if ((**f & 0x80) == 0) {
-			*zigzag |= ((unsigned long long) **f) << shift;
-			*f += 1;
-			shift += 7;
-			break;
-		} else {
-			*zigzag |= ((unsigned long long) (**f & 0x7F)) << shift;
-			*f += 1;
-			shift += 7;
-		}
-	}
-}
-
-void deserialize_uint(char **f, unsigned *n) {
-	unsigned long long v;
-	deserialize_ulong_long(f, &v);
-	*n = v;
-}
-
-void deserialize_byte(char **f, signed char *n) {
-	memcpy(n, *f, sizeof(signed char));
-	*f += sizeof(signed char);
-}
-
 static void write_geometry(drawvec const &dv, std::string &out, long long wx, long long wy) {
 	for (size_t i = 0; i < dv.size(); i++) {
 		if (dv[i].op == VT_MOVETO || dv[i].op == VT_LINETO) {
@@ -313,6 +179,39 @@ serial_feature deserialize_feature(std::string &geoms, unsigned z, unsigned tx,
 	return sf;
 }
 
+// Reads only the start of a serialized feature, through its segment,
+// without decoding its geometry or attributes
+void deserialize_feature_header(const char *feature, serial_feature &sf) {
+	char *cp = (char *) feature;
+
+	deserialize_byte(&cp, &sf.t);
+	deserialize_long_long(&cp, &sf.layer);
+
+	sf.seq = 0;
+	if (sf.layer & (1 << FLAG_SEQ)) {
+		deserialize_long_long(&cp, &sf.seq);
+	}
+
+	sf.tippecanoe_minzoom = -1;
+	sf.tippecanoe_maxzoom = -1;
+	sf.id = 0;
+	sf.has_id = false;
+	if (sf.layer & (1 << FLAG_MINZOOM)) {
+		deserialize_int(&cp, &sf.tippecanoe_minzoom);
+	}
+	if (sf.layer & (1 << FLAG_MAXZOOM)) {
+		deserialize_int(&cp, &sf.tippecanoe_maxzoom);
+	}
+	if (sf.layer & (1 << FLAG_ID)) {
+		sf.has_id = true;
+		deserialize_ulong_long(&cp, &sf.id);
+	}
+
+	deserialize_int(&cp, &sf.segment);
+
+	sf.layer >>= FLAG_LAYER;
+}
+
 static long long scale_geometry(struct serialization_state *sst, long long *bbox, drawvec &geom) {
 	long long offset = 0;
 	long long prev = 0;
@@ -393,6 +292,42 @@ static std::string strip_zeroes(std::string s) {
 	return s;
 }
 
+// The feature ID from the attribute named by --use-attribute-for-id
+static bool attribute_id(std::string const &key, serial_val const &val, unsigned long long *id) {
+	if (val.type != mvt_double && !additional[A_CONVERT_NUMERIC_IDS]) {
+		static bool warned = false;
+
+		if (!warned) {
+			fprintf(stderr, "Warning: Attribute \"%s\"=\"%s\" as feature ID is not a number\n", key.c_str(), val.s.c_str());
+			warned = true;
+		}
+	} else {
+		char *err;
+		long long id_value = strtoull(val.s.c_str(), &err, 10);
+
+		if (err != NULL && *err != '\0') {
+			static bool warned_frac = false;
+
+			if (!warned_frac) {
+				fprintf(stderr, "Warning: Can't represent non-integer feature ID %s\n", val.s.c_str());
+				warned_frac = true;
+			}
+		} else if (std::to_string(id_value) != strip_zeroes(val.s)) {
+			static bool warned = false;
+
+			if (!warned) {
+				fprintf(stderr, "Warning: Can't represent too-large feature ID %s\n", val.s.c_str());
+				warned = true;
+			}
+		} else {
+			*id = id_value;
+			return true;
+		}
+	}
+
+	return false;
+}
+
 // called from frontends
 int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 	struct reader *r = &(*sst->readers)[sst->segment];
@@ -601,7 +536,7 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 		}
 	}
 
-	if (additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED] || additional[A_CALCULATE_FEATURE_DENSITY] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED] || additional[A_INCREASE_GAMMA_AS_NEEDED] || additional[A_GENERATE_POLYGON_LABEL_POINTS] || sst->uses_gamma || cluster_distance != 0) {
+	if (additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED] || additional[A_CALCULATE_FEATURE_DENSITY] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED] || additional[A_INCREASE_GAMMA_AS_NEEDED] || additional[A_GENERATE_POLYGON_LABEL_POINTS] || sst->uses_gamma || cluster_distance != 0 || write_intermediate_dir != NULL || update_intermediate_dir != NULL) {
 		sf.index = bbox_index;
 	} else {
 		sf.index = 0;
@@ -658,39 +593,12 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 		}
 
 		if (sf.full_keys[i] == attribute_for_id) {
-			if (sf.full_values[i].type != mvt_double && !additional[A_CONVERT_NUMERIC_IDS]) {
-				static bool warned = false;
+			if (attribute_id(sf.full_keys[i], sf.full_values[i], &sf.id)) {
+				sf.has_id = true;
 
-				if (!warned) {
-					fprintf(stderr, "Warning: Attribute \"%s\"=\"%s\" as feature ID is not a number\n", sf.full_keys[i].c_str(), sf.full_values[i].s.c_str());
-					warned = true;
-				}
-			} else {
-				char *err;
-				long long id_value = strtoull(sf.full_values[i].s.c_str(), &err, 10);
-
-				if (err != NULL && *err != '\0') {
-					static bool warned_frac = false;
-
-					if (!warned_frac) {
-						fprintf(stderr, "Warning: Can't represent non-integer feature ID %s\n", sf.full_values[i].s.c_str());
-						warned_frac = true;
-					}
-				} else if (std::to_string(id_value) != strip_zeroes(sf.full_values[i].s)) {
-					static bool warned = false;
-
-					if (!warned) {
-						fprintf(stderr, "Warning: Can't represent too-large feature ID %s\n", sf.full_values[i].s.c_str());
-						warned = true;
-					}
-				} else {
-					sf.id = id_value;
-					sf.has_id = true;
-
-					sf.full_keys.erase(sf.full_keys.begin() + i);
-					sf.full_values.erase(sf.full_values.begin() + i);
-					continue;
-				}
+				sf.full_keys.erase(sf.full_keys.begin() + i);
+				sf.full_values.erase(sf.full_values.begin() + i);
+				continue;
 			}
 		}
 
@@ -719,8 +627,8 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 	}
 
 	for (size_t i = 0; i < sf.full_keys.size(); i++) {
-		sf.keys.push_back(addpool(r->poolfile, r->treefile, sf.full_keys[i].c_str(), mvt_string));
-		sf.values.push_back(addpool(r->poolfile, r->treefile, sf.full_values[i].s.c_str(), sf.full_values[i].type));
+		sf.keys.push_back(addpool(r->pool, &r->pool_cursor, sf.full_keys[i].c_str(), mvt_string));
+		sf.values.push_back(addpool(r->pool, &r->pool_cursor, sf.full_values[i].s.c_str(), sf.full_values[i].type));
 	}
 
 	long long geomstart = r->geompos;
@@ -764,6 +672,45 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 	return 1;
 }
 
+// called from frontends for a feature that --update-intermediate should delete
+void serialize_deletion(struct serialization_state *sst, serial_feature &sf) {
+	struct reader *r = &(*sst->readers)[sst->segment];
+
+	for (size_t i = 0; i < sf.full_keys.size(); i++) {
+		if (sf.full_keys[i] == attribute_for_id) {
+			coerce_value(sf.full_keys[i], sf.full_values[i].type, sf.full_values[i].s, sst->attribute_types);
+			if (attribute_id(sf.full_keys[i], sf.full_values[i], &sf.id)) {
+				sf.has_id = true;
+			}
+		}
+	}
+
+	if (!sf.has_id) {
+		static bool warned = false;
+
+		if (!warned) {
+			fprintf(stderr, "%s:%d: Warning: Can't delete a feature without an ID\n", sst->fname, sst->line);
+			warned = true;
+		}
+		return;
+	}
+
+	r->deletions.emplace_back(sf.layername, sf.id);
+}
+
+// called when --update-intermediate moves a feature that deserialize_feature()
+// read at z0 into another segment, with another starting point
+std::string reserialize_feature(serial_feature &sf, unsigned initial_x, unsigned initial_y) {
+	for (auto &d : sf.geometry) {
+		d.x = SHIFT_RIGHT(d.x);
+		d.y = SHIFT_RIGHT(d.y);
+	}
+	sf.has_tippecanoe_minzoom = sf.tippecanoe_minzoom != -1;
+	sf.has_tippecanoe_maxzoom = sf.tippecanoe_maxzoom != -1;
+
+	return serialize_feature(&sf, SHIFT_RIGHT(initial_x), SHIFT_RIGHT(initial_y));
+}
+
 void coerce_value(std::string const &key, int &vt, std::string &val, std::map<std::string, int> const *attribute_types) {
 	auto a = (*attribute_types).find(key);
 	if (a != attribute_types->end()) {
@@ -4,12 +4,14 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <string>
 #include <vector>
 #include <atomic>
 #include <sys/stat.h>
 #include "geometry.hpp"
 #include "mbtiles.hpp"
 #include "jsonpull/jsonpull.h"
+#include "pool.hpp"
 
 size_t fwrite_check(const void *ptr, size_t size, size_t nitems, FILE *stream, std::atomic<long long> *fpos, const char *fname);
 
@@ -70,16 +72,16 @@ struct serial_feature {
 };
 
 std::string serialize_feature(serial_feature *sf, long long wx, long long wy);
+std::string reserialize_feature(serial_feature &sf, unsigned initial_x, unsigned initial_y);
 serial_feature deserialize_feature(std::string &geoms, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y);
+void deserialize_feature_header(const char *feature, serial_feature &sf);
 
 struct reader {
-	int poolfd = -1;
-	int treefd = -1;
 	int geomfd = -1;
 	int indexfd = -1;
 
-	struct memfile *poolfile = NULL;
-	struct memfile *treefile = NULL;
+	struct string_pool *pool = NULL;  // shared by all readers
+	struct pool_cursor pool_cursor;
 	FILE *geomfile = NULL;
 	FILE *indexfile = NULL;
 
@@ -95,18 +97,19 @@ struct reader {
 
 	char *geom_map = NULL;
 
+	// layer names and ids of the features to delete, for --update-intermediate
+	std::vector<std::pair<std::string, unsigned long long>> deletions;
+
 	reader()
 	    : geompos(0), indexpos(0) {
 	}
 
 	reader(reader const &r) {
-		poolfd = r.poolfd;
-		treefd = r.treefd;
 		geomfd = r.geomfd;
 		indexfd = r.indexfd;
 
-		poolfile = r.poolfile;
-		treefile = r.treefile;
+		pool = r.pool;
+		pool_cursor = r.pool_cursor;
 		geomfile = r.geomfile;
 		indexfile = r.indexfile;
 
@@ -121,6 +124,7 @@ struct reader {
 		geomst = r.geomst;
 
 		geom_map = r.geom_map;
+		deletions = r.deletions;
 	}
 };
 
@@ -158,6 +162,7 @@ struct serialization_state {
 };
 
 int serialize_feature(struct serialization_state *sst, serial_feature &sf);
+void serialize_deletion(struct serialization_state *sst, serial_feature &sf);
 void coerce_value(std::string const &key, int &vt, std::string &val, std::map<std::string, int> const *attribute_types);
 
 #endif
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <deque>
+#include "task_pool.hpp"
+#include "errors.hpp"
+
+struct task {
+	task_group *group;
+	void *(*fn)(void *);
+	void *arg;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;  // a token handed to an idle thread
+static std::deque<task> pool_queue;
+
+static size_t pool_concurrency = 1;
+static size_t pool_active = 0;	 // tasks running and not blocked
+static size_t pool_starting = 0;  // threads woken or created to start a task
+static size_t pool_idle = 0;	 // threads waiting for a token
+static size_t pool_tokens = 0;
+
+// Whether this thread is one of the pool's, so that its waits
+// affect how many tasks are running
+static thread_local bool in_pool = false;
+
+static void pool_mutex_lock() {
+	if (pthread_mutex_lock(&pool_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+}
+
+static void pool_mutex_unlock() {
+	if (pthread_mutex_unlock(&pool_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+}
+
+// With the lock held
+static void finish_task(task const &t) {
+	t.group->pending--;
+	if (t.group->pending == 0) {
+		if (pthread_cond_broadcast(&t.group->done) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_PTHREAD);
+		}
+	}
+}
+
+static void *pool_thread(void *) {
+	in_pool = true;
+	pool_mutex_lock();
+
+	while (true) {
+		pool_starting--;
+
+		while (!pool_queue.empty() && pool_active < pool_concurrency) {
+			task t = pool_queue.front();
+			pool_queue.pop_front();
+			pool_active++;
+			pool_mutex_unlock();
+
+			t.fn(t.arg);
+
+			pool_mutex_lock();
+			pool_active--;
+			finish_task(t);
+		}
+
+		pool_idle++;
+		while (pool_tokens == 0) {
+			if (pthread_cond_wait(&pool_wake, &pool_lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_PTHREAD);
+			}
+		}
+		pool_tokens--;
+	}
+
+	return NULL;
+}
+
+// With the lock held: if a queued task could start, make sure
+// that there is a thread on its way to start it
+static void start_thread() {
+	if (pool_queue.size() <= pool_starting || pool_active + pool_starting >= pool_concurrency) {
+		return;
+	}
+
+	pool_starting++;
+
+	if (pool_idle > 0) {
+		pool_idle--;
+		pool_tokens++;
+		if (pthread_cond_signal(&pool_wake) != 0) {
+			perror("pthread_cond_signal");
+			exit(EXIT_PTHREAD);
+		}
+	} else {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, pool_thread, NULL) != 0) {
+			perror("pthread_create");
+			exit(EXIT_PTHREAD);
+		}
+		if (pthread_detach(thread) != 0) {
+			perror("pthread_detach");
+			exit(EXIT_PTHREAD);
+		}
+	}
+}
+
+void task_pool_init(size_t concurrency) {
+	pool_mutex_lock();
+	pool_concurrency = concurrency < 1 ? 1 : concurrency;
+	pool_mutex_unlock();
+}
+
+void task_run(task_group *group, void *(*fn)(void *), void *arg) {
+	pool_mutex_lock();
+	group->pending++;
+	pool_queue.push_back(task{group, fn, arg});
+	start_thread();
+	pool_mutex_unlock();
+}
+
+void task_wait(task_group *group) {
+	pool_mutex_lock();
+
+	while (group->pending > 0) {
+		if (in_pool) {
+			// Run the group's own tasks that haven't started yet,
+			// in the place of the task that is waiting for them
+			bool ran = false;
+			for (auto it = pool_queue.begin(); it != pool_queue.end(); ++it) {
+				if (it->group == group) {
+					task t = *it;
+					pool_queue.erase(it);
+					pool_mutex_unlock();
+
+					t.fn(t.arg);
+
+					pool_mutex_lock();
+					finish_task(t);
+					ran = true;
+					break;
+				}
+			}
+			if (ran) {
+				continue;
+			}
+
+			// The rest are running on other threads, so let
+			// another task run while this one waits for them
+			pool_active--;
+			start_thread();
+		}
+
+		if (pthread_cond_wait(&group->done, &pool_lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_PTHREAD);
+		}
+
+		if (in_pool) {
+			pool_active++;
+		}
+	}
+
+	pool_mutex_unlock();
+}
+
+void task_blocking_begin() {
+	if (in_pool) {
+		pool_mutex_lock();
+		pool_active--;
+		start_thread();
+		pool_mutex_unlock();
+	}
+}
+
+// The task continues even if that puts the pool over its limit for a
+// while, so that it can't wait forever behind tasks that wait for it
+void task_blocking_end() {
+	if (in_pool) {
+		pool_mutex_lock();
+		pool_active++;
+		pool_mutex_unlock();
+	}
+}
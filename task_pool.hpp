@@ -0,0 +1,36 @@
+#ifndef TASK_POOL_HPP
+#define TASK_POOL_HPP
+
+#include <stddef.h>
+#include <pthread.h>
+
+// One pool of threads for the whole process, which runs the tasks of all
+// the phases that work in parallel, with no more than the number of tasks
+// given to task_pool_init() running at once. The threads are started as
+// they are needed and then kept for the next task.
+//
+// A task may run tasks of its own and wait for them. While it waits, it
+// runs whichever of them no other thread has started yet, so tasks that
+// wait for tasks can't use up all the threads. A task that waits for
+// anything else should do so between task_blocking_begin() and
+// task_blocking_end(), so that another task can run in the meantime.
+
+struct task_group {
+	size_t pending = 0;  // tasks that have been run but not finished
+	pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+};
+
+void task_pool_init(size_t concurrency);
+
+// Queue fn(arg) to run as part of the group
+void task_run(task_group *group, void *(*fn)(void *), void *arg);
+
+// Wait until all the tasks of the group have finished
+void task_wait(task_group *group);
+
+// Around waits for anything other than tasks. These do nothing
+// outside of the pool's threads.
+void task_blocking_begin();
+void task_blocking_end();
+
+#endif
@@ -33,6 +33,7 @@
 #include "csv.hpp"
 #include "text.hpp"
 #include "tile.hpp"
+#include "task_pool.hpp"
 #include <fstream>
 #include <sstream>
 #include <algorithm>
@@ -80,7 +81,7 @@ void aprintf(std::string *buf, const char *format, ...) {
 	free(tmp);
 }
 
-void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &include, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, json_object *filter) {
+void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &include, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, compiled_filter const *filter) {
 	mvt_tile tile;
 	int features_added = 0;
 	bool was_compressed;
@@ -142,48 +143,56 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 
 		auto file_keys = layermap.find(layer.name);
 
+		// Which filter slot, if any, each of the layer's keys goes in,
+		// and the slots of the feature's id, type, and zoom
+		std::vector<ssize_t> key_slots;
+		ssize_t id_slot = -1, type_slot = -1, zoom_slot = -1;
+		filter_feature filter_attributes;
+		if (filter != NULL) {
+			for (size_t k = 0; k < layer.keys.size(); k++) {
+				key_slots.push_back(filter_slot(filter, layer.keys[k].c_str()));
+			}
+
+			id_slot = filter_slot(filter, "$id");
+			type_slot = filter_slot(filter, "$type");
+			zoom_slot = filter_slot(filter, "$zoom");
+		}
+
 		for (size_t f = 0; f < layer.features.size(); f++) {
 			mvt_feature feat = layer.features[f];
 			std::set<std::string> exclude_attributes;
 
 			if (filter != NULL) {
-				std::map<std::string, mvt_value> attributes;
+				filter_attributes.clear(filter);
 
 				for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
-					std::string key = layer.keys[feat.tags[t]];
-					mvt_value &val = layer.values[feat.tags[t + 1]];
-
-					attributes.insert(std::pair<std::string, mvt_value>(key, val));
+					ssize_t slot = key_slots[feat.tags[t]];
+					if (slot >= 0) {
+						filter_attributes.set(slot, layer.values[feat.tags[t + 1]]);
+					}
 				}
 
-				if (feat.has_id) {
-					mvt_value v;
-					v.type = mvt_uint;
-					v.numeric_value.uint_value = feat.id;
-
-					attributes.insert(std::pair<std::string, mvt_value>("$id", v));
+				if (feat.has_id && id_slot >= 0) {
+					filter_attributes.set_number(id_slot, feat.id);
 				}
 
-				mvt_value v;
-				v.type = mvt_string;
-
-				if (feat.type == mvt_point) {
-					v.string_value = "Point";
-				} else if (feat.type == mvt_linestring) {
-					v.string_value = "LineString";
-				} else if (feat.type == mvt_polygon) {
-					v.string_value = "Polygon";
+				if (type_slot >= 0) {
+					if (feat.type == mvt_point) {
+						filter_attributes.set_string(type_slot, "Point");
+					} else if (feat.type == mvt_linestring) {
+						filter_attributes.set_string(type_slot, "LineString");
+					} else if (feat.type == mvt_polygon) {
+						filter_attributes.set_string(type_slot, "Polygon");
+					} else {
+						filter_attributes.set_string(type_slot, "");
+					}
 				}
 
-				attributes.insert(std::pair<std::string, mvt_value>("$type", v));
-
-				mvt_value v2;
-				v2.type = mvt_uint;
-				v2.numeric_value.uint_value = z;
-
-				attributes.insert(std::pair<std::string, mvt_value>("$zoom", v2));
+				if (zoom_slot >= 0) {
+					filter_attributes.set_number(zoom_slot, z);
+				}
 
-				if (!evaluate(attributes, layer.name, filter, exclude_attributes)) {
+				if (!evaluate(filter, filter_attributes, layer.name, exclude_attributes)) {
 					continue;
 				}
 			}
@@ -525,7 +534,7 @@ struct arg {
 	std::set<std::string> *keep_layers = NULL;
 	std::set<std::string> *remove_layers = NULL;
 	int ifmatched = 0;
-	json_object *filter = NULL;
+	compiled_filter const *filter = NULL;
 };
 
 void *join_worker(void *v) {
@@ -570,8 +579,7 @@ void *join_worker(void *v) {
 	return NULL;
 }
 
-void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &include, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, json_object *filter) {
-	pthread_t pthreads[CPUS];
+void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, pmtiles_writer *outpm, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &include, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, compiled_filter const *filter) {
 	std::vector<arg> args;
 
 	for (size_t i = 0; i < CPUS; i++) {
@@ -604,23 +612,18 @@ void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<st
 		}
 	}
 
+	task_group joining;
 	for (size_t i = 0; i < CPUS; i++) {
-		if (pthread_create(&pthreads[i], NULL, join_worker, &args[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_PTHREAD);
-		}
+		task_run(&joining, join_worker, &args[i]);
 	}
+	task_wait(&joining);
 
 	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
-
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join");
-		}
-
 		for (auto ai = args[i].outputs.begin(); ai != args[i].outputs.end(); ++ai) {
 			if (outdb != NULL) {
 				mbtiles_write_tile(outdb, ai->first.z, ai->first.x, ai->first.y, ai->second.data(), ai->second.size());
+			} else if (outpm != NULL) {
+				pmtiles_write_tile(outpm, ai->first.z, ai->first.x, ai->first.y, ai->second.data(), ai->second.size());
 			} else if (outdir != NULL) {
 				dir_write_tile(outdir, ai->first.z, ai->first.x, ai->first.y, ai->second);
 			}
@@ -717,7 +720,7 @@ void handle_vector_layers(json_object *vector_layers, std::map<std::string, laye
 	}
 }
 
-void decode(struct reader *readers, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &include, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, json_object *filter, std::map<std::string, std::string> &attribute_descriptions, std::string &generator_options, std::vector<strategy> *strategies) {
+void decode(struct reader *readers, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, pmtiles_writer *outpm, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &include, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, compiled_filter const *filter, std::map<std::string, std::string> &attribute_descriptions, std::string &generator_options, std::vector<strategy> *strategies) {
 	std::vector<std::map<std::string, layermap_entry>> layermaps;
 	for (size_t i = 0; i < CPUS; i++) {
 		layermaps.push_back(std::map<std::string, layermap_entry>());
@@ -772,7 +775,7 @@ void decode(struct reader *readers, std::map<std::string, layermap_entry> &layer
 
 		if (readers == NULL || readers->zoom != r->zoom || readers->x != r->x || readers->y != r->y) {
 			if (tasks.size() > 100 * CPUS) {
-				handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, include, ifmatched, keep_layers, remove_layers, filter);
+				handle_tasks(tasks, layermaps, outdb, outdir, outpm, header, mapping, exclude, include, ifmatched, keep_layers, remove_layers, filter);
 				tasks.clear();
 			}
 		}
@@ -838,7 +841,7 @@ void decode(struct reader *readers, std::map<std::string, layermap_entry> &layer
 	st->minlat2 = min(minlat, st->minlat2);
 	st->maxlat2 = max(maxlat, st->maxlat2);
 
-	handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, include, ifmatched, keep_layers, remove_layers, filter);
+	handle_tasks(tasks, layermaps, outdb, outdir, outpm, header, mapping, exclude, include, ifmatched, keep_layers, remove_layers, filter);
 	layermap = merge_layermaps(layermaps);
 
 	struct reader *next;
@@ -993,11 +996,12 @@ int main(int argc, char **argv) {
 	char *out_mbtiles = NULL;
 	char *out_dir = NULL;
 	sqlite3 *outdb = NULL;
+	pmtiles_writer *outpm = NULL;
 	char *csv = NULL;
 	int force = 0;
 	int ifmatched = 0;
 	int filearg = 0;
-	json_object *filter = NULL;
+	compiled_filter *filter = NULL;
 
 	struct reader *readers = NULL;
 
@@ -1011,6 +1015,8 @@ int main(int argc, char **argv) {
 		CPUS = 1;
 	}
 
+	task_pool_init(CPUS);
+
 	std::vector<std::string> header;
 	std::map<std::string, std::vector<std::string>> mapping;
 
@@ -1115,11 +1121,11 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'J':
-			filter = read_filter(optarg);
+			filter = compile_filter(read_filter(optarg));
 			break;
 
 		case 'j':
-			filter = parse_filter(optarg);
+			filter = compile_filter(parse_filter(optarg));
 			break;
 
 		case 'p':
@@ -1255,10 +1261,14 @@ int main(int argc, char **argv) {
 			}
 		}
 
-		outdb = mbtiles_open(out_mbtiles, argv, 0);
+		if (pmtiles_has_suffix(out_mbtiles)) {
+			outpm = pmtiles_open(out_mbtiles, argv);
+		} else {
+			outdb = mbtiles_open(out_mbtiles, argv, 0, false);
+		}
 	}
 	if (out_dir != NULL) {
-		check_dir(out_dir, argv, force, false);
+		check_dir(out_dir, argv, force, false, false);
 	}
 
 	struct stats st;
@@ -1291,7 +1301,7 @@ int main(int argc, char **argv) {
 	std::string generator_options;
 	std::vector<strategy> strategies;
 
-	decode(readers, layermap, outdb, out_dir, &st, header, mapping, exclude, include, ifmatched, attribution, description, keep_layers, remove_layers, name, filter, attribute_descriptions, generator_options, &strategies);
+	decode(readers, layermap, outdb, out_dir, outpm, &st, header, mapping, exclude, include, ifmatched, attribution, description, keep_layers, remove_layers, name, filter, attribute_descriptions, generator_options, &strategies);
 
 	if (set_attribution.size() != 0) {
 		attribution = set_attribution;
@@ -1326,7 +1336,7 @@ int main(int argc, char **argv) {
 
 	if (outdb != NULL) {
 		mbtiles_write_metadata(outdb, m, true);
-	} else {
+	} else if (out_dir != NULL) {
 		dir_write_metadata(out_dir, m);
 	}
 
@@ -1335,11 +1345,11 @@ int main(int argc, char **argv) {
 	}
 
 	if (filter != NULL) {
-		json_free(filter);
+		delete filter;
 	}
 
-	if (pmtiles_has_suffix(out_mbtiles)) {
-		mbtiles_map_image_to_pmtiles(out_mbtiles, m, !pC, quiet, false);
+	if (outpm != NULL) {
+		pmtiles_close(outpm, m, !pC, quiet, false);
 	}
 
 	return 0;
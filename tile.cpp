@@ -9,6 +9,7 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
 #include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,6 +31,7 @@
 #include "mvt.hpp"
 #include "mbtiles.hpp"
 #include "dirtiles.hpp"
+#include "pmtiles_file.hpp"
 #include "geometry.hpp"
 #include "tile.hpp"
 #include "pool.hpp"
@@ -42,6 +44,8 @@
 #include "evaluator.hpp"
 #include "errors.hpp"
 #include "compression.hpp"
+#include "arena.hpp"
+#include "task_pool.hpp"
 #include "protozero/varint.hpp"
 
 extern "C" {
@@ -49,6 +53,7 @@ extern "C" {
 }
 
 #include "plugin.hpp"
+#include "intermediate.hpp"
 
 #define CMD_BITS 3
 
@@ -331,7 +336,7 @@ struct ordercmp {
 	}
 } ordercmp;
 
-void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int *within, std::atomic<long long> *geompos, compressor **geomfile, const char *fname, signed char t, int layer, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, unsigned long long label_point, long long extent) {
+void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int *within, std::atomic<long long> *geompos, compressor **geomfile, std::vector<long long> *tile_starts, const char *fname, signed char t, int layer, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, unsigned long long label_point, long long extent) {
 	if (geom.size() > 0 && (nextzoom <= maxzoom || additional[A_EXTEND_ZOOMS])) {
 		int xo, yo;
 		int span = 1 << (nextzoom - z);
@@ -379,6 +384,10 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 				unsigned jx = tx * span + xo;
 				unsigned jy = ty * span + yo;
 
+				if (update_tiles != NULL && !update_tiles->contains(nextzoom, jx, jy)) {
+					continue;
+				}
+
 				// j is the shard that the child tile's data is being written to.
 				//
 				// Be careful: We can't jump more zoom levels than max_zoom_increment
@@ -401,6 +410,10 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 
 				{
 					if (!within[j]) {
+						// Remember where each child tile starts so that the
+						// shard can be divided between threads at the next zoom
+						tile_starts[j].push_back(ftell(geomfile[j]->fp));
+
 						serialize_int(geomfile[j]->fp, nextzoom, &geompos[j], fname);
 						serialize_uint(geomfile[j]->fp, tx * span + xo, &geompos[j], fname);
 						serialize_uint(geomfile[j]->fp, ty * span + yo, &geompos[j], fname);
@@ -477,7 +490,7 @@ struct partial {
 };
 
 struct partial_arg {
-	std::vector<struct partial> *partials = NULL;
+	std::pmr::vector<struct partial> *partials = NULL;
 	int task = 0;
 	int tasks = 0;
 	drawvec *shared_nodes;
@@ -596,7 +609,7 @@ double simplify_partial(partial *p, drawvec &shared_nodes) {
 
 void *partial_feature_worker(void *v) {
 	struct partial_arg *a = (struct partial_arg *) v;
-	std::vector<struct partial> *partials = a->partials;
+	std::pmr::vector<struct partial> *partials = a->partials;
 
 	for (size_t i = a->task; i < (*partials).size(); i += a->tasks) {
 		double area = simplify_partial(&((*partials)[i]), *(a->shared_nodes));
@@ -754,7 +767,7 @@ bool edges_same(std::pair<std::vector<edge>::iterator, std::vector<edge>::iterat
 	return true;
 }
 
-bool find_common_edges(std::vector<partial> &partials, int z, int line_detail, double simplification, int maxzoom, double merge_fraction) {
+bool find_common_edges(std::pmr::vector<partial> &partials, int z, int line_detail, double simplification, int maxzoom, double merge_fraction) {
 	size_t merge_count = ceil((1 - merge_fraction) * partials.size());
 
 	for (size_t i = 0; i < partials.size(); i++) {
@@ -1245,7 +1258,7 @@ bool find_common_edges(std::vector<partial> &partials, int z, int line_detail, d
 	}
 }
 
-unsigned long long choose_mingap(std::vector<unsigned long long> const &indices, double f) {
+unsigned long long choose_mingap(std::pmr::vector<unsigned long long> const &indices, double f) {
 	unsigned long long bot = ULLONG_MAX;
 	unsigned long long top = 0;
 
@@ -1285,27 +1298,60 @@ unsigned long long choose_mingap(std::vector<unsigned long long> const &indices,
 	return top;
 }
 
-long long choose_minextent(std::vector<long long> &extents, double f) {
+long long choose_minextent(std::pmr::vector<long long> &extents, double f) {
 	std::sort(extents.begin(), extents.end());
 	return extents[(extents.size() - 1) * (1 - f)];
 }
 
+// For --retry-changed-tiles-only: what a tile was made from the last time
+// it was made, so that a retry of its zoom level can tell whether it would
+// come out the same with the level's new thresholds.
+//
+// A tile comes out the same if its last attempt was at full detail with the
+// same gamma and fraction, and no feature in it was kept only because its
+// spacing or extent was between the old and the new mingap or minextent,
+// because then every feature is dropped or kept exactly as before.
+struct tile_retry_record {
+	long long start = 0;  // position of the tile in its shard
+	long long end = 0;
+	bool full_detail = false;
+
+	double gamma = 0;
+	double fraction = 1;
+	unsigned long long mingap = 0;
+	unsigned long long mingap_limit = ULLONG_MAX;  // smallest spacing kept by mingap
+	long long minextent = 0;
+	double minextent_limit = INFINITY;  // smallest extent kept by minextent
+
+	// Strategy counts from the tile's last attempt, which is all that
+	// making it again would count
+	strategy counts;
+
+	bool retry = true;
+
+	bool unchanged(double gamma_, double fraction_, unsigned long long mingap_, long long minextent_) const {
+		return full_detail && gamma == gamma_ && fraction == fraction_ &&
+		       mingap <= mingap_ && mingap_ <= mingap_limit &&
+		       minextent <= minextent_ && minextent_ < minextent_limit;
+	}
+};
+
 struct write_tile_args {
-	struct task *tasks = NULL;
 	char *stringpool = NULL;
 	int min_detail = 0;
 	sqlite3 *outdb = NULL;
 	const char *outdir = NULL;
+	pmtiles_writer *outpm = NULL;
+	tile_arena *arena = NULL;  // per thread
 	int buffer = 0;
 	const char *fname = NULL;
 	compressor **geomfile = NULL;
+	std::vector<long long> *tile_starts = NULL;
 	double todo = 0;
 	std::atomic<long long> *along = NULL;
 	double gamma = 0;
 	double gamma_out = 0;
 	int child_shards = 0;
-	int *geomfd = NULL;
-	off_t *geom_size = NULL;
 	std::atomic<unsigned> *midx = NULL;
 	std::atomic<unsigned> *midy = NULL;
 	int maxzoom = 0;
@@ -1330,17 +1376,19 @@ struct write_tile_args {
 	double fraction_out = 0;
 	size_t tile_size_out = 0;
 	size_t feature_count_out = 0;
+	size_t tiles_out = 0;
 	const char *prefilter = NULL;
 	const char *postfilter = NULL;
 	std::map<std::string, attribute_op> const *attribute_accum = NULL;
 	bool still_dropping = false;
 	int wrote_zoom = 0;
 	size_t tiling_seg = 0;
-	struct json_object *filter = NULL;
+	compiled_filter const *filter = NULL;
 	std::atomic<size_t> *dropped_count = NULL;
 	atomic_strategy *strategy = NULL;
 	int zoom = -1;
 	bool compressed;
+	tile_retry_record *retry = NULL;
 };
 
 bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
@@ -1438,7 +1486,7 @@ void remove_attributes(serial_feature &sf, std::set<std::string> const &exclude_
 	}
 }
 
-serial_feature next_feature(decompressor *geoms, std::atomic<long long> *geompos_in, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, std::atomic<long long> *along, long long alongminus, int buffer, int *within, compressor **geomfile, std::atomic<long long> *geompos, std::atomic<double> *oprogress, double todo, const char *fname, int child_shards, struct json_object *filter, const char *stringpool, long long *pool_off, std::vector<std::vector<std::string>> *layer_unmaps, bool first_time, bool compressed) {
+serial_feature next_feature(decompressor *geoms, std::atomic<long long> *geompos_in, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, std::atomic<long long> *along, long long alongminus, int buffer, int *within, compressor **geomfile, std::vector<long long> *tile_starts, std::atomic<long long> *geompos, std::atomic<double> *oprogress, double todo, const char *fname, int child_shards, compiled_filter const *filter, const char *stringpool, long long *pool_off, std::vector<std::vector<std::string>> *layer_unmaps, bool first_time, bool compressed) {
 	while (1) {
 		serial_feature sf;
 		std::string s;
@@ -1467,7 +1515,10 @@ serial_feature next_feature(decompressor *geoms, std::atomic<long long> *geompos
 		sf = deserialize_feature(s, z, tx, ty, initial_x, initial_y);
 
 		size_t passes = pass + 1;
-		double progress = floor(((((*geompos_in + *along - alongminus) / (double) todo) + pass) / passes + z) / (maxzoom + 1) * 1000) / 10;
+		// A zoom level's todo can still be growing while its first units
+		// are tiled, so don't let the fraction run past the end of the zoom.
+		double fraction_done = std::min(1.0, (*geompos_in + *along - alongminus) / (double) todo);
+		double progress = floor(((fraction_done + pass) / passes + z) / (maxzoom + 1) * 1000) / 10;
 		if (progress >= *oprogress + 0.1) {
 			if (!quiet && !quiet_progress && progress_time()) {
 				fprintf(stderr, "  %3.1f%%  %d/%u/%u  \r", progress, z, tx, ty);
@@ -1491,7 +1542,7 @@ serial_feature next_feature(decompressor *geoms, std::atomic<long long> *geompos
 
 		if (first_time && pass == 0) { /* only write out the next zoom once, even if we retry */
 			if (sf.tippecanoe_maxzoom == -1 || sf.tippecanoe_maxzoom >= nextzoom) {
-				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, within, geompos, geomfile, fname, sf.t, sf.layer, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.label_point, sf.extent);
+				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, within, geompos, geomfile, tile_starts, fname, sf.t, sf.layer, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.label_point, sf.extent);
 			}
 		}
 
@@ -1507,56 +1558,63 @@ serial_feature next_feature(decompressor *geoms, std::atomic<long long> *geompos
 		}
 
 		if (filter != NULL) {
-			std::map<std::string, mvt_value> attributes;
-			std::string layername = (*layer_unmaps)[sf.segment][sf.layer];
+			// Which filter slot, if any, each string pool key goes in
+			static thread_local std::unordered_map<long long, ssize_t> key_slots;
+			static thread_local compiled_filter const *key_slots_filter = NULL;
+			static thread_local filter_feature attributes;
+
+			if (key_slots_filter != filter) {
+				key_slots.clear();
+				key_slots_filter = filter;
+			}
+
+			std::string const &layername = (*layer_unmaps)[sf.segment][sf.layer];
 			std::set<std::string> exclude_attributes;
+			attributes.clear(filter);
 
 			for (size_t i = 0; i < sf.keys.size(); i++) {
-				std::string key = stringpool + pool_off[sf.segment] + sf.keys[i] + 1;
+				long long key = pool_off[sf.segment] + sf.keys[i];
 
-				serial_val sv;
-				sv.type = (stringpool + pool_off[sf.segment])[sf.values[i]];
-				sv.s = stringpool + pool_off[sf.segment] + sf.values[i] + 1;
+				auto ks = key_slots.find(key);
+				if (ks == key_slots.end()) {
+					ks = key_slots.insert(std::pair<long long, ssize_t>(key, filter_slot(filter, stringpool + key + 1))).first;
+				}
 
-				mvt_value val = stringified_to_mvt_value(sv.type, sv.s.c_str());
-				attributes.insert(std::pair<std::string, mvt_value>(key, val));
+				if (ks->second >= 0) {
+					const char *val = stringpool + pool_off[sf.segment] + sf.values[i];
+					attributes.set_stringified(ks->second, val[0], val + 1);
+				}
 			}
 
 			for (size_t i = 0; i < sf.full_keys.size(); i++) {
-				std::string key = sf.full_keys[i];
-				mvt_value val = stringified_to_mvt_value(sf.full_values[i].type, sf.full_values[i].s.c_str());
-
-				attributes.insert(std::pair<std::string, mvt_value>(key, val));
+				ssize_t slot = filter_slot(filter, sf.full_keys[i].c_str());
+				if (slot >= 0) {
+					attributes.set_stringified(slot, sf.full_values[i].type, sf.full_values[i].s.c_str());
+				}
 			}
 
-			if (sf.has_id) {
-				mvt_value v;
-				v.type = mvt_uint;
-				v.numeric_value.uint_value = sf.id;
-
-				attributes.insert(std::pair<std::string, mvt_value>("$id", v));
+			ssize_t slot;
+			if (sf.has_id && (slot = filter_slot(filter, "$id")) >= 0) {
+				attributes.set_number(slot, sf.id);
 			}
 
-			mvt_value v;
-			v.type = mvt_string;
-
-			if (sf.t == mvt_point) {
-				v.string_value = "Point";
-			} else if (sf.t == mvt_linestring) {
-				v.string_value = "LineString";
-			} else if (sf.t == mvt_polygon) {
-				v.string_value = "Polygon";
+			if ((slot = filter_slot(filter, "$type")) >= 0) {
+				if (sf.t == mvt_point) {
+					attributes.set_string(slot, "Point");
+				} else if (sf.t == mvt_linestring) {
+					attributes.set_string(slot, "LineString");
+				} else if (sf.t == mvt_polygon) {
+					attributes.set_string(slot, "Polygon");
+				} else {
+					attributes.set_string(slot, "");
+				}
 			}
 
-			attributes.insert(std::pair<std::string, mvt_value>("$type", v));
-
-			mvt_value v2;
-			v2.type = mvt_uint;
-			v2.numeric_value.uint_value = z;
-
-			attributes.insert(std::pair<std::string, mvt_value>("$zoom", v2));
+			if ((slot = filter_slot(filter, "$zoom")) >= 0) {
+				attributes.set_number(slot, z);
+			}
 
-			if (!evaluate(attributes, layername, filter, exclude_attributes)) {
+			if (!evaluate(filter, attributes, layername, exclude_attributes)) {
 				continue;
 			}
 
@@ -1611,6 +1669,7 @@ struct run_prefilter_args {
 	int buffer = 0;
 	int *within = NULL;
 	compressor **geomfile = NULL;
+	std::vector<long long> *tile_starts = NULL;
 	std::atomic<long long> *geompos = NULL;
 	std::atomic<double> *oprogress = NULL;
 	double todo = 0;
@@ -1620,17 +1679,88 @@ struct run_prefilter_args {
 	char *stringpool = NULL;
 	long long *pool_off = NULL;
 	FILE *prefilter_fp = NULL;
-	struct json_object *filter = NULL;
+	bool persistent = false;
+	bool binary = false;
+	compiled_filter const *filter = NULL;
 	bool first_time = false;
 	bool compressed = false;
 };
 
+// With -aB, sends the whole tile to the prefilter as a vector tile, in tile-relative
+// coordinates, with the fields of the GeoJSON "tippecanoe" element as attributes
+static void run_binary_prefilter(run_prefilter_args *rpa) {
+	std::map<std::string, mvt_layer> layers;
+	int shift = binary_prefilter_shift(rpa->z);
+
+	while (1) {
+		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->geomfile, rpa->tile_starts, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards, rpa->filter, rpa->stringpool, rpa->pool_off, rpa->layer_unmaps, rpa->first_time, rpa->compressed);
+		if (sf.t < 0) {
+			break;
+		}
+
+		std::string const &layername = (*(rpa->layer_unmaps))[sf.segment][sf.layer];
+		auto l = layers.find(layername);
+		if (l == layers.end()) {
+			mvt_layer layer;
+			layer.name = layername;
+			layer.version = 2;
+			layer.extent = 1LL << (32 - rpa->z - shift);
+			l = layers.insert(std::pair<std::string, mvt_layer>(layername, layer)).first;
+		}
+
+		if (sf.t == VT_POLYGON) {
+			sf.geometry = close_poly(sf.geometry);
+		}
+
+		mvt_feature feature;
+		feature.type = sf.t;
+		feature.id = sf.id;
+		feature.has_id = sf.has_id;
+		for (size_t i = 0; i < sf.geometry.size(); i++) {
+			feature.geometry.push_back(mvt_geometry(sf.geometry[i].op, sf.geometry[i].x >> shift, sf.geometry[i].y >> shift));
+		}
+
+		decode_meta(sf.keys, sf.values, rpa->stringpool + rpa->pool_off[sf.segment], l->second, feature);
+
+		mvt_value v;
+		v.type = mvt_uint;
+		v.numeric_value.uint_value = sf.index;
+		l->second.tag(feature, "$index", v);
+		v.type = mvt_sint;
+		v.numeric_value.sint_value = sf.seq;
+		l->second.tag(feature, "$sequence", v);
+		v.numeric_value.sint_value = sf.extent;
+		l->second.tag(feature, "$extent", v);
+		v.type = mvt_bool;
+		v.numeric_value.bool_value = sf.dropped;
+		l->second.tag(feature, "$dropped", v);
+
+		l->second.features.push_back(feature);
+	}
+
+	mvt_tile tile;
+	for (auto &l : layers) {
+		tile.layers.push_back(std::move(l.second));
+	}
+	write_binary_tile(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty, tile, "prefilter");
+}
+
 void *run_prefilter(void *v) {
 	run_prefilter_args *rpa = (run_prefilter_args *) v;
+
+	if (rpa->binary) {
+		run_binary_prefilter(rpa);
+		return NULL;
+	}
+
+	if (rpa->persistent) {
+		persistent_filter_begin_tile(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty);
+	}
+
 	json_writer state(rpa->prefilter_fp);
 
 	while (1) {
-		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->geomfile, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards, rpa->filter, rpa->stringpool, rpa->pool_off, rpa->layer_unmaps, rpa->first_time, rpa->compressed);
+		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->geomfile, rpa->tile_starts, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards, rpa->filter, rpa->stringpool, rpa->pool_off, rpa->layer_unmaps, rpa->first_time, rpa->compressed);
 		if (sf.t < 0) {
 			break;
 		}
@@ -1667,6 +1797,11 @@ void *run_prefilter(void *v) {
 		layer_to_geojson(tmp_layer, 0, 0, 0, false, true, false, true, sf.index, sf.seq, sf.extent, true, state, 0);
 	}
 
+	if (rpa->persistent) {
+		persistent_filter_end_tile(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty, "prefilter");
+		return NULL;
+	}
+
 	if (fclose(rpa->prefilter_fp) != 0) {
 		if (errno == EPIPE) {
 			static bool warned = false;
@@ -1823,7 +1958,7 @@ void preserve_attributes(std::map<std::string, attribute_op> const *attribute_ac
 	}
 }
 
-bool find_partial(std::vector<partial> &partials, serial_feature &sf, ssize_t &out, std::vector<std::vector<std::string>> *layer_unmaps, long long maxextent) {
+bool find_partial(std::pmr::vector<partial> &partials, serial_feature &sf, ssize_t &out, std::vector<std::vector<std::string>> *layer_unmaps, long long maxextent) {
 	for (size_t i = partials.size(); i > 0; i--) {
 		if (partials[i - 1].t == sf.t) {
 			std::string &layername1 = (*layer_unmaps)[partials[i - 1].segment][partials[i - 1].layer];
@@ -1863,12 +1998,12 @@ static bool line_is_too_small(drawvec const &geometry, int z, int detail) {
 // to avoid spending lots of memory on a complete list when there are
 // hundreds of millions of features.
 template <class T>
-void add_sample_to(std::vector<T> &vals, T val, size_t &increment, size_t seq) {
+void add_sample_to(std::pmr::vector<T> &vals, T val, size_t &increment, size_t seq) {
 	if (seq % increment == 0) {
 		vals.push_back(val);
 
 		if (vals.size() > 100000) {
-			std::vector<T> tmp;
+			std::pmr::vector<T> tmp(vals.get_allocator());
 
 			for (size_t i = 0; i < vals.size(); i += 2) {
 				tmp.push_back(vals[i]);
@@ -1880,7 +2015,33 @@ void add_sample_to(std::vector<T> &vals, T val, size_t &increment, size_t seq) {
 	}
 }
 
-long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, char *stringpool, int z, const unsigned tx, const unsigned ty, const int detail, int min_detail, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, compressor **geomfile, int minzoom, int maxzoom, double todo, std::atomic<long long> *along, long long alongminus, double gamma, int child_shards, long long *pool_off, unsigned *initial_x, unsigned *initial_y, std::atomic<int> *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, struct json_object *filter, write_tile_args *arg, atomic_strategy *strategy, bool compressed_input) {
+static void record_retry(tile_retry_record *r, strategy const &before, atomic_strategy const *after, bool full_detail, double gamma, double fraction, unsigned long long mingap, unsigned long long mingap_limit, long long minextent, double minextent_limit) {
+	r->full_detail = full_detail;
+	r->gamma = gamma;
+	r->fraction = fraction;
+	r->mingap = mingap;
+	r->mingap_limit = mingap_limit;
+	r->minextent = minextent;
+	r->minextent_limit = minextent_limit;
+
+	r->counts.dropped_by_rate = after->dropped_by_rate - before.dropped_by_rate;
+	r->counts.dropped_by_gamma = after->dropped_by_gamma - before.dropped_by_gamma;
+	r->counts.dropped_as_needed = after->dropped_as_needed - before.dropped_as_needed;
+	r->counts.coalesced_as_needed = after->coalesced_as_needed - before.coalesced_as_needed;
+	r->counts.detail_reduced = after->detail_reduced - before.detail_reduced;
+	r->counts.tiny_polygons = after->tiny_polygons - before.tiny_polygons;
+}
+
+static void add_strategy(atomic_strategy *to, strategy const &from) {
+	to->dropped_by_rate += from.dropped_by_rate;
+	to->dropped_by_gamma += from.dropped_by_gamma;
+	to->dropped_as_needed += from.dropped_as_needed;
+	to->coalesced_as_needed += from.coalesced_as_needed;
+	to->detail_reduced += from.detail_reduced;
+	to->tiny_polygons += from.tiny_polygons;
+}
+
+long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, char *stringpool, int z, const unsigned tx, const unsigned ty, const int detail, int min_detail, sqlite3 *outdb, const char *outdir, pmtiles_writer *outpm, int buffer, const char *fname, compressor **geomfile, int minzoom, int maxzoom, double todo, std::atomic<long long> *along, long long alongminus, double gamma, int child_shards, long long *pool_off, unsigned *initial_x, unsigned *initial_y, std::atomic<int> *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, compiled_filter const *filter, write_tile_args *arg, atomic_strategy *strategy, bool compressed_input) {
 	double merge_fraction = 1;
 	double mingap_fraction = 1;
 	double minextent_fraction = 1;
@@ -1908,6 +2069,9 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 		}
 	}
 
+	// With --update-intermediate, only the tiles near the changes are made again
+	bool unselected = update_tiles != NULL && !update_tiles->contains(z, tx, ty);
+
 	bool first_time = true;
 	// This only loops if the tile data didn't fit, in which case the detail
 	// goes down and the progress indicator goes backward for the next try.
@@ -1918,6 +2082,12 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 
 		double fraction_accum = 0;
 
+		// For --retry-changed-tiles-only: how much mingap and minextent could
+		// go up before this attempt would drop anything differently
+		unsigned long long mingap_limit = ULLONG_MAX;
+		double minextent_limit = INFINITY;
+		struct strategy attempt_start(*strategy, 0, 0);
+
 		unsigned long long previndex = 0, density_previndex = 0, merge_previndex = 0;
 		unsigned long long extent_previndex = 0;
 		double scale = (double) (1LL << (64 - 2 * (z + 8)));
@@ -1927,11 +2097,16 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 		long long original_features = 0;
 		long long unclipped_features = 0;
 
-		std::vector<struct partial> partials;
-		std::map<std::string, std::vector<coalesce>> layers;
+		// The scratch state for this attempt comes from the thread's arena,
+		// which the previous attempt is finished with
+		tile_arena &arena = *arg->arena;
+		arena.reset();
+
+		std::pmr::vector<struct partial> partials(&arena);
+		std::pmr::map<std::string, std::pmr::vector<coalesce>> layers(&arena);
 
-		std::vector<unsigned long long> indices;
-		std::vector<long long> extents;
+		std::pmr::vector<unsigned long long> indices(&arena);
+		std::pmr::vector<long long> extents(&arena);
 		size_t extents_increment = 1;
 
 		double coalesced_area = 0;
@@ -1966,8 +2141,7 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 			}
 
 			*geompos_in = og;
-			geoms->zs.avail_in = 0;
-			geoms->zs.avail_out = 0;
+			geoms->reset();
 		}
 
 		int prefilter_write = -1, prefilter_read = -1;
@@ -1977,6 +2151,7 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 		run_prefilter_args rpa;	 // here so it stays in scope until joined
 		FILE *prefilter_read_fp = NULL;
 		json_pull *prefilter_jp = NULL;
+		persistent_filter *prefilter_persistent = NULL;
 
 		serial_feature tiny_feature;
 
@@ -1986,11 +2161,16 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 		}
 
 		if (prefilter != NULL) {
-			setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
-			prefilter_fp = fdopen(prefilter_write, "w");
-			if (prefilter_fp == NULL) {
-				perror("freopen prefilter");
-				exit(EXIT_OPEN);
+			if (additional[A_PERSISTENT_FILTERS] || additional[A_BINARY_FILTERS]) {
+				prefilter_persistent = persistent_filter_acquire(prefilter);
+				prefilter_fp = prefilter_persistent->write_fp;
+			} else {
+				setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
+				prefilter_fp = fdopen(prefilter_write, "w");
+				if (prefilter_fp == NULL) {
+					perror("freopen prefilter");
+					exit(EXIT_OPEN);
+				}
 			}
 
 			rpa.geoms = geoms;
@@ -2012,12 +2192,15 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 			rpa.buffer = buffer;
 			rpa.within = within;
 			rpa.geomfile = geomfile;
+			rpa.tile_starts = arg->tile_starts;
 			rpa.geompos = geompos;
 			rpa.oprogress = &oprogress;
 			rpa.todo = todo;
 			rpa.fname = fname;
 			rpa.child_shards = child_shards;
 			rpa.prefilter_fp = prefilter_fp;
+			rpa.persistent = prefilter_persistent != NULL;
+			rpa.binary = additional[A_BINARY_FILTERS];
 			rpa.layer_unmaps = layer_unmaps;
 			rpa.stringpool = stringpool;
 			rpa.pool_off = pool_off;
@@ -2030,12 +2213,16 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 				exit(EXIT_PTHREAD);
 			}
 
-			prefilter_read_fp = fdopen(prefilter_read, "r");
-			if (prefilter_read_fp == NULL) {
-				perror("fdopen prefilter output");
-				exit(EXIT_OPEN);
+			if (prefilter_persistent != NULL) {
+				prefilter_jp = prefilter_persistent->jp;
+			} else {
+				prefilter_read_fp = fdopen(prefilter_read, "r");
+				if (prefilter_read_fp == NULL) {
+					perror("fdopen prefilter output");
+					exit(EXIT_OPEN);
+				}
+				prefilter_jp = json_begin_file(prefilter_read_fp);
 			}
-			prefilter_jp = json_begin_file(prefilter_read_fp);
 		}
 
 		for (size_t seq = 0;; seq++) {
@@ -2043,15 +2230,22 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 			ssize_t which_partial = -1;
 
 			if (prefilter == NULL) {
-				sf = next_feature(geoms, geompos_in, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, along, alongminus, buffer, within, geomfile, geompos, &oprogress, todo, fname, child_shards, filter, stringpool, pool_off, layer_unmaps, first_time, compressed_input);
+				sf = next_feature(geoms, geompos_in, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, along, alongminus, buffer, within, geomfile, arg->tile_starts, geompos, &oprogress, todo, fname, child_shards, filter, stringpool, pool_off, layer_unmaps, first_time, compressed_input);
+			} else if (additional[A_BINARY_FILTERS]) {
+				sf = parse_binary_feature(prefilter_persistent, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
 			} else {
-				sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
+				sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL, prefilter_persistent != NULL);
 			}
 
 			if (sf.t < 0) {
 				break;
 			}
 
+			if (unselected) {
+				// Read through the features to get to the next tile without making this one
+				continue;
+			}
+
 			if (sf.t == VT_POINT) {
 				if (extent_previndex >= sf.index) {
 					sf.extent = 1;
@@ -2094,6 +2288,9 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 				if (indices.size() < MAX_INDICES) {
 					indices.push_back(sf.index);
 				}
+				if (sf.index >= merge_previndex && sf.index - merge_previndex >= mingap && sf.index - merge_previndex < mingap_limit) {
+					mingap_limit = sf.index - merge_previndex;
+				}
 				if ((sf.index < merge_previndex || sf.index - merge_previndex < mingap) && find_partial(partials, sf, which_partial, layer_unmaps, LLONG_MAX)) {
 					partials[which_partial].clustered++;
 
@@ -2117,6 +2314,9 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 				if (indices.size() < MAX_INDICES) {
 					indices.push_back(sf.index);
 				}
+				if (sf.index - merge_previndex >= mingap && sf.index - merge_previndex < mingap_limit) {
+					mingap_limit = sf.index - merge_previndex;
+				}
 				if (sf.index - merge_previndex < mingap && find_partial(partials, sf, which_partial, layer_unmaps, LLONG_MAX)) {
 					preserve_attributes(arg->attribute_accum, sf, stringpool, pool_off, partials[which_partial]);
 					strategy->dropped_as_needed++;
@@ -2126,6 +2326,9 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 				if (indices.size() < MAX_INDICES) {
 					indices.push_back(sf.index);
 				}
+				if (sf.index - merge_previndex >= mingap && sf.index - merge_previndex < mingap_limit) {
+					mingap_limit = sf.index - merge_previndex;
+				}
 				if (sf.index - merge_previndex < mingap && find_partial(partials, sf, which_partial, layer_unmaps, LLONG_MAX)) {
 					partials[which_partial].geoms.push_back(sf.geometry);
 					partials[which_partial].coalesced = true;
@@ -2138,6 +2341,9 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 				add_sample_to(extents, sf.extent, extents_increment, seq);
 				// search here is for LLONG_MAX, not minextent, because we are dropping features, not coalescing them,
 				// so we shouldn't expect to find anything small that we can related this feature to.
+				if (sf.extent + coalesced_area > minextent && sf.extent + coalesced_area < minextent_limit) {
+					minextent_limit = sf.extent + coalesced_area;
+				}
 				if (sf.extent + coalesced_area <= minextent && find_partial(partials, sf, which_partial, layer_unmaps, LLONG_MAX)) {
 					preserve_attributes(arg->attribute_accum, sf, stringpool, pool_off, partials[which_partial]);
 					strategy->dropped_as_needed++;
@@ -2145,6 +2351,9 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 				}
 			} else if (additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
 				add_sample_to(extents, sf.extent, extents_increment, seq);
+				if (sf.extent + coalesced_area > minextent && sf.extent + coalesced_area < minextent_limit) {
+					minextent_limit = sf.extent + coalesced_area;
+				}
 				if (sf.extent + coalesced_area <= minextent && find_partial(partials, sf, which_partial, layer_unmaps, minextent)) {
 					partials[which_partial].geoms.push_back(sf.geometry);
 					partials[which_partial].coalesced = true;
@@ -2352,7 +2561,14 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 			}
 		}
 
-		if (prefilter != NULL) {
+		if (prefilter_persistent != NULL) {
+			void *ret;
+			if (pthread_join(prefilter_writer, &ret) != 0) {
+				perror("pthread_join prefilter writer");
+				exit(EXIT_PTHREAD);
+			}
+			persistent_filter_release(prefilter_persistent);
+		} else if (prefilter != NULL) {
 			json_end(prefilter_jp);
 			if (fclose(prefilter_read_fp) != 0) {
 				perror("close output from prefilter");
@@ -2386,7 +2602,7 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 			tasks = 1;
 		}
 
-		pthread_t pthreads[tasks];
+		task_group simplifying;
 		std::vector<partial_arg> args;
 		args.resize(tasks);
 		for (int i = 0; i < tasks; i++) {
@@ -2396,24 +2612,13 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 			args[i].shared_nodes = &shared_nodes;
 
 			if (tasks > 1) {
-				if (pthread_create(&pthreads[i], NULL, partial_feature_worker, &args[i]) != 0) {
-					perror("pthread_create");
-					exit(EXIT_PTHREAD);
-				}
+				task_run(&simplifying, partial_feature_worker, &args[i]);
 			} else {
 				partial_feature_worker(&args[i]);
 			}
 		}
 
-		if (tasks > 1) {
-			for (int i = 0; i < tasks; i++) {
-				void *retval;
-
-				if (pthread_join(pthreads[i], &retval) != 0) {
-					perror("pthread_join");
-				}
-			}
-		}
+		task_wait(&simplifying);
 
 		for (size_t i = 0; i < partials.size(); i++) {
 			std::vector<drawvec> &pgeoms = partials[i].geoms;
@@ -2446,7 +2651,7 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 
 					std::string layername = (*layer_unmaps)[partials[i].segment][partials[i].layer];
 					if (layers.count(layername) == 0) {
-						layers.insert(std::pair<std::string, std::vector<coalesce>>(layername, std::vector<coalesce>()));
+						layers.insert(std::pair<std::string, std::pmr::vector<coalesce>>(layername, std::pmr::vector<coalesce>(&arena)));
 					}
 
 					auto l = layers.find(layername);
@@ -2473,13 +2678,13 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 		}
 
 		for (auto layer_iterator = layers.begin(); layer_iterator != layers.end(); ++layer_iterator) {
-			std::vector<coalesce> &layer_features = layer_iterator->second;
+			std::pmr::vector<coalesce> &layer_features = layer_iterator->second;
 
 			if (additional[A_REORDER]) {
 				std::sort(layer_features.begin(), layer_features.end());
 			}
 
-			std::vector<coalesce> out;
+			std::pmr::vector<coalesce> out(&arena);
 			if (layer_features.size() > 0) {
 				out.push_back(layer_features[0]);
 			}
@@ -2548,7 +2753,7 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 		mvt_tile tile;
 
 		for (auto layer_iterator = layers.begin(); layer_iterator != layers.end(); ++layer_iterator) {
-			std::vector<coalesce> &layer_features = layer_iterator->second;
+			std::pmr::vector<coalesce> &layer_features = layer_iterator->second;
 
 			mvt_layer layer;
 			layer.name = layer_iterator->first;
@@ -2621,12 +2826,13 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 
 		size_t totalsize = 0;
 		for (auto layer_iterator = layers.begin(); layer_iterator != layers.end(); ++layer_iterator) {
-			std::vector<coalesce> &layer_features = layer_iterator->second;
+			std::pmr::vector<coalesce> &layer_features = layer_iterator->second;
 			totalsize += layer_features.size();
 		}
 
 		size_t passes = pass + 1;
-		double progress = floor(((((*geompos_in + *along - alongminus) / (double) todo) + pass) / passes + z) / (maxzoom + 1) * 1000) / 10;
+		double fraction_done = std::min(1.0, (*geompos_in + *along - alongminus) / (double) todo);
+		double progress = floor(((fraction_done + pass) / passes + z) / (maxzoom + 1) * 1000) / 10;
 		if (progress >= oprogress + 0.1) {
 			if (!quiet && !quiet_progress && progress_time()) {
 				fprintf(stderr, "  %3.1f%%  %d/%u/%u  \r", progress, z, tx, ty);
@@ -2825,25 +3031,37 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 					strategy->detail_reduced++;
 				}
 			} else {
-				if (pthread_mutex_lock(&db_lock) != 0) {
-					perror("pthread_mutex_lock");
-					exit(EXIT_PTHREAD);
-				}
-
 				if (outdb != NULL) {
+					// The MBTiles writer queue has its own lock, and may block
+					// while it is full, so this must not hold db_lock
 					mbtiles_write_tile(outdb, z, tx, ty, compressed.data(), compressed.size());
-				} else if (outdir != NULL) {
-					dir_write_tile(outdir, z, tx, ty, compressed);
-				}
+				} else {
+					if (pthread_mutex_lock(&db_lock) != 0) {
+						perror("pthread_mutex_lock");
+						exit(EXIT_PTHREAD);
+					}
 
-				if (pthread_mutex_unlock(&db_lock) != 0) {
-					perror("pthread_mutex_unlock");
-					exit(EXIT_PTHREAD);
+					if (outpm != NULL) {
+						pmtiles_write_tile(outpm, z, tx, ty, compressed.data(), compressed.size());
+					} else if (outdir != NULL) {
+						dir_write_tile(outdir, z, tx, ty, compressed);
+					}
+
+					if (pthread_mutex_unlock(&db_lock) != 0) {
+						perror("pthread_mutex_unlock");
+						exit(EXIT_PTHREAD);
+					}
 				}
 
+				if (arg->retry != NULL) {
+					record_retry(arg->retry, attempt_start, strategy, line_detail == detail, gamma, fraction, mingap, mingap_limit, minextent, minextent_limit);
+				}
 				return count;
 			}
 		} else {
+			if (arg->retry != NULL) {
+				record_retry(arg->retry, attempt_start, strategy, line_detail == detail, gamma, fraction, mingap, mingap_limit, minextent, minextent_limit);
+			}
 			return count;
 		}
 	}
@@ -2852,455 +3070,1133 @@ long long write_tile(decompressor *geoms, std::atomic<long long> *geompos_in, ch
 	return -1;
 }
 
-struct task {
-	int fileno = 0;
-	struct task *next = NULL;
+// One zoom level in the tiling pipeline.
+//
+// Each level reads the shards that the previous level wrote and writes the
+// features for its own child tiles into a fresh set of shards. Each tiling
+// thread that works on a level claims one range of child_shards output shards
+// and is the only writer to that range, so the range is complete as soon as
+// that thread has finished its last tile at this zoom. The next zoom can then
+// start on that range without waiting for the rest of this zoom to finish.
+//
+// Retries (when some tile raised the gamma, mingap, or minextent, or lowered the
+// fraction) only reread this level's input, because the child shards are only
+// written during the first pass, so they don't hold up the next zoom either.
+//
+// The input shards are divided into units of whole tiles, which are handed out
+// to whichever thread is free, biggest first, so that one dense shard doesn't
+// keep one thread busy while the others have nothing to do.
+
+// Shards smaller than this are never divided
+#define MIN_TILING_UNIT (256 * 1024)
+
+struct tiling_unit {
+	size_t index = 0;  // in the level's units
+	size_t shard = 0;
+	long long start = 0;
+	long long end = 0;
+
+	tiling_unit(size_t index_, size_t shard_, long long start_, long long end_)
+	    : index(index_),
+	      shard(shard_),
+	      start(start_),
+	      end(end_) {
+	}
 };
 
-void *run_thread(void *vargs) {
-	write_tile_args *arg = (write_tile_args *) vargs;
-	struct task *task;
+struct zoom_level {
+	int z = 0;
+	bool compressed = false;
+	bool started = false;
+	bool settled = false;
+
+	// Input shards, published one range at a time by the previous level
+	std::vector<int> geomfd;
+	std::vector<off_t> geom_size;
+	std::vector<char *> geom_map;
+	std::vector<tiling_unit> units;
+	size_t inputs_ready = 0;
+	size_t inputs_expected = 0;
+	double todo = 0;
 
-	for (task = arg->tasks; task != NULL; task = task->next) {
-		int j = task->fileno;
+	// Output shards, one range of child_shards shards per writing thread
+	size_t ranges = 0;
+	int child_shards = 0;
+	std::vector<compressor> compressors;
+	std::vector<compressor *> sub;
+	std::vector<int> subfd;
+	std::vector<std::vector<long long>> tile_starts;
+	std::vector<ssize_t> range_holder;  // thread writing each range, or -1
+	std::vector<bool> range_busy;	    // holder is tiling a shard of this level
+	std::vector<bool> range_published;
+	size_t ranges_published = 0;
+	struct zoom_level *next = NULL;
+
+	// For --retry-changed-tiles-only, the tiles of each unit. A deque so
+	// that units can be added while other units' records are being written.
+	std::deque<std::vector<tile_retry_record>> retry_records;
+
+	// Units still to be tiled in the current pass, and units being tiled
+	std::vector<tiling_unit> queue;
+	size_t running = 0;
+	size_t pass = 0;
 
-		if (arg->geomfd[j] < 0) {
-			// only one source file for zoom level 0
-			continue;
-		}
-		if (arg->geom_size[j] == 0) {
-			continue;
-		}
+	double gamma = 0;
+	unsigned long long mingap = 0;
+	long long minextent = 0;
+	double fraction = 1;
+	double gamma_out = 0;
+	unsigned long long mingap_out = 0;
+	long long minextent_out = 0;
+	double fraction_out = 1;
+	size_t tile_size = 0;
+	size_t feature_count = 0;
+	bool still_dropping = false;
 
-		// If this is zoom level 0, the geomfd will be uncompressed data,
-		// because (at least for now) it needs to stay uncompressed during
-		// the sort and post-sort maxzoom calculation and fixup so that
-		// the sort can rearrange individual features and the fixup can
-		// then adjust their minzooms without decompressing and recompressing
-		// each feature.
-		//
-		// In higher zooms, it will be compressed data written out during the
-		// previous zoom.
+	// For --json-progress: when the level started, and what its
+	// passes have cost so far
+	phase_clock began;
+	double busy = 0;
+	double cpu = 0;
+	size_t tiles = 0;
+	long long written = 0;
+
+	std::atomic<long long> most;
+	std::atomic<long long> along;
+	atomic_strategy strategy;
+
+	zoom_level()
+	    : most(0),
+	      along(0) {
+	}
+};
 
-		FILE *geom = fdopen(arg->geomfd[j], "rb");
-		if (geom == NULL) {
-			perror("open geom");
-			exit(EXIT_OPEN);
-		}
+struct tiling_state {
+	std::deque<zoom_level> levels;	// deque so that levels never move
+	size_t threads = 0;
+	size_t ranges = 0;
+	int *maxzoom = NULL;
+	int minzoom = 0;
+	const char *tmpdir = NULL;
+	double maxzoom_simplification = 0;
+	std::vector<strategy> *strategies = NULL;
+	std::atomic<int> busy;
+	int err = INT_MAX;
+	int failed_zoom = INT_MAX;
+
+	// For --retry-changed-tiles-only
+	size_t retries = 0;
+	size_t retries_skipped = 0;
+	size_t tiles_retried = 0;
+	size_t tiles_skipped = 0;
+
+	// Template for the per-shard write_tile_args
+	write_tile_args common;
+
+	tiling_state()
+	    : busy(0) {
+	}
+};
 
-		decompressor dc(geom);
+pthread_mutex_t tiling_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tiling_cond = PTHREAD_COND_INITIALIZER;
 
-		std::atomic<long long> geompos(0);
-		long long prevgeom = 0;
+struct tiling_thread_args {
+	tiling_state *state = NULL;
+	size_t thread = 0;
 
-		while (1) {
-			int z;
-			unsigned x, y;
+	size_t units = 0;
+	double busy = 0;
+	double idle = 0;
 
-			// These z/x/y are uncompressed so we can seek to the start of the
-			// compressed feature data that immediately follows.
+	size_t arena_high_water = 0;
+	size_t arena_resets = 0;
+	size_t arena_overflowed = 0;
+};
 
-			if (!dc.deserialize_int(&z, &geompos)) {
-				break;
-			}
-			dc.deserialize_uint(&x, &geompos);
-			dc.deserialize_uint(&y, &geompos);
-#if 0
-			// currently broken because also requires tracking nextzoom when skipping zooms
-			if (z != arg->zoom) {
-				fprintf(stderr, "Expected zoom %d, found zoom %d\n", arg->zoom, z);
-				exit(EXIT_IMPOSSIBLE);
-			}
-#endif
+static double tiling_clock() {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		perror("clock_gettime");
+		exit(EXIT_IMPOSSIBLE);
+	}
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-			if (arg->compressed) {
-				dc.begin();
-			}
+// CPU time of this thread, excluding the nested tasks that other
+// threads run on its behalf
+static double tiling_cpu_clock() {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+		perror("clock_gettime");
+		exit(EXIT_IMPOSSIBLE);
+	}
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-			arg->wrote_zoom = z;
+// Tile all of the tiles in one unit of a shard. Returns false if some tile
+// couldn't be made small enough.
+// With --retry-changed-tiles-only, records holds the unit's tiles. The first
+// pass fills it in, and later passes only make the tiles that are marked to
+// be retried.
+static bool tile_unit(write_tile_args *arg, char *map, off_t size, tiling_unit const &unit, std::vector<tile_retry_record> *records) {
+	// If this is zoom level 0, the geomfd will be uncompressed data,
+	// because (at least for now) it needs to stay uncompressed during
+	// the sort and post-sort maxzoom calculation and fixup so that
+	// the sort can rearrange individual features and the fixup can
+	// then adjust their minzooms without decompressing and recompressing
+	// each feature.
+	//
+	// In higher zooms, it will be compressed data written out during the
+	// previous zoom.
+
+	// Other units of the same shard may be being tiled at the same time,
+	// so each unit reads the shard through its own stream.
+	FILE *geom = fmemopen(map, size, "rb");
+	if (geom == NULL) {
+		perror("open geom");
+		exit(EXIT_OPEN);
+	}
+	if (setvbuf(geom, NULL, _IONBF, 0) != 0) {
+		perror("setvbuf geom");
+		exit(EXIT_OPEN);
+	}
+	if (fseek(geom, unit.start, SEEK_SET) != 0) {
+		perror("fseek geom");
+		exit(EXIT_SEEK);
+	}
+
+	decompressor dc(geom);
 
-			// fprintf(stderr, "%d/%u/%u\n", z, x, y);
+	std::atomic<long long> geompos(unit.start);
+	long long prevgeom = unit.start;
+	bool ok = true;
+	size_t record = 0;
+	bool skipped = false;
+
+	while (geompos < unit.end) {
+		int z;
+		unsigned x, y;
+
+		tile_retry_record *retry = NULL;
+		if (records != NULL) {
+			if (arg->pass == 0) {
+				records->emplace_back();
+				retry = &records->back();
+				retry->start = geompos;
+			} else {
+				if (record >= records->size()) {
+					fprintf(stderr, "Internal error: ran out of tiles to retry at %lld in %lld-%lld\n", (long long) geompos, unit.start, unit.end);
+					exit(EXIT_IMPOSSIBLE);
+				}
+				retry = &(*records)[record++];
 
-			long long len = write_tile(&dc, &geompos, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->outdb, arg->outdir, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg->filter, arg, arg->strategy, arg->compressed);
+				if (!retry->retry) {
+					geompos = retry->end;
+					skipped = true;
+					continue;
+				}
 
-			if (len < 0) {
-				int *err = &arg->err;
-				*err = z - 1;
-				return err;
+				if (skipped) {
+					// Drop anything the decompressor read ahead from
+					// the tile that was skipped
+					if (fseek(geom, geompos, SEEK_SET) != 0) {
+						perror("fseek geom");
+						exit(EXIT_SEEK);
+					}
+					dc.reset();
+					skipped = false;
+				}
 			}
+		}
 
-			if (pthread_mutex_lock(&var_lock) != 0) {
-				perror("pthread_mutex_lock");
-				exit(EXIT_PTHREAD);
+		// These z/x/y are uncompressed so we can seek to the start of the
+		// compressed feature data that immediately follows.
+
+		if (!dc.deserialize_int(&z, &geompos)) {
+			break;
+		}
+		dc.deserialize_uint(&x, &geompos);
+		dc.deserialize_uint(&y, &geompos);
+
+		if (arg->pass > 0 && retry != NULL) {
+			// Only this tile is being made again, so only it is erased
+			if (arg->outdb != NULL) {
+				// queued to the MBTiles writer, like a tile, without db_lock
+				mbtiles_erase_tile(arg->outdb, z, x, y);
+			} else {
+				if (pthread_mutex_lock(&db_lock) != 0) {
+					perror("pthread_mutex_lock");
+					exit(EXIT_PTHREAD);
+				}
+
+				if (arg->outpm != NULL) {
+					pmtiles_erase_tile(arg->outpm, z, x, y);
+				} else if (arg->outdir != NULL) {
+					dir_erase_tile(arg->outdir, z, x, y);
+				}
+
+				if (pthread_mutex_unlock(&db_lock) != 0) {
+					perror("pthread_mutex_unlock");
+					exit(EXIT_PTHREAD);
+				}
 			}
+		}
+
+		if (arg->compressed) {
+			dc.begin();
+		}
+
+		arg->wrote_zoom = z;
+
+		// fprintf(stderr, "%d/%u/%u\n", z, x, y);
+
+		// A retry record needs the strategy counts of this tile alone
+		atomic_strategy tile_strategy;
+		arg->retry = retry;
+
+		long long len = write_tile(&dc, &geompos, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->outdb, arg->outdir, arg->outpm, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg->filter, arg, retry != NULL ? &tile_strategy : arg->strategy, arg->compressed);
+
+		if (retry != NULL) {
+			retry->end = geompos;
+			add_strategy(arg->strategy, strategy(tile_strategy, 0, 0));
+		}
+
+		if (len < 0) {
+			arg->err = z - 1;
+			ok = false;
+			break;
+		}
+		arg->tiles_out++;
 
-			if (z == arg->maxzoom) {
-				if (len > *arg->most) {
+		if (pthread_mutex_lock(&var_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_PTHREAD);
+		}
+
+		if (z == arg->maxzoom) {
+			if (len > *arg->most) {
+				*arg->midx = x;
+				*arg->midy = y;
+				*arg->most = len;
+			} else if (len == *arg->most) {
+				unsigned long long a = (((unsigned long long) x) << 32) | y;
+				unsigned long long b = (((unsigned long long) *arg->midx) << 32) | *arg->midy;
+
+				if (a < b) {
 					*arg->midx = x;
 					*arg->midy = y;
 					*arg->most = len;
-				} else if (len == *arg->most) {
-					unsigned long long a = (((unsigned long long) x) << 32) | y;
-					unsigned long long b = (((unsigned long long) *arg->midx) << 32) | *arg->midy;
-
-					if (a < b) {
-						*arg->midx = x;
-						*arg->midy = y;
-						*arg->most = len;
-					}
 				}
 			}
+		}
 
-			*arg->along += geompos - prevgeom;
-			prevgeom = geompos;
+		*arg->along += geompos - prevgeom;
+		prevgeom = geompos;
 
-			if (pthread_mutex_unlock(&var_lock) != 0) {
-				perror("pthread_mutex_unlock");
-				exit(EXIT_PTHREAD);
-			}
+		if (pthread_mutex_unlock(&var_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_PTHREAD);
 		}
+	}
+
+	if (fclose(geom) != 0) {
+		perror("close geom");
+		exit(EXIT_CLOSE);
+	}
+
+	return ok;
+}
+
+// Each range of output shards must be a power of 2 so that write_tile()
+// can divide the child tiles evenly between them
+static int shards_per_range(size_t ranges) {
+	int child_shards = 1;
+	while ((size_t) child_shards * 2 <= TEMP_FILES / ranges) {
+		child_shards *= 2;
+	}
+	return child_shards;
+}
+
+static int next_zoom(int z, int minzoom, int child_shards) {
+	// Same as the nextzoom calculation in write_tile()
+	int max_zoom_increment = std::log(child_shards) / std::log(4);
 
-		if (arg->pass == 1) {
-			// Since the fclose() has closed the underlying file descriptor
-			arg->geomfd[j] = -1;
+	int nextzoom = z + 1;
+	if (nextzoom < minzoom) {
+		if (z + max_zoom_increment > minzoom) {
+			nextzoom = minzoom;
 		} else {
-			int newfd = dup(arg->geomfd[j]);
-			if (newfd < 0) {
-				perror("dup geometry");
-				exit(EXIT_OPEN);
-			}
-			if (lseek(newfd, 0, SEEK_SET) < 0) {
-				perror("lseek geometry");
-				exit(EXIT_SEEK);
+			nextzoom = z + max_zoom_increment;
+		}
+	}
+	return nextzoom;
+}
+
+static void erase_zoom(write_tile_args const &common, int z) {
+	if (update_tiles != NULL) {
+		// Only some of the tiles are being made again, and the others have to stay
+		return;
+	}
+
+	if (pthread_mutex_lock(&db_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+
+	if (common.outdb != NULL) {
+		mbtiles_erase_zoom(common.outdb, z);
+	} else if (common.outpm != NULL) {
+		pmtiles_erase_zoom(common.outpm, z);
+	} else if (common.outdir != NULL) {
+		dir_erase_zoom(common.outdir, z);
+	}
+
+	if (pthread_mutex_unlock(&db_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+}
+
+static void close_level_inputs(zoom_level &level) {
+	for (size_t j = 0; j < level.geom_map.size(); j++) {
+		if (level.geom_map[j] != NULL) {
+			madvise(level.geom_map[j], level.geom_size[j], MADV_DONTNEED);
+			if (munmap(level.geom_map[j], level.geom_size[j]) != 0) {
+				perror("munmap geom");
+				exit(EXIT_MEMORY);
 			}
-			arg->geomfd[j] = newfd;
+			level.geom_map[j] = NULL;
 		}
+	}
 
-		if (fclose(geom) != 0) {
-			perror("close geom");
-			exit(EXIT_CLOSE);
+	for (size_t j = 0; j < level.geomfd.size(); j++) {
+		// Can be < 0 if there is only one source file, at z0
+		if (level.geomfd[j] >= 0) {
+			if (close(level.geomfd[j]) != 0) {
+				perror("close geom");
+				exit(EXIT_CLOSE);
+			}
+			level.geomfd[j] = -1;
 		}
 	}
+}
 
-	arg->running--;
-	return NULL;
+// Map one input shard and divide it into units of whole tiles
+static void add_level_input(zoom_level &level, size_t j, int fd, off_t size, std::vector<long long> const &starts, size_t threads) {
+	level.geomfd[j] = fd;
+	level.geom_size[j] = size;
+	level.todo += size;
+
+	if (size == 0) {
+		return;
+	}
+
+	level.geom_map[j] = (char *) mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (level.geom_map[j] == MAP_FAILED) {
+		perror("mmap geom");
+		exit(EXIT_MEMORY);
+	}
+
+	long long target = size / (4 * threads);
+	if (target < MIN_TILING_UNIT) {
+		target = MIN_TILING_UNIT;
+	}
+
+	long long start = 0;
+	for (size_t i = 0; i < starts.size(); i++) {
+		if (starts[i] - start >= target) {
+			level.units.emplace_back(level.units.size(), j, start, starts[i]);
+			level.queue.push_back(level.units.back());
+			level.retry_records.emplace_back();
+			start = starts[i];
+		}
+	}
+	level.units.emplace_back(level.units.size(), j, start, size);
+	level.queue.push_back(level.units.back());
+	level.retry_records.emplace_back();
 }
 
-int traverse_zooms(int *geomfd, off_t *geom_size, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, double maxzoom_simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, struct json_object *filter, std::vector<strategy> &strategies, int iz) {
-	last_progress = 0;
+// Open the output shards for a level and set up the level that will read them.
+static void start_level(tiling_state &st, zoom_level &level) {
+	size_t outputs = level.ranges * level.child_shards;
+
+	level.compressors.resize(outputs);
+	level.sub.resize(outputs);
+	level.subfd.resize(outputs);
+	level.tile_starts.resize(outputs);
+
+	for (size_t j = 0; j < outputs; j++) {
+		char geomname[strlen(st.tmpdir) + strlen("/geom.XXXXXXXX" XSTRINGIFY(INT_MAX)) + 1];
+		snprintf(geomname, sizeof(geomname), "%s/geom%zu.XXXXXXXX", st.tmpdir, j);
+		level.subfd[j] = mkstemp_cloexec(geomname);
+		// printf("%s\n", geomname);
+		if (level.subfd[j] < 0) {
+			perror(geomname);
+			exit(EXIT_OPEN);
+		}
+		FILE *fp = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
+		if (fp == NULL) {
+			perror(geomname);
+			exit(EXIT_OPEN);
+		}
+		level.compressors[j] = compressor(fp);
+		level.sub[j] = &level.compressors[j];
+		unlink(geomname);
+	}
 
-	// The existing layermaps are one table per input thread.
-	// We need to add another one per *tiling* thread so that it can be
-	// safely changed during tiling.
-	size_t layermaps_off = layermaps.size();
-	for (size_t i = 0; i < CPUS; i++) {
-		layermaps.push_back(std::map<std::string, layermap_entry>());
+	level.range_holder.resize(level.ranges, -1);
+	level.range_busy.resize(level.ranges, false);
+	level.range_published.resize(level.ranges, false);
+	level.started = true;
+	level.began = phase_clock::now();
+
+	if (level.z < *st.maxzoom || (additional[A_EXTEND_ZOOMS] && level.z < MAX_ZOOM)) {
+		st.levels.emplace_back();
+		zoom_level &next = st.levels.back();
+
+		next.z = next_zoom(level.z, st.minzoom, level.child_shards);
+		next.compressed = true;
+		next.geomfd.resize(outputs, -1);
+		next.geom_size.resize(outputs, 0);
+		next.geom_map.resize(outputs, NULL);
+		next.inputs_expected = level.ranges;
+		next.ranges = st.ranges;
+		next.child_shards = shards_per_range(st.ranges);
+
+		next.gamma = st.common.gamma;
+		next.mingap = ((1LL << (32 - next.z)) / 256 * cluster_distance) * ((1LL << (32 - next.z)) / 256 * cluster_distance);
+
+		level.next = &next;
 	}
+}
 
-	// Table to map segment and layer number back to layer name
-	std::vector<std::vector<std::string>> layer_unmaps;
-	for (size_t seg = 0; seg < layermaps.size(); seg++) {
-		layer_unmaps.push_back(std::vector<std::string>());
+// Close one range of a level's output shards and hand them to the next level.
+static void publish_range(tiling_state &st, zoom_level &level, size_t r) {
+	for (size_t j = r * level.child_shards; j < (r + 1) * level.child_shards; j++) {
+		if (level.sub[j]->fclose() != 0) {
+			perror("close subfile");
+			exit(EXIT_CLOSE);
+		}
 
-		for (auto a = layermaps[seg].begin(); a != layermaps[seg].end(); ++a) {
-			if (a->second.id >= layer_unmaps[seg].size()) {
-				layer_unmaps[seg].resize(a->second.id + 1);
+		struct stat geomst;
+		if (fstat(level.subfd[j], &geomst) != 0) {
+			perror("stat geom\n");
+			exit(EXIT_STAT);
+		}
+
+		level.written += geomst.st_size;
+
+		if (level.next != NULL) {
+			add_level_input(*level.next, j, level.subfd[j], geomst.st_size, level.tile_starts[j], st.threads);
+		} else {
+			if (close(level.subfd[j]) != 0) {
+				perror("close subfile");
+				exit(EXIT_CLOSE);
 			}
-			layer_unmaps[seg][a->second.id] = a->first;
 		}
+		level.subfd[j] = -1;
+		level.tile_starts[j].clear();
+		level.tile_starts[j].shrink_to_fit();
 	}
 
-	int z;
-	for (z = iz; z <= maxzoom; z++) {
-		std::atomic<long long> most(0);
+	if (level.next != NULL) {
+		level.next->inputs_ready++;
+	}
 
-		compressor compressors[TEMP_FILES];
-		compressor *sub[TEMP_FILES];
-		int subfd[TEMP_FILES];
-		for (size_t j = 0; j < TEMP_FILES; j++) {
-			char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX" XSTRINGIFY(INT_MAX)) + 1];
-			snprintf(geomname, sizeof(geomname), "%s/geom%zu.XXXXXXXX", tmpdir, j);
-			subfd[j] = mkstemp_cloexec(geomname);
-			// printf("%s\n", geomname);
-			if (subfd[j] < 0) {
-				perror(geomname);
-				exit(EXIT_OPEN);
-			}
-			FILE *fp = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
-			if (fp == NULL) {
-				perror(geomname);
-				exit(EXIT_OPEN);
+	level.range_published[r] = true;
+	level.ranges_published++;
+}
+
+// Called with tiling_lock held when a level is about to be retried with new
+// thresholds. Queues only the units with tiles that would come out differently,
+// and counts the strategies of the ones that won't be made again.
+static void queue_changed_tiles(tiling_state &st, zoom_level &level) {
+	st.retries++;
+	level.queue.clear();
+
+	for (size_t u = 0; u < level.units.size(); u++) {
+		bool any = false;
+
+		for (auto &r : level.retry_records[u]) {
+			r.retry = !r.unchanged(level.gamma, level.fraction, level.mingap, level.minextent);
+
+			if (r.retry) {
+				st.tiles_retried++;
+				any = true;
+			} else {
+				st.tiles_skipped++;
+				add_strategy(&level.strategy, r.counts);
 			}
-			compressors[j] = compressor(fp);
-			sub[j] = &compressors[j];
-			unlink(geomname);
 		}
 
-		size_t useful_threads = 0;
-		long long todo = 0;
-		for (size_t j = 0; j < TEMP_FILES; j++) {
-			todo += geom_size[j];
-			if (geom_size[j] > 0) {
-				useful_threads++;
-			}
+		if (any) {
+			level.queue.push_back(level.units[u]);
 		}
+	}
+}
 
-		size_t threads = CPUS;
-		if (threads > TEMP_FILES / 4) {
-			threads = TEMP_FILES / 4;
+// Called with tiling_lock held when a level has no more work in its current pass
+static void finish_pass(tiling_state &st, zoom_level &level) {
+	bool again = false;
+
+	if (level.gamma_out > level.gamma) {
+		level.gamma = level.gamma_out;
+		again = true;
+	}
+	if (level.mingap_out > level.mingap) {
+		level.mingap = level.mingap_out;
+		again = true;
+	}
+	if (level.minextent_out > level.minextent) {
+		level.minextent = level.minextent_out;
+		again = true;
+	}
+	if (level.fraction_out < level.fraction) {
+		level.fraction = level.fraction_out;
+		again = true;
+	}
+
+	if (additional[A_EXTEND_ZOOMS] && level.z == *st.maxzoom && level.still_dropping && *st.maxzoom < MAX_ZOOM) {
+		(*st.maxzoom)++;
+	}
+
+	if ((size_t) level.z >= st.strategies->size()) {
+		st.strategies->resize(level.z + 1);
+	}
+
+	struct strategy s(level.strategy, level.tile_size, level.feature_count);
+	(*st.strategies)[level.z] = s;
+
+	if (again && st.err == INT_MAX) {
+		level.pass++;
+		level.along = 0;
+		level.still_dropping = false;
+
+		// The strategy counts only reflect the final pass
+		level.strategy.dropped_by_rate = 0;
+		level.strategy.dropped_by_gamma = 0;
+		level.strategy.dropped_as_needed = 0;
+		level.strategy.coalesced_as_needed = 0;
+		level.strategy.detail_reduced = 0;
+		level.strategy.tiny_polygons = 0;
+
+		if (additional[A_RETRY_CHANGED_TILES]) {
+			queue_changed_tiles(st, level);
+		} else {
+			erase_zoom(st.common, level.z);
+			level.queue = level.units;
 		}
-		// XXX is it useful to divide further if we know we are skipping
-		// some zoom levels? Is it faster to have fewer CPUs working on
-		// sharding, but more deeply, or more CPUs, less deeply?
-		if (threads > useful_threads) {
-			threads = useful_threads;
+
+		if (level.queue.size() > 0) {
+			return;
 		}
 
-		// Round down to a power of 2
-		for (int e = 0; e < 30; e++) {
-			if (threads >= (1U << e) && threads < (1U << (e + 1))) {
-				threads = 1U << e;
-				break;
-			}
+		// Every tile would come out the same, so the retry is already done
+		if (additional[A_RETRY_CHANGED_TILES]) {
+			st.retries_skipped++;
 		}
-		if (threads >= (1U << 30)) {
-			threads = 1U << 30;
+		(*st.strategies)[level.z] = strategy(level.strategy, level.tile_size, level.feature_count);
+	}
+
+	if (level.pass > 0 && additional[A_RETRY_CHANGED_TILES] && st.common.outdb != NULL) {
+		if (pthread_mutex_lock(&db_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_PTHREAD);
 		}
-		if (threads < 1) {
-			threads = 1;
+
+		mbtiles_erase_unused_images(st.common.outdb, level.z);
+
+		if (pthread_mutex_unlock(&db_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_PTHREAD);
 		}
+	}
 
-		// Assign temporary files to threads
+	double wall = phase_clock::now().wall - level.began.wall;
+	logger.phase("zoom", wall, level.cpu, {{"zoom", level.z}, {"passes", level.pass + 1}, {"retries", level.pass}, {"busy", level.busy}, {"tiles", level.tiles}, {"tiles_per_second", wall > 0 ? level.tiles / wall : 0}, {"geom_input", level.todo}, {"geom_written", level.written}});
 
-		std::vector<struct task> tasks;
-		tasks.resize(TEMP_FILES);
+	level.settled = true;
+	level.retry_records.clear();
+	close_level_inputs(level);
+}
 
-		struct dispatch {
-			struct task *tasks = NULL;
-			long long todo = 0;
-			struct dispatch *next = NULL;
-		};
-		std::vector<struct dispatch> dispatches;
-		dispatches.resize(threads);
+// Called with tiling_lock held. Publishes the output ranges that are finished
+// and finishes the passes that have no more work in them.
+static void update_levels(tiling_state &st) {
+	for (size_t i = 0; i < st.levels.size(); i++) {
+		zoom_level &level = st.levels[i];
 
-		struct dispatch *dispatch_head = &dispatches[0];
-		for (size_t j = 0; j < threads; j++) {
-			dispatches[j].tasks = NULL;
-			dispatches[j].todo = 0;
-			if (j + 1 < threads) {
-				dispatches[j].next = &dispatches[j + 1];
-			} else {
-				dispatches[j].next = NULL;
-			}
+		if (level.settled) {
+			continue;
 		}
 
-		for (size_t j = 0; j < TEMP_FILES; j++) {
-			if (geom_size[j] == 0) {
-				continue;
-			}
+		// A level that is past the maxzoom, even after the level before it
+		// has had a chance to extend the maxzoom, will never be tiled.
+		if (level.z > *st.maxzoom && (i == 0 || st.levels[i - 1].settled)) {
+			level.settled = true;
+			close_level_inputs(level);
+			continue;
+		}
 
-			tasks[j].fileno = j;
-			tasks[j].next = dispatch_head->tasks;
-			dispatch_head->tasks = &tasks[j];
-			dispatch_head->todo += geom_size[j];
+		if (!level.started) {
+			continue;
+		}
 
-			struct dispatch *here = dispatch_head;
-			dispatch_head = dispatch_head->next;
+		bool inputs_complete = level.inputs_ready == level.inputs_expected && level.queue.size() == 0;
 
-			dispatch **d;
-			for (d = &dispatch_head; *d != NULL; d = &((*d)->next)) {
-				if (here->todo < (*d)->todo) {
-					break;
+		if (level.pass == 0 && inputs_complete) {
+			// No more shards at this zoom will be claimed, so each range
+			// is finished once its writer isn't tiling anything more.
+			for (size_t r = 0; r < level.ranges; r++) {
+				if (!level.range_published[r] && !level.range_busy[r]) {
+					publish_range(st, level, r);
 				}
 			}
+		}
 
-			here->next = *d;
-			*d = here;
-		}
-
-		int err = INT_MAX;
-
-		double zoom_gamma = gamma;
-		unsigned long long zoom_mingap = ((1LL << (32 - z)) / 256 * cluster_distance) * ((1LL << (32 - z)) / 256 * cluster_distance);
-		long long zoom_minextent = 0;
-		double zoom_fraction = 1;
-		size_t zoom_tile_size = 0;
-		size_t zoom_feature_count = 0;
-
-		for (size_t pass = 0;; pass++) {
-			pthread_t pthreads[threads];
-			std::vector<write_tile_args> args;
-			args.resize(threads);
-			std::atomic<int> running(threads);
-			std::atomic<long long> along(0);
-			atomic_strategy strategy;
-
-			for (size_t thread = 0; thread < threads; thread++) {
-				args[thread].stringpool = stringpool;
-				args[thread].min_detail = min_detail;
-				args[thread].outdb = outdb;  // locked with db_lock
-				args[thread].outdir = outdir;
-				args[thread].buffer = buffer;
-				args[thread].fname = fname;
-				args[thread].geomfile = sub + thread * (TEMP_FILES / threads);
-				args[thread].todo = todo;
-				args[thread].along = &along;  // locked with var_lock
-				args[thread].gamma = zoom_gamma;
-				args[thread].gamma_out = zoom_gamma;
-				args[thread].mingap = zoom_mingap;
-				args[thread].mingap_out = zoom_mingap;
-				args[thread].minextent = zoom_minextent;
-				args[thread].minextent_out = zoom_minextent;
-				args[thread].fraction = zoom_fraction;
-				args[thread].fraction_out = zoom_fraction;
-				args[thread].tile_size_out = 0;
-				args[thread].feature_count_out = 0;
-				args[thread].child_shards = TEMP_FILES / threads;
-
-				if (z == maxzoom && maxzoom_simplification > 0) {
-					args[thread].simplification = maxzoom_simplification;
-				} else {
-					args[thread].simplification = simplification;
-				}
-
-				args[thread].geomfd = geomfd;
-				args[thread].geom_size = geom_size;
-				args[thread].midx = midx;  // locked with var_lock
-				args[thread].midy = midy;  // locked with var_lock
-				args[thread].maxzoom = maxzoom;
-				args[thread].minzoom = minzoom;
-				args[thread].full_detail = full_detail;
-				args[thread].low_detail = low_detail;
-				args[thread].most = &most;  // locked with var_lock
-				args[thread].pool_off = pool_off;
-				args[thread].initial_x = initial_x;
-				args[thread].initial_y = initial_y;
-				args[thread].layermaps = &layermaps;
-				args[thread].layer_unmaps = &layer_unmaps;
-				args[thread].tiling_seg = thread + layermaps_off;
-				args[thread].prefilter = prefilter;
-				args[thread].postfilter = postfilter;
-				args[thread].attribute_accum = attribute_accum;
-				args[thread].filter = filter;
-
-				args[thread].tasks = dispatches[thread].tasks;
-				args[thread].running = &running;
-				args[thread].pass = pass;
-				args[thread].wrote_zoom = -1;
-				args[thread].still_dropping = false;
-				args[thread].strategy = &strategy;
-				args[thread].zoom = z;
-				args[thread].compressed = (z != iz);
-
-				if (pthread_create(&pthreads[thread], NULL, run_thread, &args[thread]) != 0) {
-					perror("pthread_create");
-					exit(EXIT_PTHREAD);
-				}
+		if (inputs_complete && level.running == 0 && (level.pass > 0 || level.ranges_published == level.ranges)) {
+			finish_pass(st, level);
+			i--;  // to look at this level again if it is being retried
+			continue;
+		}
+	}
+}
+
+// Called with tiling_lock held. Either claims a unit for this thread to tile,
+// returning its level, or returns NULL, with *done set if there is nothing
+// left to do at all.
+static zoom_level *claim_unit(tiling_state &st, size_t thread, tiling_unit *unit, size_t *range, bool *done) {
+	*done = false;
+
+	while (true) {
+		update_levels(st);
+
+		if (st.err != INT_MAX) {
+			// Stop handing out work, and wait for what is running to finish
+			*done = st.busy == 0;
+			return NULL;
+		}
+
+		bool all_settled = true;
+		bool started = false;
+
+		for (size_t i = 0; i < st.levels.size(); i++) {
+			zoom_level &level = st.levels[i];
+
+			if (level.settled) {
+				continue;
 			}
+			all_settled = false;
 
-			bool again = false;
-			for (size_t thread = 0; thread < threads; thread++) {
-				void *retval;
+			if (level.z > *st.maxzoom) {
+				continue;
+			}
 
-				if (pthread_join(pthreads[thread], &retval) != 0) {
-					perror("pthread_join");
+			if (!level.started) {
+				// Don't start writing another set of temporary files until
+				// the level two before this one has closed its inputs
+				if (i >= 2 && !st.levels[i - 2].settled) {
+					continue;
 				}
 
-				if (retval != NULL) {
-					err = *((int *) retval);
-				}
+				// and bring it up to date before claiming anything from it
+				start_level(st, level);
+				started = true;
+				break;
+			}
 
-				if (args[thread].gamma_out > zoom_gamma) {
-					zoom_gamma = args[thread].gamma_out;
-					again = true;
-				}
-				if (args[thread].mingap_out > zoom_mingap) {
-					zoom_mingap = args[thread].mingap_out;
-					again = true;
-				}
-				if (args[thread].minextent_out > zoom_minextent) {
-					zoom_minextent = args[thread].minextent_out;
-					again = true;
-				}
-				if (args[thread].fraction_out < zoom_fraction) {
-					zoom_fraction = args[thread].fraction_out;
-					again = true;
+			if (level.queue.size() == 0) {
+				continue;
+			}
+
+			size_t r = 0;
+			if (level.pass == 0) {
+				// The thread needs a range of output shards of its own to
+				// write the child tiles to
+
+				for (r = 0; r < level.ranges; r++) {
+					if (level.range_holder[r] == (ssize_t) thread) {
+						break;
+					}
 				}
-				if (args[thread].tile_size_out > zoom_tile_size) {
-					zoom_tile_size = args[thread].tile_size_out;
+				if (r == level.ranges) {
+					for (r = 0; r < level.ranges; r++) {
+						if (level.range_holder[r] < 0) {
+							level.range_holder[r] = thread;
+							break;
+						}
+					}
 				}
-				if (args[thread].feature_count_out > zoom_feature_count) {
-					zoom_feature_count = args[thread].feature_count_out;
+				if (r == level.ranges) {
+					continue;
 				}
 
-				// Zoom counter might be lower than reality if zooms are being skipped
-				if (args[thread].wrote_zoom > z) {
-					z = args[thread].wrote_zoom;
-				}
+				level.range_busy[r] = true;
+			}
 
-				if (additional[A_EXTEND_ZOOMS] && z == maxzoom && args[thread].still_dropping && maxzoom < MAX_ZOOM) {
-					maxzoom++;
+			// Biggest unit first, so that the small ones fill in at the end
+			size_t best = 0;
+			for (size_t q = 1; q < level.queue.size(); q++) {
+				if (level.queue[q].end - level.queue[q].start > level.queue[best].end - level.queue[best].start) {
+					best = q;
 				}
 			}
 
-			if ((size_t) z >= strategies.size()) {
-				strategies.resize(z + 1);
-			}
+			*unit = level.queue[best];
+			*range = r;
+			level.queue.erase(level.queue.begin() + best);
+			level.running++;
+			st.busy++;
+			return &level;
+		}
 
-			struct strategy s(strategy, zoom_tile_size, zoom_feature_count);
-			strategies[z] = s;
+		if (!started) {
+			*done = all_settled && st.busy == 0;
+			return NULL;
+		}
+	}
+}
 
-			if (again) {
-				if (outdb != NULL) {
-					mbtiles_erase_zoom(outdb, z);
-				} else if (outdir != NULL) {
-					dir_erase_zoom(outdir, z);
-				}
-			} else {
-				break;
+void *run_thread(void *vargs) {
+	tiling_thread_args *targ = (tiling_thread_args *) vargs;
+	tiling_state &st = *targ->state;
+	tile_arena arena;
+
+	while (true) {
+		double waiting = tiling_clock();
+
+		if (pthread_mutex_lock(&tiling_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_PTHREAD);
+		}
+
+		zoom_level *level;
+		tiling_unit unit(0, 0, 0, 0);
+		size_t range = 0;
+		bool done;
+
+		while ((level = claim_unit(st, targ->thread, &unit, &range, &done)) == NULL && !done) {
+			// Let the pool run other tasks, such as the parallel
+			// parts of other threads' tiles, in the meantime
+			task_blocking_begin();
+			if (pthread_cond_wait(&tiling_cond, &tiling_lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_PTHREAD);
 			}
+			task_blocking_end();
 		}
 
-		for (size_t j = 0; j < TEMP_FILES; j++) {
-			// Can be < 0 if there is only one source file, at z0
-			if (geomfd[j] >= 0) {
-				if (close(geomfd[j]) != 0) {
-					perror("close geom");
-					exit(EXIT_CLOSE);
-				}
+		// Claiming may also have made more units available to other threads
+		if (pthread_cond_broadcast(&tiling_cond) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_PTHREAD);
+		}
+
+		write_tile_args arg = st.common;
+		arg.arena = &arena;
+		char *map = NULL;
+		off_t size = 0;
+		std::vector<tile_retry_record> *records = NULL;
+		if (level != NULL) {
+			map = level->geom_map[unit.shard];
+			size = level->geom_size[unit.shard];
+			if (additional[A_RETRY_CHANGED_TILES]) {
+				records = &level->retry_records[unit.index];
 			}
-			if (sub[j]->fclose() != 0) {
-				perror("close subfile");
-				exit(EXIT_CLOSE);
+
+			arg.geomfile = level->sub.data() + range * level->child_shards;
+			arg.tile_starts = level->tile_starts.data() + range * level->child_shards;
+			arg.child_shards = level->child_shards;
+			arg.todo = level->todo;
+			arg.along = &level->along;  // locked with var_lock
+			arg.gamma = arg.gamma_out = level->gamma;
+			arg.mingap = arg.mingap_out = level->mingap;
+			arg.minextent = arg.minextent_out = level->minextent;
+			arg.fraction = arg.fraction_out = level->fraction;
+			arg.maxzoom = *st.maxzoom;
+			if (level->z == *st.maxzoom && st.maxzoom_simplification > 0) {
+				arg.simplification = st.maxzoom_simplification;
 			}
+			arg.most = &level->most;  // locked with var_lock
+			arg.tiling_seg += targ->thread;
+			arg.pass = level->pass;
+			arg.strategy = &level->strategy;
+			arg.zoom = level->z;
+			arg.compressed = level->compressed;
+		}
+
+		if (pthread_mutex_unlock(&tiling_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_PTHREAD);
+		}
+
+		double working = tiling_clock();
+		targ->idle += working - waiting;
+
+		if (level == NULL) {
+			break;
+		}
+
+		double working_cpu = tiling_cpu_clock();
+		bool ok = tile_unit(&arg, map, size, unit, records);
 
-			struct stat geomst;
-			if (fstat(subfd[j], &geomst) != 0) {
-				perror("stat geom\n");
-				exit(EXIT_STAT);
+		double worked = tiling_clock() - working;
+		double worked_cpu = tiling_cpu_clock() - working_cpu;
+		targ->busy += worked;
+		targ->units++;
+
+		if (pthread_mutex_lock(&tiling_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_PTHREAD);
+		}
+
+		if (!ok) {
+			if (arg.err < st.err) {
+				st.err = arg.err;
+			}
+			if (level->z < st.failed_zoom) {
+				st.failed_zoom = level->z;
 			}
+		}
 
-			geomfd[j] = subfd[j];
-			geom_size[j] = geomst.st_size;
+		if (arg.gamma_out > level->gamma_out) {
+			level->gamma_out = arg.gamma_out;
 		}
+		if (arg.mingap_out > level->mingap_out) {
+			level->mingap_out = arg.mingap_out;
+		}
+		if (arg.minextent_out > level->minextent_out) {
+			level->minextent_out = arg.minextent_out;
+		}
+		if (arg.fraction_out < level->fraction_out) {
+			level->fraction_out = arg.fraction_out;
+		}
+		if (arg.tile_size_out > level->tile_size) {
+			level->tile_size = arg.tile_size_out;
+		}
+		if (arg.feature_count_out > level->feature_count) {
+			level->feature_count = arg.feature_count_out;
+		}
+		if (arg.still_dropping) {
+			level->still_dropping = true;
+		}
+		level->busy += worked;
+		level->cpu += worked_cpu;
+		level->tiles += arg.tiles_out;
+
+		if (arg.pass == 0) {
+			level->range_busy[range] = false;
+		}
+		level->running--;
+		st.busy--;
+
+		if (pthread_cond_broadcast(&tiling_cond) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_PTHREAD);
+		}
+		if (pthread_mutex_unlock(&tiling_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_PTHREAD);
+		}
+	}
+
+	targ->arena_high_water = arena.high_water;
+	targ->arena_resets = arena.resets;
+	targ->arena_overflowed = arena.overflowed;
+
+	// Wake up anyone else who is waiting to find out that it is all over
+	if (pthread_mutex_lock(&tiling_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_PTHREAD);
+	}
+	if (pthread_cond_broadcast(&tiling_cond) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_PTHREAD);
+	}
+	if (pthread_mutex_unlock(&tiling_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_PTHREAD);
+	}
+
+	return NULL;
+}
+
+int traverse_zooms(int *geomfd, off_t *geom_size, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, pmtiles_writer *outpm, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, double maxzoom_simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, compiled_filter const *filter, std::vector<strategy> &strategies, int iz) {
+	phase_clock tiling_started = phase_clock::now();
+
+	last_progress = 0;
+
+	// The existing layermaps are one table per input thread.
+	// We need to add another one per *tiling* thread so that it can be
+	// safely changed during tiling.
+	size_t layermaps_off = layermaps.size();
+	for (size_t i = 0; i < CPUS; i++) {
+		layermaps.push_back(std::map<std::string, layermap_entry>());
+	}
+
+	// Table to map segment and layer number back to layer name
+	std::vector<std::vector<std::string>> layer_unmaps;
+	for (size_t seg = 0; seg < layermaps.size(); seg++) {
+		layer_unmaps.push_back(std::vector<std::string>());
 
-		if (err != INT_MAX) {
-			return err;
+		for (auto a = layermaps[seg].begin(); a != layermaps[seg].end(); ++a) {
+			if (a->second.id >= layer_unmaps[seg].size()) {
+				layer_unmaps[seg].resize(a->second.id + 1);
+			}
+			layer_unmaps[seg][a->second.id] = a->first;
 		}
 	}
 
+	// Every CPU gets a tiling thread, but the number of ranges of output
+	// shards is limited by the number of temporary files, and has to be a
+	// power of 2. Threads that don't get a range of their own at some zoom
+	// can still work on retries or on other zooms.
+	size_t threads = CPUS;
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	size_t ranges = 1;
+	while (ranges * 2 <= threads && ranges * 2 <= TEMP_FILES / 4) {
+		ranges *= 2;
+	}
+
+	tiling_state st;
+	st.threads = threads;
+	st.ranges = ranges;
+	st.maxzoom = &maxzoom;
+	st.minzoom = minzoom;
+	st.tmpdir = tmpdir;
+	st.maxzoom_simplification = maxzoom_simplification;
+	st.strategies = &strategies;
+
+	write_tile_args &common = st.common;
+	common.stringpool = stringpool;
+	common.min_detail = min_detail;
+	common.outdb = outdb;  // used only through its writer thread, see mbtiles.cpp
+	common.outdir = outdir;
+	common.outpm = outpm;
+	common.buffer = buffer;
+	common.fname = fname;
+	common.gamma = gamma;
+	common.simplification = simplification;
+	common.midx = midx;  // locked with var_lock
+	common.midy = midy;  // locked with var_lock
+	common.minzoom = minzoom;
+	common.full_detail = full_detail;
+	common.low_detail = low_detail;
+	common.pool_off = pool_off;
+	common.initial_x = initial_x;
+	common.initial_y = initial_y;
+	common.layermaps = &layermaps;
+	common.layer_unmaps = &layer_unmaps;
+	common.tiling_seg = layermaps_off;
+	common.prefilter = prefilter;
+	common.postfilter = postfilter;
+	common.attribute_accum = attribute_accum;
+	common.filter = filter;
+	common.running = &st.busy;
+	common.wrote_zoom = -1;
+	common.still_dropping = false;
+
+	// The first level reads the sorted features, which are all in
+	// one shard, so only one thread can work on it, and it spreads
+	// the child tiles across all the shards.
+
+	st.levels.emplace_back();
+	zoom_level &first = st.levels.back();
+	first.z = iz;
+	first.compressed = false;
+	first.geomfd.resize(TEMP_FILES, -1);
+	first.geom_size.resize(TEMP_FILES, 0);
+	first.geom_map.resize(TEMP_FILES, NULL);
+	first.inputs_ready = first.inputs_expected = 0;
+	first.ranges = 1;
+	first.child_shards = shards_per_range(1);
+	first.gamma = gamma;
+	first.mingap = ((1LL << (32 - iz)) / 256 * cluster_distance) * ((1LL << (32 - iz)) / 256 * cluster_distance);
 	for (size_t j = 0; j < TEMP_FILES; j++) {
-		// Can be < 0 if there is only one source file, at z0
 		if (geomfd[j] >= 0) {
-			if (close(geomfd[j]) != 0) {
-				perror("close geom");
-				exit(EXIT_CLOSE);
+			add_level_input(first, j, geomfd[j], geom_size[j], std::vector<long long>(), threads);
+		}
+	}
+	start_level(st, first);
+
+	task_group tiling;
+	std::vector<tiling_thread_args> args;
+	args.resize(threads);
+
+	for (size_t thread = 0; thread < threads; thread++) {
+		args[thread].state = &st;
+		args[thread].thread = thread;
+
+		task_run(&tiling, run_thread, &args[thread]);
+	}
+
+	task_wait(&tiling);
+	persistent_filters_finish();
+
+	size_t tiles = 0, retries = 0;
+	long long written = 0;
+	for (size_t i = 0; i < st.levels.size(); i++) {
+		tiles += st.levels[i].tiles;
+		retries += st.levels[i].pass;
+		written += st.levels[i].written;
+	}
+
+	// How evenly the units of work were spread across the threads,
+	// and how much of the scratch arena the tiles needed
+	double busy = 0, idle = 0;
+	double thread_busy_min = INFINITY, thread_busy_max = 0;
+	size_t thread_units_min = SIZE_MAX, thread_units_max = 0;
+	size_t arena_high_water = 0, arena_resets = 0, arena_overflowed = 0;
+	for (size_t thread = 0; thread < threads; thread++) {
+		busy += args[thread].busy;
+		idle += args[thread].idle;
+		thread_busy_min = std::min(thread_busy_min, args[thread].busy);
+		thread_busy_max = std::max(thread_busy_max, args[thread].busy);
+		thread_units_min = std::min(thread_units_min, args[thread].units);
+		thread_units_max = std::max(thread_units_max, args[thread].units);
+		arena_high_water = std::max(arena_high_water, args[thread].arena_high_water);
+		arena_resets += args[thread].arena_resets;
+		arena_overflowed += args[thread].arena_overflowed;
+	}
+
+	double tiling_wall = phase_clock::now().wall - tiling_started.wall;
+	logger.phase("tile", tiling_started, {{"threads", threads}, {"tiles", tiles}, {"tiles_per_second", tiling_wall > 0 ? tiles / tiling_wall : 0}, {"retries", retries}, {"geom_written", written}, {"busy", busy}, {"idle", idle}, {"thread_busy_min", thread_busy_min}, {"thread_busy_max", thread_busy_max}, {"thread_units_min", thread_units_min}, {"thread_units_max", thread_units_max}, {"arena_high_water", arena_high_water}, {"arena_resets", arena_resets}, {"arena_overflowed", arena_overflowed}});
+
+	for (size_t i = 0; i < st.levels.size(); i++) {
+		zoom_level &level = st.levels[i];
+
+		close_level_inputs(level);
+
+		if (level.started) {
+			for (size_t r = 0; r < level.ranges; r++) {
+				if (!level.range_published[r]) {
+					level.next = NULL;
+					publish_range(st, level, r);
+				}
+			}
+
+			// Zoom levels that got ahead of a zoom level that failed
+			// don't count as having been written.
+			if (level.z > st.failed_zoom) {
+				erase_zoom(common, level.z);
 			}
 		}
 	}
 
 	if (!quiet) {
 		fprintf(stderr, "\n");
+
+		if (additional[A_RETRY_CHANGED_TILES] && st.retries > 0) {
+			fprintf(stderr, "Retried zoom levels %zu times: made %zu tiles again, avoided remaking %zu unchanged tiles, and avoided %zu passes entirely\n", st.retries, st.tiles_retried, st.tiles_skipped, st.retries_skipped);
+		}
+	}
+
+	if (st.err != INT_MAX) {
+		return st.err;
 	}
 	return maxzoom;
 }
@@ -1,6 +1,19 @@
 #define CATCH_CONFIG_MAIN
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <algorithm>
+#include <map>
+#include <set>
 #include "catch/catch.hpp"
 #include "text.hpp"
+#include "arena.hpp"
+#include "pool.hpp"
+#include "merge.hpp"
+#include "task_pool.hpp"
+#include "jsonpull/jsonpull.h"
+#include "evaluator.hpp"
+#include "mvt.hpp"
 
 TEST_CASE("UTF-8 enforcement", "[utf8]") {
 	REQUIRE(check_utf8("") == std::string(""));
@@ -18,3 +31,706 @@ TEST_CASE("UTF-8 truncation", "[trunc]") {
 	REQUIRE(truncate16("0123456789😀😬😁😂😃😄😅😆", 17) == std::string("0123456789😀😬😁"));
 	REQUIRE(truncate16("0123456789あいうえおかきくけこさ", 16) == std::string("0123456789あいうえおか"));
 }
+
+TEST_CASE("Tile arena", "[arena]") {
+	tile_arena arena;
+	char *begin = arena.buffer.data();
+	char *end = begin + arena.buffer.size();
+
+	// Allocations come from the buffer, suitably aligned
+	void *first;
+	{
+		std::pmr::vector<long long> v(&arena);
+		v.resize(1000);
+		first = v.data();
+		REQUIRE((char *) v.data() >= begin);
+		REQUIRE((char *) (v.data() + v.size()) <= end);
+		REQUIRE((uintptr_t) v.data() % alignof(long long) == 0);
+
+		std::pmr::vector<char> c(&arena);
+		c.resize(3);
+		std::pmr::vector<double> d(&arena);
+		d.resize(7);
+		REQUIRE((uintptr_t) d.data() % alignof(double) == 0);
+		REQUIRE((char *) d.data() >= (char *) (v.data() + v.size()));
+	}
+	REQUIRE(arena.used >= 1000 * sizeof(long long) + 3 + 7 * sizeof(double));
+	REQUIRE(arena.overflowed == 0);
+
+	// After a reset, the same memory is handed out again
+	arena.reset();
+	REQUIRE(arena.used == 0);
+	REQUIRE(arena.resets == 1);
+	{
+		std::pmr::vector<long long> v(&arena);
+		v.resize(1000);
+		REQUIRE((void *) v.data() == first);
+		for (size_t i = 0; i < v.size(); i++) {
+			v[i] = i;
+		}
+		REQUIRE(v[999] == 999);
+	}
+
+	// An attempt that needs more than the buffer still gets its memory,
+	// and the buffer grows to fit it at the next reset
+	arena.reset();
+	size_t before = arena.buffer.size();
+	{
+		std::pmr::vector<char> big(&arena);
+		big.resize(before * 2, 'x');
+		REQUIRE(big[before * 2 - 1] == 'x');
+	}
+	REQUIRE(arena.overflowed == 1);
+	REQUIRE(arena.high_water >= before * 2);
+	arena.reset();
+	REQUIRE(arena.buffer.size() > before * 2);
+	REQUIRE(arena.buffer.size() <= TILE_ARENA_MAX);
+
+	{
+		std::pmr::vector<char> big(&arena);
+		big.resize(before * 2);
+		REQUIRE(big.data() >= arena.buffer.data());
+		REQUIRE(big.data() + big.size() <= arena.buffer.data() + arena.buffer.size());
+	}
+	REQUIRE(arena.overflowed == 1);
+	REQUIRE(arena.resets == 3);
+}
+
+static std::string pool_string(int fd, long long off) {
+	std::string s;
+	char c;
+	while (pread(fd, &c, 1, off++) == 1 && c != '\0') {
+		s.push_back(c);
+	}
+	return s;
+}
+
+static int pool_tmpfile() {
+	char fname[] = "/tmp/unit-pool-XXXXXX";
+	int fd = mkstemp(fname);
+	REQUIRE(fd >= 0);
+	unlink(fname);
+	return fd;
+}
+
+TEST_CASE("String pool", "[pool]") {
+	int fd = pool_tmpfile();
+	string_pool pool;
+	pool_init(&pool, fd, 1024 * 1024 * 1024);
+
+	pool_cursor cursor;
+	long long a = addpool(&pool, &cursor, "hello", 1);
+	long long b = addpool(&pool, &cursor, "world", 1);
+	long long a2 = addpool(&pool, &cursor, "hello", 1);
+	long long a3 = addpool(&pool, &cursor, "hello", 2);
+	long long e = addpool(&pool, &cursor, "", 1);
+	REQUIRE(a == a2);
+	REQUIRE(a != b);
+	REQUIRE(a != a3);
+	REQUIRE(e != a);
+
+	pool_finish_cursor(&pool, &cursor);
+	pool_finish(&pool);
+
+	REQUIRE(pool_string(fd, a) == std::string("\001hello"));
+	REQUIRE(pool_string(fd, b) == std::string("\001world"));
+	REQUIRE(pool_string(fd, a3) == std::string("\002hello"));
+	REQUIRE(pool_string(fd, e) == std::string("\001"));
+	close(fd);
+}
+
+#define POOL_TEST_THREADS 8
+#define POOL_TEST_KEYS 20000
+
+struct pool_test_arg {
+	string_pool *pool;
+	size_t n;
+	std::vector<long long> offs;
+};
+
+static void *pool_test_run(void *v) {
+	pool_test_arg *a = (pool_test_arg *) v;
+	pool_cursor cursor;
+
+	// Every thread adds the same keys, each starting at a different place
+	a->offs.resize(POOL_TEST_KEYS);
+	for (size_t i = 0; i < POOL_TEST_KEYS; i++) {
+		size_t k = (i + a->n * POOL_TEST_KEYS / POOL_TEST_THREADS) % POOL_TEST_KEYS;
+		std::string s = "key" + std::to_string(k);
+		a->offs[k] = addpool(a->pool, &cursor, s.c_str(), 1 + k % 3);
+	}
+
+	pool_finish_cursor(a->pool, &cursor);
+	return NULL;
+}
+
+static void pool_test_threads(size_t budget, bool spill) {
+	int fd = pool_tmpfile();
+	string_pool pool;
+	pool_init(&pool, fd, budget);
+
+	pthread_t threads[POOL_TEST_THREADS];
+	pool_test_arg args[POOL_TEST_THREADS];
+	for (size_t i = 0; i < POOL_TEST_THREADS; i++) {
+		args[i].pool = &pool;
+		args[i].n = i;
+		REQUIRE(pthread_create(&threads[i], NULL, pool_test_run, &args[i]) == 0);
+	}
+	for (size_t i = 0; i < POOL_TEST_THREADS; i++) {
+		REQUIRE(pthread_join(threads[i], NULL) == 0);
+	}
+
+	REQUIRE(pool.spilling == spill);
+	pool_finish(&pool);
+
+	size_t shared = 0;
+	for (size_t k = 0; k < POOL_TEST_KEYS; k++) {
+		std::string s = std::string(1, 1 + k % 3) + "key" + std::to_string(k);
+
+		bool all_same = true;
+		for (size_t i = 0; i < POOL_TEST_THREADS; i++) {
+			// Whether or not it could be shared, every offset has the right string
+			REQUIRE(pool_string(fd, args[i].offs[k]) == s);
+			if (args[i].offs[k] != args[0].offs[k]) {
+				all_same = false;
+			}
+		}
+		if (all_same) {
+			shared++;
+		}
+	}
+
+	if (spill) {
+		// Once the pool spills, new strings are no longer looked up
+		REQUIRE(shared < POOL_TEST_KEYS);
+	} else {
+		// Concurrent adds of the same key all get the one copy
+		REQUIRE(shared == POOL_TEST_KEYS);
+	}
+
+	close(fd);
+}
+
+TEST_CASE("String pool shared between threads", "[pool]") {
+	pool_test_threads(1024 * 1024 * 1024, false);
+}
+
+TEST_CASE("String pool spilling to its file", "[pool]") {
+	pool_test_threads(4 * POOL_CHUNK, true);
+}
+
+static void merge_test(std::vector<size_t> const &lengths, size_t nparts) {
+	// Sorted runs of uneven lengths, with keys from a small range
+	// so that many of them are repeated within and across runs
+	std::vector<struct index> ixs;
+	std::vector<struct mergelist> merges;
+	unsigned long long seed = 1;
+	for (size_t r = 0; r < lengths.size(); r++) {
+		size_t first = ixs.size();
+		for (size_t i = 0; i < lengths[r]; i++) {
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			struct index ix;
+			ix.ix = (seed >> 33) % 50;
+			ix.seq = (seed >> 20) % 4;
+			ix.start = r;  // to check where each one came from
+			ix.end = i;
+			ixs.push_back(ix);
+		}
+		std::stable_sort(ixs.begin() + first, ixs.end(), index_before);
+		merges.push_back(mergelist{(long long) (first * sizeof(struct index)), (long long) (ixs.size() * sizeof(struct index))});
+	}
+
+	// Serial merge: ties go to the lower-numbered run
+	std::vector<struct index> expected = ixs;
+	std::stable_sort(expected.begin(), expected.end(), index_before);
+
+	std::vector<struct index> merged(ixs.size());
+	std::vector<merge_partition> parts = merge_runs(merges.data(), merges.size(), (unsigned char *) ixs.data(), sizeof(struct index), nparts, merged.data());
+
+	REQUIRE(parts.size() == nparts);
+	size_t count = 0;
+	for (auto const &p : parts) {
+		REQUIRE(p.first == count);
+		count += p.count;
+	}
+	REQUIRE(count == ixs.size());
+
+	for (size_t i = 0; i < expected.size(); i++) {
+		REQUIRE(merged[i].ix == expected[i].ix);
+		REQUIRE(merged[i].seq == expected[i].seq);
+		REQUIRE(merged[i].start == expected[i].start);
+		REQUIRE(merged[i].end == expected[i].end);
+	}
+}
+
+TEST_CASE("Parallel merge of sorted index runs", "[merge]") {
+	task_pool_init(4);
+
+	std::vector<size_t> uneven = {0, 1, 1000, 37, 5000, 0, 2, 333};
+	for (size_t nparts : {1, 2, 3, 8, 17}) {
+		merge_test(uneven, nparts);
+	}
+
+	merge_test({}, 4);
+	merge_test({1}, 4);
+	merge_test({0, 0, 0}, 3);
+	merge_test({3, 3}, 40);
+}
+
+TEST_CASE("Index order", "[index]") {
+	struct index a, b;
+
+	// By position along the curve first
+	a.ix = 1;
+	a.seq = 9;
+	b.ix = 2;
+	b.seq = 0;
+	REQUIRE(index_before(a, b));
+	REQUIRE(!index_before(b, a));
+
+	// Then by input sequence
+	b.ix = 1;
+	REQUIRE(index_before(b, a));
+	REQUIRE(!index_before(a, b));
+
+	// Equal keys are not before each other
+	b.seq = 9;
+	REQUIRE(!index_before(a, b));
+	REQUIRE(!index_before(b, a));
+
+	// The whole range of both fields
+	a.ix = ~0ULL;
+	a.seq = 0;
+	b.ix = ~0ULL - 1;
+	b.seq = (1ULL << (64 - 18)) - 1;
+	REQUIRE(index_before(b, a));
+	a.ix = b.ix;
+	REQUIRE(index_before(a, b));
+
+	// Sorting keeps features with equal keys in the order they came in,
+	// and otherwise agrees with a three-way comparison of ix, then seq
+	std::vector<struct index> ixs;
+	unsigned long long seed = 7;
+	for (size_t i = 0; i < 10000; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		struct index ix;
+		ix.ix = (seed >> 40) % 100;
+		ix.seq = (seed >> 20) % 5;
+		ix.start = i;
+		ixs.push_back(ix);
+	}
+	std::stable_sort(ixs.begin(), ixs.end(), index_before);
+
+	for (size_t i = 1; i < ixs.size(); i++) {
+		struct index const &p = ixs[i - 1];
+		struct index const &q = ixs[i];
+		REQUIRE((p.ix < q.ix || (p.ix == q.ix && p.seq <= q.seq)));
+		if (p.ix == q.ix && p.seq == q.seq) {
+			REQUIRE(p.start < q.start);
+		}
+	}
+}
+
+// Parses the one JSON value in s, returning its error if it has one
+static std::string json_parse_one(std::string const &s, json_type *type, double *number, std::string *string, int *lines) {
+	json_pull *jp = json_begin_string(s.c_str());
+	json_object *o = json_read_tree(jp);
+	std::string error;
+
+	if (o == NULL) {
+		error = jp->error != NULL ? jp->error : "no value";
+	} else {
+		*type = o->type;
+		if (o->type == JSON_NUMBER) {
+			*number = o->value.number.number;
+		} else if (o->type == JSON_STRING) {
+			*string = o->value.string.string;
+		}
+		json_free(o);
+	}
+
+	*lines = jp->line;
+	json_end(jp);
+	return error;
+}
+
+TEST_CASE("JSON whitespace", "[jsonpull]") {
+	const char ws[] = " \t\r\n\x1e";
+
+	// Runs of each length up to past two vectors, with a newline or not at every position
+	for (size_t len = 0; len <= 40; len++) {
+		for (size_t nl = 0; nl <= len; nl++) {
+			std::string s;
+			int newlines = 0;
+			for (size_t i = 0; i < len; i++) {
+				char c = (i == nl) ? '\n' : ws[(i * 7 + len) % 5];
+				if (c == '\n') {
+					newlines++;
+				}
+				s.push_back(c);
+			}
+			s += "17";
+			s += std::string(len, ' ');
+
+			json_type type = JSON_NULL;
+			double number = 0;
+			std::string string;
+			int lines = 0;
+			REQUIRE(json_parse_one(s, &type, &number, &string, &lines) == "");
+			REQUIRE(type == JSON_NUMBER);
+			REQUIRE(number == 17);
+			REQUIRE(lines == 1 + newlines);
+		}
+	}
+
+	// Anything else ends the run, even past the first vector
+	json_type type = JSON_NULL;
+	double number = 0;
+	std::string string;
+	int lines = 0;
+	REQUIRE(json_parse_one(std::string(20, ' ') + "\v1", &type, &number, &string, &lines) != "");
+}
+
+TEST_CASE("JSON strings", "[jsonpull]") {
+	for (size_t len = 0; len <= 40; len++) {
+		// Plain text, including UTF-8, which has bytes with the high bit set
+		std::string plain;
+		while (plain.size() < len) {
+			plain += (plain.size() % 5 == 3) ? "\xC3\xA9" : "x";
+		}
+		plain.resize(len);
+
+		json_type type = JSON_NULL;
+		double number = 0;
+		std::string string;
+		int lines = 0;
+		REQUIRE(json_parse_one("\"" + plain + "\"", &type, &number, &string, &lines) == "");
+		REQUIRE(type == JSON_STRING);
+		REQUIRE(string == plain);
+
+		// An escape, or a control character, at every position
+		for (size_t at = 0; at <= len; at++) {
+			std::string before = plain.substr(0, at), after = plain.substr(at);
+
+			REQUIRE(json_parse_one("\"" + before + "\\\"" + after + "\"", &type, &number, &string, &lines) == "");
+			REQUIRE(string == before + "\"" + after);
+			REQUIRE(json_parse_one("\"" + before + "\\\\" + after + "\"", &type, &number, &string, &lines) == "");
+			REQUIRE(string == before + "\\" + after);
+			REQUIRE(json_parse_one("\"" + before + "\\n" + after + "\"", &type, &number, &string, &lines) == "");
+			REQUIRE(string == before + "\n" + after);
+
+			for (char c : {'\x01', '\t', '\n', '\x1f'}) {
+				REQUIRE(json_parse_one("\"" + before + c + after + "\"", &type, &number, &string, &lines) == "Found control character in string");
+			}
+
+			// 0x20 and 0x7F are not control characters
+			REQUIRE(json_parse_one("\"" + before + " \x7f" + after + "\"", &type, &number, &string, &lines) == "");
+			REQUIRE(string == before + " \x7f" + after);
+		}
+	}
+}
+
+TEST_CASE("JSON tokens across the end of the read buffer", "[jsonpull]") {
+	// The parser reads 10000 bytes at a time, so put each token
+	// so that it ends at every position near there
+	std::vector<std::string> tokens = {"\"a string that is longer than sixteen bytes\"", "-123.456e-7", "0.5", "1234567890123456"};
+
+	for (auto const &token : tokens) {
+		for (size_t pad = 10000 - token.size() - 20; pad < 10000 + 20; pad++) {
+			json_type type = JSON_NULL;
+			double number = 0;
+			std::string string;
+			int lines = 0;
+			REQUIRE(json_parse_one(std::string(pad, ' ') + token + " ", &type, &number, &string, &lines) == "");
+
+			if (token[0] == '"') {
+				REQUIRE(type == JSON_STRING);
+				REQUIRE("\"" + string + "\"" == token);
+			} else {
+				REQUIRE(type == JSON_NUMBER);
+				REQUIRE(number == strtod(token.c_str(), NULL));
+			}
+		}
+	}
+}
+
+TEST_CASE("JSON numbers", "[jsonpull]") {
+	std::vector<std::string> numbers = {
+		"0", "-0", "1", "-1", "0.1", "0.2", "0.3", "-122.4194155", "37.7749295",
+		"123456789012345", "1234567890123456", "12345678901234567",
+		"0.123456789012345", "0.1234567890123456", "0.0000000000000000000001",
+		"0.00000000000000000000001", "9007199254740993", "1.7976931348623157e308",
+		"5e-324", "1e22", "1e23", "100000000000000000000000", "2.5E+3", "0.50",
+	};
+
+	// Coordinates with every number of digits on each side of the point
+	unsigned long long seed = 3;
+	for (size_t i = 0; i < 20000; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		std::string s = (seed & 1) ? "-" : "";
+		size_t whole = (seed >> 8) % 6;
+		size_t frac = (seed >> 16) % 26;
+		unsigned long long r = seed >> 24;
+
+		s += std::to_string(r % 100000).substr(0, whole + 1);
+		if (frac > 0) {
+			s += ".";
+			for (size_t j = 0; j < frac; j++) {
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				s.push_back('0' + (seed >> 33) % 10);
+			}
+		}
+		numbers.push_back(s);
+	}
+
+	for (auto const &n : numbers) {
+		json_type type = JSON_NULL;
+		double number = 0;
+		std::string string;
+		int lines = 0;
+		REQUIRE(json_parse_one(n, &type, &number, &string, &lines) == "");
+		REQUIRE(type == JSON_NUMBER);
+
+		// Exactly the same bits as strtod(), including the sign of zero
+		double expected = strtod(n.c_str(), NULL);
+		INFO(n);
+		REQUIRE(memcmp(&number, &expected, sizeof(double)) == 0);
+	}
+}
+
+struct task_test {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	size_t ran = 0;
+	std::vector<int> items;
+	bool done = false;
+};
+
+struct task_test_arg {
+	task_test *t;
+	int depth;
+};
+
+// Runs four tasks of its own, each of which does the same until depth 0
+static void *task_test_nested(void *v) {
+	task_test_arg *a = (task_test_arg *) v;
+
+	if (a->depth > 0) {
+		std::vector<task_test_arg> args(4, task_test_arg{a->t, a->depth - 1});
+		task_group group;
+		for (auto &arg : args) {
+			task_run(&group, task_test_nested, &arg);
+		}
+		task_wait(&group);
+	} else {
+		pthread_mutex_lock(&a->t->lock);
+		a->t->ran++;
+		pthread_mutex_unlock(&a->t->lock);
+	}
+
+	return NULL;
+}
+
+static void *task_test_consume(void *v) {
+	task_test *t = (task_test *) v;
+
+	pthread_mutex_lock(&t->lock);
+	while (t->items.size() < 100) {
+		task_blocking_begin();
+		pthread_cond_wait(&t->cond, &t->lock);
+		task_blocking_end();
+	}
+	t->done = true;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+
+	return NULL;
+}
+
+static void *task_test_produce(void *v) {
+	task_test *t = (task_test *) v;
+
+	pthread_mutex_lock(&t->lock);
+	for (int i = 0; i < 100; i++) {
+		t->items.push_back(i);
+		pthread_cond_broadcast(&t->cond);
+
+		// Wait until the consumer is waiting again, every so often
+		if (i % 10 == 9) {
+			pthread_mutex_unlock(&t->lock);
+			sched_yield();
+			pthread_mutex_lock(&t->lock);
+		}
+	}
+	while (!t->done) {
+		task_blocking_begin();
+		pthread_cond_wait(&t->cond, &t->lock);
+		task_blocking_end();
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return NULL;
+}
+
+TEST_CASE("Task pool", "[task_pool]") {
+	// A deadlock fails the test instead of hanging it
+	alarm(60);
+
+	for (size_t concurrency : {1, 3}) {
+		task_pool_init(concurrency);
+
+		// Tasks that wait for tasks of their own, three deep
+		task_test t;
+		task_test_arg arg{&t, 3};
+		task_group group;
+		task_run(&group, task_test_nested, &arg);
+		task_wait(&group);
+
+		REQUIRE(t.ran == 4 * 4 * 4);
+
+		// A consumer that waits for a producer that hasn't started yet,
+		// in both orders
+		for (bool consumer_first : {true, false}) {
+			task_test pc;
+			task_group pair;
+			if (consumer_first) {
+				task_run(&pair, task_test_consume, &pc);
+				task_run(&pair, task_test_produce, &pc);
+			} else {
+				task_run(&pair, task_test_produce, &pc);
+				task_run(&pair, task_test_consume, &pc);
+			}
+			task_wait(&pair);
+
+			REQUIRE(pc.items.size() == 100);
+			REQUIRE(pc.done);
+		}
+	}
+
+	alarm(0);
+}
+
+static mvt_value filter_test_value(int type, const char *s, double d) {
+	mvt_value v;
+	v.type = (mvt_value_type) type;
+	if (type == mvt_string) {
+		v.string_value = s;
+	} else if (type == mvt_double) {
+		v.numeric_value.double_value = d;
+	} else if (type == mvt_float) {
+		v.numeric_value.float_value = d;
+	} else if (type == mvt_int) {
+		v.numeric_value.int_value = d;
+	} else if (type == mvt_uint) {
+		v.numeric_value.uint_value = d;
+	} else if (type == mvt_sint) {
+		v.numeric_value.sint_value = d;
+	} else if (type == mvt_bool) {
+		v.numeric_value.bool_value = d != 0;
+	} else if (type == mvt_null) {
+		v.numeric_value.null_value = 0;
+	}
+	return v;
+}
+
+static std::vector<std::map<std::string, mvt_value>> filter_test_features() {
+	return {
+		{},
+		{{"a", filter_test_value(mvt_string, "foo", 0)}},
+		{{"a", filter_test_value(mvt_double, "", 3.5)}},
+		{{"a", filter_test_value(mvt_int, "", 3)}},
+		{{"a", filter_test_value(mvt_uint, "", 7)}},
+		{{"a", filter_test_value(mvt_sint, "", -2)}},
+		{{"a", filter_test_value(mvt_float, "", 3.5)}},
+		{{"a", filter_test_value(mvt_bool, "", 1)}},
+		{{"a", filter_test_value(mvt_bool, "", 0)}},
+		{{"a", filter_test_value(mvt_null, "", 0)}},
+		{{"a", filter_test_value(mvt_string, "3", 0)}, {"b", filter_test_value(mvt_int, "", 10)}},
+		{{"a", filter_test_value(mvt_double, "", 10)}, {"b", filter_test_value(mvt_string, "bar", 0)}},
+		{{"a", filter_test_value(mvt_string, "", 0)}, {"b", filter_test_value(mvt_bool, "", 0)}},
+	};
+}
+
+// Results of the filters for each of the features above, from the filter
+// interpreter that compile_filter() replaced: 1 if the feature passes,
+// x if it passes with attribute "a" or "b" excluded, 0 if it fails
+static const std::vector<std::pair<const char *, const char *>> filter_test_expected = {
+	{R"({"*": ["has", "a"]})", "0111111111111"},
+	{R"({"*": ["!has", "a"]})", "1000000000000"},
+	{R"({"*": ["has", "c"]})", "0000000000000"},
+	{R"({"*": ["==", "a", "foo"]})", "0100000000000"},
+	{R"({"*": ["==", "a", "3"]})", "0000000000100"},
+	{R"({"*": ["==", "a", ""]})", "0000000000001"},
+	{R"({"*": ["==", "a", 3]})", "0001000000000"},
+	{R"({"*": ["==", "a", 3.5]})", "0010001000000"},
+	{R"({"*": ["==", "a", 7]})", "0000100000000"},
+	{R"({"*": ["==", "a", -2]})", "0000010000000"},
+	{R"({"*": ["==", "a", true]})", "0000000110000"},
+	{R"({"*": ["==", "a", false]})", "0000000010000"},
+	{R"({"*": ["==", "a", null]})", "0000000001000"},
+	{R"({"*": ["!=", "a", "foo"]})", "1011111111111"},
+	{R"({"*": ["!=", "a", 3]})", "1110111111111"},
+	{R"({"*": ["!=", "a", null]})", "1111111110111"},
+	{R"({"*": ["!=", "c", 3]})", "1111111111111"},
+	{R"({"*": [">", "a", 3]})", "0010101000010"},
+	{R"({"*": [">=", "a", 3]})", "0011101000010"},
+	{R"({"*": ["<", "a", 3]})", "0000010000000"},
+	{R"({"*": ["<=", "a", 3]})", "0001010000000"},
+	{R"({"*": [">", "a", "a"]})", "0100000000000"},
+	{R"({"*": ["<", "a", "zzz"]})", "0100000000101"},
+	{R"({"*": [">=", "a", "foo"]})", "0100000000000"},
+	{R"({"*": ["<=", "a", "foo"]})", "0100000000101"},
+	{R"({"*": [">", "a", false]})", "0000000100000"},
+	{R"({"*": ["<", "a", true]})", "0000000000000"},
+	{R"({"*": ["<=", "a", null]})", "0000000001000"},
+	{R"({"*": [">", "c", 0]})", "0000000000000"},
+	{R"({"*": ["in", "a", "foo", 3, true]})", "0101000110000"},
+	{R"({"*": ["!in", "a", "foo", 3, true]})", "1010111001111"},
+	{R"({"*": ["in", "a", null, -2, "3"]})", "0000010001100"},
+	{R"({"*": ["in", "a"]})", "0000000000000"},
+	{R"({"*": ["!in", "a"]})", "1111111111111"},
+	{R"({"*": ["in", "c", 1]})", "0000000000000"},
+	{R"({"*": ["!in", "c", 1]})", "1111111111111"},
+	{R"({"*": ["all"]})", "1111111111111"},
+	{R"({"*": ["any"]})", "0000000000000"},
+	{R"({"*": ["none"]})", "1111111111111"},
+	{R"({"*": ["all", ["has", "a"], ["==", "b", 10]]})", "0000000000100"},
+	{R"({"*": ["any", ["==", "a", "foo"], ["==", "b", "bar"]]})", "0100000000010"},
+	{R"({"*": ["none", ["==", "a", "foo"], [">", "a", 3]]})", "1001010111101"},
+	{R"({"*": ["any", ["all", ["has", "b"], ["!has", "c"]], ["none", ["has", "a"]]]})", "1000000000111"},
+	{R"({"*": ["attribute-filter", "a", [">", "a", 3]]})", "xx1x1x1xxxx1x"},
+	{R"({"*": ["attribute-filter", "b", ["has", "a"]]})", "x111111111111"},
+	{R"({"*": ["all", ["attribute-filter", "a", ["==", "a", "foo"]], ["has", "b"]]})", "0000000000xxx"},
+	{R"({"layer": ["has", "b"]})", "0000000000111"},
+	{R"({"other": ["has", "b"]})", "1111111111111"},
+	{R"({"layer": ["has", "a"], "*": ["has", "b"]})", "0000000000111"},
+};
+
+TEST_CASE("Compiled filters", "[evaluator]") {
+	auto features = filter_test_features();
+
+	for (auto const &test : filter_test_expected) {
+		json_object *json = parse_filter(test.first);
+		compiled_filter *filter = compile_filter(json);
+		std::string results;
+
+		for (auto const &feature : features) {
+			filter_feature attributes;
+			attributes.clear(filter);
+			for (auto const &kv : feature) {
+				ssize_t slot = filter_slot(filter, kv.first.c_str());
+				if (slot >= 0) {
+					attributes.set(slot, kv.second);
+				}
+			}
+
+			std::set<std::string> exclude_attributes;
+			bool ok = evaluate(filter, attributes, "layer", exclude_attributes);
+			results += ok ? (exclude_attributes.size() > 0 ? "x" : "1") : "0";
+		}
+
+		INFO(test.first);
+		REQUIRE(results == std::string(test.second));
+		delete filter;
+	}
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <atomic>
+#include "protozero/varint.hpp"
+#include "serial.hpp"
+#include "errors.hpp"
+
+// The variable-length integers that the temporary files are made of.
+// These are separate from the rest of serial.cpp so that they can be
+// used without the options and state of tippecanoe itself.
+
+// write to file
+
+size_t fwrite_check(const void *ptr, size_t size, size_t nitems, FILE *stream, std::atomic<long long> *fpos, const char *fname) {
+	size_t w = fwrite(ptr, size, nitems, stream);
+	if (w != nitems) {
+		fprintf(stderr, "%s: Write to temporary file failed: %s\n", fname, strerror(errno));
+		exit(EXIT_WRITE);
+	}
+	*fpos += size * nitems;
+	return w;
+}
+
+void serialize_int(FILE *out, int n, std::atomic<long long> *fpos, const char *fname) {
+	serialize_long_long(out, n, fpos, fname);
+}
+
+void serialize_long_long(FILE *out, long long n, std::atomic<long long> *fpos, const char *fname) {
+	unsigned long long zigzag = protozero::encode_zigzag64(n);
+
+	serialize_ulong_long(out, zigzag, fpos, fname);
+}
+
+void serialize_ulong_long(FILE *out, unsigned long long zigzag, std::atomic<long long> *fpos, const char *fname) {
+	while (1) {
+		unsigned char b = zigzag & 0x7F;
+		if ((zigzag >> 7) != 0) {
+			b |= 0x80;
+			if (putc(b, out) == EOF) {
+				fprintf(stderr, "%s: Write to temporary file failed: %s\n", fname, strerror(errno));
+				exit(EXIT_WRITE);
+			}
+			*fpos += 1;
+			zigzag >>= 7;
+		} else {
+			if (putc(b, out) == EOF) {
+				fprintf(stderr, "%s: Write to temporary file failed: %s\n", fname, strerror(errno));
+				exit(EXIT_WRITE);
+			}
+			*fpos += 1;
+			break;
+		}
+	}
+}
+
+void serialize_byte(FILE *out, signed char n, std::atomic<long long> *fpos, const char *fname) {
+	fwrite_check(&n, sizeof(signed char), 1, out, fpos, fname);
+}
+
+void serialize_uint(FILE *out, unsigned n, std::atomic<long long> *fpos, const char *fname) {
+	serialize_ulong_long(out, n, fpos, fname);
+}
+
+// write to memory
+
+size_t fwrite_check(const void *ptr, size_t size, size_t nitems, std::string &stream) {
+	stream += std::string((char *) ptr, size * nitems);
+	return nitems;
+}
+
+void serialize_ulong_long(std::string &out, unsigned long long zigzag) {
+	while (1) {
+		unsigned char b = zigzag & 0x7F;
+		if ((zigzag >> 7) != 0) {
+			b |= 0x80;
+			out += b;
+			zigzag >>= 7;
+		} else {
+			out += b;
+			break;
+		}
+	}
+}
+
+void serialize_long_long(std::string &out, long long n) {
+	unsigned long long zigzag = protozero::encode_zigzag64(n);
+
+	serialize_ulong_long(out, zigzag);
+}
+
+void serialize_int(std::string &out, int n) {
+	serialize_long_long(out, n);
+}
+
+void serialize_byte(std::string &out, signed char n) {
+	out += n;
+}
+
+void serialize_uint(std::string &out, unsigned n) {
+	serialize_ulong_long(out, n);
+}
+
+// read from memory
+
+void deserialize_int(char **f, int *n) {
+	long long ll;
+	deserialize_long_long(f, &ll);
+	*n = ll;
+}
+
+void deserialize_long_long(char **f, long long *n) {
+	unsigned long long zigzag = 0;
+	deserialize_ulong_long(f, &zigzag);
+	*n = protozero::decode_zigzag64(zigzag);
+}
+
+void deserialize_ulong_long(char **f, unsigned long long *zigzag) {
+	*zigzag = 0;
+	int shift = 0;
+
+	while (1) {
+		if ((**f & 0x80) == 0) {
+			*zigzag |= ((unsigned long long) **f) << shift;
+			*f += 1;
+			shift += 7;
+			break;
+		} else {
+			*zigzag |= ((unsigned long long) (**f & 0x7F)) << shift;
+			*f += 1;
+			shift += 7;
+		}
+	}
+}
+
+void deserialize_uint(char **f, unsigned *n) {
+	unsigned long long v;
+	deserialize_ulong_long(f, &v);
+	*n = v;
+}
+
+void deserialize_byte(char **f, signed char *n) {
+	memcpy(n, *f, sizeof(signed char));
+	*f += sizeof(signed char);
+}
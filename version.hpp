@@ -1,6 +1,6 @@
 #ifndef VERSION_HPP
 #define VERSION_HPP
 
-#define VERSION "v2.28.1"
+#define VERSION "v2.53.0"
 
 #endif